@@ -14,32 +14,86 @@
 
 #include "function/bidding_function.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/algorithm/container.h"
+#include "absl/cleanup/cleanup.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/flags/flag.h"
 #include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "function/snapshot_cache.h"
+#include "function/value_conversion.h"
 #include "google/protobuf/util/json_util.h"
+#include "libplatform/libplatform.h"
 #include "util/status_macros.h"
+#include "util/trace_recorder.h"
 #include "v8.h"
+#include "v8/v8_platform_initializer.h"
 
 ABSL_FLAG(::absl::Duration, bidding_function_async_wait, absl::Milliseconds(50),
           "Deadline for waiting for an async bidding function to resolve.");
+ABSL_FLAG(int, bidding_function_min_isolates, 1,
+          "Number of V8 isolates kept ready for each bidding function.");
+ABSL_FLAG(int, bidding_function_max_isolates,
+          std::max(1, static_cast<int>(std::thread::hardware_concurrency())),
+          "Maximum number of V8 isolates for each bidding function, i.e. the "
+          "maximum number of concurrent invocations of the same function.");
+ABSL_FLAG(::absl::Duration, bidding_function_isolate_idle_timeout,
+          absl::Minutes(1),
+          "Duration after which isolates in excess of "
+          "--bidding_function_min_isolates are disposed of when idle.");
+ABSL_FLAG(::absl::Duration, bidding_function_idle_gc_delay, absl::Seconds(10),
+          "Duration after which idle isolates get their garbage collected in "
+          "the background, by steps of idle-time garbage collection followed "
+          "by a full garbage collection. Never when infinite.");
+ABSL_FLAG(::absl::Duration, bidding_function_idle_gc_budget,
+          absl::Milliseconds(5),
+          "Time given to each step of idle-time garbage collection.");
 
 namespace aviary::function {
+// Refer to V8 rather than to `aviary::v8`.
+namespace v8 = ::v8;
+
 namespace {
 
+using ::aviary::v8::V8PlatformInitializer;
 using ::google::protobuf::FieldDescriptor;
 using ::google::protobuf::util::JsonStringToMessage;
 using ::google::protobuf::util::MessageToJsonString;
 
-constexpr int kBiddingFunctionWarmUpIterations = 10;
+constexpr absl::Duration kMinPromisePollInterval = absl::Microseconds(50);
+constexpr absl::Duration kMaxPromisePollInterval = absl::Milliseconds(2);
 constexpr char kInternalBiddingFunctionName[] = "__GenerateBid_Internal__";
 constexpr char kFledgeBiddingFunctionName[] = "generateBid";
 constexpr char kFledgeScoreAdFunctionName[] = "scoreAd";
 
+internal::IsolatePoolOptions GetIsolatePoolOptions() {
+  const int min_isolates =
+      std::max(1, absl::GetFlag(FLAGS_bidding_function_min_isolates));
+  return {
+      .min_isolates = min_isolates,
+      .max_isolates = std::max(
+          min_isolates, absl::GetFlag(FLAGS_bidding_function_max_isolates)),
+      .idle_timeout =
+          absl::GetFlag(FLAGS_bidding_function_isolate_idle_timeout),
+      .idle_gc_delay = absl::GetFlag(FLAGS_bidding_function_idle_gc_delay),
+      .idle_gc_budget = absl::GetFlag(FLAGS_bidding_function_idle_gc_budget),
+  };
+}
+
 template <typename T>
 absl::StatusOr<v8::Local<T>> ToLocalChecked(absl::string_view error_message,
                                             v8::MaybeLocal<T> maybe_value) {
@@ -111,21 +165,62 @@ absl::StatusOr<v8::Local<v8::Value>> GetFunctionValue(
   return function_value;
 }
 
-absl::StatusOr<v8::Local<v8::Value>> WaitForPromise(
-    v8::Promise* promise, v8::Local<v8::Context> context) {
-  absl::Time start = absl::Now();
-  const auto wait_duration = absl::GetFlag(FLAGS_bidding_function_async_wait);
-  while (promise->State() == v8::Promise::PromiseState::kPending &&
-         absl::Now() - start < wait_duration) {
-    context->GetIsolate()->PerformMicrotaskCheckpoint();
+// Returns whether `value` is a promise that has not settled yet.
+bool IsPendingPromise(const v8::Local<v8::Value>& value) {
+  return value->IsPromise() && v8::Local<v8::Promise>::Cast(value)->State() ==
+                                   v8::Promise::PromiseState::kPending;
+}
+
+// Runs microtasks and the tasks posted by V8 to the platform on behalf of
+// `isolate` until none of the promises among `values` is pending, or until
+// --bidding_function_async_wait has elapsed. Backs off exponentially while
+// there is nothing to run, instead of spinning, and leaves the isolate
+// unlocked while backing off.
+void SettlePromises(v8::Isolate* isolate,
+                    const std::vector<v8::Local<v8::Value>>& values) {
+  auto settled = [&values]() {
+    return absl::c_none_of(values, IsPendingPromise);
+  };
+  isolate->PerformMicrotaskCheckpoint();
+  const absl::Time deadline =
+      absl::Now() + absl::GetFlag(FLAGS_bidding_function_async_wait);
+  v8::Platform* platform = V8PlatformInitializer::GetPlatform();
+  absl::Duration poll_interval = kMinPromisePollInterval;
+  while (!settled()) {
+    const absl::Duration remaining = deadline - absl::Now();
+    if (remaining <= absl::ZeroDuration()) {
+      return;
+    }
+    if (v8::platform::PumpMessageLoop(
+            platform, isolate, v8::platform::MessageLoopBehavior::kDoNotWait)) {
+      isolate->PerformMicrotaskCheckpoint();
+      poll_interval = kMinPromisePollInterval;
+      continue;
+    }
+    if (v8::Locker::IsLocked(isolate)) {
+      v8::Unlocker unlocker(isolate);
+      absl::SleepFor(std::min(poll_interval, remaining));
+    } else {
+      absl::SleepFor(std::min(poll_interval, remaining));
+    }
+    poll_interval = std::min(poll_interval * 2, kMaxPromisePollInterval);
+  }
+}
+
+// Returns the result of `value`, or its resolution if it is a promise.
+absl::StatusOr<v8::Local<v8::Value>> GetResult(v8::Local<v8::Value> value,
+                                               v8::Isolate* isolate) {
+  if (!value->IsPromise()) {
+    return value;
   }
+  v8::Local<v8::Promise> promise = v8::Local<v8::Promise>::Cast(value);
   switch (promise->State()) {
     case v8::Promise::PromiseState::kFulfilled:
       return promise->Result();
     case v8::Promise::PromiseState::kRejected:
-      return absl::InvalidArgumentError(absl::StrCat(
-          "Async javascript function failed: ",
-          *v8::String::Utf8Value(context->GetIsolate(), promise->Result())));
+      return absl::InvalidArgumentError(
+          absl::StrCat("Async javascript function failed: ",
+                       *v8::String::Utf8Value(isolate, promise->Result())));
     case v8::Promise::PromiseState::kPending:
       return absl::InvalidArgumentError("Async javascript function timed out.");
     default:
@@ -138,6 +233,13 @@ template <typename T>
 absl::StatusOr<T> ConvertOutput(const v8::Local<v8::Value> function_output,
                                 const v8::Local<v8::Context>& context) {
   T converted_output;
+  // Read the usual output shapes directly, and leave anything unusual,
+  // including malformed outputs, to the JSON conversion which reports the
+  // errors.
+  if (V8ValueToProto(function_output, context, &converted_output).ok()) {
+    return converted_output;
+  }
+  converted_output.Clear();
   v8::Isolate* isolate = context->GetIsolate();
   ASSIGN_OR_RETURN(
       v8::Local<v8::String> json_string,
@@ -156,6 +258,14 @@ absl::StatusOr<T> ConvertOutput(const v8::Local<v8::Value> function_output,
 template <typename Input>
 absl::StatusOr<v8::Local<v8::Value>> ConvertArgument(
     const Input& function_input, v8::Local<v8::Context> context) {
+  // Build the argument straight from the message, falling back to the more
+  // expensive JSON round trip for messages the direct conversion cannot
+  // represent exactly.
+  absl::StatusOr<v8::Local<v8::Value>> argument =
+      ProtoToV8Value(function_input, context);
+  if (argument.status().code() != absl::StatusCode::kUnimplemented) {
+    return argument;
+  }
   v8::Isolate* isolate = context->GetIsolate();
   std::string json_string;
   if (!MessageToJsonString(function_input, &json_string).ok()) {
@@ -181,9 +291,7 @@ absl::StatusOr<v8::Local<v8::Value>> InvokeFunctionWithJsonInput(
           },
           absl::StatusCode::kInternal, "Function execution failed: ", context));
 
-  return return_value->IsPromise()
-             ? WaitForPromise(v8::Promise::Cast(*return_value), context)
-             : return_value;
+  return return_value;
 }
 
 template <typename Input>
@@ -218,84 +326,476 @@ absl::StatusOr<v8::Local<v8::Object>> GetMapArgument(
                          field_names.size());
 }
 
+// Converts a field of `input` into the argument of the same position of the
+// function in the flattened form.
 template <typename Input>
-absl::StatusOr<v8::Local<v8::Value>> InvokeFunctionOnce(
-    const Input& input, v8::Local<v8::Context> context,
+absl::StatusOr<v8::Local<v8::Value>> ConvertFieldArgument(
+    const Input& input, const FieldDescriptor* field_descriptor,
+    v8::Local<v8::Context> context) {
+  const auto* reflection = Input::GetReflection();
+  switch (field_descriptor->type()) {
+    case FieldDescriptor::Type::TYPE_MESSAGE: {
+      if (field_descriptor->is_map()) {
+        ASSIGN_OR_RETURN(v8::Local<v8::Object> map_argument,
+                         GetMapArgument(input, field_descriptor, context));
+        return map_argument;
+      }
+      return ConvertArgument(reflection->GetMessage(input, field_descriptor),
+                             context);
+    }
+    case FieldDescriptor::Type::TYPE_DOUBLE:
+      return v8::Number::New(context->GetIsolate(),
+                             reflection->GetDouble(input, field_descriptor))
+          .As<v8::Value>();
+    default:
+      return absl::FailedPreconditionError(
+          "Only message, map or double arguments are supported");
+  }
+}
+
+// Deeply freezes `value`, so that no invocation can modify what the following
+// invocations get.
+absl::Status DeepFreeze(v8::Local<v8::Value> value,
+                        v8::Local<v8::Context> context, int depth = 0) {
+  // Objects converted from messages are trees no deeper than the messages.
+  constexpr int kMaxFreezeDepth = 100;
+  if (!value->IsObject()) {
+    return absl::OkStatus();
+  }
+  if (depth > kMaxFreezeDepth) {
+    return absl::FailedPreconditionError(
+        "Shared argument too deeply nested to be frozen.");
+  }
+  v8::Local<v8::Object> object = value.As<v8::Object>();
+  if (!object->SetIntegrityLevel(context, v8::IntegrityLevel::kFrozen)
+           .FromMaybe(false)) {
+    return absl::InternalError("Unable to freeze a shared argument.");
+  }
+  v8::Local<v8::Array> property_names;
+  if (!object->GetOwnPropertyNames(context).ToLocal(&property_names)) {
+    return absl::InternalError("Unable to freeze a shared argument.");
+  }
+  for (uint32_t i = 0; i < property_names->Length(); i++) {
+    v8::Local<v8::Value> property_name;
+    v8::Local<v8::Value> property_value;
+    if (!property_names->Get(context, i).ToLocal(&property_name) ||
+        !object->Get(context, property_name).ToLocal(&property_value)) {
+      return absl::InternalError("Unable to freeze a shared argument.");
+    }
+    RETURN_IF_ERROR(DeepFreeze(property_value, context, depth + 1));
+  }
+  return absl::OkStatus();
+}
+
+// JavaScript values of the fields set in the common input of a batch, indexed
+// by field index. Handles of the fields that are not shared are empty.
+using CommonArguments = std::vector<v8::Local<v8::Value>>;
+
+template <typename Input>
+absl::StatusOr<CommonArguments> ConvertCommonArguments(
+    const Input& common_input, v8::Local<v8::Context> context,
     const FunctionOptions& options) {
+  const auto* descriptor = Input::GetDescriptor();
+  CommonArguments common_arguments(descriptor->field_count());
+  for (int field_index = 0; field_index < descriptor->field_count();
+       field_index++) {
+    const auto* field_descriptor = descriptor->field(field_index);
+    if (!IsFieldSet(common_input, field_descriptor)) {
+      continue;
+    }
+    ASSIGN_OR_RETURN(
+        common_arguments[field_index],
+        ConvertFieldArgument(common_input, field_descriptor, context));
+    if (options.freeze_common_arguments) {
+      RETURN_IF_ERROR(DeepFreeze(common_arguments[field_index], context));
+    }
+  }
+  return common_arguments;
+}
+
+// Sets the values of `common_arguments` as the properties of `argument` for the
+// corresponding fields of `descriptor`, the way the fields are named in JSON.
+absl::Status SetCommonArguments(const google::protobuf::Descriptor* descriptor,
+                                const CommonArguments& common_arguments,
+                                v8::Local<v8::Value> argument,
+                                v8::Local<v8::Context> context) {
+  if (!argument->IsObject()) {
+    return absl::InternalError("Unable to pass a shared argument.");
+  }
+  v8::Local<v8::Object> object = argument.As<v8::Object>();
+  for (int field_index = 0; field_index < descriptor->field_count();
+       field_index++) {
+    if (common_arguments[field_index].IsEmpty()) {
+      continue;
+    }
+    ASSIGN_OR_RETURN(v8::Local<v8::String> name,
+                     NewString(context->GetIsolate(),
+                               descriptor->field(field_index)->json_name()));
+    if (!object->Set(context, name, common_arguments[field_index])
+             .FromMaybe(false)) {
+      return absl::InternalError("Unable to pass a shared argument.");
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Converts `input` into the arguments of the function, passing the values of
+// `common_arguments`, if any, in place of the corresponding fields of `input`.
+template <typename Input>
+absl::StatusOr<std::vector<v8::Local<v8::Value>>> ConvertArguments(
+    const Input& input, v8::Local<v8::Context> context,
+    const FunctionOptions& options,
+    const CommonArguments* common_arguments = nullptr) {
   std::vector<v8::Local<v8::Value>> arguments;
 
+  const auto* descriptor = Input::GetDescriptor();
   if (options.flatten_function_arguments) {
-    const auto* descriptor = Input::GetDescriptor();
-    const auto* reflection = Input::GetReflection();
+    arguments.reserve(descriptor->field_count());
     for (int field_index = 0; field_index < descriptor->field_count();
          field_index++) {
-      const auto* field_descriptor = descriptor->field(field_index);
-      switch (field_descriptor->type()) {
-        case FieldDescriptor::Type::TYPE_MESSAGE: {
-          if (field_descriptor->is_map()) {
-            ASSIGN_OR_RETURN(auto map_argument,
-                             GetMapArgument(input, field_descriptor, context));
-            arguments.emplace_back(map_argument);
-          } else {
-            ASSIGN_OR_RETURN(
-                auto converted_argument,
-                ConvertArgument(reflection->GetMessage(input, field_descriptor),
-                                context));
-            arguments.push_back(converted_argument);
-          }
-        } break;
-        case FieldDescriptor::Type::TYPE_DOUBLE: {
-          arguments.push_back(
-              v8::Number::New(context->GetIsolate(),
-                              reflection->GetDouble(input, field_descriptor)));
-        } break;
-        default:
-          return absl::FailedPreconditionError(
-              "Only message, map or double arguments are supported");
+      if (common_arguments != nullptr &&
+          !(*common_arguments)[field_index].IsEmpty()) {
+        arguments.push_back((*common_arguments)[field_index]);
+        continue;
       }
+      ASSIGN_OR_RETURN(
+          v8::Local<v8::Value> converted_argument,
+          ConvertFieldArgument(input, descriptor->field(field_index), context));
+      arguments.push_back(converted_argument);
     }
   } else {
     // Convert bidding function input proto -> json.
     ASSIGN_OR_RETURN(auto converted_argument, ConvertArgument(input, context));
+    if (common_arguments != nullptr) {
+      RETURN_IF_ERROR(SetCommonArguments(descriptor, *common_arguments,
+                                         converted_argument, context));
+    }
     arguments = {converted_argument};
   }
-  return InvokeFunctionWithJsonInput(context, arguments);
+  return arguments;
 }
 
-// TODO: Implement alternative where a function is explicitly initialized;
-// remove `IgnoreError()` and have the status of `InvokeFunctionOnce()` returned
-// if there is an error.
+// Invokes the function for `input`.
 template <typename Input>
+absl::StatusOr<v8::Local<v8::Value>> InvokeFunctionOnce(
+    const Input& input, v8::Local<v8::Context> context,
+    const FunctionOptions& options) {
+  ASSIGN_OR_RETURN(std::vector<v8::Local<v8::Value>> arguments,
+                   ConvertArguments(input, context, options));
+  return InvokeFunctionWithJsonInput(context, arguments);
+}
+
+// Invokes the function `options.warm_up_iterations` times on each warm-up
+// input, so that V8 gets to optimize the code paths that these inputs take.
+template <typename Input, typename Output>
 absl::Status WarmUpBiddingFunction(v8::Local<v8::Context> context,
                                    const FunctionOptions& options) {
-  Input input;
-  // Invoking 10 times during the Create() flow reduced the future Invoke()
-  // runtime significantly for a large, complex bidding function.
-  for (int i = 0; i < kBiddingFunctionWarmUpIterations; i++) {
-    InvokeFunctionOnce(input, context, options).status().IgnoreError();
+  v8::Isolate* isolate = context->GetIsolate();
+  if (options.warm_up_inputs.empty()) {
+    Input input;
+    // Invoking 10 times during the Create() flow reduced the future Invoke()
+    // runtime significantly for a large, complex bidding function.
+    for (int i = 0; i < options.warm_up_iterations; i++) {
+      InvokeFunctionOnce(input, context, options).status().IgnoreError();
+      // Also warm up the async part of async functions.
+      isolate->PerformMicrotaskCheckpoint();
+    }
+    return absl::OkStatus();
+  }
+
+  std::vector<Input> inputs(options.warm_up_inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    const google::protobuf::util::Status parse_status =
+        JsonStringToMessage(options.warm_up_inputs[i], &inputs[i]);
+    if (!parse_status.ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unable to parse warm-up input #", i, ": ",
+                       parse_status.message().ToString()));
+    }
+  }
+  auto warm_up_once = [&](const Input& input) -> absl::Status {
+    ASSIGN_OR_RETURN(v8::Local<v8::Value> return_value,
+                     InvokeFunctionOnce(input, context, options));
+    SettlePromises(isolate, {return_value});
+    ASSIGN_OR_RETURN(v8::Local<v8::Value> result,
+                     GetResult(return_value, isolate));
+    return ConvertOutput<Output>(result, context).status();
+  };
+  for (int iteration = 0; iteration < options.warm_up_iterations;
+       iteration++) {
+    for (size_t i = 0; i < inputs.size(); i++) {
+      const absl::Status status = warm_up_once(inputs[i]);
+      if (!status.ok()) {
+        return absl::Status(
+            status.code(), absl::StrCat("Warm-up failed on input #", i, ": ",
+                                        status.message()));
+      }
+    }
   }
   return absl::OkStatus();
 }
-}  // namespace
-
-namespace internal {
 
-IsolateHolder::IsolateHolder(v8::Isolate* isolate) : isolate_(isolate) {}
+// Deserializes a value in the V8 wire format.
+absl::StatusOr<v8::Local<v8::Value>> DeserializeValue(
+    absl::string_view data, v8::Local<v8::Context> context) {
+  v8::ValueDeserializer deserializer(
+      context->GetIsolate(), reinterpret_cast<const uint8_t*>(data.data()),
+      data.size());
+  return ToLocalTryCatch<v8::Value>(
+      [&]() -> v8::MaybeLocal<v8::Value> {
+        if (!deserializer.ReadHeader(context).FromMaybe(false)) {
+          return {};
+        }
+        return deserializer.ReadValue(context);
+      },
+      absl::StatusCode::kInvalidArgument,
+      "Unable to deserialize a function input: ", context);
+}
 
-IsolateHolder::operator v8::Isolate*() { return isolate_; }
+// Serializes `value` with `v8::ValueSerializer`, or returns nothing if an
+// object of `value` cannot be cloned.
+absl::optional<std::string> SerializeClonableValue(
+    v8::Local<v8::Value> value, v8::Local<v8::Context> context) {
+  v8::Isolate* isolate = context->GetIsolate();
+  v8::TryCatch try_catch(isolate);
+  v8::ValueSerializer serializer(isolate);
+  serializer.WriteHeader();
+  if (!serializer.WriteValue(context, value).FromMaybe(false)) {
+    return absl::nullopt;
+  }
+  const std::pair<uint8_t*, size_t> buffer = serializer.Release();
+  std::string serialized(reinterpret_cast<char*>(buffer.first), buffer.second);
+  std::free(buffer.first);
+  return serialized;
+}
 
-IsolateHolder::IsolateHolder(IsolateHolder&& other) {
-  isolate_ = other.isolate_;
-  other.isolate_ = nullptr;
+// Serializes `value` in the V8 wire format. Values that cannot be cloned, e.g.
+// objects holding functions, are serialized as what JSON.parse() returns for
+// JSON.stringify() of them, which is what the JSON conversion of outputs reads.
+absl::StatusOr<std::string> SerializeValue(v8::Local<v8::Value> value,
+                                           v8::Local<v8::Context> context) {
+  if (absl::optional<std::string> serialized =
+          SerializeClonableValue(value, context)) {
+    return *std::move(serialized);
+  }
+  ASSIGN_OR_RETURN(
+      v8::Local<v8::String> json_string,
+      ToLocalChecked("Unable to serialize function output to JSON.",
+                     v8::JSON::Stringify(context, value)));
+  ASSIGN_OR_RETURN(
+      v8::Local<v8::Value> parsed_value,
+      ToLocalChecked("Unable to serialize function output to JSON.",
+                     v8::JSON::Parse(context, json_string)));
+  absl::optional<std::string> serialized =
+      SerializeClonableValue(parsed_value, context);
+  if (!serialized.has_value()) {
+    return absl::InternalError("Unable to serialize the function output.");
+  }
+  return *std::move(serialized);
 }
 
-IsolateHolder::~IsolateHolder() {
-  if (isolate_ != nullptr) {
-    isolate_->Dispose();
-    isolate_ = nullptr;
+// Turns `property`, the property of a deserialized input object for `field`,
+// into the argument of the same position of the function in the flattened
+// form, the way `ConvertFieldArgument()` converts the field.
+absl::StatusOr<v8::Local<v8::Value>> GetFieldArgument(
+    v8::Local<v8::Value> property, const FieldDescriptor* field_descriptor,
+    v8::Local<v8::Context> context) {
+  v8::Isolate* isolate = context->GetIsolate();
+  switch (field_descriptor->type()) {
+    case FieldDescriptor::Type::TYPE_MESSAGE:
+      if (field_descriptor->is_map()) {
+        // Maps are passed as objects without a prototype.
+        if (property->IsUndefined()) {
+          return v8::Object::New(isolate, v8::Null(isolate), nullptr, nullptr,
+                                 0)
+              .As<v8::Value>();
+        }
+        if (!property->IsObject() ||
+            !property.As<v8::Object>()
+                 ->SetPrototype(context, v8::Null(isolate))
+                 .FromMaybe(false)) {
+          return absl::InternalError("Unable to pass a map argument.");
+        }
+        return property;
+      }
+      // Unset messages are passed as empty objects.
+      if (property->IsUndefined()) {
+        return v8::Object::New(isolate).As<v8::Value>();
+      }
+      return property;
+    case FieldDescriptor::Type::TYPE_DOUBLE:
+      if (property->IsUndefined()) {
+        return v8::Number::New(isolate, 0).As<v8::Value>();
+      }
+      return property;
+    default:
+      return absl::FailedPreconditionError(
+          "Only message, map or double arguments are supported");
   }
 }
-}  // namespace internal
+
+// Returns the property of `object` named after `field_descriptor` in JSON.
+absl::StatusOr<v8::Local<v8::Value>> GetFieldProperty(
+    v8::Local<v8::Object> object, const FieldDescriptor* field_descriptor,
+    v8::Local<v8::Context> context) {
+  ASSIGN_OR_RETURN(
+      v8::Local<v8::String> name,
+      NewString(context->GetIsolate(), field_descriptor->json_name()));
+  return ToLocalChecked("Unable to read an input property.",
+                        object->Get(context, name));
+}
+
+// The batch types below convert the arguments and the results of the
+// invocations of a batch for `BiddingFunction::DoBatchInvoke()`:
+// - `size()` returns the number of invocations.
+// - `ConvertCommonArguments()` converts the arguments shared by the
+//   invocations, once before any invocation.
+// - `GetArguments()` returns the arguments of the invocation at `index`.
+// - `ConvertResult()` converts the result of an invocation into a `Result`.
+
+// Batch of invocations on messages.
+template <typename Input, typename Output>
+class MessageBatch {
+ public:
+  using Result = Output;
+
+  // `common_input` is null for batches that do not share any input.
+  MessageBatch(const Input* common_input, absl::Span<const Input* const> inputs,
+               const FunctionOptions& options)
+      : common_input_(common_input), inputs_(inputs), options_(options) {}
+
+  size_t size() const { return inputs_.size(); }
+
+  absl::Status ConvertCommonArguments(v8::Local<v8::Context> context) {
+    if (common_input_ == nullptr) {
+      return absl::OkStatus();
+    }
+    ASSIGN_OR_RETURN(
+        common_arguments_,
+        function::ConvertCommonArguments(*common_input_, context, options_));
+    return absl::OkStatus();
+  }
+
+  absl::StatusOr<std::vector<v8::Local<v8::Value>>> GetArguments(
+      size_t index, v8::Local<v8::Context> context) {
+    return ConvertArguments(
+        *inputs_[index], context, options_,
+        common_input_ != nullptr ? &common_arguments_ : nullptr);
+  }
+
+  absl::StatusOr<Output> ConvertResult(v8::Local<v8::Value> result,
+                                       v8::Local<v8::Context> context) {
+    return ConvertOutput<Output>(result, context);
+  }
+
+ private:
+  const Input* const common_input_;
+  const absl::Span<const Input* const> inputs_;
+  const FunctionOptions& options_;
+  CommonArguments common_arguments_;
+};
+
+// Batch of invocations on inputs in the V8 wire format, which are passed as
+// deserialized, and whose results are serialized in the same format.
+template <typename Input>
+class SerializedBatch {
+ public:
+  using Result = std::string;
+
+  // `common_input` is empty for batches that do not share any input.
+  SerializedBatch(absl::string_view common_input,
+                  absl::Span<const absl::string_view> inputs,
+                  const FunctionOptions& options)
+      : common_input_(common_input), inputs_(inputs), options_(options) {}
+
+  size_t size() const { return inputs_.size(); }
+
+  // Splits the deserialized common input into the arguments for its fields,
+  // the way `ConvertCommonArguments()` converts the set fields of common
+  // inputs, which are the properties of the deserialized object.
+  absl::Status ConvertCommonArguments(v8::Local<v8::Context> context) {
+    if (common_input_.empty()) {
+      return absl::OkStatus();
+    }
+    ASSIGN_OR_RETURN(v8::Local<v8::Object> common_object,
+                     DeserializeObject(common_input_, context));
+    const auto* descriptor = Input::GetDescriptor();
+    common_arguments_.resize(descriptor->field_count());
+    for (int field_index = 0; field_index < descriptor->field_count();
+         field_index++) {
+      const auto* field_descriptor = descriptor->field(field_index);
+      ASSIGN_OR_RETURN(
+          v8::Local<v8::Value> argument,
+          GetFieldProperty(common_object, field_descriptor, context));
+      if (argument->IsUndefined()) {
+        continue;
+      }
+      if (options_.flatten_function_arguments) {
+        ASSIGN_OR_RETURN(argument,
+                         GetFieldArgument(argument, field_descriptor, context));
+      }
+      if (options_.freeze_common_arguments) {
+        RETURN_IF_ERROR(DeepFreeze(argument, context));
+      }
+      common_arguments_[field_index] = argument;
+    }
+    has_common_arguments_ = true;
+    return absl::OkStatus();
+  }
+
+  absl::StatusOr<std::vector<v8::Local<v8::Value>>> GetArguments(
+      size_t index, v8::Local<v8::Context> context) {
+    ASSIGN_OR_RETURN(v8::Local<v8::Object> object,
+                     DeserializeObject(inputs_[index], context));
+    const auto* descriptor = Input::GetDescriptor();
+    if (!options_.flatten_function_arguments) {
+      if (has_common_arguments_) {
+        RETURN_IF_ERROR(
+            SetCommonArguments(descriptor, common_arguments_, object, context));
+      }
+      return std::vector<v8::Local<v8::Value>>{object};
+    }
+    std::vector<v8::Local<v8::Value>> arguments;
+    arguments.reserve(descriptor->field_count());
+    for (int field_index = 0; field_index < descriptor->field_count();
+         field_index++) {
+      if (has_common_arguments_ && !common_arguments_[field_index].IsEmpty()) {
+        arguments.push_back(common_arguments_[field_index]);
+        continue;
+      }
+      const auto* field_descriptor = descriptor->field(field_index);
+      ASSIGN_OR_RETURN(v8::Local<v8::Value> property,
+                       GetFieldProperty(object, field_descriptor, context));
+      ASSIGN_OR_RETURN(v8::Local<v8::Value> argument,
+                       GetFieldArgument(property, field_descriptor, context));
+      arguments.push_back(argument);
+    }
+    return arguments;
+  }
+
+  absl::StatusOr<std::string> ConvertResult(v8::Local<v8::Value> result,
+                                            v8::Local<v8::Context> context) {
+    return SerializeValue(result, context);
+  }
+
+ private:
+  static absl::StatusOr<v8::Local<v8::Object>> DeserializeObject(
+      absl::string_view data, v8::Local<v8::Context> context) {
+    ASSIGN_OR_RETURN(v8::Local<v8::Value> value,
+                     DeserializeValue(data, context));
+    if (!value->IsObject()) {
+      return absl::InvalidArgumentError("Expected an input object.");
+    }
+    return value.As<v8::Object>();
+  }
+
+  const absl::string_view common_input_;
+  const absl::Span<const absl::string_view> inputs_;
+  const FunctionOptions& options_;
+  CommonArguments common_arguments_;
+  bool has_common_arguments_ = false;
+};
+}  // namespace
 
 template <>
 std::string
@@ -314,6 +814,30 @@ template <typename Input, typename Output>
 absl::StatusOr<std::unique_ptr<BiddingFunctionInterface<Input, Output>>>
 BiddingFunction<Input, Output>::Create(absl::string_view script_source,
                                        const FunctionOptions& options) {
+  const absl::optional<SnapshotCache> snapshot_cache =
+      SnapshotCache::FromFlags();
+  std::string cache_key;
+  if (snapshot_cache.has_value()) {
+    cache_key = GetStartupSnapshotCacheKey(script_source, options,
+                                           /*sandboxed=*/false);
+    if (absl::optional<std::string> startup_snapshot =
+            snapshot_cache->Lookup(cache_key)) {
+      return CreateFromStartupSnapshot(*std::move(startup_snapshot), options);
+    }
+  }
+  ASSIGN_OR_RETURN(std::string startup_snapshot,
+                   CreateStartupSnapshot(script_source, options));
+  if (snapshot_cache.has_value()) {
+    // Failing to cache the snapshot only slows down the next start.
+    snapshot_cache->Store(cache_key, startup_snapshot).IgnoreError();
+  }
+  return CreateFromStartupSnapshot(std::move(startup_snapshot), options);
+}
+
+template <typename Input, typename Output>
+absl::StatusOr<std::string>
+BiddingFunction<Input, Output>::CreateStartupSnapshot(
+    absl::string_view script_source, const FunctionOptions& options) {
   v8::SnapshotCreator snapshot_creator;
   v8::Isolate* isolate = snapshot_creator.GetIsolate();
   {
@@ -363,7 +887,7 @@ BiddingFunction<Input, Output>::Create(absl::string_view script_source,
     }
     RETURN_IF_ERROR(SetFunctionValue(function_value, context));
 
-    RETURN_IF_ERROR(WarmUpBiddingFunction<Input>(context, options));
+    RETURN_IF_ERROR(WarmUpBiddingFunction<Input, Output>(context, options));
 
     snapshot_creator.SetDefaultContext(context);
   }
@@ -374,46 +898,200 @@ BiddingFunction<Input, Output>::Create(absl::string_view script_source,
   // std::string to avoid memory leaks.
   std::string startup_internal_data(startup_data.data, startup_data.raw_size);
   delete[] startup_data.data;
+  return startup_internal_data;
+}
 
+template <typename Input, typename Output>
+std::unique_ptr<BiddingFunction<Input, Output>>
+BiddingFunction<Input, Output>::CreateFromStartupSnapshot(
+    std::string startup_snapshot, const FunctionOptions& options) {
   return absl::WrapUnique(
-      new BiddingFunction(std::move(startup_internal_data), options));
+      new BiddingFunction(std::move(startup_snapshot), options));
+}
+
+template <typename Input, typename Output>
+std::string BiddingFunction<Input, Output>::GetStartupSnapshotCacheKey(
+    absl::string_view script_source, const FunctionOptions& options,
+    bool sandboxed) {
+  // The context reuse limit and the heap size are left out since they do not
+  // affect snapshots.
+  // Variable-length parts are prefixed with their length to keep keys
+  // unambiguous.
+  std::string key = absl::StrCat(
+      "v8:", v8::V8::GetVersion(), "|function:", GetFunctionDeclarationName(),
+      "|flatten_function_arguments:", options.flatten_function_arguments,
+      "|warm_up_iterations:", options.warm_up_iterations);
+  if (sandboxed) {
+    absl::StrAppend(&key, "|sandbox_trust_domain:",
+                    options.sandbox_trust_domain.size(), ":",
+                    options.sandbox_trust_domain);
+  }
+  for (const std::string& warm_up_input : options.warm_up_inputs) {
+    absl::StrAppend(&key, "|warm_up_input:", warm_up_input.size(), ":",
+                    warm_up_input);
+  }
+  absl::StrAppend(&key, "|source:", script_source);
+  return key;
 }
 
 template <typename Input, typename Output>
 BiddingFunction<Input, Output>::BiddingFunction(
     std::string startup_internal_data, const FunctionOptions& options)
     : options_(options),
+      metrics_(options.metrics_name),
       allocator_(v8::ArrayBuffer::Allocator::NewDefaultAllocator()),
       startup_internal_data_(std::move(startup_internal_data)),
       startup_data_{startup_internal_data_.data(),
                     static_cast<int>(startup_internal_data_.size())},
-      // Assigns `isolate_` to v8::CreateParams.
-      isolate_(v8::Isolate::New([&]() -> auto {
-        v8::Isolate::CreateParams create_params;
-        create_params.array_buffer_allocator = allocator_.get();
-        create_params.snapshot_blob = &startup_data_;
-        return create_params;
-      }())) {}
+      isolate_pool_(
+          [&]() -> auto {
+            v8::Isolate::CreateParams create_params;
+            create_params.array_buffer_allocator = allocator_.get();
+            create_params.snapshot_blob = &startup_data_;
+            if (options.max_heap_size_bytes > 0) {
+              create_params.constraints.ConfigureDefaultsFromHeapSize(
+                  /*initial_heap_size_in_bytes=*/0,
+                  options.max_heap_size_bytes);
+            }
+            return create_params;
+          }(),
+          GetIsolatePoolOptions()) {}
 
 template <typename Input, typename Output>
 absl::StatusOr<std::vector<Output>> BiddingFunction<Input, Output>::BatchInvoke(
     const std::vector<Input>& bidding_function_inputs) const {
-  v8::Locker locker(isolate_);
-  v8::Isolate::Scope isolate_scope(isolate_);
-  v8::HandleScope handle_scope(isolate_);
-  v8::Local<v8::Context> context = v8::Context::New(isolate_, nullptr);
+  std::vector<const Input*> inputs;
+  inputs.reserve(bidding_function_inputs.size());
+  for (const Input& input : bidding_function_inputs) {
+    inputs.push_back(&input);
+  }
+  MessageBatch<Input, Output> batch(/*common_input=*/nullptr, inputs, options_);
+  return DoBatchInvoke(batch);
+}
+
+template <typename Input, typename Output>
+absl::StatusOr<std::vector<Output>>
+BiddingFunction<Input, Output>::BatchInvokeWithCommonInput(
+    const Input& common_input,
+    absl::Span<const Input* const> bidding_function_inputs) const {
+  MessageBatch<Input, Output> batch(&common_input, bidding_function_inputs,
+                                    options_);
+  return DoBatchInvoke(batch);
+}
+
+template <typename Input, typename Output>
+absl::StatusOr<std::vector<std::string>>
+BiddingFunction<Input, Output>::BatchInvokeSerialized(
+    absl::string_view common_input,
+    absl::Span<const absl::string_view> serialized_inputs) const {
+  SerializedBatch<Input> batch(common_input, serialized_inputs, options_);
+  return DoBatchInvoke(batch);
+}
+
+template <typename Input, typename Output>
+template <typename Batch>
+absl::StatusOr<std::vector<typename Batch::Result>>
+BiddingFunction<Input, Output>::DoBatchInvoke(Batch& batch) const {
+  internal::IsolatePool::ScopedIsolate scoped_isolate = [this] {
+    util::ScopedTraceSpan checkout_span("pool_checkout");
+    return isolate_pool_.Acquire();
+  }();
+  v8::Isolate* isolate = scoped_isolate.get();
+  v8::Locker locker(isolate);
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context =
+      scoped_isolate.GetContext(options_.context_reuse_limit);
   v8::Context::Scope context_scope(context);
 
-  std::vector<Output> outputs;
-  for (const Input& input : bidding_function_inputs) {
-    // If any invocation fails, we immediately return the failing status.
-    // As a result, in the case of a failing invocation, no prices are returned
-    // at all.
-    ASSIGN_OR_RETURN(v8::Local<v8::Value> return_value,
-                     InvokeFunctionOnce(input, context, options_));
-    ASSIGN_OR_RETURN(auto output, ConvertOutput<Output>(return_value, context));
-    outputs.push_back(output);
+  // Stats are recorded however the batch ends.
+  InvocationStats stats;
+  absl::Cleanup record_stats = [this, &stats, start = absl::Now()] {
+    metrics_.RecordBatch(stats);
+    TraceStages(stats, start);
+  };
+  {
+    const absl::Time conversion_start = absl::Now();
+    RETURN_IF_ERROR(batch.ConvertCommonArguments(context));
+    stats[InvocationStage::kArgumentConversion] +=
+        absl::Now() - conversion_start;
+  }
+  // Results are converted as soon as the function returns them, before the
+  // next invocation can change what they refer to. Only the promises still
+  // pending are settled after all the inputs have been invoked, so that they
+  // are all in flight at once. No more inputs are invoked after a failure.
+  std::vector<typename Batch::Result> outputs(batch.size());
+  // Indices and return values of the invocations pending on a promise.
+  std::vector<size_t> pending_indices;
+  std::vector<v8::Local<v8::Value>> pending_values;
+  auto convert_result = [&](size_t index,
+                            v8::Local<v8::Value> return_value) -> absl::Status {
+    const absl::Time conversion_start = absl::Now();
+    absl::Cleanup time_conversion = [&stats, conversion_start] {
+      stats[InvocationStage::kOutputConversion] +=
+          absl::Now() - conversion_start;
+    };
+    ASSIGN_OR_RETURN(v8::Local<v8::Value> result,
+                     GetResult(return_value, isolate));
+    ASSIGN_OR_RETURN(outputs[index], batch.ConvertResult(result, context));
+    return absl::OkStatus();
+  };
+  absl::Status status;
+  size_t index = 0;
+  for (; index < batch.size(); index++) {
+    const absl::Time conversion_start = absl::Now();
+    absl::StatusOr<std::vector<v8::Local<v8::Value>>> arguments =
+        batch.GetArguments(index, context);
+    const absl::Time execution_start = absl::Now();
+    stats[InvocationStage::kArgumentConversion] +=
+        execution_start - conversion_start;
+    if (!arguments.ok()) {
+      status = arguments.status();
+      break;
+    }
+    absl::StatusOr<v8::Local<v8::Value>> return_value =
+        InvokeFunctionWithJsonInput(context, *arguments);
+    if (return_value.ok() && (*return_value)->IsPromise()) {
+      // Lets async functions that do not wait on anything settle right away.
+      isolate->PerformMicrotaskCheckpoint();
+    }
+    stats[InvocationStage::kExecution] += absl::Now() - execution_start;
+    if (!return_value.ok()) {
+      status = return_value.status();
+      break;
+    }
+    if (IsPendingPromise(*return_value)) {
+      pending_indices.push_back(index);
+      pending_values.push_back(*return_value);
+      continue;
+    }
+    if (scoped_isolate.reached_heap_limit()) {
+      break;
+    }
+    status = convert_result(index, *return_value);
+    if (!status.ok()) {
+      break;
+    }
+  }
+  const absl::Time promise_wait_start = absl::Now();
+  SettlePromises(isolate, pending_values);
+  stats[InvocationStage::kPromiseWait] = absl::Now() - promise_wait_start;
+  if (scoped_isolate.reached_heap_limit()) {
+    // The invocations got terminated, whatever they returned.
+    stats.heap_limit_terminations = 1;
+    return absl::ResourceExhaustedError(
+        "The function came close to its heap limit, and got terminated.");
+  }
+  stats.promise_timeouts = absl::c_count_if(pending_values, IsPendingPromise);
+
+  // If any invocation fails, we return the status of the first failing one in
+  // the order of the inputs. As a result, in the case of a failing
+  // invocation, no prices are returned at all.
+  for (size_t pending = 0; pending < pending_indices.size(); pending++) {
+    RETURN_IF_ERROR(
+        convert_result(pending_indices[pending], pending_values[pending]));
   }
+  RETURN_IF_ERROR(status);
   return outputs;
 }
 
@@ -17,34 +17,21 @@
 #ifndef FUNCTION_BIDDING_FUNCTION_H_
 #define FUNCTION_BIDDING_FUNCTION_H_
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "function/bidding_function_interface.h"
+#include "function/function_metrics.h"
+#include "function/isolate_pool.h"
 #include "proto/bidding_function.pb.h"
 #include "v8.h"
 
 namespace aviary {
 namespace function {
-template <typename Input, typename Output>
-class BiddingFunction;
-namespace internal {
-// Manages the lifetime of v8::Isolate.
-class IsolateHolder {
-  IsolateHolder(const IsolateHolder&) = delete;
-  IsolateHolder(IsolateHolder&& other);
-
- private:
-  template <typename Input, typename Output>
-  friend class ::aviary::function::BiddingFunction;
-  explicit IsolateHolder(v8::Isolate* isolate);
-  ~IsolateHolder();
-
-  using IsolatePtr = v8::Isolate*;
-  operator IsolatePtr();  // NOLINT
-  v8::Isolate* isolate_;
-};
-}  // namespace internal
-
 // JavaScript function that executes the sandboxed bidding logic.
 template <typename Input, typename Output>
 class BiddingFunction : public BiddingFunctionInterface<Input, Output> {
@@ -60,9 +47,44 @@ class BiddingFunction : public BiddingFunctionInterface<Input, Output> {
          const FunctionOptions& options = {
              .flatten_function_arguments = false});
 
+  // Compiles and warms up the function defined by `script_source` like
+  // `Create()` does, and returns the resulting V8 startup snapshot, which
+  // `CreateFromStartupSnapshot()` turns back into a function.
+  static absl::StatusOr<std::string> CreateStartupSnapshot(
+      absl::string_view script_source, const FunctionOptions& options);
+
+  // Creates a bidding function from a snapshot returned by
+  // `CreateStartupSnapshot()` for the same options, skipping compilation and
+  // warm-up. The snapshot must have been created by the same V8 version.
+  static std::unique_ptr<BiddingFunction> CreateFromStartupSnapshot(
+      std::string startup_snapshot, const FunctionOptions& options);
+
+  // Returns the key under which to cache the startup snapshot of the function
+  // defined by `script_source`. The key changes with anything that the
+  // snapshot depends on, i.e. the source, the function type, the options and
+  // the V8 version. Snapshots created by `sandboxed` functions are keyed by
+  // their trust domain as well, so that they are only booted by sandboxees of
+  // the same domain, and never in process.
+  static std::string GetStartupSnapshotCacheKey(
+      absl::string_view script_source, const FunctionOptions& options,
+      bool sandboxed);
+
   absl::StatusOr<std::vector<Output>> BatchInvoke(
       const std::vector<Input>& bidding_function_inputs) const override;
 
+  absl::StatusOr<std::vector<Output>> BatchInvokeWithCommonInput(
+      const Input& common_input,
+      absl::Span<const Input* const> bidding_function_inputs) const override;
+
+  // Invokes the function like `BatchInvokeWithCommonInput()` on inputs in the
+  // V8 wire format, as serialized by `MessageToV8WireFormat()`, which are
+  // deserialized straight into the isolate. Returns the results serialized by
+  // `v8::ValueSerializer`, for `V8WireFormatToMessage()` to read.
+  // `common_input` is empty for batches that do not share any input.
+  absl::StatusOr<std::vector<std::string>> BatchInvokeSerialized(
+      absl::string_view common_input,
+      absl::Span<const absl::string_view> serialized_inputs) const;
+
   BiddingFunction(const BiddingFunction&) = delete;
   BiddingFunction(BiddingFunction&& other) = delete;
 
@@ -72,7 +94,14 @@ class BiddingFunction : public BiddingFunctionInterface<Input, Output> {
 
   static std::string GetFunctionDeclarationName();
 
+  // Implements all forms of batch invocations, given a `Batch` that converts
+  // the arguments and the results of its invocations, see bidding_function.cc.
+  template <typename Batch>
+  absl::StatusOr<std::vector<typename Batch::Result>> DoBatchInvoke(
+      Batch& batch) const;
+
   const FunctionOptions options_;
+  const FunctionMetrics metrics_;
   std::unique_ptr<v8::ArrayBuffer::Allocator> allocator_;
   // v8::StartupData does not own `data` pointer; owned by
   // `startup_internal_data_` instead so it doesn't have to be manually deleted.
@@ -81,7 +110,9 @@ class BiddingFunction : public BiddingFunctionInterface<Input, Output> {
   // order to reduce latency for future invocations.
   const std::string startup_internal_data_;
   v8::StartupData startup_data_;
-  mutable internal::IsolateHolder isolate_;
+  // Isolates booted from `startup_data_`. Concurrent invocations check out
+  // different isolates so that they do not serialize on a single v8::Locker.
+  mutable internal::IsolatePool isolate_pool_;
 };
 
 using FledgeBiddingFunction =
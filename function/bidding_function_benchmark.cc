@@ -0,0 +1,448 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of the function engines, and of each stage that a batch of
+// invocations goes through. Run with:
+//
+//   bazel run -c opt //function:bidding_function_benchmark -- \
+//       --benchmark_filter=BatchInvoke
+//
+// Flags of the engines, e.g. --sandbox_shared_memory_bytes, are accepted
+// after the benchmark flags.
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <typeindex>
+#include <typeinfo>
+#include <vector>
+
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/substitute.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "function/bidding_function.h"
+#include "function/bidding_function_interface.h"
+#include "function/bidding_function_sandbox.pb.h"
+#include "function/function_metrics.h"
+#include "function/sapi_bidding_function.h"
+#include "function/shared_memory.h"
+#include "function/value_conversion.h"
+#include "google/protobuf/struct.pb.h"
+#include "google/protobuf/util/json_util.h"
+#include "proto/bidding_function.pb.h"
+#include "v8.h"
+#include "v8/v8_platform_initializer.h"
+
+namespace aviary {
+namespace function {
+namespace {
+
+using ::google::protobuf::util::JsonStringToMessage;
+using ::google::protobuf::util::MessageToJsonString;
+
+using FunctionInterface =
+    BiddingFunctionInterface<BiddingFunctionInput, BiddingFunctionOutput>;
+
+// Bids the highest price among the ads, so that every ad is read, and reads
+// the keys of the trusted bidding signals.
+constexpr absl::string_view kFunctionBody = R"(
+  const ads = interestGroup.ads;
+  let price = 0;
+  for (const ad of ads) {
+    price = Math.max(price, ad.adMetadata.price);
+  }
+  const signalCount = Object.keys(trustedBiddingSignals || {}).length;
+  return {
+    bid: price * perBuyerSignals.multiplier + signalCount,
+    renderUrl: ads[0].renderUrl,
+    ad: ads[0].adMetadata
+  };
+)";
+
+// Returns the source of the benchmarked function, taking flattened or JSON
+// arguments, and async or not.
+std::string GetFunctionSource(bool flatten_function_arguments, bool async) {
+  if (flatten_function_arguments) {
+    return absl::Substitute(
+        "($0(interestGroup, auctionSignals, perBuyerSignals, "
+        "trustedBiddingSignals) => {$1})",
+        async ? "async " : "", kFunctionBody);
+  }
+  return absl::Substitute(
+      "($0(input) => {"
+      "  const {interestGroup, perBuyerSignals, trustedBiddingSignals} = "
+      "      input;"
+      "  $1"
+      "})",
+      async ? "async " : "", kFunctionBody);
+}
+
+// Returns an input with `ad_count` ads, each with a few metadata fields, and
+// `signal_count` trusted bidding signals.
+BiddingFunctionInput CreateInput(int ad_count, int signal_count) {
+  BiddingFunctionInput input;
+  (*input.mutable_per_buyer_signals()->mutable_fields())["multiplier"]
+      .set_number_value(1.5);
+  for (int i = 0; i < ad_count; i++) {
+    InterestGroupAd* ad = input.mutable_interest_group()->add_ads();
+    ad->set_render_url(absl::StrCat("https://cdn.example/ad", i, ".html"));
+    auto& metadata = *ad->mutable_ad_metadata()->mutable_fields();
+    metadata["price"].set_number_value(i);
+    metadata["advertiser"].set_string_value("advertiser.example");
+    metadata["categories"].mutable_list_value()->add_values()->set_string_value(
+        "IAB19-6");
+  }
+  for (int i = 0; i < signal_count; i++) {
+    (*input.mutable_trusted_bidding_signals())[absl::StrCat("key", i)]
+        .set_number_value(i);
+  }
+  return input;
+}
+
+// Returns an output whose ad has `field_count` metadata fields.
+BiddingFunctionOutput CreateOutput(int field_count) {
+  BiddingFunctionOutput output;
+  output.set_bid(1.5);
+  output.set_render_url("https://cdn.example/ad.html");
+  auto& metadata = *output.mutable_ad()->mutable_fields();
+  for (int i = 0; i < field_count; i++) {
+    metadata[absl::StrCat("field", i)].set_string_value("value");
+  }
+  return output;
+}
+
+// Functions are created once per engine and options, outside of the timed
+// loops, and freed once the benchmarks are over.
+using FunctionKey = std::tuple<std::type_index, bool, bool>;
+
+std::map<FunctionKey, std::unique_ptr<FunctionInterface>>& GetFunctions() {
+  static auto* const functions =
+      new std::map<FunctionKey, std::unique_ptr<FunctionInterface>>();
+  return *functions;
+}
+
+template <typename FunctionType>
+absl::StatusOr<const FunctionInterface*> GetFunction(
+    bool flatten_function_arguments, bool async) {
+  std::unique_ptr<FunctionInterface>& function = GetFunctions()[{
+      std::type_index(typeid(FunctionType)), flatten_function_arguments,
+      async}];
+  if (function == nullptr) {
+    // Warmed up with a typical input, so that its shape is what V8 optimizes
+    // for.
+    std::string warm_up_input;
+    if (!MessageToJsonString(CreateInput(4, 16), &warm_up_input).ok()) {
+      return absl::InternalError("Unable to convert the warm-up input.");
+    }
+    absl::StatusOr<std::unique_ptr<FunctionInterface>> created =
+        FunctionType::Create(
+            GetFunctionSource(flatten_function_arguments, async),
+            {.flatten_function_arguments = flatten_function_arguments,
+             .warm_up_inputs = {warm_up_input}});
+    if (!created.ok()) {
+      return created.status();
+    }
+    function = *std::move(created);
+  }
+  return function.get();
+}
+
+// Reports the average time that an iteration spent in each stage, in
+// microseconds.
+void ReportStages(const InvocationStats& stats, benchmark::State& state) {
+  constexpr absl::string_view kCounterNames[kInvocationStageCount] = {
+      "argument_conversion_us", "execution_us", "promise_wait_us",
+      "output_conversion_us", "sandbox_ipc_us"};
+  for (int i = 0; i < kInvocationStageCount; i++) {
+    state.counters[std::string(kCounterNames[i])] = benchmark::Counter(
+        absl::ToDoubleMicroseconds(stats.stage_durations[i]),
+        benchmark::Counter::kAvgIterations);
+  }
+}
+
+// Arguments: batch size, ads per input, trusted bidding signals per input,
+// whether the arguments are flattened and whether the function is async.
+template <typename FunctionType>
+void BM_BatchInvoke(benchmark::State& state) {
+  const int batch_size = state.range(0);
+  const bool flatten_function_arguments = state.range(3);
+  const bool async = state.range(4);
+  const absl::StatusOr<const FunctionInterface*> function =
+      GetFunction<FunctionType>(flatten_function_arguments, async);
+  if (!function.ok()) {
+    state.SkipWithError(function.status().ToString().c_str());
+    return;
+  }
+  const std::vector<BiddingFunctionInput> inputs(
+      batch_size, CreateInput(state.range(1), state.range(2)));
+
+  ScopedInvocationStatsCollector collector;
+  for (auto _ : state) {
+    absl::StatusOr<std::vector<BiddingFunctionOutput>> outputs =
+        (*function)->BatchInvoke(inputs);
+    if (!outputs.ok()) {
+      state.SkipWithError(outputs.status().ToString().c_str());
+      return;
+    }
+    benchmark::DoNotOptimize(outputs);
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+  ReportStages(collector.stats(), state);
+}
+
+void BatchInvokeArguments(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"batch", "ads", "signals", "flatten", "async"});
+  for (int flatten : {0, 1}) {
+    for (int async : {0, 1}) {
+      for (int batch_size : {1, 8, 64}) {
+        benchmark->Args({batch_size, 4, 16, flatten, async});
+      }
+      for (int ad_count : {1, 16, 128}) {
+        benchmark->Args({8, ad_count, 16, flatten, async});
+      }
+      for (int signal_count : {0, 128, 1024}) {
+        benchmark->Args({8, 4, signal_count, flatten, async});
+      }
+    }
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_BatchInvoke, FledgeBiddingFunction)
+    ->Apply(BatchInvokeArguments)
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_BatchInvoke, FledgeSapiBiddingFunction)
+    ->Apply(BatchInvokeArguments)
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime();
+
+// Enters an isolate and a context of its own for the duration of a
+// conversion benchmark.
+class V8Scope {
+ public:
+  V8Scope()
+      : allocator_(::v8::ArrayBuffer::Allocator::NewDefaultAllocator()),
+        isolate_(NewIsolate(allocator_.get())),
+        isolate_scope_(std::in_place, isolate_),
+        handle_scope_(std::in_place, isolate_),
+        context_(::v8::Context::New(isolate_)),
+        context_scope_(std::in_place, context_) {}
+
+  ~V8Scope() {
+    context_scope_.reset();
+    handle_scope_.reset();
+    isolate_scope_.reset();
+    isolate_->Dispose();
+  }
+
+  ::v8::Isolate* isolate() const { return isolate_; }
+  ::v8::Local<::v8::Context> context() const { return context_; }
+
+ private:
+  static ::v8::Isolate* NewIsolate(::v8::ArrayBuffer::Allocator* allocator) {
+    ::v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = allocator;
+    return ::v8::Isolate::New(create_params);
+  }
+
+  const std::unique_ptr<::v8::ArrayBuffer::Allocator> allocator_;
+  ::v8::Isolate* const isolate_;
+  std::optional<::v8::Isolate::Scope> isolate_scope_;
+  std::optional<::v8::HandleScope> handle_scope_;
+  ::v8::Local<::v8::Context> context_;
+  std::optional<::v8::Context::Scope> context_scope_;
+};
+
+::v8::Local<::v8::String> NewString(::v8::Isolate* isolate,
+                                    absl::string_view string) {
+  return ::v8::String::NewFromUtf8(isolate, string.data(),
+                                   ::v8::NewStringType::kNormal, string.size())
+      .ToLocalChecked();
+}
+
+// Argument conversion, by `ProtoToV8Value()` and through JSON respectively.
+// Arguments: ads and trusted bidding signals of the input.
+void BM_ProtoToV8Value(benchmark::State& state) {
+  const BiddingFunctionInput input =
+      CreateInput(state.range(0), state.range(1));
+  V8Scope v8_scope;
+  for (auto _ : state) {
+    ::v8::HandleScope handle_scope(v8_scope.isolate());
+    absl::StatusOr<::v8::Local<::v8::Value>> value =
+        ProtoToV8Value(input, v8_scope.context());
+    if (!value.ok()) {
+      state.SkipWithError(value.status().ToString().c_str());
+      return;
+    }
+    benchmark::DoNotOptimize(*value);
+  }
+}
+
+void BM_JsonToV8Value(benchmark::State& state) {
+  const BiddingFunctionInput input =
+      CreateInput(state.range(0), state.range(1));
+  V8Scope v8_scope;
+  for (auto _ : state) {
+    ::v8::HandleScope handle_scope(v8_scope.isolate());
+    std::string json_string;
+    if (!MessageToJsonString(input, &json_string).ok()) {
+      state.SkipWithError("Unable to convert the input to JSON");
+      return;
+    }
+    ::v8::Local<::v8::Value> value =
+        ::v8::JSON::Parse(v8_scope.context(),
+                          NewString(v8_scope.isolate(), json_string))
+            .ToLocalChecked();
+    benchmark::DoNotOptimize(value);
+  }
+}
+
+void ConversionArguments(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"ads", "signals"});
+  for (int ad_count : {1, 16, 128}) {
+    benchmark->Args({ad_count, 16});
+  }
+  for (int signal_count : {128, 1024}) {
+    benchmark->Args({4, signal_count});
+  }
+}
+
+BENCHMARK(BM_ProtoToV8Value)->Apply(ConversionArguments);
+BENCHMARK(BM_JsonToV8Value)->Apply(ConversionArguments);
+
+// Output conversion, by `V8ValueToProto()` and through JSON respectively.
+// Argument: metadata fields of the ad of the output.
+void BM_V8ValueToProto(benchmark::State& state) {
+  V8Scope v8_scope;
+  const ::v8::Local<::v8::Value> value =
+      ProtoToV8Value(CreateOutput(state.range(0)), v8_scope.context()).value();
+  for (auto _ : state) {
+    ::v8::HandleScope handle_scope(v8_scope.isolate());
+    BiddingFunctionOutput output;
+    const absl::Status status =
+        V8ValueToProto(value, v8_scope.context(), &output);
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      return;
+    }
+    benchmark::DoNotOptimize(output);
+  }
+}
+
+void BM_JsonToProto(benchmark::State& state) {
+  V8Scope v8_scope;
+  const ::v8::Local<::v8::Value> value =
+      ProtoToV8Value(CreateOutput(state.range(0)), v8_scope.context()).value();
+  for (auto _ : state) {
+    ::v8::HandleScope handle_scope(v8_scope.isolate());
+    const ::v8::Local<::v8::String> json_string =
+        ::v8::JSON::Stringify(v8_scope.context(), value).ToLocalChecked();
+    BiddingFunctionOutput output;
+    if (!JsonStringToMessage(
+             *::v8::String::Utf8Value(v8_scope.isolate(), json_string),
+             &output)
+             .ok()) {
+      state.SkipWithError("Unable to convert the output from JSON");
+      return;
+    }
+    benchmark::DoNotOptimize(output);
+  }
+}
+
+BENCHMARK(BM_V8ValueToProto)->Arg(1)->Arg(16)->Arg(256);
+BENCHMARK(BM_JsonToProto)->Arg(1)->Arg(16)->Arg(256);
+
+// Transport of a batch of inputs to a sandboxee, through shared memory and
+// through `Any` messages sent over the comms channel respectively, without the
+// IPC itself. Arguments: batch size, ads and trusted bidding signals per input.
+void BM_SharedMemoryTransport(benchmark::State& state) {
+  const std::vector<BiddingFunctionInput> inputs(
+      state.range(0), CreateInput(state.range(1), state.range(2)));
+  std::vector<const google::protobuf::MessageLite*> messages;
+  for (const BiddingFunctionInput& input : inputs) {
+    messages.push_back(&input);
+  }
+  const absl::StatusOr<std::unique_ptr<SharedMemory>> shared_memory =
+      SharedMemory::Create(64 << 20);
+  if (!shared_memory.ok()) {
+    state.SkipWithError(shared_memory.status().ToString().c_str());
+    return;
+  }
+  for (auto _ : state) {
+    const absl::StatusOr<size_t> size =
+        WriteMessages(messages, (*shared_memory)->requests());
+    if (!size.ok()) {
+      state.SkipWithError(size.status().ToString().c_str());
+      return;
+    }
+    const std::vector<absl::string_view> read_messages =
+        ReadMessages((*shared_memory)->requests().first(*size)).value();
+    for (absl::string_view message : read_messages) {
+      BiddingFunctionInput input;
+      input.ParseFromArray(message.data(), message.size());
+      benchmark::DoNotOptimize(input);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * inputs.size());
+}
+
+void BM_AnyTransport(benchmark::State& state) {
+  const std::vector<BiddingFunctionInput> inputs(
+      state.range(0), CreateInput(state.range(1), state.range(2)));
+  for (auto _ : state) {
+    BatchedInvocationInputs inputs_proto;
+    for (const BiddingFunctionInput& input : inputs) {
+      inputs_proto.add_inputs()->PackFrom(input);
+    }
+    const std::string serialized = inputs_proto.SerializeAsString();
+    BatchedInvocationInputs parsed_proto;
+    parsed_proto.ParseFromString(serialized);
+    for (const auto& input_any : parsed_proto.inputs()) {
+      BiddingFunctionInput input;
+      input_any.UnpackTo(&input);
+      benchmark::DoNotOptimize(input);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * inputs.size());
+}
+
+void TransportArguments(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"batch", "ads", "signals"});
+  for (int batch_size : {1, 8, 64}) {
+    benchmark->Args({batch_size, 4, 16});
+  }
+  benchmark->Args({8, 128, 16});
+  benchmark->Args({8, 4, 1024});
+}
+
+BENCHMARK(BM_SharedMemoryTransport)->Apply(TransportArguments);
+BENCHMARK(BM_AnyTransport)->Apply(TransportArguments);
+}  // namespace
+}  // namespace function
+}  // namespace aviary
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  absl::ParseCommandLine(argc, argv);
+  aviary::v8::V8PlatformInitializer v8_platform_initializer;
+  benchmark::RunSpecifiedBenchmarks();
+  aviary::function::GetFunctions().clear();
+  return 0;
+}
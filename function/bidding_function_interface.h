@@ -17,12 +17,32 @@
 #ifndef FUNCTION_BIDDING_FUNCTION_INTERFACE_H_H_
 #define FUNCTION_BIDDING_FUNCTION_INTERFACE_H_H_
 
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "google/protobuf/descriptor.h"
+#include "google/protobuf/message.h"
 #include "proto/bidding_function.pb.h"
 
 namespace aviary {
 namespace function {
 
+// Fails the outputs of a batch of `input_count` inputs unless there is exactly
+// one per input, since callers match outputs to inputs by position. Outputs
+// that come from untrusted code, e.g. a sandboxee, must be checked.
+template <typename Output>
+absl::StatusOr<std::vector<Output>> CheckBatchOutputCount(
+    absl::StatusOr<std::vector<Output>> outputs, size_t input_count) {
+  if (outputs.ok() && outputs->size() != input_count) {
+    return absl::InternalError(
+        "The function returned a different number of outputs than inputs.");
+  }
+  return outputs;
+}
+
 struct FunctionOptions {
   // Whether to flatten function arguments from the fields of the input
   // object.
@@ -34,8 +54,64 @@ struct FunctionOptions {
   // value becomes an individual argument to the function in the order of
   // declaration in the protocol buffer.
   bool flatten_function_arguments = false;
+
+  // Number of `BatchInvoke()` calls served by the same V8 context before it
+  // gets replaced by a fresh one.
+  //
+  // With the default of 1, every call runs in a fresh context, so that no state
+  // leaks between calls. Larger values save the cost of creating a context at
+  // the expense of letting globals modified by one call be observed by the
+  // following ones.
+  int context_reuse_limit = 1;
+
+  // Number of times the function is invoked on each warm-up input before its
+  // snapshot is taken, so that the snapshot captures optimized code.
+  int warm_up_iterations = 10;
+
+  // Sample inputs to warm up the function with, in the JSON format of the
+  // function input message.
+  //
+  // When empty, the function is warmed up with an empty input, and errors are
+  // ignored since most functions cannot make sense of such an input. When not
+  // empty, creating the function fails if it fails on any of these inputs.
+  std::vector<std::string> warm_up_inputs;
+
+  // Whether to deeply freeze the arguments shared by the invocations of a
+  // batch, see `BiddingFunctionInterface::BatchInvokeWithCommonInput()`.
+  //
+  // When false, modifications made to shared arguments by an invocation are
+  // visible to the following invocations of the same batch.
+  bool freeze_common_arguments = false;
+
+  // Trust domain of a sandboxed function, e.g. the buyer it belongs to.
+  // Sandboxed functions of the same non-empty trust domain are hosted by the
+  // same sandboxee processes, and cannot be isolated from each other.
+  //
+  // When empty, the function gets sandboxee processes of its own.
+  std::string sandbox_trust_domain;
+
+  // Name under which the metrics of the function are recorded, e.g. its URI.
+  // Does not affect the function otherwise.
+  std::string metrics_name;
+
+  // Maximum size of the heap of each isolate running the function, in bytes.
+  // Invocations that bring the heap close to its limit fail, and the isolate
+  // running them gets replaced by a fresh one.
+  //
+  // When 0, the default limit of V8 applies.
+  size_t max_heap_size_bytes = 0;
 };
 
+// Returns whether `field` of `message` is set in the sense of
+// `Message::MergeFrom()`: message fields that are present, non-empty repeated
+// and map fields, and scalar fields that differ from their default.
+inline bool IsFieldSet(const google::protobuf::Message& message,
+                       const google::protobuf::FieldDescriptor* field) {
+  const google::protobuf::Reflection* reflection = message.GetReflection();
+  return field->is_repeated() ? reflection->FieldSize(message, field) > 0
+                              : reflection->HasField(message, field);
+}
+
 // JavaScript function that executes the sandboxed bidding and auction logic.
 template <typename Input, typename Output>
 class BiddingFunctionInterface {
@@ -49,6 +125,26 @@ class BiddingFunctionInterface {
   // detected.
   virtual absl::StatusOr<std::vector<Output>> BatchInvoke(
       const std::vector<Input>& bidding_function_inputs) const = 0;
+
+  // Invokes the function for a batch of inputs sharing the fields that are set
+  // in `common_input`, e.g. the auction configuration. Every invocation gets
+  // these fields in place of the same fields of its own input, which should be
+  // left unset. Behaves like `BatchInvoke()` otherwise.
+  //
+  // Inputs are passed by pointer so that callers can build them on an arena
+  // without copying them out. Implementations convert the shared fields once
+  // for the whole batch, and pass the same values to every invocation.
+  virtual absl::StatusOr<std::vector<Output>> BatchInvokeWithCommonInput(
+      const Input& common_input,
+      absl::Span<const Input* const> bidding_function_inputs) const {
+    std::vector<Input> merged_inputs;
+    merged_inputs.reserve(bidding_function_inputs.size());
+    for (const Input* input : bidding_function_inputs) {
+      merged_inputs.push_back(*input);
+      merged_inputs.back().MergeFrom(common_input);
+    }
+    return BatchInvoke(merged_inputs);
+  }
 };
 }  // namespace function
 }  // namespace aviary
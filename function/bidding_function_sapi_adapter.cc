@@ -12,10 +12,25 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "function/bidding_function_sapi_adapter.h"
+
+#include <string>
+#include <vector>
+
+#include "absl/cleanup/cleanup.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "absl/types/variant.h"
 #include "function/bidding_function.h"
 #include "function/bidding_function_interface.h"
 #include "function/bidding_function_sandbox.pb.h"
+#include "function/function_metrics.h"
+#include "function/shared_memory.h"
+#include "google/protobuf/arena.h"
 #include "util/status_encoding.h"
 #include "util/status_macros.h"
 
@@ -26,14 +41,39 @@ namespace {
 using ::aviary::util::SaveStatusToProto;
 using ::google::protobuf::Message;
 
-ABSL_CONST_INIT absl::Mutex bidding_function_mutex(absl::kConstInit);
-// Sandbox-wide instance of a function.
-absl::variant<
-    BiddingFunctionInterface<BiddingFunctionInput, BiddingFunctionOutput>*,
-    BiddingFunctionInterface<AdScoringFunctionInput, AdScoringFunctionOutput>*>
-    single_bidding_function ABSL_GUARDED_BY(bidding_function_mutex);
-BiddingFunctionSpec::FunctionType function_type ABSL_GUARDED_BY(
-    bidding_function_mutex) = BiddingFunctionSpec::FUNCTION_TYPE_UNSPECIFIED;
+// A function hosted by the sandboxee.
+struct HostedFunction {
+  BiddingFunctionSpec::FunctionType type;
+  absl::variant<std::shared_ptr<const FledgeBiddingFunction>,
+                std::shared_ptr<const FledgeAdScoringFunction>>
+      function;
+  // Whether the function exchanges its inputs and outputs in the V8 wire
+  // format, see `BiddingFunctionSpec::v8_wire_format`.
+  bool v8_wire_format;
+};
+
+ABSL_CONST_INIT absl::Mutex hosted_functions_mutex(absl::kConstInit);
+
+// Sandbox-wide instances of the functions, by ID.
+absl::flat_hash_map<uint64_t, HostedFunction>& GetHostedFunctions()
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(hosted_functions_mutex) {
+  // Never freed, since the functions last as long as the sandboxee.
+  static auto* const hosted_functions =
+      new absl::flat_hash_map<uint64_t, HostedFunction>();
+  return *hosted_functions;
+}
+
+// Returns the function compiled within the sandbox under `function_id`.
+absl::StatusOr<HostedFunction> GetHostedFunction(uint64_t function_id) {
+  absl::ReaderMutexLock lock(&hosted_functions_mutex);
+  const auto it = GetHostedFunctions().find(function_id);
+  if (it == GetHostedFunctions().end()) {
+    return absl::NotFoundError(absl::StrCat(
+        "Function ", function_id, " has not been initialized within the "
+        "sandbox."));
+  }
+  return it->second;
+}
 
 template <typename Output>
 BatchedInvocationOutputs GetFunctionOutputs(
@@ -46,47 +86,148 @@ BatchedInvocationOutputs GetFunctionOutputs(
 }
 
 template <typename Input, typename Output>
-absl::Status DoCompileFunction(const BiddingFunctionSpec& spec) {
+absl::StatusOr<std::string> DoCompileFunction(const BiddingFunctionSpec& spec) {
   using Function = BiddingFunction<Input, Output>;
-  ASSIGN_OR_RETURN(
-      auto bidding_function,
-      Function::Create(spec.bidding_function_source(),
-                       FunctionOptions{.flatten_function_arguments =
-                                           spec.flatten_function_arguments()}));
+  const FunctionOptions options = {
+      .flatten_function_arguments = spec.flatten_function_arguments(),
+      .context_reuse_limit = spec.context_reuse_limit(),
+      .warm_up_iterations = spec.warm_up_iterations(),
+      .warm_up_inputs = {spec.warm_up_inputs().begin(),
+                         spec.warm_up_inputs().end()},
+      .freeze_common_arguments = spec.freeze_common_arguments(),
+      .max_heap_size_bytes = spec.max_heap_size_bytes()};
+  std::string startup_snapshot = spec.startup_snapshot();
+  if (startup_snapshot.empty()) {
+    ASSIGN_OR_RETURN(startup_snapshot,
+                     Function::CreateStartupSnapshot(
+                         spec.bidding_function_source(), options));
+  }
+  std::string returned_startup_snapshot;
+  if (spec.return_startup_snapshot()) {
+    returned_startup_snapshot = startup_snapshot;
+  }
+  std::shared_ptr<const Function> bidding_function =
+      Function::CreateFromStartupSnapshot(std::move(startup_snapshot), options);
   {
-    absl::MutexLock lock(&bidding_function_mutex);
-    if (function_type != BiddingFunctionSpec::FUNCTION_TYPE_UNSPECIFIED) {
-      return absl::FailedPreconditionError(
-          "Function has already been initialized within the sandbox.");
+    absl::MutexLock lock(&hosted_functions_mutex);
+    if (!GetHostedFunctions()
+             .emplace(spec.function_id(),
+                      HostedFunction{.type = spec.type(),
+                                     .function = std::move(bidding_function),
+                                     .v8_wire_format = spec.v8_wire_format()})
+             .second) {
+      return absl::AlreadyExistsError(
+          absl::StrCat("Function ", spec.function_id(),
+                       " has already been initialized within the sandbox."));
     }
-    single_bidding_function = bidding_function.release();
-    function_type = spec.type();
   }
-  return absl::OkStatus();
+  return returned_startup_snapshot;
 }
 
 template <typename Input, typename Output>
 absl::StatusOr<BatchedInvocationOutputs> DoBatchExecuteFunction(
-    const BatchedInvocationInputs& invocation_inputs) {
-  const BiddingFunctionInterface<Input, Output>* bidding_function;
-  {
-    absl::ReaderMutexLock lock(&bidding_function_mutex);
-    bidding_function = absl::get<BiddingFunctionInterface<Input, Output>*>(
-        single_bidding_function);
+    const BiddingFunction<Input, Output>& bidding_function,
+    bool v8_wire_format, const BatchedInvocationInputs& invocation_inputs) {
+  if (v8_wire_format) {
+    const std::vector<absl::string_view> inputs(
+        invocation_inputs.serialized_inputs().begin(),
+        invocation_inputs.serialized_inputs().end());
+    ASSIGN_OR_RETURN(std::vector<std::string> outputs,
+                     bidding_function.BatchInvokeSerialized(
+                         invocation_inputs.serialized_common_input(), inputs));
+    BatchedInvocationOutputs function_outputs;
+    function_outputs.mutable_serialized_outputs()->Reserve(outputs.size());
+    for (std::string& output : outputs) {
+      function_outputs.add_serialized_outputs(std::move(output));
+    }
+    return function_outputs;
   }
-  std::vector<Input> inputs_vector;
+  // Unpacked inputs are freed at once with the arena after the invocation.
+  google::protobuf::Arena arena;
+  std::vector<const Input*> inputs;
+  inputs.reserve(invocation_inputs.inputs_size());
   for (const auto& inputs_any : invocation_inputs.inputs()) {
-    if (!inputs_any.UnpackTo(&inputs_vector.emplace_back())) {
+    Input* input = google::protobuf::Arena::CreateMessage<Input>(&arena);
+    if (!inputs_any.UnpackTo(input)) {
       return absl::InvalidArgumentError("Unable to unpack inputs");
     }
+    inputs.push_back(input);
+  }
+  // Batches without a common input are invoked with an empty one, which shares
+  // no field.
+  Input* common_input = google::protobuf::Arena::CreateMessage<Input>(&arena);
+  if (invocation_inputs.has_common_input() &&
+      !invocation_inputs.common_input().UnpackTo(common_input)) {
+    return absl::InvalidArgumentError("Unable to unpack the common input");
   }
-  ASSIGN_OR_RETURN(auto invocation_result,
-                   bidding_function->BatchInvoke(inputs_vector));
+  ASSIGN_OR_RETURN(
+      auto invocation_result,
+      bidding_function.BatchInvokeWithCommonInput(*common_input, inputs));
   return GetFunctionOutputs(invocation_result);
 }
+
+// Returns the shared memory mapped at kSharedMemoryFd, which is mapped upon the
+// first call.
+absl::StatusOr<SharedMemory*> GetSharedMemory() {
+  // Never freed, since the mapping lasts as long as the sandboxee.
+  static const auto* const shared_memory =
+      new absl::StatusOr<std::unique_ptr<SharedMemory>>(
+          SharedMemory::Map(kSharedMemoryFd));
+  RETURN_IF_ERROR(shared_memory->status());
+  return shared_memory->value().get();
+}
+
+template <typename Input, typename Output>
+absl::StatusOr<size_t> DoBatchExecuteFunctionInSharedMemory(
+    const BiddingFunction<Input, Output>& bidding_function,
+    bool v8_wire_format, size_t request_size) {
+  ASSIGN_OR_RETURN(SharedMemory * shared_memory, GetSharedMemory());
+  if (request_size > shared_memory->requests().size()) {
+    return absl::InvalidArgumentError("Request exceeds the shared memory");
+  }
+  ASSIGN_OR_RETURN(const std::vector<absl::string_view> messages,
+                   ReadMessages(shared_memory->requests().first(request_size)));
+  if (messages.empty()) {
+    return absl::InvalidArgumentError("Missing common input");
+  }
+  if (v8_wire_format) {
+    // Values are deserialized straight from the shared memory.
+    ASSIGN_OR_RETURN(const std::vector<std::string> outputs,
+                     bidding_function.BatchInvokeSerialized(
+                         messages.front(),
+                         absl::MakeConstSpan(messages).subspan(1)));
+    const std::vector<absl::string_view> serialized_outputs(outputs.begin(),
+                                                            outputs.end());
+    return WriteSerializedMessages(serialized_outputs,
+                                   shared_memory->responses());
+  }
+  // Inputs are parsed straight from the shared memory onto an arena, which
+  // frees them at once after the invocation.
+  google::protobuf::Arena arena;
+  std::vector<Input*> parsed_messages;
+  parsed_messages.reserve(messages.size());
+  for (absl::string_view message : messages) {
+    Input* input = google::protobuf::Arena::CreateMessage<Input>(&arena);
+    if (!input->ParseFromArray(message.data(), message.size())) {
+      return absl::InvalidArgumentError("Unable to parse inputs");
+    }
+    parsed_messages.push_back(input);
+  }
+  const std::vector<const Input*> inputs(parsed_messages.begin() + 1,
+                                         parsed_messages.end());
+  ASSIGN_OR_RETURN(const std::vector<Output> outputs,
+                   bidding_function.BatchInvokeWithCommonInput(
+                       *parsed_messages.front(), inputs));
+  std::vector<const google::protobuf::MessageLite*> output_messages;
+  output_messages.reserve(outputs.size());
+  for (const Output& output : outputs) {
+    output_messages.push_back(&output);
+  }
+  return WriteMessages(output_messages, shared_memory->responses());
+}
 }  // namespace
 
-absl::Status CompileFunction(const BiddingFunctionSpec& spec) {
+absl::StatusOr<std::string> CompileFunction(const BiddingFunctionSpec& spec) {
   switch (spec.type()) {
     case BiddingFunctionSpec::FLEDGE_BIDDING_FUNCTION:
       return DoCompileFunction<BiddingFunctionInput, BiddingFunctionOutput>(
@@ -101,28 +242,69 @@ absl::Status CompileFunction(const BiddingFunctionSpec& spec) {
   }
 }
 
+absl::Status ReleaseFunction(uint64_t function_id) {
+  absl::MutexLock lock(&hosted_functions_mutex);
+  if (GetHostedFunctions().erase(function_id) == 0) {
+    return absl::NotFoundError(absl::StrCat(
+        "Function ", function_id, " has not been initialized within the "
+        "sandbox."));
+  }
+  return absl::OkStatus();
+}
+
 absl::StatusOr<BatchedInvocationOutputs> BatchExecuteFunction(
-    const BatchedInvocationInputs& invocation_inputs) {
-  BiddingFunctionSpec::FunctionType type;
-  {
-    absl::ReaderMutexLock lock(&bidding_function_mutex);
-    if (function_type == BiddingFunctionSpec::FUNCTION_TYPE_UNSPECIFIED) {
-      return absl::FailedPreconditionError(
-          "Function has not been initialized within the sandbox.");
-    }
-    type = function_type;
+    const BatchedInvocationInputs& invocation_inputs,
+    BatchedInvocationStats* stats) {
+  const absl::Time start = absl::Now();
+  ASSIGN_OR_RETURN(const HostedFunction hosted_function,
+                   GetHostedFunction(invocation_inputs.function_id()));
+  ScopedInvocationStatsCollector stats_collector;
+  absl::Cleanup report_stats = [&stats_collector, stats, start] {
+    *stats = ToProto(stats_collector.stats());
+    stats->set_start_unix_micros(absl::ToUnixMicros(start));
+    stats->set_end_unix_micros(absl::ToUnixMicros(absl::Now()));
+  };
+  switch (hosted_function.type) {
+    case BiddingFunctionSpec::FLEDGE_BIDDING_FUNCTION:
+      return DoBatchExecuteFunction(*absl::get<0>(hosted_function.function),
+                                    hosted_function.v8_wire_format,
+                                    invocation_inputs);
+    case BiddingFunctionSpec::FLEDGE_AD_SCORING_FUNCTION:
+      return DoBatchExecuteFunction(*absl::get<1>(hosted_function.function),
+                                    hosted_function.v8_wire_format,
+                                    invocation_inputs);
+    default:
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Unexpected function type: ",
+          BiddingFunctionSpec::FunctionType_Name(hosted_function.type)));
   }
-  switch (type) {
+}
+
+absl::StatusOr<size_t> BatchExecuteFunctionInSharedMemory(
+    uint64_t function_id, size_t request_size,
+    BatchedInvocationStats* stats) {
+  const absl::Time start = absl::Now();
+  ASSIGN_OR_RETURN(const HostedFunction hosted_function,
+                   GetHostedFunction(function_id));
+  ScopedInvocationStatsCollector stats_collector;
+  absl::Cleanup report_stats = [&stats_collector, stats, start] {
+    *stats = ToProto(stats_collector.stats());
+    stats->set_start_unix_micros(absl::ToUnixMicros(start));
+    stats->set_end_unix_micros(absl::ToUnixMicros(absl::Now()));
+  };
+  switch (hosted_function.type) {
     case BiddingFunctionSpec::FLEDGE_BIDDING_FUNCTION:
-      return DoBatchExecuteFunction<BiddingFunctionInput,
-                                    BiddingFunctionOutput>(invocation_inputs);
+      return DoBatchExecuteFunctionInSharedMemory(
+          *absl::get<0>(hosted_function.function),
+          hosted_function.v8_wire_format, request_size);
     case BiddingFunctionSpec::FLEDGE_AD_SCORING_FUNCTION:
-      return DoBatchExecuteFunction<AdScoringFunctionInput,
-                                    AdScoringFunctionOutput>(invocation_inputs);
+      return DoBatchExecuteFunctionInSharedMemory(
+          *absl::get<1>(hosted_function.function),
+          hosted_function.v8_wire_format, request_size);
     default:
-      return absl::InvalidArgumentError(
-          absl::StrCat("Unexpected function type: ",
-                       BiddingFunctionSpec::FunctionType_Name(type)));
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Unexpected function type: ",
+          BiddingFunctionSpec::FunctionType_Name(hosted_function.type)));
   }
 }
 }  // namespace function
@@ -24,8 +24,7 @@
 
 namespace aviary::function {
 
-// Operations supported by the sandbox that executes a single JavaScript
-// function.
+// Operations supported by the sandbox that executes JavaScript functions.
 enum class SandboxedFunctionOp {
   // Exits a sandbox.
   // Must match kMsgExit from
@@ -34,21 +33,46 @@ enum class SandboxedFunctionOp {
   // kMsgExit can be triggered by sapi::Sandbox to request the sandbox to exit.
   kMsgExit = 0x104,
   // Compile a function. Pre-requisite for subsequent function executions.
-  // Each sandbox supports the execution of one function.
+  // Each sandbox hosts any number of functions, addressed by the IDs they are
+  // compiled with.
   kCompile = 0x1001,
   // Execute previously compiled function on a batch of inputs.
   kBatchExecute = 0x1002,
+  // Same as kBatchExecute, with the inputs and outputs exchanged through the
+  // shared memory mapped at kSharedMemoryFd.
+  kBatchExecuteInSharedMemory = 0x1003,
+  // Free a previously compiled function.
+  kReleaseFunction = 0x1004,
 };
 
+// File descriptor at which the memfd file backing the shared memory of a
+// sandbox is mapped into the sandboxee, see `SharedMemory`.
+constexpr int kSharedMemoryFd = 1000;
+
 // Compiles and prepares a function for later execution within the current
-// sandbox. Returns compilation status.
-absl::Status CompileFunction(const BiddingFunctionSpec& spec);
+// sandbox, under `spec.function_id()`. Returns the startup snapshot of the
+// function if `spec.return_startup_snapshot()` is set, or an empty string
+// otherwise.
+absl::StatusOr<std::string> CompileFunction(const BiddingFunctionSpec& spec);
+
+// Frees a function compiled with `CompileFunction()`.
+absl::Status ReleaseFunction(uint64_t function_id);
 
-// Executes the function that was previously compiled within the current sandbox
-// for a batch of inputs. Returns a batch of outputs in the same order as the
-// inputs or an error status.
+// Executes the function `invocation_inputs.function_id()` that was previously
+// compiled within the current sandbox for a batch of inputs. Returns a batch of
+// outputs in the same order as the inputs or an error status. Sets `*stats` to
+// the stats of the batch either way.
 absl::StatusOr<BatchedInvocationOutputs> BatchExecuteFunction(
-    const BatchedInvocationInputs& invocation_inputs);
+    const BatchedInvocationInputs& invocation_inputs,
+    BatchedInvocationStats* stats);
+
+// Same as `BatchExecuteFunction()`, for a batch read from the first
+// `request_size` bytes of the requests of the shared memory. The batch consists
+// of the common input followed by the inputs, as written by `WriteMessages()`.
+// The outputs are written to the responses of the shared memory in the same
+// way. Returns the number of bytes written.
+absl::StatusOr<size_t> BatchExecuteFunctionInSharedMemory(
+    uint64_t function_id, size_t request_size, BatchedInvocationStats* stats);
 }  // namespace aviary::function
 
 #endif // FUNCTION_BIDDING_FUNCTION_SAPI_ADAPTER_H_
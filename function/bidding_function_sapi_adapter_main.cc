@@ -16,19 +16,33 @@
 // Sandbox2
 // (https://developers.google.com/sandboxed-api/docs/sandbox2/overview).
 // This binary gets embedded into the main Aviary binary as data and runs as a
-// child process spawned by the SapiBiddingFunction::Sandbox class with the help
+// child process spawned by the FunctionSandbox class with the help
 // of Sandbox2, i.e.:
 //
-// auto sandbox = std::make_unique<Sandbox>();
+// auto sandbox = std::make_unique<FunctionSandbox>(nullptr);
 // RETURN_IF_ERROR(sandbox->Init());
 // //...operations on the sandbox
 
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/statusor.h"
 #include "function/bidding_function_sapi_adapter.h"
+#include "function/isolate_pool.h"
+#include "google/protobuf/arena.h"
 #include "google/rpc/status.pb.h"
 #include "sandboxed_api/sandbox2/comms.h"
 #include "sandboxed_api/sandbox2/forkingclient.h"
+#include "util/cpu_affinity.h"
 #include "v8/v8_platform_initializer.h"
 
+ABSL_FLAG(std::string, cpus, "",
+          "CPUs that the sandboxee and all its threads are pinned to, set from "
+          "--sandboxee_cpus of the server.");
+
 namespace aviary::function {
 namespace {
 
@@ -42,22 +56,60 @@ void ServeRequest(sandbox2::Comms& comms) {
     case SandboxedFunctionOp::kCompile: {
       BiddingFunctionSpec spec;
       if (comms.RecvProtoBuf(&spec)) {
-        absl::Status compilation_status = CompileFunction(spec);
-        comms.SendStatus(compilation_status);
+        absl::StatusOr<std::string> startup_snapshot_or =
+            CompileFunction(spec);
+        if (comms.SendStatus(startup_snapshot_or.status()) &&
+            startup_snapshot_or.ok() && spec.return_startup_snapshot()) {
+          comms.SendString(startup_snapshot_or.value());
+        }
       } else {
         comms.SendStatus(absl::InvalidArgumentError("RecvProtoBuf failed"));
       }
     } break;
     case SandboxedFunctionOp::kBatchExecute: {
-      BatchedInvocationInputs invocation_inputs;
-      if (comms.RecvProtoBuf(&invocation_inputs)) {
+      // Parse the packed inputs on an arena, which frees them all at once.
+      google::protobuf::Arena arena;
+      auto* invocation_inputs =
+          google::protobuf::Arena::CreateMessage<BatchedInvocationInputs>(
+              &arena);
+      if (comms.RecvProtoBuf(invocation_inputs)) {
+        BatchedInvocationStats stats;
         absl::StatusOr<BatchedInvocationOutputs> outputs_or =
-            BatchExecuteFunction(invocation_inputs);
-        if (comms.SendStatus(outputs_or.status()) && outputs_or.ok()) {
+            BatchExecuteFunction(*invocation_inputs, &stats);
+        // The stats follow the status, whether the batch failed or not.
+        if (comms.SendStatus(outputs_or.status()) &&
+            comms.SendProtoBuf(stats) && outputs_or.ok()) {
           comms.SendProtoBuf(outputs_or.value());
         }
       } else {
         comms.SendStatus(absl::InvalidArgumentError("RecvProtoBuf failed"));
+        comms.SendProtoBuf(BatchedInvocationStats());
+      }
+    } break;
+    case SandboxedFunctionOp::kBatchExecuteInSharedMemory: {
+      uint64_t function_id;
+      uint64_t request_size;
+      if (comms.RecvUint64(&function_id) && comms.RecvUint64(&request_size)) {
+        BatchedInvocationStats stats;
+        absl::StatusOr<size_t> response_size_or =
+            BatchExecuteFunctionInSharedMemory(function_id, request_size,
+                                               &stats);
+        // The stats follow the status, whether the batch failed or not.
+        if (comms.SendStatus(response_size_or.status()) &&
+            comms.SendProtoBuf(stats) && response_size_or.ok()) {
+          comms.SendUint64(response_size_or.value());
+        }
+      } else {
+        comms.SendStatus(absl::InvalidArgumentError("RecvUint64 failed"));
+        comms.SendProtoBuf(BatchedInvocationStats());
+      }
+    } break;
+    case SandboxedFunctionOp::kReleaseFunction: {
+      uint64_t function_id;
+      if (comms.RecvUint64(&function_id)) {
+        comms.SendStatus(ReleaseFunction(function_id));
+      } else {
+        comms.SendStatus(absl::InvalidArgumentError("RecvUint64 failed"));
       }
     } break;
     // Handle kMsgExit which can be triggered by sapi::Sandbox to terminate the
@@ -76,6 +128,20 @@ void ServeRequest(sandbox2::Comms& comms) {
 // Adapted from
 // https://github.com/google/sandboxed-api/blob/main/sandboxed_api/client.cc.
 int main(int argc, char** argv) {
+  // Flags are forwarded by `FunctionSandbox::GetArgs()`.
+  absl::ParseCommandLine(argc, argv);
+  const absl::StatusOr<std::vector<int>> cpus =
+      aviary::util::ParseCpuSet(absl::GetFlag(FLAGS_cpus));
+  // The host checks the flags that it forwards, see `SandboxPool::Create()`.
+  if (!cpus.ok() || !aviary::v8::V8PlatformInitializer::CheckFlags().ok()) {
+    return EXIT_FAILURE;
+  }
+  if (!cpus->empty()) {
+    // Pinned before forking, so that the sandboxees and the threads they start
+    // inherit the CPUs.
+    aviary::util::PinCurrentThread(*cpus).IgnoreError();
+  }
+
   sandbox2::Comms comms(sandbox2::Comms::kSandbox2ClientCommsFD);
   sandbox2::ForkingClient s2client{&comms};
 
@@ -91,6 +157,9 @@ int main(int argc, char** argv) {
   }
 
   aviary::v8::V8PlatformInitializer v8_platform_initializer;
+  // The sandboxee cannot start threads once sandboxed, so the thread that
+  // collects the garbage of idle isolates gets started beforehand.
+  aviary::function::internal::IsolatePool::StartIdleGarbageCollection();
   s2client.SandboxMeHere();
 
   // Run request serving loop.
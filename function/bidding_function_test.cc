@@ -14,16 +14,31 @@
 
 #include "function/bidding_function.h"
 
+#include <thread>
+#include <type_traits>
+
+#include "absl/flags/declare.h"
 #include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/substitute.h"
+#include "absl/time/time.h"
+#include "function/function_metrics.h"
 #include "function/sapi_bidding_function.h"
+#include "function/snapshot_cache.h"
 #include "gmock/gmock.h"
+#include "google/protobuf/arena.h"
+#include "google/protobuf/struct.pb.h"
 #include "google/protobuf/util/message_differencer.h"
 #include "gtest/gtest.h"
 #include "proto/bidding_function.pb.h"
 #include "util/parse_proto.h"
 #include "v8/v8_platform_initializer.h"
 
+ABSL_DECLARE_FLAG(std::string, function_snapshot_cache_dir);
+ABSL_DECLARE_FLAG(int64_t, sandbox_shared_memory_bytes);
+ABSL_DECLARE_FLAG(bool, sandbox_v8_wire_format);
+
 namespace aviary {
 namespace function {
 namespace {
@@ -71,6 +86,12 @@ std::string BiddingFunctionTestParam::GetName<FledgeSapiBiddingFunction>(int) {
 TYPED_TEST_SUITE(BiddingFunctionTest, BiddingFunctionTypes,
                  BiddingFunctionTestParam);
 
+// Whether the functions of type T run in sandboxees.
+template <typename T>
+constexpr bool IsSandboxed() {
+  return std::is_same_v<T, FledgeSapiBiddingFunction>;
+}
+
 MATCHER_P(EqualsProto, proto,
           absl::StrCat("equals proto ", proto.DebugString())) {
   *result_listener << "where the protocol buffer is " << (arg.DebugString());
@@ -463,6 +484,87 @@ TYPED_TEST(BiddingFunctionTest, InvokeFailsGracefullyIfAsyncTimeout) {
               AllOf(HasSubstr("Async"), HasSubstr("timed out")));
 }
 
+TYPED_TEST(BiddingFunctionTest, BatchInvokeSettlesAsyncInvocationsTogether) {
+  auto bidding_function = TypeParam::Create(R"(
+    async i => ({ bid: await Promise.resolve(i.perBuyerSignals.multiplier) })
+  )")
+                              .value();
+  std::vector<BiddingFunctionInput> inputs;
+  for (int multiplier = 1; multiplier <= 3; multiplier++) {
+    inputs.push_back(ParseTextOrDie<BiddingFunctionInput>(absl::Substitute(
+        R"pb(
+          per_buyer_signals: {
+            fields: {
+              key: "multiplier"
+              value: { number_value: $0 }
+            }
+          }
+        )pb",
+        multiplier)));
+  }
+  EXPECT_THAT(bidding_function->BatchInvoke(inputs).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0),
+                          Property(&BiddingFunctionOutput::bid, 2.0),
+                          Property(&BiddingFunctionOutput::bid, 3.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeConvertsReusedOutputs) {
+  auto bidding_function = TypeParam::Create(R"(
+    const output = {};
+    i => {
+      output.bid = i.perBuyerSignals.multiplier;
+      return output;
+    }
+  )")
+                              .value();
+  std::vector<BiddingFunctionInput> inputs;
+  for (int multiplier = 1; multiplier <= 3; multiplier++) {
+    inputs.push_back(ParseTextOrDie<BiddingFunctionInput>(absl::Substitute(
+        R"pb(
+          per_buyer_signals: {
+            fields: {
+              key: "multiplier"
+              value: { number_value: $0 }
+            }
+          }
+        )pb",
+        multiplier)));
+  }
+  EXPECT_THAT(bidding_function->BatchInvoke(inputs).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0),
+                          Property(&BiddingFunctionOutput::bid, 2.0),
+                          Property(&BiddingFunctionOutput::bid, 3.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeReturnsFirstAsyncFailure) {
+  auto bidding_function = TypeParam::Create(R"(
+    async i => {
+      if (i.perBuyerSignals.fail) {
+        throw new Error(i.perBuyerSignals.fail);
+      }
+      return { bid: 1 };
+    }
+  )")
+                              .value();
+  std::vector<BiddingFunctionInput> inputs;
+  for (absl::string_view failure : {"", "first", "second"}) {
+    inputs.push_back(ParseTextOrDie<BiddingFunctionInput>(absl::Substitute(
+        R"pb(
+          per_buyer_signals: {
+            fields: {
+              key: "fail"
+              value: { string_value: "$0" }
+            }
+          }
+        )pb",
+        failure)));
+  }
+  auto result = bidding_function->BatchInvoke(inputs);
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_THAT(std::string(result.status().message()),
+              AllOf(HasSubstr("failed"), HasSubstr("first")));
+}
+
 TYPED_TEST(BiddingFunctionTest, InvokeFailsGracefullyIfAsyncFailed) {
   auto result = this->CreateAndInvoke(R"(
    async i => thisFunctionDoesNotExist();
@@ -539,6 +641,58 @@ TYPED_TEST(BiddingFunctionTest, DoesNotReuseContext) {
   }
 }
 
+TYPED_TEST(BiddingFunctionTest, ReusesContextUpToLimit) {
+  auto bidding_function =
+      TypeParam::Create(R"(
+    var global_counter = 0;
+    (function(input) { return { bid: global_counter++ }; })
+  )",
+                        FunctionOptions{.context_reuse_limit = 2})
+          .value();
+  constexpr double kFirstCount = kBiddingFunctionWarmUpIterations;
+  std::vector<double> bids;
+  for (int iteration = 0; iteration < 4; iteration++) {
+    auto outputs = bidding_function->BatchInvoke({BiddingFunctionInput()});
+    ASSERT_TRUE(outputs.ok()) << outputs.status();
+    bids.push_back(outputs->front().bid());
+  }
+  // Every other call gets a fresh context restored from the snapshot.
+  EXPECT_THAT(bids, ElementsAre(kFirstCount, kFirstCount + 1, kFirstCount,
+                                kFirstCount + 1));
+}
+
+TYPED_TEST(BiddingFunctionTest, RecoversFromHeapLimit) {
+  auto bidding_function =
+      TypeParam::Create(R"(
+    (function(input) {
+      if (input.perBuyerSignals && input.perBuyerSignals.allocate) {
+        const arrays = [];
+        while (true) {
+          arrays.push(new Array(100000).fill(1));
+        }
+      }
+      return { bid: 1 };
+    })
+  )",
+                        FunctionOptions{.max_heap_size_bytes = 32 << 20})
+          .value();
+  auto allocating_input = ParseTextOrDie<BiddingFunctionInput>(
+      R"pb(
+        per_buyer_signals: {
+          fields: {
+            key: "allocate"
+            value: { bool_value: true }
+          }
+        }
+      )pb");
+  EXPECT_EQ(bidding_function->BatchInvoke({allocating_input}).status().code(),
+            absl::StatusCode::kResourceExhausted);
+  // A fresh isolate serves the next invocation.
+  auto outputs = bidding_function->BatchInvoke({BiddingFunctionInput()});
+  ASSERT_TRUE(outputs.ok()) << outputs.status();
+  EXPECT_EQ(outputs->front().bid(), 1);
+}
+
 TYPED_TEST(BiddingFunctionTest, ExecutionError) {
   auto bidding_function_input = ParseTextOrDie<BiddingFunctionInput>(
       R"pb(
@@ -604,6 +758,127 @@ TYPED_TEST(BiddingFunctionTest, VerifyWarmupSuccess) {
               ElementsAre(Property(&BiddingFunctionOutput::bid, 2.0)));
 }
 
+TYPED_TEST(BiddingFunctionTest, WarmsUpWithSampleInputs) {
+  auto bidding_function =
+      TypeParam::Create(R"(
+    var global_sum = 0;
+    (function(input) {
+      global_sum += input.perBuyerSignals.increment;
+      return { bid: global_sum };
+    })
+  )",
+                        FunctionOptions{
+                            .warm_up_iterations = 3,
+                            .warm_up_inputs = {
+                                R"({"perBuyerSignals": {"increment": 1}})",
+                                R"({"perBuyerSignals": {"increment": 10}})"}})
+          .value();
+  auto bidding_function_input = ParseTextOrDie<BiddingFunctionInput>(
+      R"pb(
+        per_buyer_signals: {
+          fields {
+            key: "increment"
+            value: { number_value: 100 }
+          }
+        }
+      )pb");
+  // Every iteration of the warm-up invoked the function on both inputs.
+  EXPECT_THAT(bidding_function->BatchInvoke({bidding_function_input}).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 133.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, FailsIfWarmUpInputFails) {
+  auto result = TypeParam::Create(
+      "input => ({ bid: input.perBuyerSignals.foo.bar })",
+      FunctionOptions{.warm_up_inputs = {R"({"perBuyerSignals": {}})"}});
+  EXPECT_FALSE(result.ok());
+  EXPECT_THAT(std::string(result.status().message()),
+              HasSubstr("Warm-up failed on input #0"));
+}
+
+TYPED_TEST(BiddingFunctionTest, FailsIfWarmUpInputIsMalformed) {
+  auto result = TypeParam::Create(
+      "input => ({ bid: 1 })",
+      FunctionOptions{.warm_up_inputs = {R"({"perBuyerSignals": )"}});
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_THAT(std::string(result.status().message()),
+              HasSubstr("Unable to parse warm-up input #0"));
+}
+
+TYPED_TEST(BiddingFunctionTest, StoresSnapshotInCache) {
+  absl::FlagSaver flag_saver;
+  const std::string cache_directory =
+      absl::StrCat(testing::TempDir(), "/StoresSnapshotInCache",
+                   BiddingFunctionTestParam::GetName<TypeParam>(0));
+  absl::SetFlag(&FLAGS_function_snapshot_cache_dir, cache_directory);
+  constexpr absl::string_view kSource = "input => ({ bid: 1 })";
+  ASSERT_TRUE(TypeParam::Create(kSource).ok());
+  EXPECT_TRUE(SnapshotCache(cache_directory)
+                  .Lookup(FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                      kSource, FunctionOptions(), IsSandboxed<TypeParam>()))
+                  .has_value());
+}
+
+TYPED_TEST(BiddingFunctionTest, BootsFromCachedSnapshot) {
+  absl::FlagSaver flag_saver;
+  const std::string cache_directory =
+      absl::StrCat(testing::TempDir(), "/BootsFromCachedSnapshot",
+                   BiddingFunctionTestParam::GetName<TypeParam>(0));
+  absl::SetFlag(&FLAGS_function_snapshot_cache_dir, cache_directory);
+  constexpr absl::string_view kSource = "input => ({ bid: 1 })";
+  // Cache the snapshot of another function under the key of `kSource`, which
+  // reveals whether the function is booted from the cache.
+  auto other_snapshot = FledgeBiddingFunction::CreateStartupSnapshot(
+      "input => ({ bid: 2 })", FunctionOptions());
+  ASSERT_TRUE(other_snapshot.ok()) << other_snapshot.status();
+  ASSERT_TRUE(SnapshotCache(cache_directory)
+                  .Store(FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                             kSource, FunctionOptions(),
+                             IsSandboxed<TypeParam>()),
+                         *other_snapshot)
+                  .ok());
+  EXPECT_THAT(TypeParam::Create(kSource)
+                  .value()
+                  ->BatchInvoke({BiddingFunctionInput()})
+                  .value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 2.0)));
+}
+
+TEST(BiddingFunctionSnapshotCacheKeyTest, DependsOnOptionsAndFunctionType) {
+  constexpr absl::string_view kSource = "input => ({ bid: 1 })";
+  EXPECT_NE(FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, {.flatten_function_arguments = false},
+                /*sandboxed=*/false),
+            FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, {.flatten_function_arguments = true},
+                /*sandboxed=*/false));
+  EXPECT_NE(FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, {.warm_up_iterations = 1}, /*sandboxed=*/false),
+            FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, {.warm_up_iterations = 2}, /*sandboxed=*/false));
+  EXPECT_NE(FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, {.warm_up_inputs = {"{}"}}, /*sandboxed=*/false),
+            FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, {.warm_up_inputs = {"{}", "{}"}},
+                /*sandboxed=*/false));
+  EXPECT_NE(FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, FunctionOptions(), /*sandboxed=*/false),
+            FledgeAdScoringFunction::GetStartupSnapshotCacheKey(
+                kSource, FunctionOptions(), /*sandboxed=*/false));
+}
+
+TEST(BiddingFunctionSnapshotCacheKeyTest, DependsOnEngineAndTrustDomain) {
+  constexpr absl::string_view kSource = "input => ({ bid: 1 })";
+  EXPECT_NE(FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, FunctionOptions(), /*sandboxed=*/false),
+            FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, FunctionOptions(), /*sandboxed=*/true));
+  EXPECT_NE(FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, {.sandbox_trust_domain = "a"}, /*sandboxed=*/true),
+            FledgeBiddingFunction::GetStartupSnapshotCacheKey(
+                kSource, {.sandbox_trust_domain = "b"}, /*sandboxed=*/true));
+}
+
 TYPED_TEST(BiddingFunctionTest, BatchInvokeSuccess) {
   auto input_one = ParseTextOrDie<BiddingFunctionInput>(
       R"pb(
@@ -633,6 +908,394 @@ TYPED_TEST(BiddingFunctionTest, BatchInvokeSuccess) {
                           Property(&BiddingFunctionOutput::bid, 5.0)));
 }
 
+TYPED_TEST(BiddingFunctionTest, ConcurrentBatchInvoke) {
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         return { bid: input.perBuyerSignals.multiplier };
+      }))")
+                              .value();
+  constexpr int kThreads = 8;
+  constexpr int kInvocationsPerThread = 20;
+  std::vector<std::thread> threads;
+  for (int thread_index = 0; thread_index < kThreads; thread_index++) {
+    threads.emplace_back([&bidding_function, thread_index] {
+      auto input = ParseTextOrDie<BiddingFunctionInput>(absl::Substitute(
+          R"pb(
+            per_buyer_signals: {
+              fields: {
+                key: "multiplier"
+                value: { number_value: $0 }
+              }
+            }
+          )pb",
+          thread_index));
+      for (int i = 0; i < kInvocationsPerThread; i++) {
+        EXPECT_THAT(bidding_function->BatchInvoke({input}).value(),
+                    ElementsAre(Property(&BiddingFunctionOutput::bid,
+                                         static_cast<double>(thread_index))));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Returns inputs whose only field is a per-buyer `multiplier`.
+std::vector<BiddingFunctionInput> CreateMultiplierInputs(int count) {
+  std::vector<BiddingFunctionInput> inputs;
+  for (int multiplier = 1; multiplier <= count; multiplier++) {
+    inputs.push_back(ParseTextOrDie<BiddingFunctionInput>(absl::Substitute(
+        R"pb(
+          per_buyer_signals: {
+            fields: {
+              key: "multiplier"
+              value: { number_value: $0 }
+            }
+          }
+        )pb",
+        multiplier)));
+  }
+  return inputs;
+}
+
+// Returns a common input carrying an auction-wide `offset`.
+BiddingFunctionInput CreateOffsetCommonInput() {
+  return ParseTextOrDie<BiddingFunctionInput>(
+      R"pb(
+        auction_signals: {
+          fields: {
+            key: "offset"
+            value: { number_value: 100 }
+          }
+        }
+      )pb");
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeWithCommonInput) {
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         return {
+           bid: input.auctionSignals.offset + input.perBuyerSignals.multiplier
+         };
+      }))")
+                              .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(3);
+  EXPECT_THAT(
+      bidding_function
+          ->BatchInvokeWithCommonInput(CreateOffsetCommonInput(),
+                                       {&inputs[0], &inputs[1], &inputs[2]})
+          .value(),
+      ElementsAre(Property(&BiddingFunctionOutput::bid, 101.0),
+                  Property(&BiddingFunctionOutput::bid, 102.0),
+                  Property(&BiddingFunctionOutput::bid, 103.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeWithCommonInputFlattened) {
+  auto bidding_function =
+      TypeParam::Create(R"(
+      (interestGroup, auctionSignals, perBuyerSignals) =>
+          ({ bid: auctionSignals.offset + perBuyerSignals.multiplier })
+      )",
+                        FunctionOptions{.flatten_function_arguments = true})
+          .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(2);
+  EXPECT_THAT(bidding_function
+                  ->BatchInvokeWithCommonInput(CreateOffsetCommonInput(),
+                                               {&inputs[0], &inputs[1]})
+                  .value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 101.0),
+                          Property(&BiddingFunctionOutput::bid, 102.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, SharesCommonArgumentsWithinBatch) {
+  // Without freezing, the common arguments are the same objects for every
+  // invocation of the batch, so one invocation sees the writes of the previous
+  // ones.
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         input.auctionSignals.seen = (input.auctionSignals.seen || 0) + 1;
+         return { bid: input.auctionSignals.seen };
+      }))")
+                              .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(2);
+  EXPECT_THAT(bidding_function
+                  ->BatchInvokeWithCommonInput(CreateOffsetCommonInput(),
+                                               {&inputs[0], &inputs[1]})
+                  .value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0),
+                          Property(&BiddingFunctionOutput::bid, 2.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, FreezesCommonArguments) {
+  auto bidding_function =
+      TypeParam::Create(R"(
+      (function(input) {
+         'use strict';
+         try {
+           input.auctionSignals.offset = 0;
+         } catch (e) {
+           return { bid: Object.isFrozen(input.auctionSignals) ? 1 : 2 };
+         }
+         return { bid: 3 };
+      }))",
+                        FunctionOptions{.freeze_common_arguments = true})
+          .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(2);
+  EXPECT_THAT(bidding_function
+                  ->BatchInvokeWithCommonInput(CreateOffsetCommonInput(),
+                                               {&inputs[0], &inputs[1]})
+                  .value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0),
+                          Property(&BiddingFunctionOutput::bid, 1.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeWithInputsOnArena) {
+  // Inputs are built on an arena and alias the messages that they are built
+  // from, the way the auction server builds them.
+  const auto per_buyer_signals = ParseTextOrDie<google::protobuf::Struct>(
+      R"pb(
+        fields: {
+          key: "multiplier"
+          value: { number_value: 7 }
+        }
+      )pb");
+  const BiddingFunctionInput common_input = CreateOffsetCommonInput();
+  google::protobuf::Arena arena;
+  auto* input =
+      google::protobuf::Arena::CreateMessage<BiddingFunctionInput>(&arena);
+  input->unsafe_arena_set_allocated_per_buyer_signals(
+      const_cast<google::protobuf::Struct*>(&per_buyer_signals));
+  auto* aliased_common_input =
+      google::protobuf::Arena::CreateMessage<BiddingFunctionInput>(&arena);
+  aliased_common_input->unsafe_arena_set_allocated_auction_signals(
+      const_cast<google::protobuf::Struct*>(&common_input.auction_signals()));
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         return {
+           bid: input.auctionSignals.offset + input.perBuyerSignals.multiplier
+         };
+      }))")
+                              .value();
+  EXPECT_THAT(bidding_function
+                  ->BatchInvokeWithCommonInput(*aliased_common_input, {input})
+                  .value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 107.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeLargerThanSharedMemory) {
+  absl::FlagSaver flag_saver;
+  // Leaves room for the inputs of small batches only.
+  absl::SetFlag(&FLAGS_sandbox_shared_memory_bytes, 256);
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         return { bid: input.perBuyerSignals.multiplier };
+      }))")
+                              .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(20);
+  std::vector<const BiddingFunctionInput*> input_pointers;
+  for (const BiddingFunctionInput& input : inputs) {
+    input_pointers.push_back(&input);
+  }
+  EXPECT_THAT(bidding_function
+                  ->BatchInvokeWithCommonInput(BiddingFunctionInput(),
+                                               {input_pointers[0]})
+                  .value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0)));
+  const auto outputs =
+      bidding_function
+          ->BatchInvokeWithCommonInput(BiddingFunctionInput(), input_pointers)
+          .value();
+  ASSERT_EQ(outputs.size(), 20);
+  EXPECT_EQ(outputs.back().bid(), 20.0);
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeWithoutSharedMemory) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_sandbox_shared_memory_bytes, 0);
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         return {
+           bid: input.auctionSignals.offset + input.perBuyerSignals.multiplier
+         };
+      }))")
+                              .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(2);
+  EXPECT_THAT(bidding_function
+                  ->BatchInvokeWithCommonInput(CreateOffsetCommonInput(),
+                                               {&inputs[0], &inputs[1]})
+                  .value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 101.0),
+                          Property(&BiddingFunctionOutput::bid, 102.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeInV8WireFormat) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_sandbox_v8_wire_format, true);
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         return {
+           bid: (input.auctionSignals ? input.auctionSignals.offset : 0) +
+                input.perBuyerSignals.multiplier,
+           // Dropped like any function by JSON.
+           toString: () => 'bid'
+         };
+      }))")
+                              .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(2);
+  EXPECT_THAT(bidding_function->BatchInvoke(inputs).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0),
+                          Property(&BiddingFunctionOutput::bid, 2.0)));
+  for (const int64_t shared_memory_bytes : {int64_t{1} << 20, int64_t{0}}) {
+    absl::SetFlag(&FLAGS_sandbox_shared_memory_bytes, shared_memory_bytes);
+    auto function = TypeParam::Create(R"(
+        (function(input) {
+           return {
+             bid: input.auctionSignals.offset + input.perBuyerSignals.multiplier
+           };
+        }))")
+                        .value();
+    EXPECT_THAT(function
+                    ->BatchInvokeWithCommonInput(CreateOffsetCommonInput(),
+                                                 {&inputs[0], &inputs[1]})
+                    .value(),
+                ElementsAre(Property(&BiddingFunctionOutput::bid, 101.0),
+                            Property(&BiddingFunctionOutput::bid, 102.0)))
+        << "with " << shared_memory_bytes << " bytes of shared memory";
+  }
+}
+
+TYPED_TEST(BiddingFunctionTest, BatchInvokeInV8WireFormatFlattened) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_sandbox_v8_wire_format, true);
+  auto bidding_function =
+      TypeParam::Create(R"(
+      (interestGroup, auctionSignals, perBuyerSignals) =>
+          ({
+             bid: auctionSignals.offset + perBuyerSignals.multiplier +
+                  (Object.isFrozen(auctionSignals) ? 10 : 0) +
+                  (interestGroup.ads ? 0 : 1000)
+          })
+      )",
+                        FunctionOptions{.flatten_function_arguments = true,
+                                        .freeze_common_arguments = true})
+          .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(2);
+  EXPECT_THAT(bidding_function
+                  ->BatchInvokeWithCommonInput(CreateOffsetCommonInput(),
+                                               {&inputs[0], &inputs[1]})
+                  .value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1111.0),
+                          Property(&BiddingFunctionOutput::bid, 1112.0)));
+}
+
+TEST(SapiBiddingFunctionTest, RecoversFromTimeout) {
+  auto bidding_function = FledgeSapiBiddingFunction::Create(R"(
+      (function(input) {
+         while (input.perBuyerSignals.hang) {}
+         return { bid: input.perBuyerSignals.multiplier };
+      }))")
+                              .value();
+  const auto hanging_input = ParseTextOrDie<BiddingFunctionInput>(R"pb(
+    per_buyer_signals {
+      fields {
+        key: "hang"
+        value { bool_value: true }
+      }
+    }
+  )pb");
+  EXPECT_FALSE(bidding_function->BatchInvoke({hanging_input}).ok());
+  // The sandbox killed for exceeding its time limit has been replaced.
+  EXPECT_THAT(bidding_function->BatchInvoke(CreateMultiplierInputs(1)).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, FunctionsShareTrustDomain) {
+  const FunctionOptions options = {.sandbox_trust_domain = "buyer"};
+  auto first_function = TypeParam::Create(R"(
+      (function(input) {
+         return { bid: input.perBuyerSignals.multiplier };
+      }))",
+                                          options)
+                            .value();
+  auto second_function = TypeParam::Create(R"(
+      (function(input) {
+         return { bid: 10 * input.perBuyerSignals.multiplier };
+      }))",
+                                           options)
+                             .value();
+  const std::vector<BiddingFunctionInput> inputs = CreateMultiplierInputs(2);
+  EXPECT_THAT(first_function->BatchInvoke(inputs).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0),
+                          Property(&BiddingFunctionOutput::bid, 2.0)));
+  EXPECT_THAT(second_function->BatchInvoke(inputs).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 10.0),
+                          Property(&BiddingFunctionOutput::bid, 20.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, KeepsTrustDomainAfterFunctionIsFreed) {
+  const FunctionOptions options = {.sandbox_trust_domain = "buyer"};
+  auto first_function = TypeParam::Create(R"(
+      (function(input) {
+         return { bid: input.perBuyerSignals.multiplier };
+      }))",
+                                          options)
+                            .value();
+  auto second_function = TypeParam::Create(R"(
+      (function(input) {
+         return { bid: 10 * input.perBuyerSignals.multiplier };
+      }))",
+                                           options)
+                             .value();
+  first_function.reset();
+  EXPECT_THAT(second_function->BatchInvoke(CreateMultiplierInputs(1)).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 10.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, CompilationErrorSparesTrustDomain) {
+  const FunctionOptions options = {.sandbox_trust_domain = "buyer"};
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         return { bid: input.perBuyerSignals.multiplier };
+      }))",
+                                            options)
+                              .value();
+  EXPECT_EQ(TypeParam::Create(R"((function(args) { garbage... }))", options)
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_THAT(bidding_function->BatchInvoke(CreateMultiplierInputs(1)).value(),
+              ElementsAre(Property(&BiddingFunctionOutput::bid, 1.0)));
+}
+
+TYPED_TEST(BiddingFunctionTest, RecordsInvocationStats) {
+  auto bidding_function = TypeParam::Create(R"(
+      (function(input) {
+         return { bid: input.perBuyerSignals.multiplier };
+      }))")
+                              .value();
+  ScopedInvocationStatsCollector stats_collector;
+  ASSERT_TRUE(bidding_function->BatchInvoke(CreateMultiplierInputs(2)).ok());
+  EXPECT_GT(stats_collector.stats()[InvocationStage::kExecution],
+            absl::ZeroDuration());
+  EXPECT_EQ(stats_collector.stats().promise_timeouts, 0);
+}
+
+TYPED_TEST(BiddingFunctionTest, RecordsPromiseTimeouts) {
+  auto bidding_function = TypeParam::Create(R"(
+   async i => {
+     return await new Promise(r => { /* (never resolves) */ });
+   }
+   )")
+                              .value();
+  ScopedInvocationStatsCollector stats_collector;
+  // Stats are recorded even though the batch fails.
+  EXPECT_FALSE(bidding_function->BatchInvoke(CreateMultiplierInputs(2)).ok());
+  EXPECT_GT(stats_collector.stats()[InvocationStage::kPromiseWait],
+            absl::ZeroDuration());
+  EXPECT_EQ(stats_collector.stats().promise_timeouts, 2);
+}
+
 template <typename T>
 class AdScoringFunctionTest : public testing::Test {
  protected:
@@ -0,0 +1,153 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/function_metrics.h"
+
+#include <string>
+
+namespace aviary::function {
+namespace {
+
+using ::aviary::util::Counter;
+using ::aviary::util::Histogram;
+using ::aviary::util::LatencyBuckets;
+using ::aviary::util::MetricFamily;
+
+// Values of the `stage` label, indexed by `InvocationStage`.
+constexpr absl::string_view kStageNames[kInvocationStageCount] = {
+    "argument_conversion", "execution", "promise_wait", "output_conversion",
+    "sandbox_ipc"};
+
+MetricFamily<Histogram>& GetStageDurationFamily() {
+  static auto* const family = new MetricFamily<Histogram>(
+      "aviary_function_stage_seconds",
+      "Time spent by batches of invocations of a function in each stage.",
+      {"function", "stage"}, LatencyBuckets());
+  return *family;
+}
+
+MetricFamily<Counter>& GetPromiseTimeoutFamily() {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_function_promise_timeouts_total",
+      "Promises returned by a function that did not settle by "
+      "--bidding_function_async_wait.",
+      {"function"});
+  return *family;
+}
+
+MetricFamily<Counter>& GetHeapLimitTerminationFamily() {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_function_heap_limit_terminations_total",
+      "Batches of invocations of a function that got terminated for bringing "
+      "its heap close to its limit.",
+      {"function"});
+  return *family;
+}
+
+// Innermost collector of the calling thread, if any.
+thread_local ScopedInvocationStatsCollector* current_collector = nullptr;
+}  // namespace
+
+void InvocationStats::Add(const InvocationStats& other) {
+  for (int i = 0; i < kInvocationStageCount; i++) {
+    stage_durations[i] += other.stage_durations[i];
+  }
+  promise_timeouts += other.promise_timeouts;
+  heap_limit_terminations += other.heap_limit_terminations;
+}
+
+BatchedInvocationStats ToProto(const InvocationStats& stats) {
+  BatchedInvocationStats proto;
+  proto.set_argument_conversion_nanos(absl::ToInt64Nanoseconds(
+      stats[InvocationStage::kArgumentConversion]));
+  proto.set_execution_nanos(
+      absl::ToInt64Nanoseconds(stats[InvocationStage::kExecution]));
+  proto.set_promise_wait_nanos(
+      absl::ToInt64Nanoseconds(stats[InvocationStage::kPromiseWait]));
+  proto.set_output_conversion_nanos(
+      absl::ToInt64Nanoseconds(stats[InvocationStage::kOutputConversion]));
+  proto.set_promise_timeouts(stats.promise_timeouts);
+  proto.set_heap_limit_terminations(stats.heap_limit_terminations);
+  return proto;
+}
+
+InvocationStats FromProto(const BatchedInvocationStats& proto) {
+  InvocationStats stats;
+  stats[InvocationStage::kArgumentConversion] =
+      absl::Nanoseconds(proto.argument_conversion_nanos());
+  stats[InvocationStage::kExecution] =
+      absl::Nanoseconds(proto.execution_nanos());
+  stats[InvocationStage::kPromiseWait] =
+      absl::Nanoseconds(proto.promise_wait_nanos());
+  stats[InvocationStage::kOutputConversion] =
+      absl::Nanoseconds(proto.output_conversion_nanos());
+  stats.promise_timeouts = proto.promise_timeouts();
+  stats.heap_limit_terminations = proto.heap_limit_terminations();
+  return stats;
+}
+
+void TraceStages(const InvocationStats& stats, absl::Time start) {
+  util::TraceRecorder* recorder = util::ScopedTraceContext::recorder();
+  if (recorder == nullptr) {
+    return;
+  }
+  const int parent = util::ScopedTraceContext::parent();
+  for (int i = 0; i < kInvocationStageCount; i++) {
+    if (stats.stage_durations[i] > absl::ZeroDuration()) {
+      const absl::Time end = start + stats.stage_durations[i];
+      recorder->AddSpan(kStageNames[i], parent, start, end);
+      start = end;
+    }
+  }
+}
+
+FunctionMetrics::FunctionMetrics(absl::string_view function_name) {
+  const absl::string_view name =
+      function_name.empty() ? "unnamed" : function_name;
+  for (int i = 0; i < kInvocationStageCount; i++) {
+    stage_durations_[i] = &GetStageDurationFamily().Get({name, kStageNames[i]});
+  }
+  promise_timeouts_ = &GetPromiseTimeoutFamily().Get({name});
+  heap_limit_terminations_ = &GetHeapLimitTerminationFamily().Get({name});
+}
+
+void FunctionMetrics::RecordBatch(const InvocationStats& stats) const {
+  if (current_collector != nullptr) {
+    current_collector->stats_.Add(stats);
+    return;
+  }
+  for (int i = 0; i < kInvocationStageCount; i++) {
+    // Stages that a batch does not go through, e.g. the sandbox IPC of an
+    // unsandboxed function, are left out.
+    if (stats.stage_durations[i] > absl::ZeroDuration()) {
+      stage_durations_[i]->RecordDuration(stats.stage_durations[i]);
+    }
+  }
+  if (stats.promise_timeouts > 0) {
+    promise_timeouts_->Increment(stats.promise_timeouts);
+  }
+  if (stats.heap_limit_terminations > 0) {
+    heap_limit_terminations_->Increment(stats.heap_limit_terminations);
+  }
+}
+
+ScopedInvocationStatsCollector::ScopedInvocationStatsCollector()
+    : previous_(current_collector) {
+  current_collector = this;
+}
+
+ScopedInvocationStatsCollector::~ScopedInvocationStatsCollector() {
+  current_collector = previous_;
+}
+}  // namespace aviary::function
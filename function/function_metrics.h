@@ -0,0 +1,124 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FUNCTION_FUNCTION_METRICS_H_
+#define FUNCTION_FUNCTION_METRICS_H_
+
+#include <cstdint>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "function/bidding_function_sandbox.pb.h"
+#include "util/metrics.h"
+#include "util/trace_recorder.h"
+
+namespace aviary::function {
+
+// Stages of a batch of invocations that are timed separately.
+enum class InvocationStage {
+  // Converting the inputs into JavaScript arguments.
+  kArgumentConversion,
+  // Running the function until it returns.
+  kExecution,
+  // Waiting for the promises returned by async functions to settle.
+  kPromiseWait,
+  // Converting the results into outputs.
+  kOutputConversion,
+  // Exchanging the inputs and outputs with a sandboxee.
+  kSandboxIpc,
+};
+inline constexpr int kInvocationStageCount = 5;
+
+// Statistics of a batch of invocations.
+struct InvocationStats {
+  absl::Duration& operator[](InvocationStage stage) {
+    return stage_durations[static_cast<int>(stage)];
+  }
+  absl::Duration operator[](InvocationStage stage) const {
+    return stage_durations[static_cast<int>(stage)];
+  }
+
+  // Adds the durations and counts of `other` to these.
+  void Add(const InvocationStats& other);
+
+  // Time spent in each stage, indexed by `InvocationStage`.
+  absl::Duration stage_durations[kInvocationStageCount] = {};
+  // Promises still pending once the async wait was over.
+  int64_t promise_timeouts = 0;
+  // Batches terminated for bringing the heap close to its limit.
+  int64_t heap_limit_terminations = 0;
+};
+
+// Converts stats to and from their form sent by sandboxees. The sandbox IPC
+// stage is left out, since only the host process can time it.
+BatchedInvocationStats ToProto(const InvocationStats& stats);
+InvocationStats FromProto(const BatchedInvocationStats& stats);
+
+// Records the stages of `stats` as spans in the trace of the calling thread,
+// if any, laid end to end from `start` in the order of `InvocationStage`.
+// Argument conversion and execution alternate from one input to the next, so
+// their spans show how long each stage took overall rather than when.
+void TraceStages(const InvocationStats& stats, absl::Time start);
+
+// Metrics of the invocations of a function:
+//
+// - aviary_function_stage_seconds{function,stage}: time spent by batches in
+//   each stage.
+// - aviary_function_promise_timeouts_total{function}: promises that did not
+//   settle in time.
+// - aviary_function_heap_limit_terminations_total{function}: batches that got
+//   terminated near the heap limit.
+//
+// Thread-safe.
+class FunctionMetrics {
+ public:
+  // Records the metrics under `function_name`, or under "unnamed" if empty.
+  explicit FunctionMetrics(absl::string_view function_name);
+
+  // Records the stats of a batch. Adds them to the innermost
+  // `ScopedInvocationStatsCollector` of the calling thread instead, if any.
+  void RecordBatch(const InvocationStats& stats) const;
+
+ private:
+  util::Histogram* stage_durations_[kInvocationStageCount];
+  util::Counter* promise_timeouts_;
+  util::Counter* heap_limit_terminations_;
+};
+
+// Collects the stats of the batches recorded by the calling thread while in
+// scope, instead of recording them as metrics, e.g. for a sandboxee to report
+// them to the host process.
+class ScopedInvocationStatsCollector {
+ public:
+  ScopedInvocationStatsCollector();
+  ~ScopedInvocationStatsCollector();
+
+  const InvocationStats& stats() const { return stats_; }
+
+  ScopedInvocationStatsCollector(const ScopedInvocationStatsCollector&) =
+      delete;
+  ScopedInvocationStatsCollector& operator=(
+      const ScopedInvocationStatsCollector&) = delete;
+
+ private:
+  friend class FunctionMetrics;
+
+  InvocationStats stats_;
+  ScopedInvocationStatsCollector* const previous_;
+};
+}  // namespace aviary::function
+
+#endif  // FUNCTION_FUNCTION_METRICS_H_
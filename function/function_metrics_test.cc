@@ -0,0 +1,147 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/function_metrics.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "util/metrics.h"
+#include "util/trace_recorder.h"
+
+namespace aviary::function {
+namespace {
+
+using ::aviary::util::MetricRegistry;
+using ::testing::HasSubstr;
+
+InvocationStats GetStats() {
+  InvocationStats stats;
+  stats[InvocationStage::kArgumentConversion] = absl::Milliseconds(1);
+  stats[InvocationStage::kExecution] = absl::Milliseconds(2);
+  stats[InvocationStage::kPromiseWait] = absl::Milliseconds(3);
+  stats[InvocationStage::kOutputConversion] = absl::Milliseconds(4);
+  stats.promise_timeouts = 2;
+  stats.heap_limit_terminations = 1;
+  return stats;
+}
+
+TEST(FunctionMetricsTest, RecordsBatch) {
+  const FunctionMetrics metrics("test://records");
+  metrics.RecordBatch(GetStats());
+  const std::string output = MetricRegistry::Global().Export();
+  EXPECT_THAT(output, HasSubstr("aviary_function_stage_seconds_count{function="
+                                "\"test://records\",stage=\"execution\"} 1"));
+  EXPECT_THAT(output, HasSubstr("aviary_function_stage_seconds_sum{function="
+                                "\"test://records\",stage=\"execution\"} "
+                                "0.002"));
+  // Stages that the batch did not go through are not recorded.
+  EXPECT_THAT(output, HasSubstr("aviary_function_stage_seconds_count{function="
+                                "\"test://records\",stage=\"sandbox_ipc\"} 0"));
+  EXPECT_THAT(output, HasSubstr("aviary_function_promise_timeouts_total{"
+                                "function=\"test://records\"} 2"));
+  EXPECT_THAT(output,
+              HasSubstr("aviary_function_heap_limit_terminations_total{"
+                        "function=\"test://records\"} 1"));
+}
+
+TEST(FunctionMetricsTest, NamesUnnamedFunctions) {
+  const FunctionMetrics metrics("");
+  EXPECT_THAT(MetricRegistry::Global().Export(),
+              HasSubstr("aviary_function_promise_timeouts_total{"
+                        "function=\"unnamed\"}"));
+}
+
+TEST(FunctionMetricsTest, CollectorCapturesBatches) {
+  const FunctionMetrics metrics("test://collected");
+  InvocationStats collected_stats;
+  {
+    ScopedInvocationStatsCollector collector;
+    metrics.RecordBatch(GetStats());
+    metrics.RecordBatch(GetStats());
+    collected_stats = collector.stats();
+  }
+  EXPECT_EQ(collected_stats[InvocationStage::kExecution],
+            absl::Milliseconds(4));
+  EXPECT_EQ(collected_stats.promise_timeouts, 4);
+  EXPECT_THAT(MetricRegistry::Global().Export(),
+              HasSubstr("aviary_function_stage_seconds_count{function="
+                        "\"test://collected\",stage=\"execution\"} 0"));
+}
+
+TEST(FunctionMetricsTest, InnermostCollectorCapturesBatches) {
+  const FunctionMetrics metrics("test://nested");
+  ScopedInvocationStatsCollector outer_collector;
+  {
+    ScopedInvocationStatsCollector inner_collector;
+    metrics.RecordBatch(GetStats());
+    EXPECT_EQ(inner_collector.stats().promise_timeouts, 2);
+  }
+  EXPECT_EQ(outer_collector.stats().promise_timeouts, 0);
+  metrics.RecordBatch(GetStats());
+  EXPECT_EQ(outer_collector.stats().promise_timeouts, 2);
+}
+
+TEST(FunctionMetricsTest, ConvertsStatsToProto) {
+  InvocationStats stats = GetStats();
+  stats[InvocationStage::kSandboxIpc] = absl::Milliseconds(5);
+  const InvocationStats converted_stats = FromProto(ToProto(stats));
+  for (InvocationStage stage :
+       {InvocationStage::kArgumentConversion, InvocationStage::kExecution,
+        InvocationStage::kPromiseWait, InvocationStage::kOutputConversion}) {
+    EXPECT_EQ(converted_stats[stage], stats[stage]);
+  }
+  EXPECT_EQ(converted_stats[InvocationStage::kSandboxIpc],
+            absl::ZeroDuration());
+  EXPECT_EQ(converted_stats.promise_timeouts, 2);
+  EXPECT_EQ(converted_stats.heap_limit_terminations, 1);
+}
+
+TEST(FunctionMetricsTest, TracesStages) {
+  util::TraceRecorder recorder;
+  const absl::Time start =
+      absl::FromUnixMicros(recorder.ToProto().start_unix_micros()) +
+      absl::Milliseconds(1);
+  {
+    util::ScopedTraceContext context(&recorder);
+    util::ScopedTraceSpan batch("batch");
+    TraceStages(GetStats(), start);
+  }
+  const util::Trace trace = recorder.ToProto();
+  ASSERT_EQ(trace.spans_size(), 5);
+  // The sandbox IPC stage that the batch did not go through is left out.
+  const std::vector<std::pair<std::string, int64_t>> stages = {
+      {"argument_conversion", 1000},
+      {"execution", 2000},
+      {"promise_wait", 3000},
+      {"output_conversion", 4000}};
+  for (size_t i = 0; i < stages.size(); i++) {
+    const util::Trace::Span& span = trace.spans(i + 1);
+    EXPECT_EQ(span.name(), stages[i].first);
+    EXPECT_EQ(span.parent(), 0);
+    EXPECT_EQ(span.duration_micros(), stages[i].second);
+    if (i > 0) {
+      // Each stage starts once the previous one is over.
+      const util::Trace::Span& previous_span = trace.spans(i);
+      EXPECT_EQ(span.start_micros(),
+                previous_span.start_micros() + previous_span.duration_micros());
+    }
+  }
+}
+}  // namespace
+}  // namespace aviary::function
@@ -0,0 +1,297 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/isolate_pool.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "absl/algorithm/container.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/memory/memory.h"
+#include "absl/time/clock.h"
+#include "util/periodic_function.h"
+#include "v8-platform.h"
+#include "v8/v8_platform_initializer.h"
+
+namespace aviary {
+namespace function {
+namespace internal {
+// Refer to V8 rather than to `aviary::v8`.
+namespace v8 = ::v8;
+
+namespace {
+
+using ::aviary::v8::V8PlatformInitializer;
+
+// Interval between the calls to `IsolatePool::CollectIdleGarbage()`.
+constexpr absl::Duration kIdleGarbageCollectionInterval = absl::Seconds(1);
+// Idle-time garbage collection steps taken on an isolate before the full
+// garbage collection, in case V8 keeps finding idle work to do.
+constexpr int kMaxIdleGarbageCollectionSteps = 10;
+
+ABSL_CONST_INIT absl::Mutex gc_pools_mutex(absl::kConstInit);
+
+// Pools whose idle isolates get their garbage collected in the background.
+absl::flat_hash_set<IsolatePool*>& GetGcPools()
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(gc_pools_mutex) {
+  static auto* const pools = new absl::flat_hash_set<IsolatePool*>();
+  return *pools;
+}
+
+// Pool being collected, which waits for the collection to be over before
+// being destroyed. Pools are collected without holding `gc_pools_mutex`, so
+// that other pools get created and destroyed meanwhile.
+ABSL_CONST_INIT IsolatePool* collected_pool ABSL_GUARDED_BY(gc_pools_mutex) =
+    nullptr;
+}  // namespace
+
+IsolateHolder::IsolateHolder(v8::Isolate* isolate)
+    : isolate_(isolate),
+      heap_limit_state_(std::make_unique<HeapLimitState>()) {
+  heap_limit_state_->isolate = isolate;
+  isolate_->AddNearHeapLimitCallback(&IsolateHolder::OnNearHeapLimit,
+                                     heap_limit_state_.get());
+}
+
+size_t IsolateHolder::OnNearHeapLimit(void* data, size_t current_heap_limit,
+                                      size_t initial_heap_limit) {
+  auto* state = static_cast<HeapLimitState*>(data);
+  state->reached = true;
+  state->isolate->TerminateExecution();
+  // V8 aborts the process unless it gets more room, which lets the terminated
+  // JavaScript unwind. The isolate is disposed of before it can grow further.
+  return current_heap_limit + initial_heap_limit;
+}
+
+IsolateHolder::operator v8::Isolate*() { return isolate_; }
+
+IsolateHolder::IsolateHolder(IsolateHolder&& other)
+    : reusable_context_(std::move(other.reusable_context_)),
+      reusable_context_uses_(other.reusable_context_uses_),
+      heap_limit_state_(std::move(other.heap_limit_state_)) {
+  isolate_ = other.isolate_;
+  other.isolate_ = nullptr;
+}
+
+IsolateHolder::~IsolateHolder() {
+  if (isolate_ != nullptr) {
+    if (!reusable_context_.IsEmpty()) {
+      v8::Locker locker(isolate_);
+      reusable_context_.Reset();
+    }
+    isolate_->Dispose();
+    isolate_ = nullptr;
+  }
+}
+
+v8::Local<v8::Context> IsolateHolder::GetContext(int reuse_limit) {
+  if (reuse_limit <= 1) {
+    return v8::Context::New(isolate_);
+  }
+  if (reusable_context_.IsEmpty() || reusable_context_uses_ >= reuse_limit) {
+    reusable_context_.Reset(isolate_, v8::Context::New(isolate_));
+    reusable_context_uses_ = 0;
+  }
+  reusable_context_uses_++;
+  return reusable_context_.Get(isolate_);
+}
+
+IsolatePool::ScopedIsolate::ScopedIsolate(
+    IsolatePool* pool, std::unique_ptr<IsolateHolder> isolate)
+    : pool_(pool), isolate_(std::move(isolate)) {}
+
+IsolatePool::ScopedIsolate::~ScopedIsolate() {
+  if (isolate_ != nullptr) {
+    pool_->Release(std::move(isolate_));
+  }
+}
+
+IsolatePool::IsolatePool(const v8::Isolate::CreateParams& create_params,
+                         const IsolatePoolOptions& options)
+    : create_params_(create_params), options_(options) {
+  absl::MutexLock lock(&mutex_);
+  const absl::Time now = absl::Now();
+  for (; size_ < options_.min_isolates; size_++) {
+    idle_isolates_.push_back({.isolate = NewIsolate(), .idle_since = now});
+  }
+  if (options_.idle_gc_delay != absl::InfiniteDuration()) {
+    StartIdleGarbageCollection();
+    absl::MutexLock gc_pools_lock(&gc_pools_mutex);
+    GetGcPools().insert(this);
+  }
+}
+
+IsolatePool::~IsolatePool() {
+  absl::MutexLock lock(&gc_pools_mutex);
+  GetGcPools().erase(this);
+  // Waits for any ongoing collection of the pool to be over.
+  auto is_not_collected = [this]()
+                              ABSL_EXCLUSIVE_LOCKS_REQUIRED(gc_pools_mutex) {
+                                return collected_pool != this;
+                              };
+  gc_pools_mutex.Await(absl::Condition(&is_not_collected));
+}
+
+std::unique_ptr<IsolateHolder> IsolatePool::NewIsolate() const {
+  return absl::WrapUnique(new IsolateHolder(v8::Isolate::New(create_params_)));
+}
+
+bool IsolatePool::CanAcquire() const {
+  return !idle_isolates_.empty() ||
+         (size_ < options_.max_isolates && collected_isolates_ == 0);
+}
+
+bool IsolatePool::IsBusy() const {
+  return static_cast<int>(idle_isolates_.size()) + collected_isolates_ <
+         size_;
+}
+
+IsolatePool::ScopedIsolate IsolatePool::Acquire() {
+  std::unique_ptr<IsolateHolder> isolate;
+  {
+    absl::MutexLock lock(&mutex_);
+    mutex_.Await(absl::Condition(this, &IsolatePool::CanAcquire));
+    if (!idle_isolates_.empty()) {
+      isolate = std::move(idle_isolates_.back().isolate);
+      idle_isolates_.pop_back();
+    } else {
+      // Reserve a slot for the new isolate, which is created outside of the
+      // critical section since deserializing a snapshot is expensive.
+      size_++;
+    }
+  }
+  if (isolate == nullptr) {
+    isolate = NewIsolate();
+  }
+  return ScopedIsolate(this, std::move(isolate));
+}
+
+void IsolatePool::Release(std::unique_ptr<IsolateHolder> isolate) {
+  // Expired isolates are disposed of outside of the critical section.
+  std::vector<std::unique_ptr<IsolateHolder>> expired_isolates;
+  {
+    absl::MutexLock lock(&mutex_);
+    const absl::Time now = absl::Now();
+    if (isolate->reached_heap_limit()) {
+      // Replaced by a fresh isolate on demand.
+      expired_isolates.push_back(std::move(isolate));
+      size_--;
+      return;
+    }
+    idle_isolates_.push_back({.isolate = std::move(isolate), .idle_since = now});
+    while (size_ > options_.min_isolates && !idle_isolates_.empty() &&
+           now - idle_isolates_.front().idle_since >= options_.idle_timeout) {
+      expired_isolates.push_back(std::move(idle_isolates_.front().isolate));
+      idle_isolates_.pop_front();
+      size_--;
+    }
+  }
+}
+
+int IsolatePool::size() const {
+  absl::MutexLock lock(&mutex_);
+  return size_;
+}
+
+void IsolatePool::CollectIdleGarbage() {
+  const absl::Time now = absl::Now();
+  int gc_pass;
+  {
+    absl::MutexLock lock(&mutex_);
+    gc_pass = ++gc_passes_;
+  }
+  v8::Platform* platform = V8PlatformInitializer::GetPlatform();
+  while (true) {
+    IdleIsolate idle_isolate;
+    {
+      absl::MutexLock lock(&mutex_);
+      // Garbage is only collected during quiet periods.
+      if (IsBusy()) {
+        return;
+      }
+      const auto it = absl::c_find_if(
+          idle_isolates_, [&](const IdleIsolate& candidate) {
+            return !candidate.fully_collected &&
+                   candidate.last_gc_pass != gc_pass &&
+                   now - candidate.idle_since >= options_.idle_gc_delay;
+          });
+      if (it == idle_isolates_.end()) {
+        return;
+      }
+      // Checked out so that no caller uses or disposes of the isolate while it
+      // is collected.
+      idle_isolate = std::move(*it);
+      idle_isolates_.erase(it);
+      collected_isolates_++;
+    }
+    v8::Isolate* isolate = *idle_isolate.isolate;
+    {
+      v8::Locker locker(isolate);
+      v8::Isolate::Scope isolate_scope(isolate);
+      if (!idle_isolate.idle_work_done) {
+        idle_isolate.idle_work_done =
+            isolate->IdleNotificationDeadline(
+                platform->MonotonicallyIncreasingTime() +
+                absl::ToDoubleSeconds(options_.idle_gc_budget)) ||
+            ++idle_isolate.idle_gc_steps >= kMaxIdleGarbageCollectionSteps;
+      } else {
+        isolate->LowMemoryNotification();
+        idle_isolate.fully_collected = true;
+      }
+    }
+    idle_isolate.last_gc_pass = gc_pass;
+
+    // Put back in its place in the order of use.
+    absl::MutexLock lock(&mutex_);
+    collected_isolates_--;
+    const auto position = std::upper_bound(
+        idle_isolates_.begin(), idle_isolates_.end(), idle_isolate.idle_since,
+        [](absl::Time idle_since, const IdleIsolate& other) {
+          return idle_since < other.idle_since;
+        });
+    idle_isolates_.insert(position, std::move(idle_isolate));
+  }
+}
+
+void IsolatePool::StartIdleGarbageCollection() {
+  // Never stopped, since the pools may be collected for as long as the process
+  // lasts.
+  static auto* const periodic_function = new util::PeriodicFunction(
+      [] {
+        std::vector<IsolatePool*> pools;
+        {
+          absl::MutexLock lock(&gc_pools_mutex);
+          pools.assign(GetGcPools().begin(), GetGcPools().end());
+        }
+        for (IsolatePool* pool : pools) {
+          {
+            absl::MutexLock lock(&gc_pools_mutex);
+            // Skips the pools destroyed in the meantime.
+            if (!GetGcPools().contains(pool)) {
+              continue;
+            }
+            collected_pool = pool;
+          }
+          pool->CollectIdleGarbage();
+          absl::MutexLock lock(&gc_pools_mutex);
+          collected_pool = nullptr;
+        }
+      },
+      kIdleGarbageCollectionInterval, kIdleGarbageCollectionInterval);
+  (void)periodic_function;
+}
+}  // namespace internal
+}  // namespace function
+}  // namespace aviary
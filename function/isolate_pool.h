@@ -0,0 +1,203 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FUNCTION_ISOLATE_POOL_H_
+#define FUNCTION_ISOLATE_POOL_H_
+
+#include <atomic>
+#include <deque>
+#include <memory>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "v8.h"
+
+namespace aviary {
+namespace function {
+namespace internal {
+class IsolatePool;
+
+// Manages the lifetime of v8::Isolate.
+class IsolateHolder {
+ public:
+  IsolateHolder(const IsolateHolder&) = delete;
+  IsolateHolder(IsolateHolder&& other);
+  ~IsolateHolder();
+
+  using IsolatePtr = v8::Isolate*;
+  operator IsolatePtr();  // NOLINT
+
+  // Returns a context for running scripts in the isolate. The same context is
+  // returned for up to `reuse_limit` calls before being replaced by a new one,
+  // so a limit of 1 or less returns a new context for every call.
+  //
+  // Must be called with the isolate locked and entered, within a handle scope.
+  v8::Local<v8::Context> GetContext(int reuse_limit);
+
+  // Whether the heap of the isolate came close to its limit. The JavaScript
+  // running at the time gets terminated rather than crashing the process, and
+  // the isolate must not be used any further.
+  bool reached_heap_limit() const { return heap_limit_state_->reached; }
+
+ private:
+  friend class IsolatePool;
+
+  // State shared with the near-heap-limit callback, which stays in place when
+  // the holder is moved.
+  struct HeapLimitState {
+    v8::Isolate* isolate = nullptr;
+    std::atomic<bool> reached{false};
+  };
+
+  explicit IsolateHolder(v8::Isolate* isolate);
+
+  static size_t OnNearHeapLimit(void* data, size_t current_heap_limit,
+                                size_t initial_heap_limit);
+
+  v8::Isolate* isolate_;
+  v8::Global<v8::Context> reusable_context_;
+  int reusable_context_uses_ = 0;
+  std::unique_ptr<HeapLimitState> heap_limit_state_;
+};
+
+struct IsolatePoolOptions {
+  // Number of isolates that are created upfront and that are never disposed of
+  // for being idle.
+  int min_isolates = 1;
+  // Maximum number of isolates. Callers block in `Acquire()` once all of them
+  // are checked out.
+  int max_isolates = 1;
+  // Isolates in excess of `min_isolates` that stay idle for at least this long
+  // are disposed of.
+  absl::Duration idle_timeout = absl::Minutes(1);
+  // Isolates that stay idle for at least this long get their garbage collected
+  // in the background, see `IsolatePool::CollectIdleGarbage()`. Never when
+  // infinite.
+  absl::Duration idle_gc_delay = absl::InfiniteDuration();
+  // Time given to each step of idle-time garbage collection.
+  absl::Duration idle_gc_budget = absl::Milliseconds(5);
+};
+
+// A pool of isolates created with the same parameters, typically booted from
+// the same startup snapshot. Each isolate is used by at most one caller at a
+// time, so callers holding different isolates run JavaScript in parallel.
+//
+// The pool grows on demand up to `max_isolates` and shrinks back towards
+// `min_isolates` as isolates stay idle. Isolates that reach their heap limit
+// are disposed of once released, and replaced on demand.
+class IsolatePool {
+ public:
+  // An isolate checked out from the pool. Returns the isolate to the pool upon
+  // destruction.
+  class ScopedIsolate {
+   public:
+    ScopedIsolate(ScopedIsolate&& other) = default;
+    ~ScopedIsolate();
+
+    v8::Isolate* get() const { return *isolate_; }
+
+    // See `IsolateHolder::GetContext()`.
+    v8::Local<v8::Context> GetContext(int reuse_limit) {
+      return isolate_->GetContext(reuse_limit);
+    }
+
+    // See `IsolateHolder::reached_heap_limit()`.
+    bool reached_heap_limit() const { return isolate_->reached_heap_limit(); }
+
+    ScopedIsolate(const ScopedIsolate&) = delete;
+    ScopedIsolate& operator=(const ScopedIsolate&) = delete;
+
+   private:
+    friend class IsolatePool;
+    ScopedIsolate(IsolatePool* pool, std::unique_ptr<IsolateHolder> isolate);
+
+    IsolatePool* pool_;
+    std::unique_ptr<IsolateHolder> isolate_;
+  };
+
+  // The allocator and the snapshot blob referenced by `create_params` must
+  // outlive the pool.
+  IsolatePool(const v8::Isolate::CreateParams& create_params,
+              const IsolatePoolOptions& options);
+  ~IsolatePool();
+
+  // Checks out an idle isolate, creating a new one if none is idle and the
+  // pool has not reached its maximum size. Blocks otherwise until another
+  // caller returns an isolate. An isolate whose garbage is being collected is
+  // waited for rather than replaced by a new one.
+  ScopedIsolate Acquire() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the current number of isolates, whether idle or checked out.
+  int size() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Performs a step of garbage collection on each isolate that has been idle
+  // for at least `idle_gc_delay`, which is checked out in the meantime: a step
+  // of idle-time garbage collection of up to `idle_gc_budget` for as long as V8
+  // has idle work left, up to a few steps, then a full garbage collection that
+  // frees as much memory as possible, after which the isolate is left alone
+  // until it gets used again. Does nothing while callers have isolates checked
+  // out, and stops as soon as one does.
+  //
+  // Called periodically for the pools with a finite `idle_gc_delay`, so that
+  // garbage gets collected during quiet periods rather than during requests.
+  void CollectIdleGarbage() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Starts the thread that periodically calls `CollectIdleGarbage()` on the
+  // pools with a finite `idle_gc_delay`, unless already started. Such pools
+  // start it when created, but processes that cannot start threads later on,
+  // such as sandboxees, must start it upfront.
+  static void StartIdleGarbageCollection();
+
+  IsolatePool(const IsolatePool&) = delete;
+  IsolatePool& operator=(const IsolatePool&) = delete;
+
+ private:
+  struct IdleIsolate {
+    std::unique_ptr<IsolateHolder> isolate;
+    absl::Time idle_since;
+    // Idle-time garbage collection since the isolate was last used, see
+    // `CollectIdleGarbage()`.
+    int idle_gc_steps = 0;
+    bool idle_work_done = false;
+    bool fully_collected = false;
+    int last_gc_pass = 0;
+  };
+
+  std::unique_ptr<IsolateHolder> NewIsolate() const;
+  void Release(std::unique_ptr<IsolateHolder> isolate)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+  bool CanAcquire() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool IsBusy() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const v8::Isolate::CreateParams create_params_;
+  const IsolatePoolOptions options_;
+  mutable absl::Mutex mutex_;
+  // Ordered from the least to the most recently used, so the most recently
+  // used isolates, which are the most likely to be warm, get reused first.
+  std::deque<IdleIsolate> idle_isolates_ ABSL_GUARDED_BY(mutex_);
+  int size_ ABSL_GUARDED_BY(mutex_) = 0;
+  // Number of isolates checked out by `CollectIdleGarbage()`.
+  int collected_isolates_ ABSL_GUARDED_BY(mutex_) = 0;
+  // Number of calls to `CollectIdleGarbage()`, so that each call collects each
+  // isolate at most once.
+  int gc_passes_ ABSL_GUARDED_BY(mutex_) = 0;
+};
+}  // namespace internal
+}  // namespace function
+}  // namespace aviary
+
+#endif  // FUNCTION_ISOLATE_POOL_H_
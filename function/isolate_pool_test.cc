@@ -0,0 +1,225 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/isolate_pool.h"
+
+#include <thread>
+
+#include "absl/memory/memory.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/types/optional.h"
+#include "gtest/gtest.h"
+#include "v8.h"
+#include "v8/v8_platform_initializer.h"
+
+namespace aviary {
+namespace function {
+namespace internal {
+namespace {
+
+using ::aviary::v8::V8PlatformInitializer;
+
+// Runs `source` in a fresh context of `isolate`. Returns whether it completed.
+bool RunScript(::v8::Isolate* isolate, const char* source) {
+  ::v8::Locker locker(isolate);
+  ::v8::Isolate::Scope isolate_scope(isolate);
+  ::v8::HandleScope handle_scope(isolate);
+  ::v8::Local<::v8::Context> context = ::v8::Context::New(isolate);
+  ::v8::Context::Scope context_scope(context);
+  ::v8::Local<::v8::Script> script =
+      ::v8::Script::Compile(
+          context, ::v8::String::NewFromUtf8(isolate, source).ToLocalChecked())
+          .ToLocalChecked();
+  return !script->Run(context).IsEmpty();
+}
+
+size_t GetUsedHeapSize(::v8::Isolate* isolate) {
+  ::v8::Locker locker(isolate);
+  ::v8::HeapStatistics heap_statistics;
+  isolate->GetHeapStatistics(&heap_statistics);
+  return heap_statistics.used_heap_size();
+}
+
+class IsolatePoolTest : public ::testing::Test {
+ protected:
+  IsolatePoolTest()
+      : allocator_(::v8::ArrayBuffer::Allocator::NewDefaultAllocator()) {
+    create_params_.array_buffer_allocator = allocator_.get();
+  }
+
+  V8PlatformInitializer v8_platform_initializer_;
+  std::unique_ptr<::v8::ArrayBuffer::Allocator> allocator_;
+  ::v8::Isolate::CreateParams create_params_;
+};
+
+TEST_F(IsolatePoolTest, CreatesMinIsolatesUpfront) {
+  IsolatePool pool(create_params_, {.min_isolates = 2, .max_isolates = 4});
+  EXPECT_EQ(pool.size(), 2);
+}
+
+TEST_F(IsolatePoolTest, ReusesReleasedIsolate) {
+  IsolatePool pool(create_params_, {.min_isolates = 1, .max_isolates = 1});
+  ::v8::Isolate* first_isolate;
+  {
+    auto isolate = pool.Acquire();
+    first_isolate = isolate.get();
+  }
+  EXPECT_EQ(pool.Acquire().get(), first_isolate);
+  EXPECT_EQ(pool.size(), 1);
+}
+
+TEST_F(IsolatePoolTest, GrowsUpToMaxIsolates) {
+  IsolatePool pool(create_params_, {.min_isolates = 1, .max_isolates = 3});
+  auto first_isolate = pool.Acquire();
+  auto second_isolate = pool.Acquire();
+  auto third_isolate = pool.Acquire();
+  EXPECT_NE(first_isolate.get(), second_isolate.get());
+  EXPECT_NE(second_isolate.get(), third_isolate.get());
+  EXPECT_NE(first_isolate.get(), third_isolate.get());
+  EXPECT_EQ(pool.size(), 3);
+}
+
+TEST_F(IsolatePoolTest, BlocksWhenAllIsolatesAreCheckedOut) {
+  IsolatePool pool(create_params_, {.min_isolates = 1, .max_isolates = 1});
+  auto isolate = absl::make_unique<IsolatePool::ScopedIsolate>(pool.Acquire());
+  absl::Notification acquired;
+  std::thread waiter([&] {
+    auto other_isolate = pool.Acquire();
+    acquired.Notify();
+  });
+  EXPECT_FALSE(acquired.WaitForNotificationWithTimeout(absl::Milliseconds(100)));
+  isolate.reset();
+  EXPECT_TRUE(acquired.WaitForNotificationWithTimeout(absl::Seconds(5)));
+  waiter.join();
+  EXPECT_EQ(pool.size(), 1);
+}
+
+TEST_F(IsolatePoolTest, ShrinksIdleIsolatesDownToMinIsolates) {
+  IsolatePool pool(create_params_, {.min_isolates = 1,
+                                    .max_isolates = 3,
+                                    .idle_timeout = absl::ZeroDuration()});
+  {
+    auto first_isolate = pool.Acquire();
+    auto second_isolate = pool.Acquire();
+    auto third_isolate = pool.Acquire();
+    EXPECT_EQ(pool.size(), 3);
+  }
+  EXPECT_EQ(pool.size(), 1);
+}
+
+TEST_F(IsolatePoolTest, KeepsIsolatesBeforeIdleTimeout) {
+  IsolatePool pool(create_params_, {.min_isolates = 1,
+                                    .max_isolates = 3,
+                                    .idle_timeout = absl::Hours(1)});
+  {
+    auto first_isolate = pool.Acquire();
+    auto second_isolate = pool.Acquire();
+  }
+  EXPECT_EQ(pool.size(), 2);
+}
+
+TEST_F(IsolatePoolTest, ReplacesIsolateReachingHeapLimit) {
+  create_params_.constraints.ConfigureDefaultsFromHeapSize(
+      /*initial_heap_size_in_bytes=*/0,
+      /*maximum_heap_size_in_bytes=*/16 << 20);
+  IsolatePool pool(create_params_, {.min_isolates = 1, .max_isolates = 1});
+  {
+    auto isolate = pool.Acquire();
+    EXPECT_FALSE(RunScript(isolate.get(), R"(
+      const arrays = [];
+      while (true) {
+        arrays.push(new Array(100000).fill(1));
+      })"));
+    EXPECT_TRUE(isolate.reached_heap_limit());
+  }
+  // The isolate got disposed of rather than reused.
+  EXPECT_EQ(pool.size(), 0);
+  auto isolate = pool.Acquire();
+  EXPECT_FALSE(isolate.reached_heap_limit());
+  EXPECT_TRUE(RunScript(isolate.get(), "1 + 1"));
+  EXPECT_EQ(pool.size(), 1);
+}
+
+TEST_F(IsolatePoolTest, CollectsGarbageOfIdleIsolates) {
+  IsolatePool pool(create_params_, {.min_isolates = 1,
+                                    .max_isolates = 1,
+                                    .idle_gc_delay = absl::ZeroDuration()});
+  ::v8::Isolate* isolate;
+  size_t used_heap_size;
+  {
+    auto scoped_isolate = pool.Acquire();
+    isolate = scoped_isolate.get();
+    ASSERT_TRUE(RunScript(
+        isolate, "new Array(100000).fill(0).map((value, i) => ({i}))"));
+    used_heap_size = GetUsedHeapSize(isolate);
+  }
+  // Enough passes for the idle-time steps and the full collection.
+  for (int i = 0; i < 100; i++) {
+    pool.CollectIdleGarbage();
+  }
+  EXPECT_LT(GetUsedHeapSize(isolate), used_heap_size);
+  // The isolate is back in the pool, and still usable.
+  auto scoped_isolate = pool.Acquire();
+  EXPECT_EQ(scoped_isolate.get(), isolate);
+  EXPECT_TRUE(RunScript(isolate, "1 + 1"));
+  EXPECT_EQ(pool.size(), 1);
+}
+
+TEST_F(IsolatePoolTest, CollectsGarbageOnlyWhileNoIsolateIsCheckedOut) {
+  IsolatePool pool(create_params_, {.min_isolates = 2,
+                                    .max_isolates = 2,
+                                    .idle_gc_delay = absl::ZeroDuration()});
+  ::v8::Isolate* isolate;
+  size_t used_heap_size;
+  auto busy_isolate = absl::make_optional(pool.Acquire());
+  {
+    auto scoped_isolate = pool.Acquire();
+    isolate = scoped_isolate.get();
+    ASSERT_TRUE(RunScript(
+        isolate, "new Array(100000).fill(0).map((value, i) => ({i}))"));
+    used_heap_size = GetUsedHeapSize(isolate);
+  }
+  for (int i = 0; i < 100; i++) {
+    pool.CollectIdleGarbage();
+  }
+  EXPECT_EQ(GetUsedHeapSize(isolate), used_heap_size);
+  busy_isolate.reset();
+  for (int i = 0; i < 100; i++) {
+    pool.CollectIdleGarbage();
+  }
+  EXPECT_LT(GetUsedHeapSize(isolate), used_heap_size);
+  EXPECT_EQ(pool.size(), 2);
+}
+
+TEST_F(IsolatePoolTest, LeavesRecentlyUsedIsolatesAlone) {
+  IsolatePool pool(create_params_, {.min_isolates = 1,
+                                    .max_isolates = 1,
+                                    .idle_gc_delay = absl::Hours(1)});
+  ::v8::Isolate* isolate;
+  size_t used_heap_size;
+  {
+    auto scoped_isolate = pool.Acquire();
+    isolate = scoped_isolate.get();
+    ASSERT_TRUE(RunScript(
+        isolate, "new Array(100000).fill(0).map((value, i) => ({i}))"));
+    used_heap_size = GetUsedHeapSize(isolate);
+  }
+  pool.CollectIdleGarbage();
+  EXPECT_EQ(GetUsedHeapSize(isolate), used_heap_size);
+}
+}  // namespace
+}  // namespace internal
+}  // namespace function
+}  // namespace aviary
@@ -0,0 +1,703 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/sandbox_pool.h"
+
+#include <asm/unistd_64.h>
+#include <linux/prctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "absl/algorithm/container.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/declare.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "function/bidding_function_sapi_adapter.h"
+#include "function/bidding_function_sapi_adapter_bin_embed.h"
+#include "sandboxed_api/sandbox2/executor.h"
+#include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/util/bpf_helper.h"
+#include "util/cpu_affinity.h"
+#include "util/metrics.h"
+#include "util/status_macros.h"
+#include "v8/v8_platform_initializer.h"
+
+ABSL_FLAG(int, sandbox_pool_size, 1,
+          "Number of sandboxes, each running a separate sandboxee process, "
+          "into which every sandboxed function is compiled. Bounds the number "
+          "of concurrent invocations of the functions of the same trust "
+          "domain.");
+ABSL_FLAG(int64_t, sandbox_shared_memory_bytes, 16 << 20,
+          "Size of the memory shared with each sandboxee, half of which "
+          "carries the inputs of a batch and half its outputs. Batches whose "
+          "inputs do not fit are sent through the sandbox2 comms channel "
+          "instead. No memory is shared when 0.");
+ABSL_FLAG(int, sandbox_spares, 0,
+          "Number of spare sandboxes kept by each sandbox pool, with its "
+          "functions booted from their startup snapshots, to replace the "
+          "sandboxes that crash or time out without recompiling anything. "
+          "Each spare sandbox runs a sandboxee process of its own.");
+ABSL_FLAG(std::string, sandboxee_cpus, "",
+          "CPUs that sandboxees are pinned to, along with all their threads, "
+          "in the format of --v8_platform_cpus. Keeps JavaScript off the CPUs "
+          "serving RPCs. Unpinned when empty.");
+
+ABSL_DECLARE_FLAG(int, v8_platform_threads);
+ABSL_DECLARE_FLAG(std::string, v8_platform_cpus);
+ABSL_DECLARE_FLAG(bool, v8_concurrent_compilation);
+ABSL_DECLARE_FLAG(bool, v8_concurrent_gc);
+
+namespace aviary::function {
+namespace {
+
+using ::aviary::util::Counter;
+using ::aviary::util::Gauge;
+using ::aviary::util::MetricFamily;
+
+constexpr absl::Duration kCompileTimeLimit = absl::Seconds(5);
+constexpr absl::Duration kSandboxRetryDelay = absl::Seconds(1);
+
+ABSL_CONST_INIT absl::Mutex pools_mutex(absl::kConstInit);
+
+// Pools of the non-empty trust domains, kept for as long as they have
+// functions.
+absl::flat_hash_map<std::string, std::weak_ptr<SandboxPool>>& GetPools()
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pools_mutex) {
+  static auto* const pools =
+      new absl::flat_hash_map<std::string, std::weak_ptr<SandboxPool>>();
+  return *pools;
+}
+
+// Metrics of all the pools of the process, along with `SandboxPoolStats`.
+Gauge& GetWaitingInvocationsGauge() {
+  static auto* const family = new MetricFamily<Gauge>(
+      "aviary_sandbox_pool_waiting_invocations",
+      "Invocations waiting for an idle sandbox.", {});
+  static Gauge* const gauge = &family->Get({});
+  return *gauge;
+}
+
+Counter& GetDeadSandboxCounter(absl::string_view cause) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_sandbox_deaths_total",
+      "Sandboxes that died, by cause: timeout or crash.", {"cause"});
+  return family->Get({cause});
+}
+
+Counter& GetSandboxReplacementCounter(absl::string_view kind) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_sandbox_replacements_total",
+      "Replacements of dead sandboxes, by kind: spare, cold or failed.",
+      {"kind"});
+  return family->Get({kind});
+}
+}  // namespace
+
+FunctionSandbox::FunctionSandbox(std::unique_ptr<SharedMemory> shared_memory)
+    : ::sapi::Sandbox(bidding_function_sapi_adapter_bin_embed_create()),
+      shared_memory_(std::move(shared_memory)) {}
+
+void FunctionSandbox::ModifyExecutor(sandbox2::Executor* executor) {
+  if (shared_memory_ != nullptr) {
+    // The executor closes the mapped file descriptor once the sandboxee has
+    // started, so it gets a duplicate of it.
+    executor->ipc()->MapFd(dup(shared_memory_->fd()), kSharedMemoryFd);
+  }
+}
+
+void FunctionSandbox::GetArgs(std::vector<std::string>* args) const {
+  // The sandboxee runs its own V8 platform, configured like the one of the
+  // server. The platform threads of the sandboxee are pinned to its CPUs
+  // unless --v8_platform_cpus says otherwise.
+  args->push_back(absl::StrCat("--v8_platform_threads=",
+                               absl::GetFlag(FLAGS_v8_platform_threads)));
+  args->push_back(absl::StrCat("--v8_platform_cpus=",
+                               absl::GetFlag(FLAGS_v8_platform_cpus)));
+  args->push_back(
+      absl::StrCat("--v8_concurrent_compilation=",
+                   absl::GetFlag(FLAGS_v8_concurrent_compilation)));
+  args->push_back(absl::StrCat("--v8_concurrent_gc=",
+                               absl::GetFlag(FLAGS_v8_concurrent_gc)));
+  args->push_back(
+      absl::StrCat("--cpus=", absl::GetFlag(FLAGS_sandboxee_cpus)));
+}
+
+// This policy provides the minimum permissions needed to run V8, ensuring
+// that the sandbox is as secure as possible while still allowing the use
+// of V8 to compile and execute JavaScript functions.
+std::unique_ptr<sandbox2::Policy> FunctionSandbox::ModifyPolicy(
+    sandbox2::PolicyBuilder*) {
+  // Return a new policy.
+  return sandbox2::PolicyBuilder()
+      .DisableNamespaces()
+      .AllowRead()
+      .AllowOpen()
+      .AllowTCGETS()
+      .AllowLogForwarding()
+      .AllowGetPIDs()
+      .AllowExit()
+      .AllowStat()
+      // Allows to map the shared memory.
+      .AllowMmap()
+      .AddPolicyOnSyscall(__NR_prctl,
+                          {
+                              ARG_32(0),
+                              JEQ32(PR_SET_NAME, ALLOW),
+                              KILL,
+                          })
+      .AllowSyscalls({
+          // Allows to mark pages as executable, which necessary for V8 JIT to
+          // work.
+          __NR_mprotect,
+          __NR_madvise,
+          __NR_set_robust_list,
+          __NR_sched_yield,
+      })
+      .BuildOrDie();
+}
+
+absl::Status FunctionSandbox::CommsFailure(absl::string_view message) {
+  comms_failed_ = true;
+  return absl::InternalError(message);
+}
+
+absl::StatusOr<std::string> FunctionSandbox::CompileFunction(
+    const BiddingFunctionSpec& spec) {
+  if (!comms()->SendTLV(static_cast<uint32_t>(SandboxedFunctionOp::kCompile),
+                        /*length=*/0,
+                        /*value=*/nullptr)) {
+    return CommsFailure("SendTLV failed");
+  }
+  if (!comms()->SendProtoBuf(spec)) {
+    return CommsFailure("SendProtoBuf failed");
+  }
+  absl::Status compilation_status;
+  if (!comms()->RecvStatus(&compilation_status)) {
+    return CommsFailure("RecvStatus failed");
+  }
+  RETURN_IF_ERROR(compilation_status);
+  function_ids_.insert(spec.function_id());
+  std::string startup_snapshot;
+  if (spec.return_startup_snapshot() &&
+      !comms()->RecvString(&startup_snapshot)) {
+    return CommsFailure("RecvString failed");
+  }
+  return startup_snapshot;
+}
+
+absl::Status FunctionSandbox::ReleaseFunction(uint64_t function_id) {
+  if (!comms()->SendTLV(
+          static_cast<uint32_t>(SandboxedFunctionOp::kReleaseFunction),
+          /*length=*/0,
+          /*value=*/nullptr)) {
+    return CommsFailure("SendTLV failed");
+  }
+  if (!comms()->SendUint64(function_id)) {
+    return CommsFailure("SendUint64 failed");
+  }
+  absl::Status release_status;
+  if (!comms()->RecvStatus(&release_status)) {
+    return CommsFailure("RecvStatus failed");
+  }
+  RETURN_IF_ERROR(release_status);
+  function_ids_.erase(function_id);
+  return absl::OkStatus();
+}
+
+absl::Status FunctionSandbox::BatchExecute(
+    const BatchedInvocationInputs& inputs, BatchedInvocationOutputs* outputs,
+    BatchedInvocationStats* stats) {
+  if (!comms()->SendTLV(
+          static_cast<uint32_t>(SandboxedFunctionOp::kBatchExecute),
+          /*length=*/0,
+          /*value=*/nullptr)) {
+    return CommsFailure("SendTLV failed");
+  }
+  if (!comms()->SendProtoBuf(inputs)) {
+    return CommsFailure("SendProtoBuf failed");
+  }
+  absl::Status invocation_status;
+  if (!comms()->RecvStatus(&invocation_status)) {
+    return CommsFailure("RecvStatus failed");
+  }
+  if (!comms()->RecvProtoBuf(stats)) {
+    return CommsFailure("RecvProtoBuf failed");
+  }
+  if (!invocation_status.ok()) {
+    return invocation_status;
+  }
+  if (!comms()->RecvProtoBuf(outputs)) {
+    return CommsFailure("RecvProtoBuf failed");
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<size_t> FunctionSandbox::BatchExecuteInSharedMemory(
+    uint64_t function_id, size_t request_size, BatchedInvocationStats* stats) {
+  if (!comms()->SendTLV(static_cast<uint32_t>(
+                            SandboxedFunctionOp::kBatchExecuteInSharedMemory),
+                        /*length=*/0,
+                        /*value=*/nullptr)) {
+    return CommsFailure("SendTLV failed");
+  }
+  if (!comms()->SendUint64(function_id) ||
+      !comms()->SendUint64(request_size)) {
+    return CommsFailure("SendUint64 failed");
+  }
+  absl::Status invocation_status;
+  if (!comms()->RecvStatus(&invocation_status)) {
+    return CommsFailure("RecvStatus failed");
+  }
+  if (!comms()->RecvProtoBuf(stats)) {
+    return CommsFailure("RecvProtoBuf failed");
+  }
+  RETURN_IF_ERROR(invocation_status);
+  uint64_t response_size;
+  if (!comms()->RecvUint64(&response_size)) {
+    return CommsFailure("RecvUint64 failed");
+  }
+  if (response_size > shared_memory_->responses().size()) {
+    return CommsFailure("Response exceeds the shared memory");
+  }
+  return response_size;
+}
+
+absl::StatusOr<std::shared_ptr<SandboxPool>> SandboxPool::Get(
+    absl::string_view trust_domain) {
+  if (trust_domain.empty()) {
+    return Create();
+  }
+  // Pools are created under the lock, so that concurrent callers of the same
+  // trust domain do not end up with pools of their own.
+  absl::MutexLock lock(&pools_mutex);
+  std::weak_ptr<SandboxPool>& pool = GetPools()[trust_domain];
+  if (std::shared_ptr<SandboxPool> existing_pool = pool.lock()) {
+    return existing_pool;
+  }
+  ASSIGN_OR_RETURN(std::shared_ptr<SandboxPool> new_pool, Create());
+  pool = new_pool;
+  return new_pool;
+}
+
+absl::StatusOr<std::unique_ptr<SandboxPool>> SandboxPool::Create() {
+  // Sandboxees exit right away on invalid CPUs.
+  if (const absl::StatusOr<std::vector<int>> sandboxee_cpus =
+          util::ParseCpuSet(absl::GetFlag(FLAGS_sandboxee_cpus));
+      !sandboxee_cpus.ok()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Invalid --sandboxee_cpus: ", sandboxee_cpus.status().message()));
+  }
+  RETURN_IF_ERROR(::aviary::v8::V8PlatformInitializer::CheckFlags());
+  if (const int64_t shared_memory_bytes =
+          absl::GetFlag(FLAGS_sandbox_shared_memory_bytes);
+      shared_memory_bytes < 0 ||
+      static_cast<uint64_t>(shared_memory_bytes) > SharedMemory::kMaxSize) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "--sandbox_shared_memory_bytes must be between 0 and ",
+        SharedMemory::kMaxSize));
+  }
+  const int pool_size = std::max(1, absl::GetFlag(FLAGS_sandbox_pool_size));
+  std::vector<std::unique_ptr<FunctionSandbox>> sandboxes;
+  sandboxes.reserve(pool_size);
+  for (int i = 0; i < pool_size; i++) {
+    ASSIGN_OR_RETURN(sandboxes.emplace_back(), NewSandbox());
+  }
+  return absl::WrapUnique(new SandboxPool(std::move(sandboxes)));
+}
+
+absl::StatusOr<std::unique_ptr<FunctionSandbox>> SandboxPool::NewSandbox() {
+  const int64_t shared_memory_bytes =
+      absl::GetFlag(FLAGS_sandbox_shared_memory_bytes);
+  std::unique_ptr<SharedMemory> shared_memory;
+  if (shared_memory_bytes > 0) {
+    ASSIGN_OR_RETURN(shared_memory, SharedMemory::Create(shared_memory_bytes));
+  }
+  auto sandbox = std::make_unique<FunctionSandbox>(std::move(shared_memory));
+  RETURN_IF_ERROR(sandbox->Init());
+  return sandbox;
+}
+
+SandboxPool::SandboxPool(
+    std::vector<std::unique_ptr<FunctionSandbox>> sandboxes)
+    : spare_count_(std::max(0, absl::GetFlag(FLAGS_sandbox_spares))),
+      sandboxes_(std::move(sandboxes)) {
+  {
+    absl::MutexLock lock(&mutex_);
+    for (const auto& sandbox : sandboxes_) {
+      idle_sandboxes_.push_back(sandbox.get());
+    }
+  }
+  if (spare_count_ > 0) {
+    absl::MutexLock lock(&mutex_);
+    StartMaintenance();
+  }
+}
+
+SandboxPool::~SandboxPool() {
+  std::thread maintenance_thread;
+  {
+    absl::MutexLock lock(&mutex_);
+    stopping_ = true;
+    maintenance_thread = std::move(maintenance_thread_);
+  }
+  if (maintenance_thread.joinable()) {
+    maintenance_thread.join();
+  }
+}
+
+absl::StatusOr<uint64_t> SandboxPool::CompileFunction(
+    BiddingFunctionSpec spec, std::string* startup_snapshot) {
+  size_t pool_size;
+  {
+    absl::MutexLock lock(&mutex_);
+    spec.set_function_id(next_function_id_++);
+    pool_size = sandboxes_.size();
+  }
+  const uint64_t function_id = spec.function_id();
+  // Frees the function wherever it got compiled when compiling it fails.
+  auto release_function = [this, function_id](const absl::Status& status) {
+    ReleaseFunction(function_id);
+    return status;
+  };
+  // An idle sandbox compiles the function, unless it has a startup snapshot
+  // already.
+  ASSIGN_OR_RETURN(FunctionSandbox * sandbox, Acquire());
+  spec.set_return_startup_snapshot(spec.startup_snapshot().empty());
+  absl::StatusOr<std::string> returned_startup_snapshot =
+      CompileFunctionInSandbox(sandbox, spec);
+  Release(sandbox);
+  if (!returned_startup_snapshot.ok()) {
+    return release_function(returned_startup_snapshot.status());
+  }
+  if (spec.return_startup_snapshot()) {
+    spec.set_startup_snapshot(*std::move(returned_startup_snapshot));
+    spec.set_return_startup_snapshot(false);
+  }
+  auto shared_spec = std::make_shared<const BiddingFunctionSpec>(spec);
+  {
+    // From now on, sandboxes replacing dead ones host the function too.
+    absl::MutexLock lock(&mutex_);
+    functions_[function_id] = shared_spec;
+  }
+  // The sandbox that compiled the function is visited again, since it may have
+  // been replaced by one that does not host the function in the meantime.
+  // Dead sandboxes are skipped, since their replacement gets synced.
+  for (size_t i = 0; i < pool_size; i++) {
+    sandbox = AcquireSandbox(i);
+    if (sandbox == nullptr) {
+      continue;
+    }
+    absl::Status compilation_status;
+    if (!sandbox->function_ids().contains(function_id)) {
+      compilation_status =
+          CompileFunctionInSandbox(sandbox, *shared_spec).status();
+    }
+    Release(sandbox);
+    if (!compilation_status.ok()) {
+      return release_function(compilation_status);
+    }
+  }
+  *startup_snapshot = shared_spec->startup_snapshot();
+  return function_id;
+}
+
+absl::StatusOr<std::string> SandboxPool::CompileFunctionInSandbox(
+    FunctionSandbox* sandbox, const BiddingFunctionSpec& spec) {
+  RETURN_IF_ERROR(sandbox->SetWallTimeLimit(kCompileTimeLimit));
+  ASSIGN_OR_RETURN(std::string startup_snapshot,
+                   sandbox->CompileFunction(spec));
+  // Disarm the wall time limit until the next execution.
+  RETURN_IF_ERROR(sandbox->SetWallTimeLimit(absl::ZeroDuration()));
+  return startup_snapshot;
+}
+
+void SandboxPool::ReleaseFunction(uint64_t function_id) {
+  {
+    absl::MutexLock lock(&mutex_);
+    functions_.erase(function_id);
+  }
+  FreeFunction(function_id);
+}
+
+void SandboxPool::ReleaseFunctionInBackground(uint64_t function_id) {
+  absl::MutexLock lock(&mutex_);
+  // From now on, sandboxes replacing dead ones do not host the function.
+  functions_.erase(function_id);
+  released_function_ids_.push_back(function_id);
+  StartMaintenance();
+}
+
+void SandboxPool::FreeFunction(uint64_t function_id) {
+  size_t pool_size;
+  {
+    absl::MutexLock lock(&mutex_);
+    pool_size = sandboxes_.size();
+  }
+  for (size_t i = 0; i < pool_size; i++) {
+    FunctionSandbox* sandbox = AcquireSandbox(i);
+    if (sandbox == nullptr) {
+      continue;
+    }
+    if (sandbox->function_ids().contains(function_id)) {
+      // A sandboxee that fails to free the function only keeps it around until
+      // the sandbox is freed.
+      sandbox->ReleaseFunction(function_id).IgnoreError();
+    }
+    Release(sandbox);
+  }
+}
+
+absl::Status SandboxPool::SyncFunctions(FunctionSandbox* sandbox) {
+  std::vector<std::shared_ptr<const BiddingFunctionSpec>> missing_functions;
+  std::vector<uint64_t> stale_function_ids;
+  {
+    absl::MutexLock lock(&mutex_);
+    for (const auto& [function_id, spec] : functions_) {
+      if (!sandbox->function_ids().contains(function_id)) {
+        missing_functions.push_back(spec);
+      }
+    }
+    for (uint64_t function_id : sandbox->function_ids()) {
+      if (!functions_.contains(function_id)) {
+        stale_function_ids.push_back(function_id);
+      }
+    }
+  }
+  for (uint64_t function_id : stale_function_ids) {
+    RETURN_IF_ERROR(sandbox->ReleaseFunction(function_id));
+  }
+  for (const auto& spec : missing_functions) {
+    RETURN_IF_ERROR(CompileFunctionInSandbox(sandbox, *spec).status());
+  }
+  return absl::OkStatus();
+}
+
+bool SandboxPool::HostsPoolFunctions(const FunctionSandbox& sandbox) const {
+  if (sandbox.function_ids().size() != functions_.size()) {
+    return false;
+  }
+  for (uint64_t function_id : sandbox.function_ids()) {
+    if (!functions_.contains(function_id)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SandboxPool::HasIdleSandbox() const { return !idle_sandboxes_.empty(); }
+
+bool SandboxPool::IsOutOfSandboxes() const {
+  return replacement_failing_ && dead_sandboxes_.size() == sandboxes_.size();
+}
+
+bool SandboxPool::HasIdleSandboxOrIsOutOfSandboxes() const {
+  return HasIdleSandbox() || IsOutOfSandboxes();
+}
+
+absl::StatusOr<FunctionSandbox*> SandboxPool::Acquire() {
+  absl::MutexLock lock(&mutex_);
+  if (!HasIdleSandbox()) {
+    Gauge& waiting_invocations = GetWaitingInvocationsGauge();
+    waiting_invocations.Add(1);
+    mutex_.Await(absl::Condition(
+        this, &SandboxPool::HasIdleSandboxOrIsOutOfSandboxes));
+    waiting_invocations.Add(-1);
+    if (!HasIdleSandbox()) {
+      return absl::UnavailableError(
+          "Every sandbox of the pool died, and none could be replaced yet");
+    }
+  }
+  FunctionSandbox* sandbox = idle_sandboxes_.back();
+  idle_sandboxes_.pop_back();
+  return sandbox;
+}
+
+FunctionSandbox* SandboxPool::AcquireSandbox(size_t index) {
+  // Looks the sandbox up again on every check, since it may be replaced while
+  // waiting.
+  auto is_idle_or_dead = [this, index]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    FunctionSandbox* sandbox = sandboxes_[index].get();
+    return absl::c_linear_search(idle_sandboxes_, sandbox) ||
+           absl::c_linear_search(dead_sandboxes_, sandbox);
+  };
+  absl::MutexLock lock(&mutex_);
+  mutex_.Await(absl::Condition(&is_idle_or_dead));
+  FunctionSandbox* sandbox = sandboxes_[index].get();
+  if (absl::c_linear_search(dead_sandboxes_, sandbox)) {
+    return nullptr;
+  }
+  idle_sandboxes_.erase(absl::c_find(idle_sandboxes_, sandbox));
+  return sandbox;
+}
+
+void SandboxPool::Release(FunctionSandbox* sandbox) {
+  absl::MutexLock lock(&mutex_);
+  if (!sandbox->IsActive() || sandbox->comms_failed()) {
+    // Replaced in the background, rather than by the thread of the caller.
+    dead_sandboxes_.push_back(sandbox);
+    StartMaintenance();
+    return;
+  }
+  idle_sandboxes_.push_back(sandbox);
+}
+
+void SandboxPool::StartMaintenance() {
+  if (!maintenance_thread_.joinable() && !stopping_) {
+    maintenance_thread_ = std::thread([this] { MaintainSandboxes(); });
+  }
+}
+
+void SandboxPool::RecordDeath(FunctionSandbox* dead_sandbox) {
+  // A sandboxee that only stopped responding is killed for good.
+  dead_sandbox->Terminate(/*attempt_graceful_exit=*/false);
+  const bool timed_out = dead_sandbox->AwaitResult().final_status() ==
+                         sandbox2::Result::TIMEOUT;
+  absl::MutexLock lock(&mutex_);
+  if (timed_out) {
+    stats_.timed_out_sandboxes++;
+    GetDeadSandboxCounter("timeout").Increment();
+  } else {
+    stats_.crashed_sandboxes++;
+    GetDeadSandboxCounter("crash").Increment();
+  }
+}
+
+bool SandboxPool::ReplaceSandbox(FunctionSandbox* dead_sandbox) {
+  std::unique_ptr<FunctionSandbox> new_sandbox;
+  {
+    absl::MutexLock lock(&mutex_);
+    if (!spare_sandboxes_.empty()) {
+      new_sandbox = std::move(spare_sandboxes_.back());
+      spare_sandboxes_.pop_back();
+    }
+  }
+  const bool is_spare = new_sandbox != nullptr;
+  if (!is_spare) {
+    absl::StatusOr<std::unique_ptr<FunctionSandbox>> created_sandbox =
+        NewSandbox();
+    if (created_sandbox.ok()) {
+      new_sandbox = *std::move(created_sandbox);
+    }
+  }
+  // Destroyed outside of the critical section, since it waits for the
+  // sandboxee to exit.
+  std::unique_ptr<FunctionSandbox> replaced_sandbox;
+  while (new_sandbox != nullptr) {
+    if (!SyncFunctions(new_sandbox.get()).ok()) {
+      break;
+    }
+    absl::MutexLock lock(&mutex_);
+    // Functions may have been compiled or freed while syncing, in which case
+    // the new sandbox gets synced again.
+    if (!HostsPoolFunctions(*new_sandbox)) {
+      continue;
+    }
+    auto it = std::find_if(sandboxes_.begin(), sandboxes_.end(),
+                           [dead_sandbox](const auto& sandbox) {
+                             return sandbox.get() == dead_sandbox;
+                           });
+    replaced_sandbox = std::move(*it);
+    *it = std::move(new_sandbox);
+    dead_sandboxes_.erase(absl::c_find(dead_sandboxes_, dead_sandbox));
+    idle_sandboxes_.push_back(it->get());
+    replacement_failing_ = false;
+    if (is_spare) {
+      stats_.spare_replacements++;
+      GetSandboxReplacementCounter("spare").Increment();
+    } else {
+      stats_.cold_replacements++;
+      GetSandboxReplacementCounter("cold").Increment();
+    }
+    return true;
+  }
+  absl::MutexLock lock(&mutex_);
+  stats_.failed_replacements++;
+  GetSandboxReplacementCounter("failed").Increment();
+  replacement_failing_ = true;
+  return false;
+}
+
+bool SandboxPool::HasMaintenanceOrIsStopping() const {
+  return !dead_sandboxes_.empty() || !released_function_ids_.empty() ||
+         spare_sandboxes_.size() < static_cast<size_t>(spare_count_) ||
+         stopping_;
+}
+
+bool SandboxPool::IsStopping() const { return stopping_; }
+
+bool SandboxPool::BackOff() {
+  absl::MutexLock lock(&mutex_);
+  return !mutex_.AwaitWithTimeout(
+      absl::Condition(this, &SandboxPool::IsStopping), kSandboxRetryDelay);
+}
+
+void SandboxPool::MaintainSandboxes() {
+  while (true) {
+    FunctionSandbox* dead_sandbox = nullptr;
+    std::vector<uint64_t> released_function_ids;
+    {
+      absl::MutexLock lock(&mutex_);
+      mutex_.Await(
+          absl::Condition(this, &SandboxPool::HasMaintenanceOrIsStopping));
+      if (stopping_) {
+        return;
+      }
+      if (!dead_sandboxes_.empty()) {
+        dead_sandbox = dead_sandboxes_.front();
+      } else {
+        released_function_ids.swap(released_function_ids_);
+      }
+    }
+    // Dead sandboxes are replaced first, and stay out of the idle sandboxes
+    // until then.
+    if (dead_sandbox != nullptr) {
+      RecordDeath(dead_sandbox);
+      while (!ReplaceSandbox(dead_sandbox)) {
+        if (!BackOff()) {
+          return;
+        }
+      }
+      continue;
+    }
+    if (!released_function_ids.empty()) {
+      for (uint64_t function_id : released_function_ids) {
+        FreeFunction(function_id);
+      }
+      continue;
+    }
+    // Spare sandboxes are created and booted from the startup snapshots of the
+    // functions outside of the critical section.
+    absl::StatusOr<std::unique_ptr<FunctionSandbox>> sandbox = NewSandbox();
+    if (sandbox.ok() && SyncFunctions(sandbox->get()).ok()) {
+      absl::MutexLock lock(&mutex_);
+      spare_sandboxes_.push_back(*std::move(sandbox));
+      continue;
+    }
+    if (!BackOff()) {
+      return;
+    }
+  }
+}
+
+SandboxPoolStats SandboxPool::GetStats() const {
+  absl::MutexLock lock(&mutex_);
+  return stats_;
+}
+}  // namespace aviary::function
@@ -0,0 +1,258 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FUNCTION_SANDBOX_POOL_H_
+#define FUNCTION_SANDBOX_POOL_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "function/bidding_function_sandbox.pb.h"
+#include "function/shared_memory.h"
+#include "sandboxed_api/sandbox.h"
+
+namespace aviary::function {
+
+// Implements low-level requests to a sandboxee hosting functions, addressed by
+// the IDs they are compiled with.
+class FunctionSandbox : public ::sapi::Sandbox {
+ public:
+  // Maps `shared_memory` into the sandboxee, unless null.
+  explicit FunctionSandbox(std::unique_ptr<SharedMemory> shared_memory);
+
+  // Returns the memory shared with the sandboxee, or null if there is none.
+  SharedMemory* shared_memory() const { return shared_memory_.get(); }
+
+  // Returns the IDs of the functions hosted by the sandboxee.
+  const absl::flat_hash_set<uint64_t>& function_ids() const {
+    return function_ids_;
+  }
+
+  // Returns whether a request failed to reach the sandboxee or to get its
+  // response, in which case the sandboxee cannot serve further requests.
+  bool comms_failed() const { return comms_failed_; }
+
+  // Requests the sandboxee to compile the function of `spec` under
+  // `spec.function_id()`. Returns its startup snapshot if
+  // `spec.return_startup_snapshot()` is set, or an empty string otherwise.
+  absl::StatusOr<std::string> CompileFunction(const BiddingFunctionSpec& spec);
+
+  // Requests the sandboxee to free a function compiled with
+  // `CompileFunction()`.
+  absl::Status ReleaseFunction(uint64_t function_id);
+
+  // Requests the sandboxee to execute the function `inputs.function_id()` for
+  // a batch of inputs. Fills `outputs` in the order corresponding to the order
+  // of inputs or returns an error status. Fills `stats` with the stats of the
+  // batch reported by the sandboxee, even if the batch failed.
+  absl::Status BatchExecute(const BatchedInvocationInputs& inputs,
+                            BatchedInvocationOutputs* outputs,
+                            BatchedInvocationStats* stats);
+
+  // Same as `BatchExecute()`, for a batch written to the first `request_size`
+  // bytes of the requests of the shared memory. Returns the size of the
+  // outputs written to the responses of the shared memory.
+  absl::StatusOr<size_t> BatchExecuteInSharedMemory(
+      uint64_t function_id, size_t request_size, BatchedInvocationStats* stats);
+
+ private:
+  std::unique_ptr<sandbox2::Policy> ModifyPolicy(
+      sandbox2::PolicyBuilder*) override;
+  void ModifyExecutor(sandbox2::Executor* executor) override;
+  // Forwards the flags that configure V8 and the CPUs of the sandboxee.
+  void GetArgs(std::vector<std::string>* args) const override;
+
+  // Records a failure to communicate with the sandboxee.
+  absl::Status CommsFailure(absl::string_view message);
+
+  const std::unique_ptr<SharedMemory> shared_memory_;
+  absl::flat_hash_set<uint64_t> function_ids_;
+  bool comms_failed_ = false;
+};
+
+// Counts the sandboxes of a pool that died, and how they were replaced.
+struct SandboxPoolStats {
+  // Sandboxes killed for exceeding their wall time limit.
+  int64_t timed_out_sandboxes = 0;
+  // Sandboxes that died otherwise, e.g. by crashing or violating the policy.
+  int64_t crashed_sandboxes = 0;
+  // Dead sandboxes replaced with a warm spare sandbox.
+  int64_t spare_replacements = 0;
+  // Dead sandboxes replaced with a sandbox created on the spot, for lack of a
+  // spare sandbox.
+  int64_t cold_replacements = 0;
+  // Failed attempts at replacing a dead sandbox. They are retried in the
+  // background until one succeeds.
+  int64_t failed_replacements = 0;
+};
+
+// A fixed-size pool of sandboxes hosting the functions of a trust domain, e.g.
+// those of the same buyer. Every function of the pool is compiled into each of
+// its sandboxes, so that the functions of a trust domain cost one sandboxee
+// process per sandbox rather than per function, and invocations of any of them
+// run in whichever sandbox is idle.
+//
+// Sandboxes that die, e.g. by crashing or exceeding their wall time limit, are
+// replaced in the background once released. The pool may keep --sandbox_spares
+// spare sandboxes, booted from the startup snapshots of its functions, so that
+// a dead sandbox is replaced without compiling anything.
+//
+// Thread-safe.
+class SandboxPool {
+ public:
+  // Returns the pool shared by the functions of `trust_domain`, creating it if
+  // there is none. Pools are freed along with their last function. An empty
+  // trust domain gets a pool of its own, shared with no other function.
+  static absl::StatusOr<std::shared_ptr<SandboxPool>> Get(
+      absl::string_view trust_domain);
+
+  // Stops maintaining the sandboxes. The sandboxes go along with the functions
+  // they still host.
+  ~SandboxPool();
+
+  // Compiles the function of `spec` into every sandbox of the pool, under a
+  // new ID that is returned. Only the first sandbox compiles the function when
+  // `spec` has no startup snapshot, and the other sandboxes boot from the
+  // snapshot it returns. Sets `*startup_snapshot` to the snapshot that the
+  // function was booted from or compiled into.
+  absl::StatusOr<uint64_t> CompileFunction(BiddingFunctionSpec spec,
+                                           std::string* startup_snapshot)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Frees a function compiled with `CompileFunction()` in every sandbox of the
+  // pool.
+  void ReleaseFunction(uint64_t function_id) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Frees a function like `ReleaseFunction()`, but in the background, so that
+  // the caller does not wait for the sandboxes busy running other functions.
+  // The function must not be invoked anymore.
+  void ReleaseFunctionInBackground(uint64_t function_id)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Checks out an idle sandbox. Blocks while all sandboxes are busy, or while
+  // dead ones are being replaced. Fails with `UnavailableError` once every
+  // sandbox is dead and the latest attempt at replacing one failed, rather
+  // than waiting for the attempts retried in the background.
+  absl::StatusOr<FunctionSandbox*> Acquire() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns a sandbox checked out with `Acquire()` back to the pool. A sandbox
+  // that died is replaced in the background, and must not be used anymore.
+  void Release(FunctionSandbox* sandbox) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  SandboxPoolStats GetStats() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  SandboxPool(const SandboxPool&) = delete;
+  SandboxPool& operator=(const SandboxPool&) = delete;
+
+ private:
+  explicit SandboxPool(std::vector<std::unique_ptr<FunctionSandbox>> sandboxes);
+
+  // Creates a pool of --sandbox_pool_size sandboxes.
+  static absl::StatusOr<std::unique_ptr<SandboxPool>> Create();
+
+  // Creates and starts a sandbox hosting no function.
+  static absl::StatusOr<std::unique_ptr<FunctionSandbox>> NewSandbox();
+
+  // Checks out the sandbox at `index` within `sandboxes_` once it is idle.
+  // Returns null if the sandbox died and awaits its replacement.
+  FunctionSandbox* AcquireSandbox(size_t index) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Compiles the function of `spec` into a checked out `sandbox`, within the
+  // compilation time limit.
+  static absl::StatusOr<std::string> CompileFunctionInSandbox(
+      FunctionSandbox* sandbox, const BiddingFunctionSpec& spec);
+
+  // Compiles the functions of the pool that a `sandbox` owned by the caller
+  // does not host, and frees those it hosts that are no longer in the pool.
+  absl::Status SyncFunctions(FunctionSandbox* sandbox)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Frees the function `function_id`, no longer in `functions_`, in every
+  // sandbox hosting it once idle.
+  void FreeFunction(uint64_t function_id) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns whether `sandbox` hosts exactly the functions of the pool.
+  bool HostsPoolFunctions(const FunctionSandbox& sandbox) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Starts the thread maintaining the sandboxes, unless it runs already.
+  void StartMaintenance() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Kills a released dead sandbox for good, and counts how it died.
+  void RecordDeath(FunctionSandbox* dead_sandbox) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Replaces a released dead sandbox, preferably with a spare sandbox. Returns
+  // false if no sandbox could replace it.
+  bool ReplaceSandbox(FunctionSandbox* dead_sandbox)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Waits before retrying a failed replacement. Returns false if the pool
+  // started stopping in the meantime.
+  bool BackOff() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Replaces the dead sandboxes, then frees the functions released in the
+  // background, then keeps `spare_count_` spare sandboxes, until the pool is
+  // stopping.
+  void MaintainSandboxes() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  bool HasIdleSandbox() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool IsOutOfSandboxes() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool HasIdleSandboxOrIsOutOfSandboxes() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool HasMaintenanceOrIsStopping() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool IsStopping() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const int spare_count_;
+  mutable absl::Mutex mutex_;
+  std::vector<std::unique_ptr<FunctionSandbox>> sandboxes_
+      ABSL_GUARDED_BY(mutex_);
+  std::vector<FunctionSandbox*> idle_sandboxes_ ABSL_GUARDED_BY(mutex_);
+  // Released sandboxes of `sandboxes_` that died and await their replacement.
+  std::vector<FunctionSandbox*> dead_sandboxes_ ABSL_GUARDED_BY(mutex_);
+  // Whether the latest attempt at replacing a dead sandbox failed.
+  bool replacement_failing_ ABSL_GUARDED_BY(mutex_) = false;
+  // Functions released with `ReleaseFunctionInBackground()` that sandboxes may
+  // still host.
+  std::vector<uint64_t> released_function_ids_ ABSL_GUARDED_BY(mutex_);
+  // Sandboxes ready to replace dead ones. They host the functions of the pool
+  // as of their creation, and are brought up to date before replacing one.
+  std::vector<std::unique_ptr<FunctionSandbox>> spare_sandboxes_
+      ABSL_GUARDED_BY(mutex_);
+  // Specifications of the functions of the pool, with their startup snapshot.
+  absl::flat_hash_map<uint64_t, std::shared_ptr<const BiddingFunctionSpec>>
+      functions_ ABSL_GUARDED_BY(mutex_);
+  uint64_t next_function_id_ ABSL_GUARDED_BY(mutex_) = 1;
+  SandboxPoolStats stats_ ABSL_GUARDED_BY(mutex_);
+  bool stopping_ ABSL_GUARDED_BY(mutex_) = false;
+  // Replaces the dead sandboxes, frees the functions released in the
+  // background and replenishes the spare sandboxes. Started along with the
+  // pool if it keeps spare sandboxes, or once there is work for it.
+  std::thread maintenance_thread_ ABSL_GUARDED_BY(mutex_);
+};
+}  // namespace aviary::function
+
+#endif  // FUNCTION_SANDBOX_POOL_H_
@@ -0,0 +1,199 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/sandbox_pool.h"
+
+#include <cstdint>
+#include <limits>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "proto/bidding_function.pb.h"
+#include "util/parse_proto.h"
+
+ABSL_DECLARE_FLAG(int, sandbox_spares);
+ABSL_DECLARE_FLAG(int64_t, sandbox_shared_memory_bytes);
+ABSL_DECLARE_FLAG(std::string, sandboxee_cpus);
+
+namespace aviary::function {
+namespace {
+
+using ::aviary::util::ParseTextOrDie;
+
+BiddingFunctionSpec CreateMultiplyingSpec() {
+  return ParseTextOrDie<BiddingFunctionSpec>(R"pb(
+    bidding_function_source: "(function(input) { return { bid: 2 * input.perBuyerSignals.multiplier }; })"
+    type: FLEDGE_BIDDING_FUNCTION
+  )pb");
+}
+
+// Invokes the function `function_id` of `pool` with a multiplier of 21.
+absl::StatusOr<double> Invoke(SandboxPool& pool, uint64_t function_id) {
+  BatchedInvocationInputs inputs;
+  inputs.set_function_id(function_id);
+  inputs.add_inputs()->PackFrom(ParseTextOrDie<BiddingFunctionInput>(R"pb(
+    per_buyer_signals {
+      fields {
+        key: "multiplier"
+        value { number_value: 21 }
+      }
+    }
+  )pb"));
+  BatchedInvocationOutputs outputs;
+  BatchedInvocationStats stats;
+  const absl::StatusOr<FunctionSandbox*> sandbox = pool.Acquire();
+  if (!sandbox.ok()) {
+    return sandbox.status();
+  }
+  const absl::Status status =
+      (*sandbox)->BatchExecute(inputs, &outputs, &stats);
+  pool.Release(*sandbox);
+  if (!status.ok()) {
+    return status;
+  }
+  BiddingFunctionOutput output;
+  if (outputs.outputs_size() != 1 || !outputs.outputs(0).UnpackTo(&output)) {
+    return absl::InternalError("Unexpected outputs");
+  }
+  return output.bid();
+}
+
+TEST(SandboxPoolTest, SharesPoolWithinTrustDomain) {
+  const auto pool = SandboxPool::Get("buyer").value();
+  EXPECT_EQ(SandboxPool::Get("buyer").value(), pool);
+  EXPECT_NE(SandboxPool::Get("other buyer").value(), pool);
+}
+
+TEST(SandboxPoolTest, DoesNotShareDedicatedPools) {
+  EXPECT_NE(SandboxPool::Get("").value(), SandboxPool::Get("").value());
+}
+
+TEST(SandboxPoolTest, RejectsInvalidFlags) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_sandbox_shared_memory_bytes, -1);
+  EXPECT_EQ(SandboxPool::Get("").status().code(),
+            absl::StatusCode::kInvalidArgument);
+  absl::SetFlag(&FLAGS_sandbox_shared_memory_bytes, shared_memory_bytes);
+  absl::SetFlag(&FLAGS_sandboxee_cpus, "0-a");
+  EXPECT_EQ(SandboxPool::Get("").status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(SandboxPoolTest, ReturnsStartupSnapshot) {
+  const auto pool = SandboxPool::Get("").value();
+  std::string startup_snapshot;
+  ASSERT_TRUE(
+      pool->CompileFunction(CreateMultiplyingSpec(), &startup_snapshot).ok());
+  EXPECT_FALSE(startup_snapshot.empty());
+}
+
+TEST(SandboxPoolTest, ReplacesDeadSandboxWithSpare) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_sandbox_spares, 1);
+  const auto pool = SandboxPool::Get("").value();
+  std::string startup_snapshot;
+  const uint64_t function_id =
+      pool->CompileFunction(CreateMultiplyingSpec(), &startup_snapshot)
+          .value();
+  FunctionSandbox* sandbox = pool->Acquire().value();
+  sandbox->Terminate(/*attempt_graceful_exit=*/false);
+  pool->Release(sandbox);
+  EXPECT_EQ(Invoke(*pool, function_id).value(), 42.0);
+  const SandboxPoolStats stats = pool->GetStats();
+  EXPECT_EQ(stats.crashed_sandboxes, 1);
+  // The spare sandbox may not be ready yet when the sandbox dies so early.
+  EXPECT_EQ(stats.spare_replacements + stats.cold_replacements, 1);
+}
+
+TEST(SandboxPoolTest, ReplacesDeadSandboxWithoutSpare) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_sandbox_spares, 0);
+  const auto pool = SandboxPool::Get("").value();
+  std::string startup_snapshot;
+  const uint64_t function_id =
+      pool->CompileFunction(CreateMultiplyingSpec(), &startup_snapshot)
+          .value();
+  FunctionSandbox* sandbox = pool->Acquire().value();
+  sandbox->Terminate(/*attempt_graceful_exit=*/false);
+  pool->Release(sandbox);
+  EXPECT_EQ(Invoke(*pool, function_id).value(), 42.0);
+  const SandboxPoolStats stats = pool->GetStats();
+  EXPECT_EQ(stats.crashed_sandboxes, 1);
+  EXPECT_EQ(stats.cold_replacements, 1);
+}
+
+TEST(SandboxPoolTest, FailsOnceNoDeadSandboxCanBeReplaced) {
+  absl::FlagSaver flag_saver;
+  const auto pool = SandboxPool::Get("").value();
+  std::string startup_snapshot;
+  const uint64_t function_id =
+      pool->CompileFunction(CreateMultiplyingSpec(), &startup_snapshot)
+          .value();
+  // New sandboxes fail to get their shared memory from now on.
+  const int64_t shared_memory_bytes =
+      absl::GetFlag(FLAGS_sandbox_shared_memory_bytes);
+  absl::SetFlag(&FLAGS_sandbox_shared_memory_bytes,
+                std::numeric_limits<int64_t>::max());
+  FunctionSandbox* sandbox = pool->Acquire().value();
+  sandbox->Terminate(/*attempt_graceful_exit=*/false);
+  pool->Release(sandbox);
+  EXPECT_EQ(Invoke(*pool, function_id).status().code(),
+            absl::StatusCode::kUnavailable);
+  EXPECT_GE(pool->GetStats().failed_replacements, 1);
+  // The pool recovers once a replacement succeeds.
+  absl::SetFlag(&FLAGS_sandbox_shared_memory_bytes, shared_memory_bytes);
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  absl::StatusOr<double> result;
+  do {
+    result = Invoke(*pool, function_id);
+  } while (!result.ok() && absl::Now() < deadline);
+  EXPECT_EQ(result.value_or(0), 42.0);
+}
+
+TEST(SandboxPoolTest, FreesFunction) {
+  const auto pool = SandboxPool::Get("").value();
+  std::string startup_snapshot;
+  const uint64_t function_id =
+      pool->CompileFunction(CreateMultiplyingSpec(), &startup_snapshot)
+          .value();
+  pool->ReleaseFunction(function_id);
+  EXPECT_EQ(Invoke(*pool, function_id).status().code(),
+            absl::StatusCode::kNotFound);
+}
+
+TEST(SandboxPoolTest, FreesFunctionInBackground) {
+  const auto pool = SandboxPool::Get("").value();
+  std::string startup_snapshot;
+  const uint64_t function_id =
+      pool->CompileFunction(CreateMultiplyingSpec(), &startup_snapshot)
+          .value();
+  // Returns even though the only sandbox is busy.
+  FunctionSandbox* sandbox = pool->Acquire().value();
+  pool->ReleaseFunctionInBackground(function_id);
+  pool->Release(sandbox);
+  // The function is freed once the sandbox is idle.
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  absl::StatusOr<double> result;
+  do {
+    result = Invoke(*pool, function_id);
+  } while (result.ok() && absl::Now() < deadline);
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kNotFound);
+}
+}  // namespace
+}  // namespace aviary::function
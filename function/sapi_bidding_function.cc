@@ -14,34 +14,47 @@
 
 #include "function/sapi_bidding_function.h"
 
-#include <asm/unistd_64.h>
-#include <linux/prctl.h>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/cleanup/cleanup.h"
+#include "absl/flags/flag.h"
 #include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "function/bidding_function.h"
 #include "function/bidding_function_sandbox.pb.h"
-#include "function/bidding_function_sapi_adapter.h"
-#include "function/bidding_function_sapi_adapter_bin_embed.h"
-#include "sandboxed_api/sandbox.h"
-#include "sandboxed_api/sandbox2/policy.h"
-#include "sandboxed_api/sandbox2/policybuilder.h"
-#include "sandboxed_api/sandbox2/util/bpf_helper.h"
-#include "util/status_encoding.h"
+#include "function/function_metrics.h"
+#include "function/sandbox_pool.h"
+#include "function/shared_memory.h"
+#include "function/snapshot_cache.h"
+#include "function/v8_wire_format.h"
+#include "google/protobuf/arena.h"
 #include "util/status_macros.h"
+#include "util/trace_recorder.h"
+
+ABSL_FLAG(bool, sandbox_v8_wire_format, false,
+          "Whether sandboxed functions exchange their inputs and outputs with "
+          "the sandboxees in the wire format of V8's ValueSerializer, which "
+          "sandboxees deserialize straight into the function isolates, "
+          "instead of as messages converted by reflection.");
 
 namespace aviary {
 namespace function {
 namespace {
-using ::aviary::util::StatusFromProto;
-
-constexpr absl::Duration kCompileTimeLimit = absl::Seconds(5);
-
+// Packs `inputs` into `inputs_proto`.
 template <typename Input>
-BatchedInvocationInputs GetBatchedInvocationInputs(
-    const std::vector<Input>& inputs) {
-  BatchedInvocationInputs inputs_proto;
-  for (const auto& input : inputs) {
-    inputs_proto.add_inputs()->PackFrom(input);
+void PackBatchedInvocationInputs(absl::Span<const Input* const> inputs,
+                                 BatchedInvocationInputs* inputs_proto) {
+  inputs_proto->mutable_inputs()->Reserve(inputs.size());
+  for (const Input* input : inputs) {
+    inputs_proto->add_inputs()->PackFrom(*input);
   }
-  return inputs_proto;
 }
 
 template <typename Input>
@@ -64,122 +77,271 @@ BiddingFunctionSpec GetBiddingFunctionSpec(absl::string_view script_source,
   spec.set_bidding_function_source(std::string(script_source));
   spec.set_type(GetFunctionType<Input>());
   spec.set_flatten_function_arguments(options.flatten_function_arguments);
+  spec.set_context_reuse_limit(options.context_reuse_limit);
+  spec.set_freeze_common_arguments(options.freeze_common_arguments);
+  spec.set_max_heap_size_bytes(options.max_heap_size_bytes);
+  spec.set_v8_wire_format(absl::GetFlag(FLAGS_sandbox_v8_wire_format));
+  spec.set_warm_up_iterations(options.warm_up_iterations);
+  for (const std::string& warm_up_input : options.warm_up_inputs) {
+    spec.add_warm_up_inputs(warm_up_input);
+  }
   return spec;
 }
 }  // namespace
 
 template <typename Input, typename Output>
-SapiBiddingFunction<Input, Output>::Sandbox::Sandbox()
-    : ::sapi::Sandbox(bidding_function_sapi_adapter_bin_embed_create()) {}
+void SapiBiddingFunction<Input, Output>::RecordBatch(
+    const FunctionSandbox& sandbox,
+    const BatchedInvocationStats& sandboxee_stats, absl::Time start) const {
+  if (sandbox.comms_failed()) {
+    // The batch did not complete, and the sandboxee reported nothing.
+    return;
+  }
+  const absl::Time end = absl::Now();
+  InvocationStats stats = FromProto(sandboxee_stats);
+  absl::Duration sandboxee_duration;
+  for (const absl::Duration stage_duration : stats.stage_durations) {
+    sandboxee_duration += stage_duration;
+  }
+  // Whatever the sandboxee does not account for is spent on the exchange.
+  stats[InvocationStage::kSandboxIpc] =
+      std::max(end - start - sandboxee_duration, absl::ZeroDuration());
+  metrics_.RecordBatch(stats);
 
-// This policy provides the minimum permissions needed to run V8, ensuring
-// that the sandbox is as secure as possible while still allowing the use
-// of V8 to compile and execute JavaScript functions.
-template <typename Input, typename Output>
-std::unique_ptr<sandbox2::Policy>
-SapiBiddingFunction<Input, Output>::Sandbox::ModifyPolicy(
-    sandbox2::PolicyBuilder*) {
-  // Return a new policy.
-  return sandbox2::PolicyBuilder()
-      .DisableNamespaces()
-      .AllowRead()
-      .AllowOpen()
-      .AllowTCGETS()
-      .AllowLogForwarding()
-      .AllowGetPIDs()
-      .AllowExit()
-      .AllowStat()
-      .AddPolicyOnSyscall(__NR_prctl,
-                          {
-                              ARG_32(0),
-                              JEQ32(PR_SET_NAME, ALLOW),
-                              KILL,
-                          })
-      .AllowSyscalls({
-          // Allows to mark pages as executable, which necessary for V8 JIT to
-          // work.
-          __NR_mprotect,
-          __NR_madvise,
-          __NR_set_robust_list,
-          __NR_sched_yield,
-      })
-      .BuildOrDie();
+  util::TraceRecorder* recorder = util::ScopedTraceContext::recorder();
+  if (recorder == nullptr) {
+    return;
+  }
+  // The sandboxee runs on the same clock, so that its timestamps split the
+  // round trip into sending the batch, running it and receiving its outcome.
+  const absl::Time sandboxee_start = std::clamp(
+      absl::FromUnixMicros(sandboxee_stats.start_unix_micros()), start, end);
+  const absl::Time sandboxee_end = std::clamp(
+      absl::FromUnixMicros(sandboxee_stats.end_unix_micros()), sandboxee_start,
+      end);
+  const int parent = util::ScopedTraceContext::parent();
+  recorder->AddSpan("sandbox_send", parent, start, sandboxee_start);
+  const int sandboxee_span =
+      recorder->AddSpan("sandboxee", parent, sandboxee_start, sandboxee_end);
+  {
+    util::ScopedTraceContext sandboxee_context(recorder, sandboxee_span);
+    TraceStages(FromProto(sandboxee_stats), sandboxee_start);
+  }
+  recorder->AddSpan("sandbox_receive", parent, sandboxee_end, end);
 }
 
 template <typename Input, typename Output>
-absl::Status SapiBiddingFunction<Input, Output>::Sandbox::CompileFunction(
-    const BiddingFunctionSpec& spec) {
-  if (!comms()->SendTLV(static_cast<uint32_t>(SandboxedFunctionOp::kCompile),
-                        /*length=*/0,
-                        /*value=*/nullptr)) {
-    return absl::InternalError("SendTLV failed");
+absl::StatusOr<std::unique_ptr<BiddingFunctionInterface<Input, Output>>>
+SapiBiddingFunction<Input, Output>::Create(absl::string_view script_source,
+                                           const FunctionOptions& options) {
+  BiddingFunctionSpec spec =
+      GetBiddingFunctionSpec<Input>(script_source, options);
+  // Sandboxees cannot access the snapshot cache, so snapshots are looked up and
+  // stored on their behalf.
+  const absl::optional<SnapshotCache> snapshot_cache =
+      SnapshotCache::FromFlags();
+  std::string cache_key;
+  if (snapshot_cache.has_value()) {
+    cache_key = BiddingFunction<Input, Output>::GetStartupSnapshotCacheKey(
+        script_source, options, /*sandboxed=*/true);
+    if (absl::optional<std::string> startup_snapshot =
+            snapshot_cache->Lookup(cache_key)) {
+      spec.set_startup_snapshot(*std::move(startup_snapshot));
+    }
   }
-  if (!comms()->SendProtoBuf(spec)) {
-    return absl::InternalError("SendProtoBuf failed");
+  const bool v8_wire_format = spec.v8_wire_format();
+  ASSIGN_OR_RETURN(std::shared_ptr<SandboxPool> pool,
+                   SandboxPool::Get(options.sandbox_trust_domain));
+  const bool cache_startup_snapshot =
+      snapshot_cache.has_value() && spec.startup_snapshot().empty();
+  std::string startup_snapshot;
+  ASSIGN_OR_RETURN(const uint64_t function_id,
+                   pool->CompileFunction(std::move(spec), &startup_snapshot));
+  if (cache_startup_snapshot) {
+    // Failing to cache the snapshot only slows down the next start.
+    snapshot_cache->Store(cache_key, startup_snapshot).IgnoreError();
   }
-  absl::Status compilation_status;
-  if (!comms()->RecvStatus(&compilation_status)) {
-    return absl::InternalError("RecvStatus failed");
+  return absl::WrapUnique(new SapiBiddingFunction(
+      std::move(pool), function_id, options, v8_wire_format));
+}
+
+template <typename Input, typename Output>
+SapiBiddingFunction<Input, Output>::~SapiBiddingFunction() {
+  // Freeing the function in the sandboxes waits for those that are busy,
+  // which would hold up a refresh or the last auction using the function.
+  pool_->ReleaseFunctionInBackground(function_id_);
+}
+
+template <typename Input, typename Output>
+absl::StatusOr<std::vector<Output>>
+SapiBiddingFunction<Input, Output>::BatchInvoke(
+    const std::vector<Input>& bidding_function_inputs) const {
+  std::vector<const Input*> inputs;
+  inputs.reserve(bidding_function_inputs.size());
+  for (const Input& input : bidding_function_inputs) {
+    inputs.push_back(&input);
   }
-  return compilation_status;
+  return DoBatchInvoke(/*common_input=*/nullptr, inputs);
 }
 
 template <typename Input, typename Output>
-absl::StatusOr<BatchedInvocationOutputs>
-SapiBiddingFunction<Input, Output>::Sandbox::BatchExecute(
-    const BatchedInvocationInputs& inputs) {
-  // TODO(b/191545684): recycle the sandbox in all the failure cases
-  if (!comms()->SendTLV(
-          static_cast<uint32_t>(SandboxedFunctionOp::kBatchExecute),
-          /*length=*/0,
-          /*value=*/nullptr)) {
-    return absl::InternalError("SendTLV failed");
-  }
-  if (!comms()->SendProtoBuf(inputs)) {
-    return absl::InternalError("SendProtoBuf failed");
-  }
-  absl::Status invocation_status;
-  if (!comms()->RecvStatus(&invocation_status)) {
-    return absl::InternalError("RecvStatus failed");
-  }
-  if (!invocation_status.ok()) {
-    return invocation_status;
-  }
-  BatchedInvocationOutputs outputs;
-  if (!comms()->RecvProtoBuf(&outputs)) {
-    return absl::InternalError("RecvProtoBuf failed");
-  }
-  return outputs;
+absl::StatusOr<std::vector<Output>>
+SapiBiddingFunction<Input, Output>::BatchInvokeWithCommonInput(
+    const Input& common_input,
+    absl::Span<const Input* const> bidding_function_inputs) const {
+  return DoBatchInvoke(&common_input, bidding_function_inputs);
 }
 
 template <typename Input, typename Output>
-absl::StatusOr<std::unique_ptr<BiddingFunctionInterface<Input, Output>>>
-SapiBiddingFunction<Input, Output>::Create(absl::string_view script_source,
-                                           const FunctionOptions& options) {
-  auto sandbox = std::make_unique<Sandbox>();
-  RETURN_IF_ERROR(sandbox->Init());
+absl::StatusOr<std::vector<Output>>
+SapiBiddingFunction<Input, Output>::DoBatchInvoke(
+    const Input* common_input,
+    absl::Span<const Input* const> bidding_function_inputs) const {
+  // The common input always comes first, so that the sandboxee tells it apart
+  // from the inputs. Inputs are serialized before checking out a sandbox,
+  // which they do not need.
+  std::vector<std::string> serialized_inputs;
+  if (v8_wire_format_) {
+    serialized_inputs.reserve(bidding_function_inputs.size() + 1);
+    if (common_input != nullptr) {
+      ASSIGN_OR_RETURN(serialized_inputs.emplace_back(),
+                       MessageToV8WireFormat(*common_input));
+    } else {
+      serialized_inputs.emplace_back();
+    }
+    for (const Input* input : bidding_function_inputs) {
+      ASSIGN_OR_RETURN(serialized_inputs.emplace_back(),
+                       MessageToV8WireFormat(*input));
+    }
+  }
+  const absl::StatusOr<FunctionSandbox*> acquired_sandbox = [this] {
+    util::ScopedTraceSpan checkout_span("pool_checkout");
+    return pool_->Acquire();
+  }();
+  RETURN_IF_ERROR(acquired_sandbox.status());
+  FunctionSandbox* sandbox = *acquired_sandbox;
+  absl::Cleanup release_sandbox = [this, sandbox] { pool_->Release(sandbox); };
+  if (SharedMemory* shared_memory = sandbox->shared_memory();
+      shared_memory != nullptr) {
+    absl::StatusOr<size_t> request_size;
+    if (v8_wire_format_) {
+      const std::vector<absl::string_view> messages(serialized_inputs.begin(),
+                                                    serialized_inputs.end());
+      request_size =
+          WriteSerializedMessages(messages, shared_memory->requests());
+    } else {
+      std::vector<const google::protobuf::MessageLite*> messages;
+      messages.reserve(bidding_function_inputs.size() + 1);
+      messages.push_back(common_input != nullptr ? common_input
+                                                 : &Input::default_instance());
+      messages.insert(messages.end(), bidding_function_inputs.begin(),
+                      bidding_function_inputs.end());
+      request_size = WriteMessages(messages, shared_memory->requests());
+    }
+    // The sandboxee is not trusted to return an output per input.
+    if (request_size.ok()) {
+      return CheckBatchOutputCount(
+          BatchInvokeInSharedMemory(sandbox, *request_size),
+          bidding_function_inputs.size());
+    }
+  }
+  return CheckBatchOutputCount(
+      BatchInvokeThroughComms(sandbox, common_input, bidding_function_inputs,
+                              serialized_inputs),
+      bidding_function_inputs.size());
+}
+
+template <typename Input, typename Output>
+absl::Status SapiBiddingFunction<Input, Output>::ParseOutput(
+    absl::string_view message, Output* output) const {
+  if (v8_wire_format_) {
+    return V8WireFormatToMessage(message, output);
+  }
+  if (!output->ParseFromArray(message.data(), message.size())) {
+    return absl::InternalError("Unable to parse the function outputs.");
+  }
+  return absl::OkStatus();
+}
 
-  RETURN_IF_ERROR(sandbox->SetWallTimeLimit(kCompileTimeLimit));
-  RETURN_IF_ERROR(sandbox->CompileFunction(
-      GetBiddingFunctionSpec<Input>(script_source, options)));
+template <typename Input, typename Output>
+absl::StatusOr<std::vector<Output>>
+SapiBiddingFunction<Input, Output>::BatchInvokeInSharedMemory(
+    FunctionSandbox* sandbox, size_t request_size) const {
+  RETURN_IF_ERROR(sandbox->SetWallTimeLimit(execute_duration_limit_));
+  const absl::Time start = absl::Now();
+  BatchedInvocationStats stats;
+  const absl::StatusOr<size_t> response_size =
+      sandbox->BatchExecuteInSharedMemory(function_id_, request_size, &stats);
+  RecordBatch(*sandbox, stats, start);
   // Disarm the wall time limit until the next execution.
   RETURN_IF_ERROR(sandbox->SetWallTimeLimit(absl::ZeroDuration()));
-  return absl::WrapUnique(new SapiBiddingFunction(std::move(sandbox), options));
+  RETURN_IF_ERROR(response_size.status());
+  const absl::Span<const char> responses =
+      sandbox->shared_memory()->responses();
+  if (*response_size > responses.size()) {
+    return absl::InternalError("Response exceeds the shared memory");
+  }
+  // The sandboxee can still write to the shared memory, so the response is
+  // copied out before being parsed, which reads parts of it more than once.
+  const std::string response(responses.data(), *response_size);
+  ASSIGN_OR_RETURN(const std::vector<absl::string_view> messages,
+                   ReadMessages(response));
+  std::vector<Output> outputs_vector(messages.size());
+  for (size_t i = 0; i < messages.size(); i++) {
+    RETURN_IF_ERROR(ParseOutput(messages[i], &outputs_vector[i]));
+  }
+  return outputs_vector;
 }
 
 template <typename Input, typename Output>
 absl::StatusOr<std::vector<Output>>
-SapiBiddingFunction<Input, Output>::BatchInvoke(
-    const std::vector<Input>& bidding_function_inputs) const {
-  RETURN_IF_ERROR(sandbox_->SetWallTimeLimit(execute_duration_limit_));
-  absl::StatusOr<BatchedInvocationOutputs> status_or_outputs =
-      sandbox_->BatchExecute(
-          GetBatchedInvocationInputs<Input>(bidding_function_inputs));
+SapiBiddingFunction<Input, Output>::BatchInvokeThroughComms(
+    FunctionSandbox* sandbox, const Input* common_input,
+    absl::Span<const Input* const> bidding_function_inputs,
+    absl::Span<const std::string> serialized_inputs) const {
+  // The packed inputs and outputs are only needed for the duration of the
+  // call, so they are all freed at once with the arena.
+  google::protobuf::Arena arena;
+  auto* inputs_proto =
+      google::protobuf::Arena::CreateMessage<BatchedInvocationInputs>(&arena);
+  inputs_proto->set_function_id(function_id_);
+  if (v8_wire_format_) {
+    inputs_proto->set_serialized_common_input(serialized_inputs.front());
+    inputs_proto->mutable_serialized_inputs()->Reserve(
+        serialized_inputs.size() - 1);
+    for (const std::string& input : serialized_inputs.subspan(1)) {
+      inputs_proto->add_serialized_inputs(input);
+    }
+  } else {
+    PackBatchedInvocationInputs(bidding_function_inputs, inputs_proto);
+    if (common_input != nullptr) {
+      // Shared fields are sent to the sandboxee once for the whole batch.
+      inputs_proto->mutable_common_input()->PackFrom(*common_input);
+    }
+  }
+  auto* outputs_proto =
+      google::protobuf::Arena::CreateMessage<BatchedInvocationOutputs>(&arena);
+  auto* stats =
+      google::protobuf::Arena::CreateMessage<BatchedInvocationStats>(&arena);
+  RETURN_IF_ERROR(sandbox->SetWallTimeLimit(execute_duration_limit_));
+  const absl::Time start = absl::Now();
+  const absl::Status execute_status =
+      sandbox->BatchExecute(*inputs_proto, outputs_proto, stats);
+  RecordBatch(*sandbox, *stats, start);
   // Disarm the wall time limit until the next execution.
-  RETURN_IF_ERROR(sandbox_->SetWallTimeLimit(absl::ZeroDuration()));
-  ASSIGN_OR_RETURN(auto outputs_proto, status_or_outputs);
+  RETURN_IF_ERROR(sandbox->SetWallTimeLimit(absl::ZeroDuration()));
+  RETURN_IF_ERROR(execute_status);
   std::vector<Output> outputs_vector;
-  for (const auto& outputs_any : outputs_proto.outputs()) {
+  if (v8_wire_format_) {
+    outputs_vector.resize(outputs_proto->serialized_outputs_size());
+    for (int i = 0; i < outputs_proto->serialized_outputs_size(); i++) {
+      RETURN_IF_ERROR(ParseOutput(outputs_proto->serialized_outputs(i),
+                                  &outputs_vector[i]));
+    }
+    return outputs_vector;
+  }
+  outputs_vector.reserve(outputs_proto->outputs_size());
+  for (const auto& outputs_any : outputs_proto->outputs()) {
     if (!outputs_any.UnpackTo(&outputs_vector.emplace_back())) {
       return absl::InternalError("Unable to unpack the function outputs.");
     }
@@ -189,9 +351,13 @@ SapiBiddingFunction<Input, Output>::BatchInvoke(
 
 template <typename Input, typename Output>
 SapiBiddingFunction<Input, Output>::SapiBiddingFunction(
-    std::unique_ptr<Sandbox> sandbox,
-    const FunctionOptions& options)
-    : sandbox_(std::move(sandbox)), options_(options) {}
+    std::shared_ptr<SandboxPool> pool, uint64_t function_id,
+    const FunctionOptions& options, bool v8_wire_format)
+    : pool_(std::move(pool)),
+      function_id_(function_id),
+      options_(options),
+      metrics_(options.metrics_name),
+      v8_wire_format_(v8_wire_format) {}
 
 template class SapiBiddingFunction<BiddingFunctionInput, BiddingFunctionOutput>;
 template class SapiBiddingFunction<AdScoringFunctionInput,
@@ -17,15 +17,40 @@
 #ifndef FUNCTION_SAPI_BIDDING_FUNCTION_H_
 #define FUNCTION_SAPI_BIDDING_FUNCTION_H_
 
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "function/bidding_function_interface.h"
 #include "function/bidding_function_sandbox.pb.h"
-#include "sandboxed_api/sandbox.h"
+#include "function/function_metrics.h"
+#include "function/sandbox_pool.h"
 
 namespace aviary::function {
 
 // A single bidding function wrapped into a SAPI sandbox
 // (https://developers.google.com/sandboxed-api) for the extra layer of security
 // protection.
+//
+// The function is compiled into a fixed-size pool of sandboxes, so that
+// concurrent invocations each get a sandboxee process of their own. Invocations
+// wait for a sandbox to become available when all of them are busy. Functions
+// of the same `FunctionOptions::sandbox_trust_domain` share the same pool, and
+// sandboxes that crash or exceed the execution time limit get replaced, see
+// `SandboxPool`.
+//
+// Inputs and outputs are exchanged with each sandboxee through a region of
+// shared memory, with sandbox2::Comms only signaling that a batch is ready.
+// Batches too large for the shared memory are sent through the comms instead.
+// With --sandbox_v8_wire_format, inputs and outputs are exchanged in the wire
+// format of V8's `ValueSerializer` rather than as messages, see
+// v8_wire_format.h.
 template <typename Input, typename Output>
 class SapiBiddingFunction : public BiddingFunctionInterface<Input, Output> {
  public:
@@ -35,41 +60,60 @@ class SapiBiddingFunction : public BiddingFunctionInterface<Input, Output> {
          const FunctionOptions& options = {
              .flatten_function_arguments = false});
 
-  virtual ~SapiBiddingFunction() = default;
+  virtual ~SapiBiddingFunction();
 
   absl::StatusOr<std::vector<Output>> BatchInvoke(
       const std::vector<Input>& bidding_function_inputs) const override;
 
+  absl::StatusOr<std::vector<Output>> BatchInvokeWithCommonInput(
+      const Input& common_input,
+      absl::Span<const Input* const> bidding_function_inputs) const override;
+
   SapiBiddingFunction(const SapiBiddingFunction&) = delete;
   SapiBiddingFunction& operator=(const SapiBiddingFunction&) = delete;
 
  private:
-  // Implements low-level requests to the sandbox for compiling and running
-  // bidding functions.
-  class Sandbox : public ::sapi::Sandbox {
-   public:
-    Sandbox();
-
-    // Requests the sandboxee to compile a bidding function and returns a
-    // status. Should only be invoked once per sandbox.
-    absl::Status CompileFunction(const BiddingFunctionSpec& spec);
-
-    // Requests the sandboxee to execute a bidding function for a batch of
-    // inputs. Returns a outputs in the order corresponding to the order of
-    // inputs or an error status.
-    absl::StatusOr<BatchedInvocationOutputs> BatchExecute(
-        const BatchedInvocationInputs& inputs);
-
-   private:
-    std::unique_ptr<sandbox2::Policy> ModifyPolicy(
-        sandbox2::PolicyBuilder*) override;
-  };
-
-  explicit SapiBiddingFunction(std::unique_ptr<Sandbox> sandbox,
-                               const FunctionOptions& options);
-
-  std::unique_ptr<Sandbox> sandbox_;
+  SapiBiddingFunction(std::shared_ptr<SandboxPool> pool, uint64_t function_id,
+                      const FunctionOptions& options, bool v8_wire_format);
+
+  // Runs a batch of invocations in an idle sandbox. `common_input` is null for
+  // batches that do not share any input.
+  absl::StatusOr<std::vector<Output>> DoBatchInvoke(
+      const Input* common_input,
+      absl::Span<const Input* const> bidding_function_inputs) const;
+
+  // Runs a batch written to the shared memory of `sandbox`, see
+  // `FunctionSandbox::BatchExecuteInSharedMemory()`.
+  absl::StatusOr<std::vector<Output>> BatchInvokeInSharedMemory(
+      FunctionSandbox* sandbox, size_t request_size) const;
+
+  // Runs a batch by sending it through the comms of `sandbox`.
+  // `serialized_inputs` holds the common input followed by the inputs when
+  // they are exchanged in the V8 wire format.
+  absl::StatusOr<std::vector<Output>> BatchInvokeThroughComms(
+      FunctionSandbox* sandbox, const Input* common_input,
+      absl::Span<const Input* const> bidding_function_inputs,
+      absl::Span<const std::string> serialized_inputs) const;
+
+  // Parses an output sent back by a sandboxee.
+  absl::Status ParseOutput(absl::string_view message, Output* output) const;
+
+  // Records the stats reported by `sandbox` for a batch sent at `start`, along
+  // with the time spent exchanging it, i.e. the rest of its round trip, and
+  // traces them on the calling thread. Batches that did not make it through
+  // the comms are not recorded.
+  void RecordBatch(const FunctionSandbox& sandbox,
+                   const BatchedInvocationStats& sandboxee_stats,
+                   absl::Time start) const;
+
+  // Sandboxes with the function compiled and ready for execution.
+  const std::shared_ptr<SandboxPool> pool_;
+  // ID of the function within the sandboxes of `pool_`.
+  const uint64_t function_id_;
   const FunctionOptions options_;
+  const FunctionMetrics metrics_;
+  // Whether inputs and outputs are exchanged in the V8 wire format.
+  const bool v8_wire_format_;
   // A fail-safe max duration to prevent a bidding function execution from
   // running indefinitely within the sandbox.
   absl::Duration execute_duration_limit_ = absl::Seconds(1);
@@ -0,0 +1,189 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/shared_memory.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "util/status_macros.h"
+
+namespace aviary {
+namespace function {
+namespace {
+
+absl::Status ErrnoToStatus(absl::string_view operation) {
+  return absl::InternalError(
+      absl::StrCat(operation, " failed: ", std::strerror(errno)));
+}
+
+// Maps `size` bytes of `fd`, closing `fd` upon failure.
+absl::StatusOr<char*> MapOrClose(int fd, size_t size) {
+  void* data =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, /*offset=*/0);
+  if (data == MAP_FAILED) {
+    const absl::Status status = ErrnoToStatus("mmap");
+    close(fd);
+    return status;
+  }
+  return static_cast<char*>(data);
+}
+
+// Sizes are written in the native byte order, since both ends of the shared
+// memory run on the same machine.
+// Sizes that do not fit in 32 bits do not fit in the buffer either, see
+// `SharedMemory::kMaxSize`.
+bool WriteSize(size_t size, absl::Span<char> buffer, size_t* offset) {
+  const uint32_t written_size = static_cast<uint32_t>(size);
+  if (written_size != size ||
+      buffer.size() - *offset < sizeof(written_size)) {
+    return false;
+  }
+  std::memcpy(buffer.data() + *offset, &written_size, sizeof(written_size));
+  *offset += sizeof(written_size);
+  return true;
+}
+
+bool ReadSize(absl::Span<const char> buffer, size_t* offset, uint32_t* size) {
+  if (buffer.size() - *offset < sizeof(*size)) {
+    return false;
+  }
+  std::memcpy(size, buffer.data() + *offset, sizeof(*size));
+  *offset += sizeof(*size);
+  return true;
+}
+
+absl::Status MessagesDoNotFit(size_t buffer_size) {
+  return absl::ResourceExhaustedError(absl::StrCat(
+      "Messages do not fit in the shared memory buffer of ", buffer_size,
+      " bytes"));
+}
+}  // namespace
+
+SharedMemory::SharedMemory(int fd, char* data, size_t size)
+    : fd_(fd), data_(data), size_(size) {}
+
+SharedMemory::~SharedMemory() {
+  munmap(data_, size_);
+  close(fd_);
+}
+
+absl::StatusOr<std::unique_ptr<SharedMemory>> SharedMemory::Create(
+    size_t size) {
+  if (size == 0) {
+    return absl::InvalidArgumentError("Shared memory cannot be empty");
+  }
+  if (size > kMaxSize) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Shared memory cannot exceed ", kMaxSize, " bytes"));
+  }
+  const int fd = memfd_create("aviary_shared_memory", MFD_CLOEXEC);
+  if (fd == -1) {
+    return ErrnoToStatus("memfd_create");
+  }
+  if (ftruncate(fd, size) == -1) {
+    const absl::Status status = ErrnoToStatus("ftruncate");
+    close(fd);
+    return status;
+  }
+  ASSIGN_OR_RETURN(char* data, MapOrClose(fd, size));
+  return absl::WrapUnique(new SharedMemory(fd, data, size));
+}
+
+absl::StatusOr<std::unique_ptr<SharedMemory>> SharedMemory::Map(int fd) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    const absl::Status status = ErrnoToStatus("fstat");
+    close(fd);
+    return status;
+  }
+  const size_t size = static_cast<size_t>(file_stat.st_size);
+  if (size == 0 || size > kMaxSize) {
+    close(fd);
+    return absl::InvalidArgumentError("Invalid shared memory size");
+  }
+  ASSIGN_OR_RETURN(char* data, MapOrClose(fd, size));
+  return absl::WrapUnique(new SharedMemory(fd, data, size));
+}
+
+absl::StatusOr<size_t> WriteMessages(
+    absl::Span<const google::protobuf::MessageLite* const> messages,
+    absl::Span<char> buffer) {
+  size_t offset = 0;
+  if (!WriteSize(messages.size(), buffer, &offset)) {
+    return MessagesDoNotFit(buffer.size());
+  }
+  for (const google::protobuf::MessageLite* message : messages) {
+    const size_t message_size = message->ByteSizeLong();
+    if (!WriteSize(message_size, buffer, &offset) ||
+        buffer.size() - offset < message_size) {
+      return MessagesDoNotFit(buffer.size());
+    }
+    message->SerializeWithCachedSizesToArray(
+        reinterpret_cast<uint8_t*>(buffer.data() + offset));
+    offset += message_size;
+  }
+  return offset;
+}
+
+absl::StatusOr<size_t> WriteSerializedMessages(
+    absl::Span<const absl::string_view> messages, absl::Span<char> buffer) {
+  size_t offset = 0;
+  if (!WriteSize(messages.size(), buffer, &offset)) {
+    return MessagesDoNotFit(buffer.size());
+  }
+  for (absl::string_view message : messages) {
+    if (!WriteSize(message.size(), buffer, &offset) ||
+        buffer.size() - offset < message.size()) {
+      return MessagesDoNotFit(buffer.size());
+    }
+    std::memcpy(buffer.data() + offset, message.data(), message.size());
+    offset += message.size();
+  }
+  return offset;
+}
+
+absl::StatusOr<std::vector<absl::string_view>> ReadMessages(
+    absl::Span<const char> buffer) {
+  size_t offset = 0;
+  uint32_t count;
+  if (!ReadSize(buffer, &offset, &count)) {
+    return absl::InvalidArgumentError("Truncated message count");
+  }
+  std::vector<absl::string_view> messages;
+  // Every message takes at least the size of its size.
+  messages.reserve(std::min<size_t>(count, buffer.size() / sizeof(count)));
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t message_size;
+    if (!ReadSize(buffer, &offset, &message_size) ||
+        buffer.size() - offset < message_size) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Truncated message #", i));
+    }
+    messages.emplace_back(buffer.data() + offset, message_size);
+    offset += message_size;
+  }
+  return messages;
+}
+}  // namespace function
+}  // namespace aviary
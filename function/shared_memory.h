@@ -0,0 +1,91 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FUNCTION_SHARED_MEMORY_H_
+#define FUNCTION_SHARED_MEMORY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "google/protobuf/message_lite.h"
+
+namespace aviary {
+namespace function {
+
+// Memory region backed by a memfd file, which is mapped by both the host and a
+// sandboxee so that batches of messages are exchanged without being copied
+// through sandbox2::Comms.
+//
+// The region is split into two halves: requests written by the host, and
+// responses written by the sandboxee. Each sandbox only runs one batch at a
+// time, so one buffer in each direction is enough.
+class SharedMemory {
+ public:
+  // Largest region, whose halves are addressed by the 32-bit sizes of the
+  // messages written to them.
+  static constexpr size_t kMaxSize = 2 * size_t{UINT32_MAX};
+
+  // Creates a region of `size` bytes, up to `kMaxSize`, backed by a new memfd
+  // file.
+  static absl::StatusOr<std::unique_ptr<SharedMemory>> Create(size_t size);
+
+  // Maps the whole region backed by `fd`, as created by `Create()` in another
+  // process. Takes ownership of `fd`.
+  static absl::StatusOr<std::unique_ptr<SharedMemory>> Map(int fd);
+
+  ~SharedMemory();
+
+  // File descriptor of the memfd file backing the region.
+  int fd() const { return fd_; }
+
+  absl::Span<char> requests() { return {data_, size_ / 2}; }
+  absl::Span<char> responses() { return {data_ + size_ / 2, size_ / 2}; }
+
+  SharedMemory(const SharedMemory&) = delete;
+  SharedMemory& operator=(const SharedMemory&) = delete;
+
+ private:
+  SharedMemory(int fd, char* data, size_t size);
+
+  const int fd_;
+  char* const data_;
+  const size_t size_;
+};
+
+// Serializes `messages` into `buffer` as their count followed by each of them
+// prefixed with its size. Returns the number of bytes written, or a
+// ResourceExhausted error if the messages do not fit.
+absl::StatusOr<size_t> WriteMessages(
+    absl::Span<const google::protobuf::MessageLite* const> messages,
+    absl::Span<char> buffer);
+
+// Writes `messages`, already serialized, the same way `WriteMessages()` does.
+absl::StatusOr<size_t> WriteSerializedMessages(
+    absl::Span<const absl::string_view> messages, absl::Span<char> buffer);
+
+// Returns the messages serialized by `WriteMessages()` at the beginning of
+// `buffer`, pointing into `buffer` for them to be parsed in place.
+absl::StatusOr<std::vector<absl::string_view>> ReadMessages(
+    absl::Span<const char> buffer);
+}  // namespace function
+}  // namespace aviary
+
+#endif  // FUNCTION_SHARED_MEMORY_H_
@@ -0,0 +1,131 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "function/shared_memory.h"
+
+#include <unistd.h>
+
+#include <cstring>
+
+#include "gmock/gmock.h"
+#include "google/protobuf/struct.pb.h"
+#include "gtest/gtest.h"
+
+namespace aviary {
+namespace function {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+google::protobuf::Value NumberValue(double number) {
+  google::protobuf::Value value;
+  value.set_number_value(number);
+  return value;
+}
+
+TEST(SharedMemoryTest, SplitsRegionInHalves) {
+  auto shared_memory = SharedMemory::Create(4096).value();
+  EXPECT_EQ(shared_memory->requests().size(), 2048);
+  EXPECT_EQ(shared_memory->responses().size(), 2048);
+  EXPECT_EQ(shared_memory->requests().data() + 2048,
+            shared_memory->responses().data());
+}
+
+TEST(SharedMemoryTest, MappingsShareContents) {
+  auto shared_memory = SharedMemory::Create(4096).value();
+  auto other_mapping = SharedMemory::Map(dup(shared_memory->fd())).value();
+  std::strcpy(shared_memory->requests().data(), "request");
+  std::strcpy(other_mapping->responses().data(), "response");
+  EXPECT_STREQ(other_mapping->requests().data(), "request");
+  EXPECT_STREQ(shared_memory->responses().data(), "response");
+}
+
+TEST(SharedMemoryTest, RejectsEmptyRegion) {
+  EXPECT_EQ(SharedMemory::Create(0).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(SharedMemoryTest, FailsToCreateOversizedRegion) {
+  EXPECT_EQ(SharedMemory::Create(SharedMemory::kMaxSize + 1).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(SharedMemoryTest, FailsToMapInvalidFileDescriptor) {
+  EXPECT_FALSE(SharedMemory::Map(-1).ok());
+}
+
+TEST(MessagesTest, RoundTrips) {
+  const google::protobuf::Value first = NumberValue(1);
+  const google::protobuf::Value empty;
+  const google::protobuf::Value second = NumberValue(2);
+  std::vector<char> buffer(1024);
+  const size_t size = WriteMessages({&first, &empty, &second},
+                                    absl::MakeSpan(buffer))
+                          .value();
+  const std::vector<absl::string_view> messages =
+      ReadMessages(absl::MakeConstSpan(buffer.data(), size)).value();
+  ASSERT_EQ(messages.size(), 3);
+  google::protobuf::Value parsed;
+  ASSERT_TRUE(parsed.ParseFromArray(messages[0].data(), messages[0].size()));
+  EXPECT_EQ(parsed.number_value(), 1);
+  EXPECT_THAT(messages[1], IsEmpty());
+  ASSERT_TRUE(parsed.ParseFromArray(messages[2].data(), messages[2].size()));
+  EXPECT_EQ(parsed.number_value(), 2);
+}
+
+TEST(MessagesTest, RoundTripsNoMessages) {
+  std::vector<char> buffer(16);
+  const size_t size = WriteMessages({}, absl::MakeSpan(buffer)).value();
+  EXPECT_THAT(ReadMessages(absl::MakeConstSpan(buffer.data(), size)).value(),
+              IsEmpty());
+}
+
+TEST(MessagesTest, FailsIfMessagesDoNotFit) {
+  const google::protobuf::Value value = NumberValue(1);
+  std::vector<char> buffer(value.ByteSizeLong() + 4);
+  EXPECT_EQ(WriteMessages({&value}, absl::MakeSpan(buffer)).status().code(),
+            absl::StatusCode::kResourceExhausted);
+  buffer.resize(value.ByteSizeLong() + 8);
+  EXPECT_TRUE(WriteMessages({&value}, absl::MakeSpan(buffer)).ok());
+}
+
+TEST(MessagesTest, RoundTripsSerializedMessages) {
+  std::vector<char> buffer(1024);
+  const size_t size =
+      WriteSerializedMessages({"first", "", "second"}, absl::MakeSpan(buffer))
+          .value();
+  EXPECT_THAT(ReadMessages(absl::MakeConstSpan(buffer.data(), size)).value(),
+              ElementsAre("first", "", "second"));
+  EXPECT_EQ(WriteSerializedMessages({"first"}, absl::MakeSpan(buffer).first(9))
+                .status()
+                .code(),
+            absl::StatusCode::kResourceExhausted);
+}
+
+TEST(MessagesTest, FailsToReadTruncatedMessages) {
+  const google::protobuf::Value value = NumberValue(1);
+  std::vector<char> buffer(1024);
+  const size_t size = WriteMessages({&value}, absl::MakeSpan(buffer)).value();
+  EXPECT_EQ(ReadMessages(absl::MakeConstSpan(buffer.data(), size - 1))
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ReadMessages(absl::MakeConstSpan(buffer.data(), 2)).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+}  // namespace
+}  // namespace function
+}  // namespace aviary
@@ -0,0 +1,152 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/snapshot_cache.h"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+#include "absl/flags/flag.h"
+#include "absl/random/random.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "openssl/sha.h"
+
+ABSL_FLAG(std::string, function_snapshot_cache_dir, "",
+          "Directory in which to persist the warmed-up V8 snapshots of "
+          "functions across restarts. Functions are compiled and warmed up "
+          "from scratch upon every start when empty.");
+
+namespace aviary {
+namespace function {
+namespace {
+
+// Returns the 64-bit FNV-1a hash of `data`. Unlike absl::Hash, the hash is
+// stable across processes, which file names need to be.
+uint64_t StableHash(absl::string_view data) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// Returns the SHA-256 digest of `data`.
+std::string Checksum(absl::string_view data) {
+  std::string digest(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(),
+         reinterpret_cast<uint8_t*>(&digest[0]));
+  return digest;
+}
+
+// Cache files consist of the decimal size of the key, a newline, the key, the
+// checksum of the snapshot, then the snapshot.
+std::string EncodeEntry(absl::string_view key, absl::string_view snapshot) {
+  return absl::StrCat(key.size(), "\n", key, Checksum(snapshot), snapshot);
+}
+
+absl::optional<std::string> DecodeEntry(absl::string_view key,
+                                        absl::string_view entry) {
+  const size_t newline = entry.find('\n');
+  size_t key_size;
+  if (newline == absl::string_view::npos ||
+      !absl::SimpleAtoi(entry.substr(0, newline), &key_size) ||
+      entry.substr(newline + 1, key_size) != key) {
+    return absl::nullopt;
+  }
+  entry.remove_prefix(newline + 1 + key_size);
+  if (entry.size() < SHA256_DIGEST_LENGTH) {
+    return absl::nullopt;
+  }
+  const absl::string_view checksum = entry.substr(0, SHA256_DIGEST_LENGTH);
+  const absl::string_view snapshot = entry.substr(SHA256_DIGEST_LENGTH);
+  // V8 trusts the snapshots it deserializes.
+  if (Checksum(snapshot) != checksum) {
+    return absl::nullopt;
+  }
+  return std::string(snapshot);
+}
+}  // namespace
+
+SnapshotCache::SnapshotCache(std::string directory)
+    : directory_(std::move(directory)) {}
+
+absl::optional<SnapshotCache> SnapshotCache::FromFlags() {
+  std::string directory = absl::GetFlag(FLAGS_function_snapshot_cache_dir);
+  if (directory.empty()) {
+    return absl::nullopt;
+  }
+  return SnapshotCache(std::move(directory));
+}
+
+std::string SnapshotCache::GetPath(absl::string_view key) const {
+  return absl::StrCat(directory_, "/", absl::Hex(StableHash(key)),
+                      ".snapshot");
+}
+
+absl::optional<std::string> SnapshotCache::Lookup(absl::string_view key) const {
+  std::ifstream file(GetPath(key), std::ios::binary);
+  if (!file) {
+    return absl::nullopt;
+  }
+  std::stringstream entry;
+  entry << file.rdbuf();
+  if (file.bad()) {
+    return absl::nullopt;
+  }
+  return DecodeEntry(key, entry.str());
+}
+
+absl::Status SnapshotCache::Store(absl::string_view key,
+                                  absl::string_view snapshot) const {
+  std::error_code error;
+  std::filesystem::create_directories(directory_, error);
+  if (error) {
+    return absl::InternalError(absl::StrCat("Unable to create directory ",
+                                            directory_, ": ", error.message()));
+  }
+  // Write to a file private to this call, then move it into place, so that
+  // concurrent lookups never observe a partially written snapshot.
+  const std::string path = GetPath(key);
+  absl::BitGen bitgen;
+  const std::string temporary_path = absl::StrCat(
+      path, ".", getpid(), ".", absl::Uniform<uint32_t>(bitgen), ".tmp");
+  {
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    const std::string entry = EncodeEntry(key, snapshot);
+    file.write(entry.data(), entry.size());
+    file.close();
+    if (!file) {
+      std::filesystem::remove(temporary_path, error);
+      return absl::InternalError(
+          absl::StrCat("Unable to write snapshot to ", temporary_path));
+    }
+  }
+  std::filesystem::rename(temporary_path, path, error);
+  if (error) {
+    const absl::Status status = absl::InternalError(absl::StrCat(
+        "Unable to move snapshot to ", path, ": ", error.message()));
+    std::filesystem::remove(temporary_path, error);
+    return status;
+  }
+  return absl::OkStatus();
+}
+}  // namespace function
+}  // namespace aviary
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FUNCTION_SNAPSHOT_CACHE_H_
+#define FUNCTION_SNAPSHOT_CACHE_H_
+
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+
+namespace aviary {
+namespace function {
+
+// Persistent cache of V8 startup snapshots, so that a restarted server does not
+// have to compile and warm up its functions again.
+//
+// Each snapshot is stored in its own file of the cache directory, named after a
+// hash of its key. The key itself is stored alongside the snapshot and checked
+// upon lookup, so that hash collisions result in cache misses, as is a SHA-256
+// checksum of the snapshot, so that truncated or otherwise corrupted files are
+// never handed to V8, which does not validate snapshots. Keys are
+// expected to capture everything the snapshot depends on, e.g. the source code
+// of the function, the options it was built with and the V8 version.
+//
+// Thread-safe, and safe to share a cache directory between processes.
+class SnapshotCache {
+ public:
+  explicit SnapshotCache(std::string directory);
+
+  // Returns the cache in the directory specified by
+  // --function_snapshot_cache_dir, or nullopt if the flag is empty.
+  static absl::optional<SnapshotCache> FromFlags();
+
+  // Returns the snapshot stored with `key`, or nullopt if there is none or if
+  // it cannot be read.
+  absl::optional<std::string> Lookup(absl::string_view key) const;
+
+  // Stores `snapshot` with `key`, replacing any snapshot previously stored with
+  // the same key. Creates the cache directory if it does not exist yet.
+  absl::Status Store(absl::string_view key, absl::string_view snapshot) const;
+
+ private:
+  std::string GetPath(absl::string_view key) const;
+
+  std::string directory_;
+};
+}  // namespace function
+}  // namespace aviary
+
+#endif  // FUNCTION_SNAPSHOT_CACHE_H_
@@ -0,0 +1,103 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "function/snapshot_cache.h"
+
+#include <filesystem>
+#include <fstream>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "absl/random/random.h"
+#include "absl/strings/str_cat.h"
+#include "gtest/gtest.h"
+
+ABSL_DECLARE_FLAG(std::string, function_snapshot_cache_dir);
+
+namespace aviary {
+namespace function {
+namespace {
+
+std::string TempDirectoryName() {
+  absl::BitGen bitgen;
+  return absl::StrCat(testing::TempDir(), "/snapshot_cache_",
+                      absl::Uniform<uint32_t>(bitgen));
+}
+
+TEST(SnapshotCacheTest, MissesUnknownKey) {
+  SnapshotCache cache(TempDirectoryName());
+  EXPECT_EQ(cache.Lookup("key"), absl::nullopt);
+}
+
+TEST(SnapshotCacheTest, FindsStoredSnapshot) {
+  SnapshotCache cache(TempDirectoryName());
+  ASSERT_TRUE(cache.Store("key", std::string("snap\0shot", 9)).ok());
+  EXPECT_EQ(cache.Lookup("key"), std::string("snap\0shot", 9));
+  EXPECT_EQ(cache.Lookup("other key"), absl::nullopt);
+}
+
+TEST(SnapshotCacheTest, ReplacesStoredSnapshot) {
+  SnapshotCache cache(TempDirectoryName());
+  ASSERT_TRUE(cache.Store("key", "first").ok());
+  ASSERT_TRUE(cache.Store("key", "second").ok());
+  EXPECT_EQ(cache.Lookup("key"), "second");
+}
+
+TEST(SnapshotCacheTest, SharesSnapshotsBetweenInstances) {
+  const std::string directory = TempDirectoryName();
+  ASSERT_TRUE(SnapshotCache(directory).Store("key", "snapshot").ok());
+  EXPECT_EQ(SnapshotCache(directory).Lookup("key"), "snapshot");
+}
+
+TEST(SnapshotCacheTest, MissesCorruptedSnapshot) {
+  const std::string directory = TempDirectoryName();
+  SnapshotCache cache(directory);
+  ASSERT_TRUE(cache.Store("key", "snapshot").ok());
+  for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+    std::ofstream(entry.path(), std::ios::trunc) << "garbage";
+  }
+  EXPECT_EQ(cache.Lookup("key"), absl::nullopt);
+}
+
+TEST(SnapshotCacheTest, MissesSnapshotWithWrongChecksum) {
+  const std::string directory = TempDirectoryName();
+  SnapshotCache cache(directory);
+  ASSERT_TRUE(cache.Store("key", "snapshot").ok());
+  for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+    // Overwrite the last byte of the snapshot.
+    std::fstream file(entry.path(),
+                      std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(-1, std::ios::end);
+    file << 'X';
+  }
+  EXPECT_EQ(cache.Lookup("key"), absl::nullopt);
+}
+
+TEST(SnapshotCacheTest, FromFlags) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_function_snapshot_cache_dir, "");
+  EXPECT_FALSE(SnapshotCache::FromFlags().has_value());
+
+  const std::string directory = TempDirectoryName();
+  absl::SetFlag(&FLAGS_function_snapshot_cache_dir, directory);
+  auto cache = SnapshotCache::FromFlags();
+  ASSERT_TRUE(cache.has_value());
+  ASSERT_TRUE(cache->Store("key", "snapshot").ok());
+  EXPECT_EQ(SnapshotCache(directory).Lookup("key"), "snapshot");
+}
+}  // namespace
+}  // namespace function
+}  // namespace aviary
@@ -0,0 +1,966 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/v8_wire_format.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "google/protobuf/descriptor.h"
+#include "google/protobuf/struct.pb.h"
+#include "google/protobuf/util/json_util.h"
+#include "util/status_macros.h"
+
+namespace aviary {
+namespace function {
+namespace {
+
+using ::google::protobuf::Descriptor;
+using ::google::protobuf::FieldDescriptor;
+using ::google::protobuf::ListValue;
+using ::google::protobuf::Message;
+using ::google::protobuf::Reflection;
+using ::google::protobuf::Struct;
+using ::google::protobuf::Value;
+using ::google::protobuf::util::JsonStringToMessage;
+using ::google::protobuf::util::MessageToJsonString;
+
+constexpr absl::string_view kWellKnownTypesPackage = "google.protobuf";
+constexpr absl::string_view kNullValueEnumName = "google.protobuf.NullValue";
+
+// Version of the format written, that of V8 9.0. Later versions of V8 still
+// read it.
+constexpr uint8_t kWireFormatVersion = 13;
+
+// Tags of the values in the format, as defined by V8's value-serializer.cc.
+enum Tag : uint8_t {
+  kVersion = 0xFF,
+  kPadding = '\0',
+  kVerifyObjectCount = '?',
+  kTheHole = '-',
+  kUndefined = '_',
+  kNull = '0',
+  kTrue = 'T',
+  kFalse = 'F',
+  kInt32 = 'I',
+  kUint32 = 'U',
+  kDouble = 'N',
+  kUtf8String = 'S',
+  kOneByteString = '"',
+  kTwoByteString = 'c',
+  kObjectReference = '^',
+  kBeginJSObject = 'o',
+  kEndJSObject = '{',
+  kBeginSparseJSArray = 'a',
+  kEndSparseJSArray = '@',
+  kBeginDenseJSArray = 'A',
+  kEndDenseJSArray = '$',
+  kTrueObject = 'y',
+  kFalseObject = 'x',
+  kNumberObject = 'n',
+  kStringObject = 's',
+};
+
+// Writes the values that `ProtoToV8Value()` builds, in the same order.
+class MessageWriter {
+ public:
+  explicit MessageWriter(std::string* output) : output_(output) {
+    WriteTag(kVersion);
+    WriteVarint(kWireFormatVersion);
+  }
+
+  absl::Status Write(const Message& message) {
+    const Descriptor* descriptor = message.GetDescriptor();
+    if (descriptor == Struct::descriptor()) {
+      return WriteStruct(static_cast<const Struct&>(message));
+    }
+    if (descriptor == Value::descriptor()) {
+      return WriteValue(static_cast<const Value&>(message));
+    }
+    if (descriptor == ListValue::descriptor()) {
+      return WriteListValue(static_cast<const ListValue&>(message));
+    }
+    if (descriptor->file()->package() == kWellKnownTypesPackage) {
+      return absl::UnimplementedError(
+          absl::StrCat("Unsupported message type: ", descriptor->full_name()));
+    }
+    return WriteMessage(message);
+  }
+
+  // Writes a `Value` parsed from JSON, which has no non-finite numbers.
+  absl::Status WriteValue(const Value& message) {
+    switch (message.kind_case()) {
+      case Value::kNullValue:
+        WriteTag(kNull);
+        return absl::OkStatus();
+      case Value::kNumberValue:
+        return WriteNumber(message.number_value());
+      case Value::kStringValue:
+        WriteString(message.string_value());
+        return absl::OkStatus();
+      case Value::kBoolValue:
+        WriteTag(message.bool_value() ? kTrue : kFalse);
+        return absl::OkStatus();
+      case Value::kStructValue:
+        return WriteStruct(message.struct_value());
+      case Value::kListValue:
+        return WriteListValue(message.list_value());
+      default:
+        return absl::UnimplementedError("Value without a kind.");
+    }
+  }
+
+ private:
+  absl::Status WriteStruct(const Struct& message) {
+    WriteTag(kBeginJSObject);
+    for (const auto& [name, value] : message.fields()) {
+      WriteString(name);
+      RETURN_IF_ERROR(WriteValue(value));
+    }
+    WriteTag(kEndJSObject);
+    WriteVarint(message.fields_size());
+    return absl::OkStatus();
+  }
+
+  absl::Status WriteListValue(const ListValue& message) {
+    WriteTag(kBeginDenseJSArray);
+    WriteVarint(message.values_size());
+    for (const Value& value : message.values()) {
+      RETURN_IF_ERROR(WriteValue(value));
+    }
+    EndDenseArray(message.values_size());
+    return absl::OkStatus();
+  }
+
+  absl::Status WriteMessage(const Message& message) {
+    const Reflection* reflection = message.GetReflection();
+    // Lists the populated fields ordered by field number, which is what the
+    // JSON printer emits.
+    std::vector<const FieldDescriptor*> fields;
+    reflection->ListFields(message, &fields);
+    WriteTag(kBeginJSObject);
+    for (const FieldDescriptor* field : fields) {
+      if (field->is_extension()) {
+        return absl::UnimplementedError("Extensions are not supported.");
+      }
+      WriteString(field->json_name());
+      if (field->is_map()) {
+        RETURN_IF_ERROR(WriteMapField(message, field));
+      } else if (field->is_repeated()) {
+        const int size = reflection->FieldSize(message, field);
+        WriteTag(kBeginDenseJSArray);
+        WriteVarint(size);
+        for (int index = 0; index < size; index++) {
+          RETURN_IF_ERROR(WriteFieldValue(message, field, index));
+        }
+        EndDenseArray(size);
+      } else {
+        RETURN_IF_ERROR(WriteFieldValue(message, field, /*index=*/-1));
+      }
+    }
+    WriteTag(kEndJSObject);
+    WriteVarint(fields.size());
+    return absl::OkStatus();
+  }
+
+  absl::Status WriteMapField(const Message& message,
+                             const FieldDescriptor* field) {
+    const Reflection* reflection = message.GetReflection();
+    const FieldDescriptor* key_field = field->message_type()->map_key();
+    const FieldDescriptor* value_field = field->message_type()->map_value();
+    const int size = reflection->FieldSize(message, field);
+    WriteTag(kBeginJSObject);
+    for (int index = 0; index < size; index++) {
+      const Message& entry =
+          reflection->GetRepeatedMessage(message, field, index);
+      WriteString(GetMapKey(entry, key_field));
+      RETURN_IF_ERROR(WriteFieldValue(entry, value_field, /*index=*/-1));
+    }
+    WriteTag(kEndJSObject);
+    WriteVarint(size);
+    return absl::OkStatus();
+  }
+
+  // Writes the value of a singular field if `index` is negative, or the
+  // element at `index` of a repeated field otherwise.
+  absl::Status WriteFieldValue(const Message& message,
+                               const FieldDescriptor* field, int index) {
+    const Reflection* reflection = message.GetReflection();
+    const bool repeated = index >= 0;
+    switch (field->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_INT32:
+        WriteInt32(repeated
+                       ? reflection->GetRepeatedInt32(message, field, index)
+                       : reflection->GetInt32(message, field));
+        return absl::OkStatus();
+      case FieldDescriptor::CPPTYPE_UINT32:
+        WriteTag(kUint32);
+        WriteVarint(repeated
+                        ? reflection->GetRepeatedUInt32(message, field, index)
+                        : reflection->GetUInt32(message, field));
+        return absl::OkStatus();
+      case FieldDescriptor::CPPTYPE_INT64:
+        // 64-bit integers are printed as strings to avoid precision loss.
+        WriteString(absl::StrCat(
+            repeated ? reflection->GetRepeatedInt64(message, field, index)
+                     : reflection->GetInt64(message, field)));
+        return absl::OkStatus();
+      case FieldDescriptor::CPPTYPE_UINT64:
+        WriteString(absl::StrCat(
+            repeated ? reflection->GetRepeatedUInt64(message, field, index)
+                     : reflection->GetUInt64(message, field)));
+        return absl::OkStatus();
+      case FieldDescriptor::CPPTYPE_DOUBLE:
+        return WriteNumber(
+            repeated ? reflection->GetRepeatedDouble(message, field, index)
+                     : reflection->GetDouble(message, field));
+      case FieldDescriptor::CPPTYPE_FLOAT:
+        // The JSON printer rounds floats to their shortest representation,
+        // which is not worth mirroring here.
+        return absl::UnimplementedError("Float fields are not supported.");
+      case FieldDescriptor::CPPTYPE_BOOL:
+        WriteTag((repeated ? reflection->GetRepeatedBool(message, field, index)
+                           : reflection->GetBool(message, field))
+                     ? kTrue
+                     : kFalse);
+        return absl::OkStatus();
+      case FieldDescriptor::CPPTYPE_ENUM: {
+        if (field->enum_type()->full_name() == kNullValueEnumName) {
+          WriteTag(kNull);
+          return absl::OkStatus();
+        }
+        const int number =
+            repeated ? reflection->GetRepeatedEnumValue(message, field, index)
+                     : reflection->GetEnumValue(message, field);
+        const auto* enum_value = field->enum_type()->FindValueByNumber(number);
+        if (enum_value == nullptr) {
+          WriteInt32(number);
+        } else {
+          WriteString(enum_value->name());
+        }
+        return absl::OkStatus();
+      }
+      case FieldDescriptor::CPPTYPE_STRING: {
+        std::string scratch;
+        const std::string& value =
+            repeated ? reflection->GetRepeatedStringReference(message, field,
+                                                              index, &scratch)
+                     : reflection->GetStringReference(message, field, &scratch);
+        if (field->type() == FieldDescriptor::TYPE_BYTES) {
+          WriteString(absl::Base64Escape(value));
+        } else {
+          WriteString(value);
+        }
+        return absl::OkStatus();
+      }
+      case FieldDescriptor::CPPTYPE_MESSAGE:
+        return Write(repeated
+                         ? reflection->GetRepeatedMessage(message, field, index)
+                         : reflection->GetMessage(message, field));
+      default:
+        return absl::UnimplementedError(
+            absl::StrCat("Unsupported field type: ", field->type_name()));
+    }
+  }
+
+  static std::string GetMapKey(const Message& entry,
+                               const FieldDescriptor* key_field) {
+    const Reflection* reflection = entry.GetReflection();
+    switch (key_field->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_INT32:
+        return absl::StrCat(reflection->GetInt32(entry, key_field));
+      case FieldDescriptor::CPPTYPE_UINT32:
+        return absl::StrCat(reflection->GetUInt32(entry, key_field));
+      case FieldDescriptor::CPPTYPE_INT64:
+        return absl::StrCat(reflection->GetInt64(entry, key_field));
+      case FieldDescriptor::CPPTYPE_UINT64:
+        return absl::StrCat(reflection->GetUInt64(entry, key_field));
+      case FieldDescriptor::CPPTYPE_BOOL:
+        return reflection->GetBool(entry, key_field) ? "true" : "false";
+      default:
+        return reflection->GetString(entry, key_field);
+    }
+  }
+
+  absl::Status WriteNumber(double value) {
+    if (!std::isfinite(value)) {
+      // Non-finite numbers have no JSON representation.
+      return absl::UnimplementedError("Non-finite numbers are not supported.");
+    }
+    WriteTag(kDouble);
+    char bytes[sizeof(value)];
+    std::memcpy(bytes, &value, sizeof(value));
+    output_->append(bytes, sizeof(bytes));
+    return absl::OkStatus();
+  }
+
+  void WriteInt32(int32_t value) {
+    WriteTag(kInt32);
+    // Zigzag encoding, as V8 does.
+    WriteVarint((static_cast<uint32_t>(value) << 1) ^
+                static_cast<uint32_t>(value >> 31));
+  }
+
+  // Writes `value` as UTF-8, which saves transcoding it into Latin-1 or UTF-16
+  // the way V8 writes strings.
+  void WriteString(absl::string_view value) {
+    WriteTag(kUtf8String);
+    WriteVarint(value.size());
+    output_->append(value.data(), value.size());
+  }
+
+  // Ends a dense array of `length` elements without other properties.
+  void EndDenseArray(uint64_t length) {
+    WriteTag(kEndDenseJSArray);
+    WriteVarint(/*properties=*/0);
+    WriteVarint(length);
+  }
+
+  void WriteTag(Tag tag) { output_->push_back(static_cast<char>(tag)); }
+
+  void WriteVarint(uint64_t value) {
+    do {
+      uint8_t byte = value & 0x7F;
+      value >>= 7;
+      if (value != 0) {
+        byte |= 0x80;
+      }
+      output_->push_back(static_cast<char>(byte));
+    } while (value != 0);
+  }
+
+  std::string* const output_;
+};
+
+// Reads serialized values into the `Value` that JSON.parse() of their
+// JSON.stringify() would produce.
+class ValueReader {
+ public:
+  explicit ValueReader(absl::string_view data) : data_(data) {}
+
+  // Reads the serialized value, failing if JSON.stringify() would not print
+  // anything for it.
+  absl::Status Read(Value* value) {
+    uint8_t tag;
+    uint64_t version;
+    if (!ReadByte(&tag) || tag != kVersion || !ReadVarint(&version)) {
+      return Malformed("Missing version.");
+    }
+    bool omitted;
+    RETURN_IF_ERROR(ReadValue(value, &omitted, /*depth=*/0));
+    if (omitted) {
+      return absl::FailedPreconditionError(
+          "The function output has no JSON representation.");
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  // Maximum nesting of objects and arrays, matching the default recursion
+  // limit of the JSON parser.
+  static constexpr int kMaxDepth = 100;
+  // Maximum size of the value read per byte of data, counting a byte per
+  // value and the bytes of strings. It bounds how far references to the same
+  // object, printed in full each time by JSON, and sparse arrays, whose holes
+  // JSON prints as nulls, expand the data.
+  static constexpr size_t kMaxExpansion = 16;
+
+  // ID of the objects that are being read again, which keep their first ID.
+  static constexpr size_t kReplayedObject = -1;
+
+  // An object read or being read, to be read again where referenced.
+  struct ObjectRange {
+    size_t begin;
+    // Offset past the object, or 0 while it is being read.
+    size_t end;
+  };
+
+  // Reads the next value into `value`, or sets `omitted` if JSON.stringify()
+  // leaves it out of objects.
+  absl::Status ReadValue(Value* value, bool* omitted, int depth) {
+    *omitted = false;
+    if (depth > kMaxDepth) {
+      return absl::FailedPreconditionError("Value nested too deeply.");
+    }
+    RETURN_IF_ERROR(Expand(1));
+    const size_t begin = offset_;
+    uint8_t tag;
+    RETURN_IF_ERROR(ReadTag(&tag));
+    size_t id;
+    switch (tag) {
+      case kUndefined:
+        *omitted = true;
+        return absl::OkStatus();
+      case kNull:
+        value->set_null_value(google::protobuf::NULL_VALUE);
+        return absl::OkStatus();
+      case kTrue:
+      case kFalse:
+        value->set_bool_value(tag == kTrue);
+        return absl::OkStatus();
+      case kInt32:
+      case kUint32:
+      case kDouble: {
+        double number;
+        RETURN_IF_ERROR(ReadNumber(tag, &number));
+        SetNumber(number, value);
+        return absl::OkStatus();
+      }
+      case kUtf8String:
+      case kOneByteString:
+      case kTwoByteString:
+        return ReadString(tag, value->mutable_string_value());
+      case kObjectReference:
+        return ReadReference(value, omitted, depth);
+      // JSON.stringify() prints boxed primitives as their primitive.
+      case kTrueObject:
+      case kFalseObject:
+        id = BeginObject(begin);
+        value->set_bool_value(tag == kTrueObject);
+        break;
+      case kNumberObject: {
+        id = BeginObject(begin);
+        double number;
+        RETURN_IF_ERROR(ReadNumber(kDouble, &number));
+        SetNumber(number, value);
+        break;
+      }
+      case kStringObject:
+        id = BeginObject(begin);
+        RETURN_IF_ERROR(ReadTag(&tag));
+        RETURN_IF_ERROR(ReadString(tag, value->mutable_string_value()));
+        break;
+      case kBeginJSObject:
+        id = BeginObject(begin);
+        RETURN_IF_ERROR(ReadObject(value->mutable_struct_value(), depth));
+        break;
+      case kBeginDenseJSArray:
+        id = BeginObject(begin);
+        RETURN_IF_ERROR(ReadDenseArray(value->mutable_list_value(), depth));
+        break;
+      case kBeginSparseJSArray:
+        id = BeginObject(begin);
+        RETURN_IF_ERROR(ReadSparseArray(value->mutable_list_value(), depth));
+        break;
+      default:
+        return absl::FailedPreconditionError(absl::StrCat(
+            "Unsupported value in the function output, with tag ",
+            absl::CEscape(absl::string_view(reinterpret_cast<char*>(&tag), 1)),
+            "."));
+    }
+    if (id != kReplayedObject) {
+      objects_[id].end = offset_;
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status ReadObject(Struct* message, int depth) {
+    auto& fields = *message->mutable_fields();
+    uint64_t properties = 0;
+    for (;;) {
+      uint8_t tag;
+      RETURN_IF_ERROR(PeekTag(&tag));
+      if (tag == kEndJSObject) {
+        offset_++;
+        break;
+      }
+      std::string name;
+      RETURN_IF_ERROR(ReadPropertyName(&name));
+      Value property_value;
+      bool omitted;
+      RETURN_IF_ERROR(ReadValue(&property_value, &omitted, depth + 1));
+      properties++;
+      if (!omitted) {
+        // JSON.stringify() skips properties that cannot be serialized.
+        fields[name] = std::move(property_value);
+      }
+    }
+    return ReadCount(properties);
+  }
+
+  absl::Status ReadDenseArray(ListValue* message, int depth) {
+    uint64_t length;
+    if (!ReadVarint(&length) || length > data_.size() - offset_) {
+      return Malformed("Invalid array length.");
+    }
+    message->mutable_values()->Reserve(length);
+    for (uint64_t index = 0; index < length; index++) {
+      uint8_t tag;
+      RETURN_IF_ERROR(PeekTag(&tag));
+      Value* element = message->add_values();
+      if (tag == kTheHole) {
+        offset_++;
+        // JSON.stringify() prints holes and non-serializable elements as
+        // null.
+        element->set_null_value(google::protobuf::NULL_VALUE);
+        continue;
+      }
+      bool omitted;
+      RETURN_IF_ERROR(ReadValue(element, &omitted, depth + 1));
+      if (omitted) {
+        element->set_null_value(google::protobuf::NULL_VALUE);
+      }
+    }
+    // Properties other than the elements are left out by JSON.stringify().
+    uint64_t properties = 0;
+    RETURN_IF_ERROR(SkipProperties(kEndDenseJSArray, depth, &properties));
+    RETURN_IF_ERROR(ReadCount(properties));
+    return ReadCount(length);
+  }
+
+  absl::Status ReadSparseArray(ListValue* message, int depth) {
+    uint64_t length;
+    if (!ReadVarint(&length)) {
+      return Malformed("Invalid array length.");
+    }
+    // Holes are read as nulls.
+    RETURN_IF_ERROR(Expand(length));
+    message->mutable_values()->Reserve(length);
+    for (uint64_t index = 0; index < length; index++) {
+      message->add_values()->set_null_value(google::protobuf::NULL_VALUE);
+    }
+    uint64_t properties = 0;
+    for (;;) {
+      uint8_t tag;
+      RETURN_IF_ERROR(PeekTag(&tag));
+      if (tag == kEndSparseJSArray) {
+        offset_++;
+        break;
+      }
+      double index = -1;
+      if (tag == kInt32 || tag == kUint32 || tag == kDouble) {
+        offset_++;
+        RETURN_IF_ERROR(ReadNumber(tag, &index));
+      } else {
+        std::string name;
+        RETURN_IF_ERROR(ReadPropertyName(&name));
+      }
+      Value element;
+      bool omitted;
+      RETURN_IF_ERROR(ReadValue(&element, &omitted, depth + 1));
+      properties++;
+      if (!omitted && index >= 0 && index < length &&
+          index == std::floor(index)) {
+        *message->mutable_values(static_cast<int>(index)) = std::move(element);
+      }
+    }
+    RETURN_IF_ERROR(ReadCount(properties));
+    return ReadCount(length);
+  }
+
+  // Reads an object read before again, as JSON.stringify() prints each
+  // reference to the same object in full.
+  absl::Status ReadReference(Value* value, bool* omitted, int depth) {
+    uint64_t id;
+    if (!ReadVarint(&id) || id >= objects_.size()) {
+      return Malformed("Invalid object reference.");
+    }
+    const ObjectRange object = objects_[id];
+    if (object.end == 0) {
+      return absl::FailedPreconditionError(
+          "Cyclic values are not supported.");
+    }
+    const size_t offset = offset_;
+    // The objects within the range keep the IDs they were read under.
+    replaying_++;
+    offset_ = object.begin;
+    absl::Status status = ReadValue(value, omitted, depth);
+    replaying_--;
+    offset_ = offset;
+    return status;
+  }
+
+  // Assigns the next ID to the object starting at `begin`, and returns it,
+  // unless the object is being read again.
+  size_t BeginObject(size_t begin) {
+    if (replaying_ > 0) {
+      return kReplayedObject;
+    }
+    objects_.push_back({.begin = begin, .end = 0});
+    return objects_.size() - 1;
+  }
+
+  // Skips the properties of an array up to `end_tag`, counting them.
+  absl::Status SkipProperties(uint8_t end_tag, int depth,
+                              uint64_t* properties) {
+    for (;;) {
+      uint8_t tag;
+      RETURN_IF_ERROR(PeekTag(&tag));
+      if (tag == end_tag) {
+        offset_++;
+        return absl::OkStatus();
+      }
+      Value ignored;
+      bool omitted;
+      RETURN_IF_ERROR(ReadValue(&ignored, &omitted, depth + 1));
+      RETURN_IF_ERROR(ReadValue(&ignored, &omitted, depth + 1));
+      (*properties)++;
+    }
+  }
+
+  // Reads a property key, which V8 writes as a number for array indices.
+  absl::Status ReadPropertyName(std::string* name) {
+    uint8_t tag;
+    RETURN_IF_ERROR(ReadTag(&tag));
+    switch (tag) {
+      case kUtf8String:
+      case kOneByteString:
+      case kTwoByteString:
+        return ReadString(tag, name);
+      case kInt32:
+      case kUint32:
+      case kDouble: {
+        double number;
+        RETURN_IF_ERROR(ReadNumber(tag, &number));
+        if (number < 0 || number > std::numeric_limits<uint32_t>::max() ||
+            number != std::floor(number)) {
+          return Malformed("Invalid property key.");
+        }
+        *name = absl::StrCat(static_cast<uint32_t>(number));
+        return absl::OkStatus();
+      }
+      default:
+        return Malformed("Invalid property key.");
+    }
+  }
+
+  absl::Status ReadNumber(uint8_t tag, double* number) {
+    uint64_t varint;
+    switch (tag) {
+      case kInt32:
+      case kUint32: {
+        if (!ReadVarint(&varint) ||
+            varint > std::numeric_limits<uint32_t>::max()) {
+          return Malformed("Invalid integer.");
+        }
+        const uint32_t unsigned_value = static_cast<uint32_t>(varint);
+        if (tag == kUint32) {
+          *number = unsigned_value;
+        } else {
+          // Zigzag decoding.
+          *number = static_cast<int32_t>((unsigned_value >> 1) ^
+                                         -(unsigned_value & 1));
+        }
+        return absl::OkStatus();
+      }
+      default:
+        if (data_.size() - offset_ < sizeof(*number)) {
+          return Malformed("Truncated number.");
+        }
+        std::memcpy(number, data_.data() + offset_, sizeof(*number));
+        offset_ += sizeof(*number);
+        return absl::OkStatus();
+    }
+  }
+
+  static void SetNumber(double number, Value* value) {
+    if (std::isfinite(number)) {
+      // JSON.stringify() prints negative zero as 0.
+      value->set_number_value(number == 0 ? 0 : number);
+    } else {
+      // JSON.stringify() prints non-finite numbers as null.
+      value->set_null_value(google::protobuf::NULL_VALUE);
+    }
+  }
+
+  // Reads a string with the given tag into `value` as UTF-8.
+  absl::Status ReadString(uint8_t tag, std::string* value) {
+    uint64_t size;
+    if (!ReadVarint(&size) || size > data_.size() - offset_) {
+      return Malformed("Truncated string.");
+    }
+    // Strings read again through references count each time.
+    RETURN_IF_ERROR(Expand(size));
+    const absl::string_view bytes = data_.substr(offset_, size);
+    offset_ += size;
+    value->clear();
+    switch (tag) {
+      case kUtf8String:
+        value->assign(bytes.data(), bytes.size());
+        return absl::OkStatus();
+      case kOneByteString:
+        // Latin-1.
+        value->reserve(bytes.size());
+        for (const char c : bytes) {
+          AppendUtf8(static_cast<uint8_t>(c), value);
+        }
+        return absl::OkStatus();
+      case kTwoByteString:
+        if (size % 2 != 0) {
+          return Malformed("Invalid two-byte string.");
+        }
+        value->reserve(bytes.size());
+        for (size_t i = 0; i < bytes.size(); i += 2) {
+          uint32_t code_point = ReadUtf16Unit(bytes, i);
+          if (code_point >= 0xD800 && code_point < 0xDC00 &&
+              i + 2 < bytes.size()) {
+            const uint32_t low = ReadUtf16Unit(bytes, i + 2);
+            if (low >= 0xDC00 && low < 0xE000) {
+              code_point = 0x10000 + ((code_point - 0xD800) << 10) +
+                           (low - 0xDC00);
+              i += 2;
+            }
+          }
+          if (code_point >= 0xD800 && code_point < 0xE000) {
+            // Lone surrogates have no UTF-8 representation.
+            code_point = 0xFFFD;
+          }
+          AppendUtf8(code_point, value);
+        }
+        return absl::OkStatus();
+      default:
+        return Malformed("Expected a string.");
+    }
+  }
+
+  static uint32_t ReadUtf16Unit(absl::string_view bytes, size_t offset) {
+    // Two-byte strings are written in the byte order of the host.
+    uint16_t unit;
+    std::memcpy(&unit, bytes.data() + offset, sizeof(unit));
+    return unit;
+  }
+
+  static void AppendUtf8(uint32_t code_point, std::string* output) {
+    if (code_point < 0x80) {
+      output->push_back(static_cast<char>(code_point));
+    } else if (code_point < 0x800) {
+      output->push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+      output->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    } else if (code_point < 0x10000) {
+      output->push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+      output->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+      output->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    } else {
+      output->push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+      output->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+      output->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+      output->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    }
+  }
+
+  // Reads a count ending an object or an array, which must match `expected`.
+  absl::Status ReadCount(uint64_t expected) {
+    uint64_t count;
+    if (!ReadVarint(&count) || count != expected) {
+      return Malformed("Mismatched property count.");
+    }
+    return absl::OkStatus();
+  }
+
+  // Reads the next tag, skipping the padding that V8 inserts to align
+  // two-byte strings.
+  absl::Status ReadTag(uint8_t* tag) {
+    RETURN_IF_ERROR(PeekTag(tag));
+    offset_++;
+    return absl::OkStatus();
+  }
+
+  absl::Status PeekTag(uint8_t* tag) {
+    while (offset_ < data_.size() && (data_[offset_] == kPadding ||
+                                      data_[offset_] == kVerifyObjectCount)) {
+      if (data_[offset_++] == kVerifyObjectCount) {
+        uint64_t ignored;
+        if (!ReadVarint(&ignored)) {
+          return Malformed("Truncated value.");
+        }
+      }
+    }
+    if (offset_ >= data_.size()) {
+      return Malformed("Truncated value.");
+    }
+    *tag = static_cast<uint8_t>(data_[offset_]);
+    return absl::OkStatus();
+  }
+
+  bool ReadByte(uint8_t* byte) {
+    if (offset_ >= data_.size()) {
+      return false;
+    }
+    *byte = static_cast<uint8_t>(data_[offset_++]);
+    return true;
+  }
+
+  bool ReadVarint(uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte;
+      if (!ReadByte(&byte)) {
+        return false;
+      }
+      *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Accounts for `size` more bytes of the value read, failing past the
+  // expansion limit.
+  absl::Status Expand(uint64_t size) {
+    if (size > kMaxExpansion * (data_.size() + 1) - size_read_) {
+      return absl::FailedPreconditionError("Value too large.");
+    }
+    size_read_ += size;
+    return absl::OkStatus();
+  }
+
+  static absl::Status Malformed(absl::string_view message) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("Malformed serialized function output: ", message));
+  }
+
+  const absl::string_view data_;
+  size_t offset_ = 0;
+  size_t size_read_ = 0;
+  // Objects by ID, in the order of their beginnings.
+  std::vector<ObjectRange> objects_;
+  // Depth of the references being read again.
+  int replaying_ = 0;
+};
+
+const FieldDescriptor* FindField(const Descriptor* descriptor,
+                                 absl::string_view name) {
+  for (int field_index = 0; field_index < descriptor->field_count();
+       field_index++) {
+    const FieldDescriptor* field = descriptor->field(field_index);
+    if (field->json_name() == name || field->name() == name) {
+      return field;
+    }
+  }
+  return nullptr;
+}
+
+// Reads `value` into `message` for the usual shapes of outputs, i.e. singular
+// double, string, bool and message fields, `Struct`, `Value` and `ListValue`,
+// the way `V8ValueToProto()` does. Returns a kUnimplemented error for anything
+// else, leaving it to the JSON parser.
+absl::Status ValueToMessage(const Value& value, Message* message) {
+  const Descriptor* descriptor = message->GetDescriptor();
+  if (descriptor == Value::descriptor()) {
+    *static_cast<Value*>(message) = value;
+    return absl::OkStatus();
+  }
+  if (descriptor == Struct::descriptor()) {
+    if (value.kind_case() != Value::kStructValue) {
+      return absl::UnimplementedError("Expected an object.");
+    }
+    *static_cast<Struct*>(message) = value.struct_value();
+    return absl::OkStatus();
+  }
+  if (descriptor == ListValue::descriptor()) {
+    if (value.kind_case() != Value::kListValue) {
+      return absl::UnimplementedError("Expected an array.");
+    }
+    *static_cast<ListValue*>(message) = value.list_value();
+    return absl::OkStatus();
+  }
+  if (descriptor->file()->package() == kWellKnownTypesPackage ||
+      value.kind_case() != Value::kStructValue) {
+    return absl::UnimplementedError("Expected a plain object.");
+  }
+  const Reflection* reflection = message->GetReflection();
+  for (const auto& [name, property_value] : value.struct_value().fields()) {
+    const FieldDescriptor* field = FindField(descriptor, name);
+    if (field == nullptr) {
+      return absl::UnimplementedError(absl::StrCat("Unknown field: ", name));
+    }
+    if (field->is_repeated()) {
+      return absl::UnimplementedError("Repeated fields are not supported.");
+    }
+    switch (field->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_DOUBLE:
+        if (property_value.kind_case() != Value::kNumberValue) {
+          return absl::UnimplementedError("Expected a number.");
+        }
+        reflection->SetDouble(message, field, property_value.number_value());
+        break;
+      case FieldDescriptor::CPPTYPE_BOOL:
+        if (property_value.kind_case() != Value::kBoolValue) {
+          return absl::UnimplementedError("Expected a boolean.");
+        }
+        reflection->SetBool(message, field, property_value.bool_value());
+        break;
+      case FieldDescriptor::CPPTYPE_STRING:
+        if (property_value.kind_case() != Value::kStringValue ||
+            field->type() == FieldDescriptor::TYPE_BYTES) {
+          return absl::UnimplementedError("Expected a string.");
+        }
+        reflection->SetString(message, field, property_value.string_value());
+        break;
+      case FieldDescriptor::CPPTYPE_MESSAGE:
+        if (property_value.kind_case() == Value::kNullValue) {
+          return absl::UnimplementedError("Unexpected null.");
+        }
+        RETURN_IF_ERROR(ValueToMessage(
+            property_value, reflection->MutableMessage(message, field)));
+        break;
+      default:
+        return absl::UnimplementedError(
+            absl::StrCat("Unsupported field type: ", field->type_name()));
+    }
+  }
+  return absl::OkStatus();
+}
+}  // namespace
+
+absl::StatusOr<std::string> MessageToV8WireFormat(const Message& message) {
+  std::string serialized;
+  absl::Status status = MessageWriter(&serialized).Write(message);
+  if (status.code() != absl::StatusCode::kUnimplemented) {
+    RETURN_IF_ERROR(status);
+    return serialized;
+  }
+  // Serialize what JSON.parse() returns for messages whose JSON representation
+  // is not mirrored, by way of a `Value` parsed from the same JSON.
+  std::string json_string;
+  Value value;
+  if (!MessageToJsonString(message, &json_string).ok() ||
+      !JsonStringToMessage(json_string, &value).ok()) {
+    return absl::InternalError("Unable to convert a bidding function input.");
+  }
+  serialized.clear();
+  MessageWriter writer(&serialized);
+  RETURN_IF_ERROR(writer.WriteValue(value));
+  return serialized;
+}
+
+absl::Status V8WireFormatToMessage(absl::string_view data, Message* message) {
+  Value value;
+  RETURN_IF_ERROR(ValueReader(data).Read(&value));
+  if (ValueToMessage(value, message).ok()) {
+    return absl::OkStatus();
+  }
+  message->Clear();
+  std::string json_string;
+  if (!MessageToJsonString(value, &json_string).ok()) {
+    return absl::InternalError("Unable to print the function output as JSON.");
+  }
+  const google::protobuf::util::Status conversion_status =
+      JsonStringToMessage(json_string, message);
+  if (!conversion_status.ok()) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Unable to convert the bidding function output from JSON: ",
+        conversion_status.message().ToString()));
+  }
+  return absl::OkStatus();
+}
+}  // namespace function
+}  // namespace aviary
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FUNCTION_V8_WIRE_FORMAT_H_
+#define FUNCTION_V8_WIRE_FORMAT_H_
+
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "google/protobuf/message.h"
+
+namespace aviary {
+namespace function {
+// Conversions between messages and the wire format of V8's `ValueSerializer`,
+// which lets the host hand function arguments to a sandboxee and get results
+// back without either side going through JSON, and without the sandboxee
+// walking messages by reflection: `v8::ValueDeserializer` builds the values
+// straight into the isolate.
+//
+// Neither conversion depends on V8, so that the host does not link it.
+
+// Serializes the value that `JSON.parse()` returns for the proto3 JSON
+// representation of `message`, i.e. the value that `ProtoToV8Value()` builds.
+absl::StatusOr<std::string> MessageToV8WireFormat(
+    const google::protobuf::Message& message);
+
+// Reads the value serialized in `data` by `v8::ValueSerializer` into `message`
+// the same way `JsonStringToMessage()` parses `JSON.stringify()` of the value.
+//
+// Values that the structured clone algorithm and JSON treat differently, such
+// as dates, maps, sets, array buffers, regular expressions and errors, are
+// rejected with a kFailedPrecondition error, as are malformed values. Objects
+// inheriting a `toJSON()` method are read from their own properties, which is
+// all the serializer writes of them.
+absl::Status V8WireFormatToMessage(absl::string_view data,
+                                   google::protobuf::Message* message);
+}  // namespace function
+}  // namespace aviary
+
+#endif  // FUNCTION_V8_WIRE_FORMAT_H_
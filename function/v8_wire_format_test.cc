@@ -0,0 +1,433 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/v8_wire_format.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "google/protobuf/struct.pb.h"
+#include "google/protobuf/util/json_util.h"
+#include "google/protobuf/util/message_differencer.h"
+#include "gtest/gtest.h"
+#include "proto/bidding_function.pb.h"
+#include "util/parse_proto.h"
+#include "v8.h"
+#include "v8/v8_platform_initializer.h"
+
+namespace aviary {
+namespace function {
+namespace {
+
+using ::aviary::util::ParseTextOrDie;
+using ::aviary::v8::V8PlatformInitializer;
+using ::google::protobuf::Message;
+using ::google::protobuf::Struct;
+using ::google::protobuf::util::MessageDifferencer;
+using ::google::protobuf::util::MessageToJsonString;
+using ::std::string_literals::operator""s;
+
+// Returns `data` written in the format, after the version header.
+std::string Serialized(absl::string_view data) {
+  return std::string("\xFF\x0D", 2) + std::string(data);
+}
+
+// Returns the bytes of `value`, as V8 writes doubles.
+std::string DoubleBytes(double value) {
+  std::string bytes(sizeof(value), '\0');
+  std::memcpy(&bytes[0], &value, sizeof(value));
+  return bytes;
+}
+
+std::string Double(double value) { return "N" + DoubleBytes(value); }
+
+TEST(V8WireFormatTest, WritesMessageAsObject) {
+  absl::StatusOr<std::string> serialized =
+      MessageToV8WireFormat(ParseTextOrDie<BiddingFunctionOutput>(R"pb(
+        bid: 1.5
+        render_url: "ad"
+      )pb"));
+  ASSERT_TRUE(serialized.ok()) << serialized.status();
+  EXPECT_EQ(*serialized, Serialized("oS\x03" "bid" + Double(1.5) +
+                                    "S\x09" "renderUrl" "S\x02" "ad" "{\x02"));
+}
+
+TEST(V8WireFormatTest, ReadsOutput) {
+  const BiddingFunctionOutput expected =
+      ParseTextOrDie<BiddingFunctionOutput>(R"pb(
+        ad {
+          fields {
+            key: "list"
+            value {
+              list_value {
+                values { number_value: 1 }
+                values { string_value: "two" }
+                values { null_value: NULL_VALUE }
+              }
+            }
+          }
+        }
+        bid: 2
+        render_url: "https://dsp.example/ad"
+      )pb");
+  absl::StatusOr<std::string> serialized = MessageToV8WireFormat(expected);
+  ASSERT_TRUE(serialized.ok()) << serialized.status();
+  BiddingFunctionOutput output;
+  ASSERT_TRUE(V8WireFormatToMessage(*serialized, &output).ok());
+  EXPECT_TRUE(MessageDifferencer::Equals(output, expected))
+      << output.DebugString();
+}
+
+TEST(V8WireFormatTest, ReadsValuesAsJsonPrintsThem) {
+  // {"a": undefined, "b": [1, <hole>, undefined, NaN], "c": "é", "d": "€",
+  //  "0": new Number(-0), "e": <the array of "b">}
+  const std::string serialized = Serialized(
+      "o\"\x01" "a_"
+      "\"\x01" "bA\x04" "I\x02" "-_"s + Double(std::nan("")) + "$\x00\x04"
+      "\"\x01" "c\"\x01" "\xE9"
+      "\"\x01" "d\x00" "c\x02" "\xAC\x20"
+      "I\x00" "n"s + DoubleBytes(-0.0) +
+      "\"\x01" "e^\x01"
+      "{\x06"s);
+  google::protobuf::Value value;
+  ASSERT_TRUE(V8WireFormatToMessage(serialized, &value).ok());
+  EXPECT_TRUE(MessageDifferencer::Equals(
+      value, ParseTextOrDie<google::protobuf::Value>(R"pb(
+        struct_value {
+          fields {
+            key: "b"
+            value {
+              list_value {
+                values { number_value: 1 }
+                values { null_value: NULL_VALUE }
+                values { null_value: NULL_VALUE }
+                values { null_value: NULL_VALUE }
+              }
+            }
+          }
+          fields {
+            key: "c"
+            value { string_value: "é" }
+          }
+          fields {
+            key: "d"
+            value { string_value: "€" }
+          }
+          fields {
+            key: "0"
+            value { number_value: 0 }
+          }
+          fields {
+            key: "e"
+            value {
+              list_value {
+                values { number_value: 1 }
+                values { null_value: NULL_VALUE }
+                values { null_value: NULL_VALUE }
+                values { null_value: NULL_VALUE }
+              }
+            }
+          }
+        }
+      )pb")))
+      << value.DebugString();
+}
+
+TEST(V8WireFormatTest, ReadsSparseArrays) {
+  // [, "x"] with a length of 3, and a property that JSON leaves out.
+  const std::string serialized =
+      Serialized("a\x03" "I\x02" "\"\x01" "x" "\"\x01" "pT" "@\x02\x03");
+  google::protobuf::ListValue list;
+  ASSERT_TRUE(V8WireFormatToMessage(serialized, &list).ok());
+  EXPECT_TRUE(MessageDifferencer::Equals(
+      list, ParseTextOrDie<google::protobuf::ListValue>(R"pb(
+        values { null_value: NULL_VALUE }
+        values { string_value: "x" }
+        values { null_value: NULL_VALUE }
+      )pb")))
+      << list.DebugString();
+}
+
+TEST(V8WireFormatTest, FallsBackToJsonParser) {
+  // A bid printed as a string, which only the JSON parser accepts.
+  const std::string serialized =
+      Serialized("o\"\x03" "bid\"\x03" "1.5{\x01");
+  BiddingFunctionOutput output;
+  ASSERT_TRUE(V8WireFormatToMessage(serialized, &output).ok());
+  EXPECT_EQ(output.bid(), 1.5);
+}
+
+TEST(V8WireFormatTest, RejectsValuesWithoutJsonRepresentation) {
+  BiddingFunctionOutput output;
+  // A date.
+  EXPECT_EQ(V8WireFormatToMessage(Serialized("D" + Double(0)), &output).code(),
+            absl::StatusCode::kFailedPrecondition);
+  // undefined.
+  EXPECT_EQ(V8WireFormatToMessage(Serialized("_"), &output).code(),
+            absl::StatusCode::kFailedPrecondition);
+  // An object holding itself.
+  EXPECT_EQ(
+      V8WireFormatToMessage(Serialized("o\"\x01" "a^\x00{\x01"s), &output)
+          .code(),
+      absl::StatusCode::kFailedPrecondition);
+  // An unknown field.
+  EXPECT_EQ(V8WireFormatToMessage(Serialized("o\"\x01" "aT{\x01"), &output)
+                .code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(V8WireFormatTest, RejectsValuesExpandingTooFar) {
+  // An array referencing the same object, with a long string, many times.
+  std::string references;
+  for (int i = 0; i < 100; i++) {
+    references += "^\x01";
+  }
+  const std::string serialized = Serialized(
+      "A\x65" "o\"\x01" "a\"\x64" + std::string(100, 'x') + "{\x01" +
+      references + "$\x00\x65"s);
+  google::protobuf::ListValue list;
+  EXPECT_EQ(V8WireFormatToMessage(serialized, &list).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(V8WireFormatTest, RejectsMalformedValues) {
+  BiddingFunctionOutput output;
+  for (const std::string& malformed :
+       {""s, "o{\x00"s, Serialized("o"), Serialized("o\"\x05" "bid"),
+       Serialized("o{\x01"), Serialized("A\x7F"), Serialized("^\x00"s)}) {
+    EXPECT_EQ(V8WireFormatToMessage(malformed, &output).code(),
+              absl::StatusCode::kFailedPrecondition)
+        << malformed;
+  }
+}
+
+// Checks the compatibility of the conversions with V8 itself.
+class V8WireFormatCompatibilityTest : public ::testing::Test {
+ protected:
+  V8WireFormatCompatibilityTest()
+      : allocator_(::v8::ArrayBuffer::Allocator::NewDefaultAllocator()) {
+    ::v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = allocator_.get();
+    isolate_ = ::v8::Isolate::New(create_params);
+  }
+
+  ~V8WireFormatCompatibilityTest() override { isolate_->Dispose(); }
+
+  // Expects V8 to deserialize `message` into the same value as `JSON.parse()`
+  // of its JSON representation, comparing them through `JSON.stringify()`.
+  void ExpectSameAsJson(const Message& message) {
+    std::string json_string;
+    ASSERT_TRUE(MessageToJsonString(message, &json_string).ok());
+    absl::StatusOr<std::string> serialized = MessageToV8WireFormat(message);
+    ASSERT_TRUE(serialized.ok()) << serialized.status();
+
+    ::v8::Isolate::Scope isolate_scope(isolate_);
+    ::v8::HandleScope handle_scope(isolate_);
+    ::v8::Local<::v8::Context> context = ::v8::Context::New(isolate_);
+    ::v8::Context::Scope context_scope(context);
+    ::v8::ValueDeserializer deserializer(
+        isolate_, reinterpret_cast<const uint8_t*>(serialized->data()),
+        serialized->size());
+    ASSERT_TRUE(deserializer.ReadHeader(context).FromMaybe(false));
+    ::v8::Local<::v8::Value> deserialized;
+    ASSERT_TRUE(deserializer.ReadValue(context).ToLocal(&deserialized));
+    ::v8::Local<::v8::Value> parsed =
+        ::v8::JSON::Parse(context, NewString(json_string)).ToLocalChecked();
+    EXPECT_EQ(Stringify(context, deserialized), Stringify(context, parsed));
+  }
+
+  // Serializes the result of `script` with V8, and reads it into a message of
+  // type T.
+  template <typename T>
+  absl::StatusOr<T> EvaluateToProto(absl::string_view script) {
+    ::v8::Isolate::Scope isolate_scope(isolate_);
+    ::v8::HandleScope handle_scope(isolate_);
+    ::v8::Local<::v8::Context> context = ::v8::Context::New(isolate_);
+    ::v8::Context::Scope context_scope(context);
+    ::v8::Local<::v8::Value> value =
+        ::v8::Script::Compile(context, NewString(script))
+            .ToLocalChecked()
+            ->Run(context)
+            .ToLocalChecked();
+    ::v8::ValueSerializer serializer(isolate_);
+    serializer.WriteHeader();
+    if (!serializer.WriteValue(context, value).FromMaybe(false)) {
+      return absl::InvalidArgumentError("Unable to serialize the value.");
+    }
+    std::pair<uint8_t*, size_t> buffer = serializer.Release();
+    const std::string serialized(reinterpret_cast<char*>(buffer.first),
+                                 buffer.second);
+    std::free(buffer.first);
+    T message;
+    absl::Status status = V8WireFormatToMessage(serialized, &message);
+    if (!status.ok()) {
+      return status;
+    }
+    return message;
+  }
+
+  ::v8::Local<::v8::String> NewString(absl::string_view value) {
+    return ::v8::String::NewFromUtf8(isolate_, value.data(),
+                                     ::v8::NewStringType::kNormal,
+                                     static_cast<int>(value.size()))
+        .ToLocalChecked();
+  }
+
+  std::string Stringify(::v8::Local<::v8::Context> context,
+                        ::v8::Local<::v8::Value> value) {
+    return *::v8::String::Utf8Value(
+        isolate_, ::v8::JSON::Stringify(context, value).ToLocalChecked());
+  }
+
+  V8PlatformInitializer v8_platform_initializer_;
+  std::unique_ptr<::v8::ArrayBuffer::Allocator> allocator_;
+  ::v8::Isolate* isolate_;
+};
+
+TEST_F(V8WireFormatCompatibilityTest, WritesBiddingFunctionInput) {
+  ExpectSameAsJson(ParseTextOrDie<BiddingFunctionInput>(R"pb(
+    interest_group {
+      owner: "dsp.example"
+      name: "shoes"
+      ads {
+        render_url: "https://dsp.example/shoes"
+        ad_metadata {
+          fields {
+            key: "size"
+            value { number_value: 42 }
+          }
+          fields {
+            key: "city"
+            value { string_value: "Zürich" }
+          }
+        }
+      }
+      ads { render_url: "https://dsp.example/boots" }
+      trusted_bidding_signals_keys: [ "first", "second" ]
+      user_bidding_signals {}
+    }
+    per_buyer_signals {
+      fields {
+        key: "foo"
+        value { list_value { values { bool_value: true } } }
+      }
+    }
+    trusted_bidding_signals {
+      key: "first"
+      value { null_value: NULL_VALUE }
+    }
+  )pb"));
+}
+
+TEST_F(V8WireFormatCompatibilityTest, WritesAdScoringFunctionInput) {
+  ExpectSameAsJson(ParseTextOrDie<AdScoringFunctionInput>(R"pb(
+    bid: 2.5
+    auction_config {
+      seller: "ssp.example"
+      interest_group_buyers: [ "dsp.example" ]
+      additional_bids {}
+      per_buyer_signals {
+        key: "dsp.example"
+        value {
+          fields {
+            key: "foo"
+            value { number_value: -0.5 }
+          }
+        }
+      }
+    }
+  )pb"));
+}
+
+TEST_F(V8WireFormatCompatibilityTest, ReadsSerializedValues) {
+  absl::StatusOr<BiddingFunctionOutput> output =
+      EvaluateToProto<BiddingFunctionOutput>(R"js(
+        const shared = {nested: ['€', 1, , undefined, new String('boxed')]};
+        const sparse = [];
+        sparse[3] = true;
+        ({ad: {first: shared, second: shared, sparse, skipped: undefined},
+          bid: 1.5, renderUrl: 'https://dsp.example/ad'})
+      )js");
+  ASSERT_TRUE(output.ok()) << output.status();
+  EXPECT_TRUE(MessageDifferencer::Equals(
+      *output, ParseTextOrDie<BiddingFunctionOutput>(R"pb(
+        ad {
+          fields {
+            key: "first"
+            value {
+              struct_value {
+                fields {
+                  key: "nested"
+                  value {
+                    list_value {
+                      values { string_value: "€" }
+                      values { number_value: 1 }
+                      values { null_value: NULL_VALUE }
+                      values { null_value: NULL_VALUE }
+                      values { string_value: "boxed" }
+                    }
+                  }
+                }
+              }
+            }
+          }
+          fields {
+            key: "second"
+            value {
+              struct_value {
+                fields {
+                  key: "nested"
+                  value {
+                    list_value {
+                      values { string_value: "€" }
+                      values { number_value: 1 }
+                      values { null_value: NULL_VALUE }
+                      values { null_value: NULL_VALUE }
+                      values { string_value: "boxed" }
+                    }
+                  }
+                }
+              }
+            }
+          }
+          fields {
+            key: "sparse"
+            value {
+              list_value {
+                values { null_value: NULL_VALUE }
+                values { null_value: NULL_VALUE }
+                values { null_value: NULL_VALUE }
+                values { bool_value: true }
+              }
+            }
+          }
+        }
+        bid: 1.5
+        render_url: "https://dsp.example/ad"
+      )pb")))
+      << output->DebugString();
+}
+
+TEST_F(V8WireFormatCompatibilityTest, RejectsDates) {
+  EXPECT_EQ(EvaluateToProto<Struct>("({date: new Date(0)})").status().code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+}  // namespace
+}  // namespace function
+}  // namespace aviary
@@ -0,0 +1,557 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/value_conversion.h"
+
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "google/protobuf/descriptor.h"
+#include "google/protobuf/struct.pb.h"
+#include "util/status_macros.h"
+
+namespace aviary {
+namespace function {
+namespace {
+
+using ::google::protobuf::Descriptor;
+using ::google::protobuf::FieldDescriptor;
+using ::google::protobuf::ListValue;
+using ::google::protobuf::Message;
+using ::google::protobuf::Reflection;
+using ::google::protobuf::Struct;
+using ::google::protobuf::Value;
+
+constexpr absl::string_view kWellKnownTypesPackage = "google.protobuf";
+constexpr absl::string_view kNullValueEnumName = "google.protobuf.NullValue";
+
+// Builds V8 values for a single conversion. Objects get the same prototype as
+// those created by `JSON.parse()`, and property names are internalized the same
+// way.
+class ProtoToV8Converter {
+ public:
+  explicit ProtoToV8Converter(v8::Local<v8::Context> context)
+      : isolate_(context->GetIsolate()),
+        object_prototype_(v8::Object::New(isolate_)->GetPrototype()) {}
+
+  absl::StatusOr<v8::Local<v8::Value>> Convert(const Message& message) {
+    const Descriptor* descriptor = message.GetDescriptor();
+    if (descriptor == Struct::descriptor()) {
+      return ConvertStruct(static_cast<const Struct&>(message));
+    }
+    if (descriptor == Value::descriptor()) {
+      return ConvertValue(static_cast<const Value&>(message));
+    }
+    if (descriptor == ListValue::descriptor()) {
+      return ConvertListValue(static_cast<const ListValue&>(message));
+    }
+    if (descriptor->file()->package() == kWellKnownTypesPackage) {
+      return absl::UnimplementedError(
+          absl::StrCat("Unsupported message type: ", descriptor->full_name()));
+    }
+    return ConvertMessage(message);
+  }
+
+ private:
+  absl::StatusOr<v8::Local<v8::Value>> ConvertStruct(const Struct& message) {
+    std::vector<v8::Local<v8::Name>> names;
+    std::vector<v8::Local<v8::Value>> values;
+    names.reserve(message.fields_size());
+    values.reserve(message.fields_size());
+    for (const auto& [name, value] : message.fields()) {
+      ASSIGN_OR_RETURN(auto converted_name, NewName(name));
+      ASSIGN_OR_RETURN(auto converted_value, ConvertValue(value));
+      names.push_back(converted_name);
+      values.push_back(converted_value);
+    }
+    return NewObject(&names, &values);
+  }
+
+  absl::StatusOr<v8::Local<v8::Value>> ConvertValue(const Value& message) {
+    switch (message.kind_case()) {
+      case Value::kNullValue:
+        return v8::Null(isolate_);
+      case Value::kNumberValue:
+        return NewNumber(message.number_value());
+      case Value::kStringValue:
+        return NewString(message.string_value());
+      case Value::kBoolValue:
+        return v8::Boolean::New(isolate_, message.bool_value());
+      case Value::kStructValue:
+        return ConvertStruct(message.struct_value());
+      case Value::kListValue:
+        return ConvertListValue(message.list_value());
+      default:
+        return absl::UnimplementedError("Value without a kind.");
+    }
+  }
+
+  absl::StatusOr<v8::Local<v8::Value>> ConvertListValue(
+      const ListValue& message) {
+    std::vector<v8::Local<v8::Value>> elements;
+    elements.reserve(message.values_size());
+    for (const Value& value : message.values()) {
+      ASSIGN_OR_RETURN(auto converted_value, ConvertValue(value));
+      elements.push_back(converted_value);
+    }
+    return v8::Array::New(isolate_, elements.data(), elements.size());
+  }
+
+  absl::StatusOr<v8::Local<v8::Value>> ConvertMessage(const Message& message) {
+    const Reflection* reflection = message.GetReflection();
+    // Lists the populated fields ordered by field number, which is what the
+    // JSON printer emits.
+    std::vector<const FieldDescriptor*> fields;
+    reflection->ListFields(message, &fields);
+    std::vector<v8::Local<v8::Name>> names;
+    std::vector<v8::Local<v8::Value>> values;
+    names.reserve(fields.size());
+    values.reserve(fields.size());
+    for (const FieldDescriptor* field : fields) {
+      if (field->is_extension()) {
+        return absl::UnimplementedError("Extensions are not supported.");
+      }
+      ASSIGN_OR_RETURN(auto converted_name, NewName(field->json_name()));
+      v8::Local<v8::Value> converted_value;
+      if (field->is_map()) {
+        ASSIGN_OR_RETURN(converted_value, ConvertMapField(message, field));
+      } else if (field->is_repeated()) {
+        std::vector<v8::Local<v8::Value>> elements;
+        const int size = reflection->FieldSize(message, field);
+        elements.reserve(size);
+        for (int index = 0; index < size; index++) {
+          ASSIGN_OR_RETURN(auto element,
+                           ConvertFieldValue(message, field, index));
+          elements.push_back(element);
+        }
+        converted_value =
+            v8::Array::New(isolate_, elements.data(), elements.size());
+      } else {
+        ASSIGN_OR_RETURN(converted_value,
+                         ConvertFieldValue(message, field, /*index=*/-1));
+      }
+      names.push_back(converted_name);
+      values.push_back(converted_value);
+    }
+    return NewObject(&names, &values);
+  }
+
+  absl::StatusOr<v8::Local<v8::Value>> ConvertMapField(
+      const Message& message, const FieldDescriptor* field) {
+    const Reflection* reflection = message.GetReflection();
+    const FieldDescriptor* key_field = field->message_type()->map_key();
+    const FieldDescriptor* value_field = field->message_type()->map_value();
+    const int size = reflection->FieldSize(message, field);
+    std::vector<v8::Local<v8::Name>> names;
+    std::vector<v8::Local<v8::Value>> values;
+    names.reserve(size);
+    values.reserve(size);
+    for (int index = 0; index < size; index++) {
+      const Message& entry =
+          reflection->GetRepeatedMessage(message, field, index);
+      ASSIGN_OR_RETURN(auto converted_name,
+                       NewName(GetMapKey(entry, key_field)));
+      ASSIGN_OR_RETURN(auto converted_value,
+                       ConvertFieldValue(entry, value_field, /*index=*/-1));
+      names.push_back(converted_name);
+      values.push_back(converted_value);
+    }
+    return NewObject(&names, &values);
+  }
+
+  // Converts the value of a singular field if `index` is negative, or the
+  // element at `index` of a repeated field otherwise.
+  absl::StatusOr<v8::Local<v8::Value>> ConvertFieldValue(
+      const Message& message, const FieldDescriptor* field, int index) {
+    const Reflection* reflection = message.GetReflection();
+    const bool repeated = index >= 0;
+    switch (field->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_INT32:
+        return v8::Integer::New(
+            isolate_, repeated
+                          ? reflection->GetRepeatedInt32(message, field, index)
+                          : reflection->GetInt32(message, field));
+      case FieldDescriptor::CPPTYPE_UINT32:
+        return v8::Integer::NewFromUnsigned(
+            isolate_, repeated
+                          ? reflection->GetRepeatedUInt32(message, field, index)
+                          : reflection->GetUInt32(message, field));
+      case FieldDescriptor::CPPTYPE_INT64:
+        // 64-bit integers are printed as strings to avoid precision loss.
+        return NewString(absl::StrCat(
+            repeated ? reflection->GetRepeatedInt64(message, field, index)
+                     : reflection->GetInt64(message, field)));
+      case FieldDescriptor::CPPTYPE_UINT64:
+        return NewString(absl::StrCat(
+            repeated ? reflection->GetRepeatedUInt64(message, field, index)
+                     : reflection->GetUInt64(message, field)));
+      case FieldDescriptor::CPPTYPE_DOUBLE:
+        return NewNumber(repeated
+                             ? reflection->GetRepeatedDouble(message, field,
+                                                             index)
+                             : reflection->GetDouble(message, field));
+      case FieldDescriptor::CPPTYPE_FLOAT:
+        // The JSON printer rounds floats to their shortest representation,
+        // which is not worth mirroring here.
+        return absl::UnimplementedError("Float fields are not supported.");
+      case FieldDescriptor::CPPTYPE_BOOL:
+        return v8::Boolean::New(
+            isolate_, repeated
+                          ? reflection->GetRepeatedBool(message, field, index)
+                          : reflection->GetBool(message, field));
+      case FieldDescriptor::CPPTYPE_ENUM: {
+        if (field->enum_type()->full_name() == kNullValueEnumName) {
+          return v8::Null(isolate_);
+        }
+        const int number =
+            repeated ? reflection->GetRepeatedEnumValue(message, field, index)
+                     : reflection->GetEnumValue(message, field);
+        const auto* enum_value = field->enum_type()->FindValueByNumber(number);
+        if (enum_value == nullptr) {
+          return v8::Integer::New(isolate_, number);
+        }
+        return NewString(enum_value->name());
+      }
+      case FieldDescriptor::CPPTYPE_STRING: {
+        std::string scratch;
+        const std::string& value =
+            repeated ? reflection->GetRepeatedStringReference(message, field,
+                                                              index, &scratch)
+                     : reflection->GetStringReference(message, field, &scratch);
+        if (field->type() == FieldDescriptor::TYPE_BYTES) {
+          return NewString(absl::Base64Escape(value));
+        }
+        return NewString(value);
+      }
+      case FieldDescriptor::CPPTYPE_MESSAGE:
+        return Convert(repeated
+                           ? reflection->GetRepeatedMessage(message, field,
+                                                            index)
+                           : reflection->GetMessage(message, field));
+      default:
+        return absl::UnimplementedError(
+            absl::StrCat("Unsupported field type: ", field->type_name()));
+    }
+  }
+
+  static std::string GetMapKey(const Message& entry,
+                               const FieldDescriptor* key_field) {
+    const Reflection* reflection = entry.GetReflection();
+    switch (key_field->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_INT32:
+        return absl::StrCat(reflection->GetInt32(entry, key_field));
+      case FieldDescriptor::CPPTYPE_UINT32:
+        return absl::StrCat(reflection->GetUInt32(entry, key_field));
+      case FieldDescriptor::CPPTYPE_INT64:
+        return absl::StrCat(reflection->GetInt64(entry, key_field));
+      case FieldDescriptor::CPPTYPE_UINT64:
+        return absl::StrCat(reflection->GetUInt64(entry, key_field));
+      case FieldDescriptor::CPPTYPE_BOOL:
+        return reflection->GetBool(entry, key_field) ? "true" : "false";
+      default:
+        return reflection->GetString(entry, key_field);
+    }
+  }
+
+  absl::StatusOr<v8::Local<v8::Value>> NewNumber(double value) {
+    if (!std::isfinite(value)) {
+      // Non-finite numbers have no JSON representation.
+      return absl::UnimplementedError("Non-finite numbers are not supported.");
+    }
+    return v8::Number::New(isolate_, value);
+  }
+
+  absl::StatusOr<v8::Local<v8::Value>> NewString(absl::string_view value) {
+    v8::MaybeLocal<v8::String> string = v8::String::NewFromUtf8(
+        isolate_, value.data(), v8::NewStringType::kNormal,
+        static_cast<int>(value.size()));
+    if (string.IsEmpty()) {
+      return absl::InternalError("Unable to create a V8 string.");
+    }
+    return string.ToLocalChecked();
+  }
+
+  absl::StatusOr<v8::Local<v8::Name>> NewName(absl::string_view name) {
+    v8::MaybeLocal<v8::String> string = v8::String::NewFromUtf8(
+        isolate_, name.data(), v8::NewStringType::kInternalized,
+        static_cast<int>(name.size()));
+    if (string.IsEmpty()) {
+      return absl::InternalError("Unable to create a V8 property name.");
+    }
+    return string.ToLocalChecked();
+  }
+
+  v8::Local<v8::Value> NewObject(std::vector<v8::Local<v8::Name>>* names,
+                                 std::vector<v8::Local<v8::Value>>* values) {
+    return v8::Object::New(isolate_, object_prototype_, names->data(),
+                           values->data(), names->size());
+  }
+
+  v8::Isolate* isolate_;
+  v8::Local<v8::Value> object_prototype_;
+};
+
+// Reads V8 values into messages for a single conversion. Any value that would
+// not make the JSON round trip the same way is reported as kUnimplemented.
+class V8ToProtoConverter {
+ public:
+  explicit V8ToProtoConverter(v8::Local<v8::Context> context)
+      : context_(context),
+        isolate_(context->GetIsolate()),
+        object_prototype_(v8::Object::New(isolate_)->GetPrototype()) {}
+
+  absl::Status Convert(v8::Local<v8::Value> value, Message* message,
+                       int depth = 0) {
+    if (depth > kMaxDepth) {
+      // Also guards against cyclic objects, which JSON.stringify() rejects.
+      return absl::UnimplementedError("Value nested too deeply.");
+    }
+    const Descriptor* descriptor = message->GetDescriptor();
+    if (descriptor == Struct::descriptor()) {
+      return ConvertStruct(value, static_cast<Struct*>(message), depth);
+    }
+    if (descriptor == Value::descriptor()) {
+      return ConvertValue(value, static_cast<Value*>(message), depth);
+    }
+    if (descriptor == ListValue::descriptor()) {
+      return ConvertListValue(value, static_cast<ListValue*>(message), depth);
+    }
+    if (descriptor->file()->package() == kWellKnownTypesPackage) {
+      return absl::UnimplementedError(
+          absl::StrCat("Unsupported message type: ", descriptor->full_name()));
+    }
+    return ConvertMessage(value, message, depth);
+  }
+
+ private:
+  // Maximum nesting of objects and arrays, matching the default recursion
+  // limit of the JSON parser.
+  static constexpr int kMaxDepth = 100;
+
+  absl::Status ConvertMessage(v8::Local<v8::Value> value, Message* message,
+                              int depth) {
+    const Descriptor* descriptor = message->GetDescriptor();
+    const Reflection* reflection = message->GetReflection();
+    return ForEachProperty(
+        value, [&](const std::string& name,
+                   v8::Local<v8::Value> property_value) -> absl::Status {
+          const FieldDescriptor* field = FindField(descriptor, name);
+          if (field == nullptr) {
+            return absl::UnimplementedError(
+                absl::StrCat("Unknown field: ", name));
+          }
+          if (field->is_repeated()) {
+            return absl::UnimplementedError(
+                "Repeated fields are not supported.");
+          }
+          switch (field->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_DOUBLE: {
+              if (!property_value->IsNumber()) {
+                return absl::UnimplementedError("Expected a number.");
+              }
+              const double number =
+                  v8::Local<v8::Number>::Cast(property_value)->Value();
+              if (!std::isfinite(number)) {
+                return absl::UnimplementedError("Expected a finite number.");
+              }
+              // JSON.stringify() prints negative zero as 0.
+              reflection->SetDouble(message, field, number == 0 ? 0 : number);
+              return absl::OkStatus();
+            }
+            case FieldDescriptor::CPPTYPE_BOOL:
+              if (!property_value->IsBoolean()) {
+                return absl::UnimplementedError("Expected a boolean.");
+              }
+              reflection->SetBool(message, field,
+                                  property_value->IsTrue());
+              return absl::OkStatus();
+            case FieldDescriptor::CPPTYPE_STRING:
+              if (!property_value->IsString() ||
+                  field->type() == FieldDescriptor::TYPE_BYTES) {
+                return absl::UnimplementedError("Expected a string.");
+              }
+              reflection->SetString(message, field,
+                                    *v8::String::Utf8Value(isolate_,
+                                                           property_value));
+              return absl::OkStatus();
+            case FieldDescriptor::CPPTYPE_MESSAGE:
+              if (property_value->IsNull()) {
+                return absl::UnimplementedError("Unexpected null.");
+              }
+              return Convert(property_value,
+                             reflection->MutableMessage(message, field),
+                             depth + 1);
+            default:
+              return absl::UnimplementedError(
+                  absl::StrCat("Unsupported field type: ", field->type_name()));
+          }
+        });
+  }
+
+  absl::Status ConvertStruct(v8::Local<v8::Value> value, Struct* message,
+                             int depth) {
+    auto& fields = *message->mutable_fields();
+    return ForEachProperty(
+        value, [&](const std::string& name,
+                   v8::Local<v8::Value> property_value) -> absl::Status {
+          return ConvertValue(property_value, &fields[name], depth + 1);
+        });
+  }
+
+  absl::Status ConvertValue(v8::Local<v8::Value> value, Value* message,
+                            int depth) {
+    if (depth > kMaxDepth) {
+      return absl::UnimplementedError("Value nested too deeply.");
+    }
+    if (value->IsNull()) {
+      message->set_null_value(google::protobuf::NULL_VALUE);
+    } else if (value->IsBoolean()) {
+      message->set_bool_value(value->IsTrue());
+    } else if (value->IsNumber()) {
+      const double number = v8::Local<v8::Number>::Cast(value)->Value();
+      if (std::isfinite(number)) {
+        message->set_number_value(number == 0 ? 0 : number);
+      } else {
+        // JSON.stringify() prints non-finite numbers as null.
+        message->set_null_value(google::protobuf::NULL_VALUE);
+      }
+    } else if (value->IsString()) {
+      message->set_string_value(*v8::String::Utf8Value(isolate_, value));
+    } else if (value->IsArray()) {
+      return ConvertListValue(value, message->mutable_list_value(), depth);
+    } else {
+      return ConvertStruct(value, message->mutable_struct_value(), depth);
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status ConvertListValue(v8::Local<v8::Value> value,
+                                ListValue* message, int depth) {
+    if (!value->IsArray()) {
+      return absl::UnimplementedError("Expected an array.");
+    }
+    v8::Local<v8::Array> array = v8::Local<v8::Array>::Cast(value);
+    const uint32_t length = array->Length();
+    message->mutable_values()->Reserve(length);
+    for (uint32_t index = 0; index < length; index++) {
+      v8::Local<v8::Value> element;
+      if (!array->Get(context_, index).ToLocal(&element)) {
+        return absl::UnimplementedError("Unable to read an array element.");
+      }
+      if (IsOmitted(element)) {
+        // JSON.stringify() prints holes and non-serializable elements as null.
+        message->add_values()->set_null_value(google::protobuf::NULL_VALUE);
+        continue;
+      }
+      RETURN_IF_ERROR(
+          ConvertValue(element, message->add_values(), depth + 1));
+    }
+    return absl::OkStatus();
+  }
+
+  // Invokes `callback` for the properties of `value` that JSON.stringify()
+  // prints, provided that `value` is an object that JSON.stringify() prints
+  // property by property.
+  absl::Status ForEachProperty(
+      v8::Local<v8::Value> value,
+      const std::function<absl::Status(const std::string&,
+                                       v8::Local<v8::Value>)>& callback) {
+    if (!value->IsObject() || value->IsArray() || value->IsFunction() ||
+        value->IsProxy()) {
+      return absl::UnimplementedError("Expected a plain object.");
+    }
+    v8::Local<v8::Object> object = v8::Local<v8::Object>::Cast(value);
+    // Rules out dates, boxed primitives, class instances and other objects
+    // which may be serialized differently, e.g. through toJSON().
+    v8::Local<v8::Value> prototype = object->GetPrototype();
+    if (!prototype->IsNull() && !prototype->StrictEquals(object_prototype_)) {
+      return absl::UnimplementedError("Expected a plain object.");
+    }
+    v8::Local<v8::Array> names;
+    if (!object
+             ->GetOwnPropertyNames(
+                 context_,
+                 static_cast<v8::PropertyFilter>(v8::ONLY_ENUMERABLE |
+                                                 v8::SKIP_SYMBOLS),
+                 v8::KeyConversionMode::kConvertToString)
+             .ToLocal(&names)) {
+      return absl::UnimplementedError("Unable to list object properties.");
+    }
+    for (uint32_t index = 0; index < names->Length(); index++) {
+      v8::Local<v8::Value> name;
+      v8::Local<v8::Value> property_value;
+      if (!names->Get(context_, index).ToLocal(&name) ||
+          !object->Get(context_, name).ToLocal(&property_value)) {
+        return absl::UnimplementedError("Unable to read an object property.");
+      }
+      std::string name_string = *v8::String::Utf8Value(isolate_, name);
+      if (name_string == "toJSON") {
+        return absl::UnimplementedError("Objects with toJSON() unsupported.");
+      }
+      if (IsOmitted(property_value)) {
+        // JSON.stringify() skips properties that cannot be serialized.
+        continue;
+      }
+      RETURN_IF_ERROR(callback(name_string, property_value));
+    }
+    return absl::OkStatus();
+  }
+
+  // Whether JSON.stringify() omits `value` from objects.
+  static bool IsOmitted(v8::Local<v8::Value> value) {
+    return value->IsUndefined() || value->IsFunction() || value->IsSymbol();
+  }
+
+  // Finds a field by its JSON name or by its original name, both of which
+  // `JsonStringToMessage()` accepts.
+  static const FieldDescriptor* FindField(const Descriptor* descriptor,
+                                          absl::string_view name) {
+    for (int field_index = 0; field_index < descriptor->field_count();
+         field_index++) {
+      const FieldDescriptor* field = descriptor->field(field_index);
+      if (field->json_name() == name || field->name() == name) {
+        return field;
+      }
+    }
+    return nullptr;
+  }
+
+  v8::Local<v8::Context> context_;
+  v8::Isolate* isolate_;
+  v8::Local<v8::Value> object_prototype_;
+};
+}  // namespace
+
+absl::StatusOr<v8::Local<v8::Value>> ProtoToV8Value(
+    const google::protobuf::Message& message, v8::Local<v8::Context> context) {
+  return ProtoToV8Converter(context).Convert(message);
+}
+
+absl::Status V8ValueToProto(v8::Local<v8::Value> value,
+                            v8::Local<v8::Context> context,
+                            google::protobuf::Message* message) {
+  // Exceptions thrown by property getters must not leak out of the
+  // conversion. Note that getters run again if the caller falls back to the
+  // JSON conversion.
+  v8::TryCatch try_catch(context->GetIsolate());
+  return V8ToProtoConverter(context).Convert(value, message);
+}
+}  // namespace function
+}  // namespace aviary
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FUNCTION_VALUE_CONVERSION_H_
+#define FUNCTION_VALUE_CONVERSION_H_
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "google/protobuf/message.h"
+#include "v8.h"
+
+namespace aviary {
+namespace function {
+// Converts `message` into the V8 value that `JSON.parse()` returns for the
+// proto3 JSON representation of `message`, as printed by
+// `MessageToJsonString()` with default options, without going through an
+// intermediate JSON string.
+//
+// Returns a kUnimplemented error for messages whose JSON representation is not
+// mirrored, such as well-known types other than `Struct`, `Value` and
+// `ListValue`, or non-finite numbers. Callers are expected to fall back to the
+// JSON conversion in that case.
+absl::StatusOr<v8::Local<v8::Value>> ProtoToV8Value(
+    const google::protobuf::Message& message, v8::Local<v8::Context> context);
+
+// Reads `value` into `message` the same way `JsonStringToMessage()` parses
+// `JSON.stringify(value)`, without going through an intermediate JSON string.
+//
+// Only plain objects, arrays and primitives, read into singular double, string,
+// bool and message fields, `Struct`, `Value` and `ListValue`, are handled.
+// Returns a kUnimplemented error for any other value, including values that
+// the JSON conversion rejects, possibly leaving `message` partially populated.
+// Callers are expected to clear `message` and fall back to the JSON conversion
+// in that case.
+absl::Status V8ValueToProto(v8::Local<v8::Value> value,
+                            v8::Local<v8::Context> context,
+                            google::protobuf::Message* message);
+}  // namespace function
+}  // namespace aviary
+
+#endif  // FUNCTION_VALUE_CONVERSION_H_
@@ -0,0 +1,295 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "function/value_conversion.h"
+
+#include <limits>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "google/protobuf/struct.pb.h"
+#include "google/protobuf/timestamp.pb.h"
+#include "google/protobuf/util/json_util.h"
+#include "google/protobuf/util/message_differencer.h"
+#include "gtest/gtest.h"
+#include "proto/bidding_function.pb.h"
+#include "util/parse_proto.h"
+#include "util/status_macros.h"
+#include "v8.h"
+#include "v8/v8_platform_initializer.h"
+
+namespace aviary {
+namespace function {
+namespace {
+
+using ::aviary::util::ParseTextOrDie;
+using ::aviary::v8::V8PlatformInitializer;
+using ::google::protobuf::Message;
+using ::google::protobuf::util::MessageDifferencer;
+using ::google::protobuf::util::MessageToJsonString;
+
+class ValueConversionTest : public ::testing::Test {
+ protected:
+  ValueConversionTest()
+      : allocator_(::v8::ArrayBuffer::Allocator::NewDefaultAllocator()) {
+    ::v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = allocator_.get();
+    isolate_ = ::v8::Isolate::New(create_params);
+  }
+
+  ~ValueConversionTest() override { isolate_->Dispose(); }
+
+  // Expects the direct conversion of `message` to produce the same value as
+  // `JSON.parse()` of its JSON representation, comparing them through
+  // `JSON.stringify()`.
+  void ExpectSameAsJson(const Message& message) {
+    std::string json_string;
+    ASSERT_TRUE(MessageToJsonString(message, &json_string).ok());
+
+    ::v8::Isolate::Scope isolate_scope(isolate_);
+    ::v8::HandleScope handle_scope(isolate_);
+    ::v8::Local<::v8::Context> context = ::v8::Context::New(isolate_);
+    ::v8::Context::Scope context_scope(context);
+    absl::StatusOr<::v8::Local<::v8::Value>> converted =
+        ProtoToV8Value(message, context);
+    ASSERT_TRUE(converted.ok()) << converted.status();
+    ::v8::Local<::v8::Value> parsed =
+        ::v8::JSON::Parse(context, ::v8::String::NewFromUtf8(
+                                       isolate_, json_string.c_str())
+                                       .ToLocalChecked())
+            .ToLocalChecked();
+    EXPECT_EQ(Stringify(context, *converted), Stringify(context, parsed));
+  }
+
+  absl::StatusCode ConversionStatusCode(const Message& message) {
+    ::v8::Isolate::Scope isolate_scope(isolate_);
+    ::v8::HandleScope handle_scope(isolate_);
+    ::v8::Local<::v8::Context> context = ::v8::Context::New(isolate_);
+    ::v8::Context::Scope context_scope(context);
+    return ProtoToV8Value(message, context).status().code();
+  }
+
+  // Evaluates `script` and reads the result into a message of type T.
+  template <typename T>
+  absl::StatusOr<T> EvaluateToProto(absl::string_view script) {
+    ::v8::Isolate::Scope isolate_scope(isolate_);
+    ::v8::HandleScope handle_scope(isolate_);
+    ::v8::Local<::v8::Context> context = ::v8::Context::New(isolate_);
+    ::v8::Context::Scope context_scope(context);
+    ::v8::Local<::v8::Value> value =
+        ::v8::Script::Compile(
+            context, ::v8::String::NewFromUtf8(isolate_, script.data(),
+                                               ::v8::NewStringType::kNormal,
+                                               static_cast<int>(script.size()))
+                         .ToLocalChecked())
+            .ToLocalChecked()
+            ->Run(context)
+            .ToLocalChecked();
+    T message;
+    RETURN_IF_ERROR(V8ValueToProto(value, context, &message));
+    return message;
+  }
+
+  std::string Stringify(::v8::Local<::v8::Context> context,
+                        ::v8::Local<::v8::Value> value) {
+    return *::v8::String::Utf8Value(
+        isolate_, ::v8::JSON::Stringify(context, value).ToLocalChecked());
+  }
+
+  V8PlatformInitializer v8_platform_initializer_;
+  std::unique_ptr<::v8::ArrayBuffer::Allocator> allocator_;
+  ::v8::Isolate* isolate_;
+};
+
+TEST_F(ValueConversionTest, ConvertsStruct) {
+  ExpectSameAsJson(ParseTextOrDie<google::protobuf::Struct>(R"pb(
+    fields {
+      key: "list"
+      value {
+        list_value {
+          values { null_value: NULL_VALUE }
+          values { number_value: 1.5 }
+          values { number_value: -3 }
+          values { string_value: "Zürich" }
+          values { bool_value: true }
+          values {
+            struct_value {
+              fields {
+                key: "empty"
+                value { list_value {} }
+              }
+            }
+          }
+        }
+      }
+    }
+  )pb"));
+}
+
+TEST_F(ValueConversionTest, ConvertsBiddingFunctionInput) {
+  ExpectSameAsJson(ParseTextOrDie<BiddingFunctionInput>(R"pb(
+    interest_group {
+      owner: "dsp.example"
+      name: "shoes"
+      ads {
+        render_url: "https://dsp.example/shoes"
+        ad_metadata {
+          fields {
+            key: "size"
+            value { number_value: 42 }
+          }
+        }
+      }
+      ads { render_url: "https://dsp.example/boots" }
+      trusted_bidding_signals_keys: [ "first", "second" ]
+      user_bidding_signals {}
+    }
+    per_buyer_signals {
+      fields {
+        key: "foo"
+        value { string_value: "bar" }
+      }
+    }
+    trusted_bidding_signals {
+      key: "first"
+      value { number_value: 1 }
+    }
+  )pb"));
+}
+
+TEST_F(ValueConversionTest, ConvertsAdScoringFunctionInput) {
+  ExpectSameAsJson(ParseTextOrDie<AdScoringFunctionInput>(R"pb(
+    bid: 2.5
+    auction_config {
+      seller: "ssp.example"
+      interest_group_buyers: [ "dsp.example" ]
+      additional_bids {}
+      per_buyer_signals {
+        key: "dsp.example"
+        value {
+          fields {
+            key: "foo"
+            value { bool_value: false }
+          }
+        }
+      }
+    }
+  )pb"));
+}
+
+TEST_F(ValueConversionTest, ConvertsEmptyMessage) {
+  ExpectSameAsJson(BiddingFunctionInput());
+}
+
+TEST_F(ValueConversionTest, CreatesObjectsWithObjectPrototype) {
+  ::v8::Isolate::Scope isolate_scope(isolate_);
+  ::v8::HandleScope handle_scope(isolate_);
+  ::v8::Local<::v8::Context> context = ::v8::Context::New(isolate_);
+  ::v8::Context::Scope context_scope(context);
+  absl::StatusOr<::v8::Local<::v8::Value>> converted =
+      ProtoToV8Value(google::protobuf::Struct(), context);
+  ASSERT_TRUE(converted.ok()) << converted.status();
+  ASSERT_TRUE((*converted)->IsObject());
+  EXPECT_TRUE(::v8::Local<::v8::Object>::Cast(*converted)
+                  ->GetPrototype()
+                  ->StrictEquals(::v8::Object::New(isolate_)->GetPrototype()));
+}
+
+TEST_F(ValueConversionTest, UnsupportedWellKnownType) {
+  google::protobuf::Timestamp timestamp;
+  timestamp.set_seconds(1);
+  EXPECT_EQ(ConversionStatusCode(timestamp), absl::StatusCode::kUnimplemented);
+}
+
+TEST_F(ValueConversionTest, ReadsBiddingFunctionOutput) {
+  absl::StatusOr<BiddingFunctionOutput> output =
+      EvaluateToProto<BiddingFunctionOutput>(R"(
+        ({ bid: 2.5,
+           renderUrl: "https://dsp.example/shoes",
+           ad: { list: [1, "two", null, true, undefined, { nested: {} }],
+                 notANumber: NaN,
+                 omitted: undefined,
+                 alsoOmitted: () => 0 } }))");
+  ASSERT_TRUE(output.ok()) << output.status();
+  EXPECT_TRUE(MessageDifferencer::Equals(
+      *output, ParseTextOrDie<BiddingFunctionOutput>(R"pb(
+        bid: 2.5
+        render_url: "https://dsp.example/shoes"
+        ad {
+          fields {
+            key: "list"
+            value {
+              list_value {
+                values { number_value: 1 }
+                values { string_value: "two" }
+                values { null_value: NULL_VALUE }
+                values { bool_value: true }
+                values { null_value: NULL_VALUE }
+                values {
+                  struct_value {
+                    fields {
+                      key: "nested"
+                      value { struct_value {} }
+                    }
+                  }
+                }
+              }
+            }
+          }
+          fields {
+            key: "notANumber"
+            value { null_value: NULL_VALUE }
+          }
+        }
+      )pb")))
+      << output->DebugString();
+}
+
+TEST_F(ValueConversionTest, ReadsOriginalFieldNames) {
+  absl::StatusOr<BiddingFunctionOutput> output =
+      EvaluateToProto<BiddingFunctionOutput>(
+          R"(({ render_url: "https://dsp.example/shoes" }))");
+  ASSERT_TRUE(output.ok()) << output.status();
+  EXPECT_EQ(output->render_url(), "https://dsp.example/shoes");
+}
+
+TEST_F(ValueConversionTest, LeavesUnusualOutputsToJsonConversion) {
+  for (absl::string_view script : {
+           R"("abc")",
+           R"(({ bid: "1" }))",
+           R"(({ bid: Infinity }))",
+           R"(({ bid: null }))",
+           R"(({ unknownField: 1 }))",
+           R"(({ ad: "ad" }))",
+           R"(({ ad: { date: new Date(0) } }))",
+           R"(({ bid: 1, toJSON: () => ({ bid: 2 }) }))",
+           R"(new Proxy({}, {}))",
+           R"((() => { const ad = {}; ad.self = ad; return { ad }; })())",
+       }) {
+    EXPECT_EQ(EvaluateToProto<BiddingFunctionOutput>(script).status().code(),
+              absl::StatusCode::kUnimplemented)
+        << script;
+  }
+}
+
+TEST_F(ValueConversionTest, NonFiniteNumber) {
+  google::protobuf::Value value;
+  value.set_number_value(std::numeric_limits<double>::infinity());
+  EXPECT_EQ(ConversionStatusCode(value), absl::StatusCode::kUnimplemented);
+}
+}  // namespace
+}  // namespace function
+}  // namespace aviary
@@ -14,14 +14,43 @@
 
 #include "server/ad_auctions.h"
 
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+
+#include "absl/algorithm/container.h"
+#include "absl/cleanup/cleanup.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/flags/flag.h"
 #include "absl/functional/bind_front.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/substitute.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
 #include "function/bidding_function.h"
+#include "function/bidding_function_interface.h"
 #include "function/sapi_bidding_function.h"
+#include "google/protobuf/arena.h"
 #include "include/yaml-cpp/yaml.h"
+#include "server/function_memo.h"
 #include "server/function_source.h"
+#include "server/invocation_limiter.h"
+#include "util/cpu_affinity.h"
+#include "util/metrics.h"
+#include "util/trace.pb.h"
+#include "util/trace_recorder.h"
+#include "v8/v8_platform_initializer.h"
 
 ABSL_FLAG(bool,
           use_sandbox2,
@@ -31,6 +60,106 @@ ABSL_FLAG(absl::Duration,
           function_refresh_interval,
           absl::Minutes(1),
           "Refresh interval for bidding functions and ad scoring functions.");
+ABSL_FLAG(int,
+          function_context_reuse_limit,
+          1,
+          "Number of invocations of a bidding or ad scoring function served by "
+          "the same V8 context before it is replaced by a fresh one. Values "
+          "above 1 trade isolation between invocations for speed.");
+ABSL_FLAG(int,
+          function_build_threads,
+          std::max(1u, std::thread::hardware_concurrency()),
+          "Number of threads fetching and building functions in parallel "
+          "during startup and refreshes.");
+ABSL_FLAG(int,
+          memoized_function_outputs,
+          100000,
+          "Number of outputs memoized per function configured with `memoize`, "
+          "beyond which the least recently used ones are evicted.");
+ABSL_FLAG(int,
+          function_max_concurrent_batches,
+          0,
+          "Number of batched invocations of a function that run at once, "
+          "beyond which the others are queued. Unbounded when 0. Overridden "
+          "by `maxConcurrentBatches` in the configuration of a function.");
+ABSL_FLAG(int,
+          function_max_queued_batches,
+          100,
+          "Number of batched invocations of a function queued at most once "
+          "--function_max_concurrent_batches run, beyond which more are "
+          "rejected right away. Overridden by `maxQueuedBatches` in the "
+          "configuration of a function.");
+ABSL_FLAG(bool,
+          freeze_common_function_arguments,
+          false,
+          "Whether to deeply freeze the arguments that are shared by the "
+          "invocations of a bidding or ad scoring function within an auction, "
+          "such as the auction configuration. When false, modifications made "
+          "by an invocation are visible to the following ones.");
+ABSL_FLAG(int,
+          auction_executor_threads,
+          std::max(1u, std::thread::hardware_concurrency()),
+          "Number of threads running the buyers of ad auctions concurrently.");
+ABSL_FLAG(std::string,
+          auction_executor_cpus,
+          "",
+          "CPUs that the threads running the buyers of ad auctions, and the "
+          "JavaScript of their unsandboxed functions, are pinned to. In the "
+          "format of `taskset --cpu-list` (e.g. \"0-3,8\"), or \"node<N>\" "
+          "for the CPUs of NUMA node N. Unpinned when empty.");
+ABSL_FLAG(absl::Duration,
+          trusted_signals_ttl,
+          absl::Minutes(1),
+          "How long trusted bidding signals are cached for once fetched.");
+ABSL_FLAG(int,
+          trusted_signals_cache_capacity,
+          1000000,
+          "Number of trusted bidding signals cached at most.");
+ABSL_FLAG(absl::Duration,
+          interest_group_cache_ttl,
+          absl::Hours(1),
+          "How long the state of versioned interest groups is cached for since "
+          "it was last used.");
+ABSL_FLAG(int,
+          interest_group_cache_capacity,
+          1000000,
+          "Number of versioned interest groups cached at most.");
+ABSL_FLAG(absl::Duration,
+          auction_deadline,
+          absl::InfiniteDuration(),
+          "Time budget of an ad auction, capped by the deadline of its RPC. "
+          "Buyers whose bids are not scored by then are left out of the "
+          "auction, and reported as late in its response.");
+ABSL_FLAG(absl::Duration,
+          auction_rpc_deadline_margin,
+          absl::Milliseconds(5),
+          "Time kept before the deadline of an ad auction RPC to respond "
+          "with the bids scored by then.");
+ABSL_FLAG(int,
+          late_buyer_skip_threshold,
+          3,
+          "Number of consecutive ad auctions that a buyer must be late for to "
+          "be skipped for --late_buyer_skip_duration. Buyers are never skipped "
+          "when 0.");
+ABSL_FLAG(absl::Duration,
+          late_buyer_skip_duration,
+          absl::Seconds(10),
+          "How long buyers are skipped for once they reach "
+          "--late_buyer_skip_threshold. The first auction past that gives "
+          "them another try, and skips them again if they are still late.");
+ABSL_FLAG(bool,
+          allow_requested_auction_traces,
+          false,
+          "Whether clients get the trace of their ad auctions by asking for "
+          "it with the aviary-trace metadata. Traces show how long every "
+          "buyer of an auction took, so only trusted clients should get "
+          "them.");
+ABSL_FLAG(double,
+          auction_trace_sampling_rate,
+          0,
+          "Fraction of the ad auctions traced, on top of those whose client "
+          "asks for a trace under --allow_requested_auction_traces. Traces "
+          "are returned in the aviary-trace-bin trailing metadata.");
 
 namespace YAML {
 template <>
@@ -48,6 +177,58 @@ struct convert<::aviary::server::FunctionSpecification> {
     if (uri_node.IsDefined()) {
       decoded.uri = uri_node.as<std::string>();
     }
+    const auto sandbox_trust_domain_node = node["sandboxTrustDomain"];
+    if (sandbox_trust_domain_node.IsDefined()) {
+      decoded.sandbox_trust_domain =
+          sandbox_trust_domain_node.as<std::string>();
+    }
+    const auto max_heap_size_node = node["maxHeapSizeMb"];
+    if (max_heap_size_node.IsDefined()) {
+      decoded.max_heap_size_mb = max_heap_size_node.as<int>();
+    }
+    const auto memoize_node = node["memoize"];
+    if (memoize_node.IsDefined()) {
+      decoded.memoize = memoize_node.as<bool>();
+    }
+    const auto max_concurrent_batches_node = node["maxConcurrentBatches"];
+    if (max_concurrent_batches_node.IsDefined()) {
+      decoded.max_concurrent_batches = max_concurrent_batches_node.as<int>();
+    }
+    const auto max_queued_batches_node = node["maxQueuedBatches"];
+    if (max_queued_batches_node.IsDefined()) {
+      decoded.max_queued_batches = max_queued_batches_node.as<int>();
+    }
+    const auto scheduling_weight_node = node["schedulingWeight"];
+    if (scheduling_weight_node.IsDefined()) {
+      decoded.scheduling_weight = scheduling_weight_node.as<int>();
+    }
+    // Warm-up settings, e.g.
+    //
+    // warmUp:
+    //   iterations: 20
+    //   inputs:
+    //     - '{"perBuyerSignals": {"bidFloor": 1}}'
+    //     - file: warm_up/input.json
+    const auto warm_up_node = node["warmUp"];
+    if (warm_up_node.IsDefined()) {
+      if (!warm_up_node.IsMap()) {
+        return false;
+      }
+      const auto iterations_node = warm_up_node["iterations"];
+      if (iterations_node.IsDefined()) {
+        decoded.warm_up_iterations = iterations_node.as<int>();
+      }
+      for (const auto& input_node : warm_up_node["inputs"]) {
+        if (input_node.IsScalar()) {
+          decoded.warm_up_inputs.push_back(input_node.as<std::string>());
+        } else if (input_node.IsMap() && input_node["file"].IsDefined()) {
+          decoded.warm_up_input_files.push_back(
+              input_node["file"].as<std::string>());
+        } else {
+          return false;
+        }
+      }
+    }
     return !decoded.uri.empty();
   }
 };
@@ -58,61 +239,393 @@ namespace server {
 
 namespace {
 using ::aviary::function::BiddingFunctionInterface;
+using ::aviary::function::CheckBatchOutputCount;
 using ::aviary::function::FledgeAdScoringFunction;
 using ::aviary::function::FledgeBiddingFunction;
 using ::aviary::function::FledgeSapiAdScoringFunction;
 using ::aviary::function::FledgeSapiBiddingFunction;
 using ::aviary::function::FunctionOptions;
+using ::aviary::util::Counter;
+using ::aviary::util::Histogram;
+using ::aviary::util::LatencyBuckets;
+using ::aviary::util::MetricFamily;
+using ::aviary::util::ScopedTraceContext;
+using ::aviary::util::ScopedTraceSpan;
+using ::aviary::util::TraceRecorder;
+
+// Client metadata asking for the trace of an auction, and trailing metadata
+// that the trace is returned in, as a serialized `aviary::util::Trace`.
+constexpr char kTraceMetadataKey[] = "aviary-trace";
+constexpr char kTraceTrailerKey[] = "aviary-trace-bin";
+// Bounds the serialized trace well within the 8 KiB that gRPC allows for all
+// the metadata of a call by default, beyond which the call fails.
+constexpr size_t kMaxTraceTrailerBytes = 4096;
+
+// Returns the histogram of the time spent by auctions in `stage` for the
+// function of `uri`: looking up trusted signals, building its inputs, bidding
+// or scoring.
+Histogram& GetAuctionStageHistogram(absl::string_view uri,
+                                    absl::string_view stage) {
+  static auto* const family = new MetricFamily<Histogram>(
+      "aviary_auction_stage_seconds",
+      "Time spent by auctions in each stage around the invocations of a "
+      "function: trusted_signals_lookup, input_building, bidding or "
+      "scoring.",
+      {"function", "stage"}, LatencyBuckets());
+  return family->Get({uri, stage});
+}
+
+// Returns the counter of the failed invocations of the function of `uri`.
+Counter& GetFunctionFailureCounter(absl::string_view uri) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_function_failures_total",
+      "Invocations of a function that failed, e.g. by throwing or by timing "
+      "out.",
+      {"function"});
+  return family->Get({uri});
+}
+
+// Returns the counter of the lookups of memoized outputs of the function of
+// `uri`, by whether an output was memoized for the input.
+Counter& GetFunctionMemoLookupCounter(absl::string_view uri, bool hit) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_function_memo_lookups_total",
+      "Lookups of the memoized outputs of a function, by whether the output "
+      "was memoized: hit or miss.",
+      {"function", "result"});
+  return family->Get({uri, hit ? "hit" : "miss"});
+}
+
+// Returns the histogram of the time that the invocations of the function of
+// `uri` spend waiting in `queue`: the auction executor, or admission by the
+// limiter of the function.
+Histogram& GetFunctionQueueHistogram(absl::string_view uri,
+                                     absl::string_view queue) {
+  static auto* const family = new MetricFamily<Histogram>(
+      "aviary_function_queue_seconds",
+      "Time spent by the invocations of a function waiting in a queue: "
+      "executor, for a thread of the auction executor, or admission, for "
+      "the invocations of the function running at once to go down.",
+      {"function", "queue"}, LatencyBuckets());
+  return family->Get({uri, queue});
+}
+
+// Returns the counter of the batched invocations of the function of `uri`
+// rejected by its limiter with `code`.
+Counter& GetFunctionRejectionCounter(absl::string_view uri,
+                                     absl::StatusCode code) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_function_rejections_total",
+      "Batched invocations of a function rejected before running, by reason: "
+      "queue_full or deadline, when still queued at the deadline.",
+      {"function", "reason"});
+  return family->Get(
+      {uri, code == absl::StatusCode::kDeadlineExceeded ? "deadline"
+                                                        : "queue_full"});
+}
+
+// Looks up the metrics of the bidding function of `uri`, or of its ad scoring
+// function otherwise, with those of its memo lookups if `memoize`.
+AuctionFunctionMetrics GetAuctionFunctionMetrics(absl::string_view uri,
+                                                 bool is_bidding_function,
+                                                 bool memoize) {
+  AuctionFunctionMetrics metrics = {
+      .input_building_seconds =
+          &GetAuctionStageHistogram(uri, "input_building"),
+      .invocation_seconds = &GetAuctionStageHistogram(
+          uri, is_bidding_function ? "bidding" : "scoring"),
+      .admission_queue_seconds = &GetFunctionQueueHistogram(uri, "admission"),
+      .failures = &GetFunctionFailureCounter(uri),
+      .queue_full_rejections = &GetFunctionRejectionCounter(
+          uri, absl::StatusCode::kResourceExhausted),
+      .deadline_rejections = &GetFunctionRejectionCounter(
+          uri, absl::StatusCode::kDeadlineExceeded)};
+  if (is_bidding_function) {
+    metrics.trusted_signals_lookup_seconds =
+        &GetAuctionStageHistogram(uri, "trusted_signals_lookup");
+    metrics.executor_queue_seconds =
+        &GetFunctionQueueHistogram(uri, "executor");
+  }
+  if (memoize) {
+    metrics.memo_hits = &GetFunctionMemoLookupCounter(uri, /*hit=*/true);
+    metrics.memo_misses = &GetFunctionMemoLookupCounter(uri, /*hit=*/false);
+  }
+  return metrics;
+}
+
+// Admits a batched invocation of a function through `limiter`, unless null,
+// and records the time it was queued for into `metrics`, within `wait_budget`.
+// Returns the status of the rejection otherwise. Admitted invocations must be
+// released with `ReleaseInvocation()`.
+absl::Status AdmitInvocation(const AuctionFunctionMetrics& metrics,
+                             InvocationLimiter* limiter, absl::Time deadline,
+                             InvocationLimiter::WaitBudget* wait_budget) {
+  if (limiter == nullptr) {
+    return absl::OkStatus();
+  }
+  ScopedTraceSpan admission_span("admission");
+  const absl::Time start = absl::Now();
+  absl::Status status = limiter->Acquire(deadline, wait_budget);
+  metrics.admission_queue_seconds->RecordDuration(absl::Now() - start);
+  if (!status.ok()) {
+    (status.code() == absl::StatusCode::kDeadlineExceeded
+         ? metrics.deadline_rejections
+         : metrics.queue_full_rejections)
+        ->Increment();
+  }
+  return status;
+}
+
+void ReleaseInvocation(InvocationLimiter* limiter) {
+  if (limiter != nullptr) {
+    limiter->Release();
+  }
+}
+
+// Buckets of the durations of function builds and refreshes, in seconds.
+constexpr double kBuildBuckets[] = {0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120};
+
+// Returns the counter of the failed builds of the function of `uri`.
+Counter& GetFunctionBuildFailureCounter(absl::string_view uri) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_function_build_failures_total",
+      "Builds of a function that failed, at startup or during refreshes.",
+      {"function"});
+  return family->Get({uri});
+}
+
+// Returns the histogram of the durations of the builds of the function of
+// `uri`, whether they succeed or fail.
+Histogram& GetFunctionBuildHistogram(absl::string_view uri) {
+  static auto* const family = new MetricFamily<Histogram>(
+      "aviary_function_build_seconds",
+      "Time spent building a function, compiling and warming it up, at "
+      "startup or during refreshes.",
+      {"function"}, absl::MakeConstSpan(kBuildBuckets));
+  return family->Get({uri});
+}
+
+// Returns the counter of the auctions that left out the buyer of `uri` for
+// `reason`.
+Counter& GetDroppedBuyerCounter(absl::string_view uri,
+                                DroppedBuyer::Reason reason) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_auction_dropped_buyers_total",
+      "Auctions that left out a buyer, by its bidding function and the reason "
+      "why: late, skipped or failed.",
+      {"function", "reason"});
+  switch (reason) {
+    case DroppedBuyer::LATE:
+      return family->Get({uri, "late"});
+    case DroppedBuyer::SKIPPED:
+      return family->Get({uri, "skipped"});
+    default:
+      return family->Get({uri, "failed"});
+  }
+}
+
+// Returns the histogram of the durations of the function refreshes.
+Histogram& GetRefreshHistogram() {
+  static auto* const family = new MetricFamily<Histogram>(
+      "aviary_function_refresh_seconds",
+      "Time spent refreshing the functions, including fetching their source "
+      "and building those that changed.",
+      {}, absl::MakeConstSpan(kBuildBuckets));
+  static Histogram* const histogram = &family->Get({});
+  return *histogram;
+}
+
+FunctionOptions GetFunctionOptions(const FunctionSpecification& specification) {
+  FunctionOptions options = {
+      .flatten_function_arguments = true,
+      .context_reuse_limit = absl::GetFlag(FLAGS_function_context_reuse_limit),
+      .warm_up_inputs = specification.warm_up_inputs,
+      .freeze_common_arguments =
+          absl::GetFlag(FLAGS_freeze_common_function_arguments),
+      .sandbox_trust_domain = specification.sandbox_trust_domain,
+      .metrics_name = specification.uri,
+      .max_heap_size_bytes =
+          static_cast<size_t>(std::max(0, specification.max_heap_size_mb))
+          << 20,
+  };
+  if (specification.warm_up_iterations.has_value()) {
+    options.warm_up_iterations = *specification.warm_up_iterations;
+  }
+  return options;
+}
+
+// Reads the warm-up input files of the `specifications` into their warm-up
+// inputs. Relative paths are relative to `base_directory`.
+absl::Status ReadWarmUpInputFiles(
+    const std::filesystem::path& base_directory,
+    std::vector<FunctionSpecification>* specifications) {
+  for (FunctionSpecification& specification : *specifications) {
+    for (const std::string& file_name : specification.warm_up_input_files) {
+      const std::filesystem::path path = base_directory / file_name;
+      std::ifstream file(path);
+      std::stringstream contents;
+      contents << file.rdbuf();
+      if (!file) {
+        return absl::NotFoundError(
+            absl::StrCat("Could not read the warm-up input file ",
+                         path.string(), " of function ", specification.uri));
+      }
+      specification.warm_up_inputs.push_back(contents.str());
+    }
+    specification.warm_up_input_files.clear();
+  }
+  return absl::OkStatus();
+}
+
+// Returns `message` for aliasing into a message allocated on an arena with
+// `unsafe_arena_set_allocated_*()` or `UnsafeArenaAddAllocated()`, which the
+// arena never frees. Aliased messages must be left unmodified and outlive the
+// arena.
+template <typename Message>
+Message* Alias(const Message& message) {
+  return const_cast<Message*>(&message);
+}
+
+// Returns `interest_group` with the state that lasts across auctions taken from
+// `lasting_state`. The result is allocated on `arena` and aliases both.
+const InterestGroupAuctionState* CreateVersionedInterestGroup(
+    const InterestGroupAuctionState& interest_group,
+    const InterestGroupAuctionState& lasting_state,
+    google::protobuf::Arena* arena) {
+  auto* resolved_interest_group =
+      google::protobuf::Arena::CreateMessage<InterestGroupAuctionState>(arena);
+  resolved_interest_group->set_owner(interest_group.owner());
+  resolved_interest_group->set_name(interest_group.name());
+  resolved_interest_group->set_version(interest_group.version());
+  resolved_interest_group->set_bidding_logic_url(
+      lasting_state.bidding_logic_url());
+  resolved_interest_group->mutable_ads()->Reserve(lasting_state.ads_size());
+  for (const auto& ad : lasting_state.ads()) {
+    resolved_interest_group->mutable_ads()->UnsafeArenaAddAllocated(Alias(ad));
+  }
+  resolved_interest_group->unsafe_arena_set_allocated_user_bidding_signals(
+      Alias(lasting_state.user_bidding_signals()));
+  resolved_interest_group->set_trusted_bidding_signals_url(
+      lasting_state.trusted_bidding_signals_url());
+  *resolved_interest_group->mutable_trusted_bidding_signals_keys() =
+      lasting_state.trusted_bidding_signals_keys();
+  resolved_interest_group->unsafe_arena_set_allocated_browser_signals(
+      Alias(interest_group.browser_signals()));
+  // Map fields cannot be aliased.
+  *resolved_interest_group->mutable_trusted_bidding_signals() =
+      interest_group.trusted_bidding_signals();
+  return resolved_interest_group;
+}
 
-BiddingFunctionInput CreateBiddingFunctionInput(
+// Returns the input fields shared by the invocations of a bidding function for
+// `interest_groups`: the auction signals, as well as the per-buyer signals when
+// all the interest groups have the same owner. The input is allocated on
+// `arena` and aliases `auction_configuration`.
+BiddingFunctionInput* CreateCommonBiddingFunctionInput(
+    const std::vector<const InterestGroupAuctionState*>& interest_groups,
+    const AuctionConfiguration& auction_configuration,
+    google::protobuf::Arena* arena) {
+  auto* common_input =
+      google::protobuf::Arena::CreateMessage<BiddingFunctionInput>(arena);
+  common_input->unsafe_arena_set_allocated_auction_signals(
+      Alias(auction_configuration.auction_signals()));
+  const bool same_owner = absl::c_all_of(
+      interest_groups,
+      [&interest_groups](const InterestGroupAuctionState* interest_group) {
+        return interest_group->owner() == interest_groups.front()->owner();
+      });
+  if (!interest_groups.empty() && same_owner) {
+    const auto& per_buyer_signals_it =
+        auction_configuration.per_buyer_signals().find(
+            interest_groups.front()->owner());
+    if (per_buyer_signals_it !=
+        auction_configuration.per_buyer_signals().cend()) {
+      common_input->unsafe_arena_set_allocated_per_buyer_signals(
+          Alias(per_buyer_signals_it->second));
+    }
+  }
+  return common_input;
+}
+
+// Returns the input of a bidding function for `interest_group_state`, leaving
+// out the fields set in `common_input`. The trusted bidding signals that are
+// not inlined in `interest_group_state` are taken from
+// `looked_up_trusted_bidding_signals`, if any. The input is allocated on
+// `arena` and aliases the fields of `interest_group_state` and
+// `auction_configuration` rather than copying them.
+BiddingFunctionInput* CreateBiddingFunctionInput(
     const InterestGroupAuctionState& interest_group_state,
-    const AuctionConfiguration& auction_configuration) {
-  BiddingFunctionInput input;
+    const AuctionConfiguration& auction_configuration,
+    const BiddingFunctionInput& common_input,
+    const TrustedSignals* looked_up_trusted_bidding_signals,
+    google::protobuf::Arena* arena) {
+  auto* input =
+      google::protobuf::Arena::CreateMessage<BiddingFunctionInput>(arena);
   const auto& per_buyer_signals_it =
       auction_configuration.per_buyer_signals().find(
           interest_group_state.owner());
-  if (per_buyer_signals_it !=
-      auction_configuration.per_buyer_signals().cend()) {
-    input.mutable_per_buyer_signals()->CopyFrom(per_buyer_signals_it->second);
+  if (!common_input.has_per_buyer_signals() &&
+      per_buyer_signals_it !=
+          auction_configuration.per_buyer_signals().cend()) {
+    input->unsafe_arena_set_allocated_per_buyer_signals(
+        Alias(per_buyer_signals_it->second));
+  }
+  if (!common_input.has_auction_signals()) {
+    input->unsafe_arena_set_allocated_auction_signals(
+        Alias(auction_configuration.auction_signals()));
   }
-  input.mutable_auction_signals()->CopyFrom(
-      auction_configuration.auction_signals());
 
-  InterestGroup* inputs_interest_group = input.mutable_interest_group();
+  InterestGroup* inputs_interest_group = input->mutable_interest_group();
   inputs_interest_group->set_name(interest_group_state.name());
   inputs_interest_group->set_owner(interest_group_state.owner());
   inputs_interest_group->set_bidding_logic_url(
       interest_group_state.bidding_logic_url());
+  inputs_interest_group->mutable_ads()->Reserve(
+      interest_group_state.ads_size());
   for (const auto& ad : interest_group_state.ads()) {
-    inputs_interest_group->mutable_ads()->Add()->CopyFrom(ad);
+    inputs_interest_group->mutable_ads()->UnsafeArenaAddAllocated(Alias(ad));
   }
 
-  inputs_interest_group->mutable_user_bidding_signals()->CopyFrom(
-      interest_group_state.user_bidding_signals());
-  input.mutable_browser_signals()->CopyFrom(
-      interest_group_state.browser_signals());
-  *input.mutable_trusted_bidding_signals() =
-      interest_group_state.trusted_bidding_signals();
+  inputs_interest_group->unsafe_arena_set_allocated_user_bidding_signals(
+      Alias(interest_group_state.user_bidding_signals()));
+  input->unsafe_arena_set_allocated_browser_signals(
+      Alias(interest_group_state.browser_signals()));
+  // Map fields cannot be aliased.
+  auto& trusted_bidding_signals = *input->mutable_trusted_bidding_signals();
+  trusted_bidding_signals = interest_group_state.trusted_bidding_signals();
+  if (looked_up_trusted_bidding_signals != nullptr) {
+    for (const std::string& key :
+         interest_group_state.trusted_bidding_signals_keys()) {
+      const auto it = looked_up_trusted_bidding_signals->find(key);
+      if (it != looked_up_trusted_bidding_signals->end() &&
+          trusted_bidding_signals.count(key) == 0) {
+        trusted_bidding_signals[key] = it->second;
+      }
+    }
+  }
   return input;
 }
 
-AdScoringFunctionInput CreateAdScoringInputs(
+// Returns the input of the ad scoring function for `output`. The auction
+// configuration is left out, since it is shared by all the bids of an auction.
+// The input is allocated on `arena` and aliases `output` and
+// `trusted_scoring_signals`.
+AdScoringFunctionInput* CreateAdScoringInputs(
     const BiddingFunctionOutput& output,
-    const AuctionConfiguration& auction_configuration,
     const google::protobuf::Map<std::string, google::protobuf::Struct>&
-        trusted_scoring_signals) {
-  AdScoringFunctionInput ad_scoring_function_input;
-  ad_scoring_function_input.mutable_auction_config()->CopyFrom(
-      auction_configuration);
-  ad_scoring_function_input.mutable_ad_metadata()->CopyFrom(output.ad());
-  ad_scoring_function_input.set_bid(output.bid());
+        trusted_scoring_signals,
+    google::protobuf::Arena* arena) {
+  auto* input =
+      google::protobuf::Arena::CreateMessage<AdScoringFunctionInput>(arena);
+  input->unsafe_arena_set_allocated_ad_metadata(Alias(output.ad()));
+  input->set_bid(output.bid());
   const auto& it = trusted_scoring_signals.find(output.render_url());
   if (it != trusted_scoring_signals.cend()) {
-    ad_scoring_function_input.mutable_trusted_scoring_signals()->CopyFrom(
-        it->second);
+    input->unsafe_arena_set_allocated_trusted_scoring_signals(
+        Alias(it->second));
   }
   // TODO(b/191545684): provide browser signals to the ad scoring function
-  return ad_scoring_function_input;
+  return input;
 }
 
 ScoredInterestGroupBid GetScoredInterestGroupBid(
@@ -129,87 +642,368 @@ ScoredInterestGroupBid GetScoredInterestGroupBid(
   return scored_interest_group_bid;
 }
 
-absl::StatusOr<std::map<std::string, std::string>> GetFunctionSourceCodes(
+// Runs `tasks` concurrently on up to --function_build_threads threads, and
+// waits for all of them to complete.
+void RunInParallel(std::vector<std::function<void()>> tasks) {
+  if (tasks.empty()) {
+    return;
+  }
+  ::aviary::util::ThreadPool thread_pool(
+      std::clamp(absl::GetFlag(FLAGS_function_build_threads), 1,
+                 static_cast<int>(tasks.size())));
+  for (auto& task : tasks) {
+    thread_pool.Schedule(std::move(task));
+  }
+  // The thread pool destructor waits for the scheduled tasks.
+}
+
+// Adds tasks to `fetches` that fetch the source code of the `specifications`
+// into `source_codes`.
+void AddSourceCodeFetches(
     const FunctionSource& function_source,
-    const std::vector<FunctionSpecification>& specifications) {
-  std::map<std::string, std::string> functions_code;
-  for (const auto& function_specification : specifications) {
-    ASSIGN_OR_RETURN(auto source_code,
-                     function_source.GetFunctionCode(function_specification));
-    if (!functions_code.insert({function_specification.uri, source_code})
+    const std::vector<FunctionSpecification>& specifications,
+    std::vector<absl::StatusOr<std::string>>* source_codes,
+    std::vector<std::function<void()>>* fetches) {
+  source_codes->resize(specifications.size());
+  for (size_t i = 0; i < specifications.size(); i++) {
+    fetches->push_back([&function_source, &specifications, source_codes, i] {
+      (*source_codes)[i] = function_source.GetFunctionCode(specifications[i]);
+    });
+  }
+}
+
+InvocationLimiter::Limits GetInvocationLimits(
+    const FunctionSpecification& specification) {
+  return {.max_concurrent_batches = std::max(
+              0, specification.max_concurrent_batches.value_or(
+                     absl::GetFlag(FLAGS_function_max_concurrent_batches))),
+          .max_queued_batches = std::max(
+              0, specification.max_queued_batches.value_or(
+                     absl::GetFlag(FLAGS_function_max_queued_batches)))};
+}
+
+// Source code of a function and the options to build it with.
+struct FunctionDefinition {
+  std::string source_code;
+  FunctionOptions options;
+  bool memoize = false;
+  // Not part of the build, so that changing them does not rebuild the
+  // function.
+  InvocationLimiter::Limits limits;
+  int scheduling_weight = 1;
+};
+
+// Maps the URIs of the `specifications` to their definitions, given their
+// fetched `source_codes`. Returns the first fetch error in the order of the
+// specifications, if any.
+absl::StatusOr<std::map<std::string, FunctionDefinition>>
+GetFunctionDefinitions(const std::vector<FunctionSpecification>& specifications,
+                       std::vector<absl::StatusOr<std::string>> source_codes) {
+  std::map<std::string, FunctionDefinition> definitions;
+  for (size_t i = 0; i < specifications.size(); i++) {
+    ASSIGN_OR_RETURN(auto source_code, std::move(source_codes[i]));
+    if (!definitions
+             .insert({specifications[i].uri,
+                      {.source_code = std::move(source_code),
+                       .options = GetFunctionOptions(specifications[i]),
+                       .memoize = specifications[i].memoize,
+                       .limits = GetInvocationLimits(specifications[i]),
+                       .scheduling_weight = std::max(
+                           1, specifications[i].scheduling_weight)}})
              .second) {
       return absl::InvalidArgumentError(absl::Substitute(
           "Function '$0' defined more than once in the configuration file.",
-          function_specification.uri));
+          specifications[i].uri));
     }
   }
-  return functions_code;
+  return definitions;
 }
 
-absl::StatusOr<std::unique_ptr<FunctionRepository>> CreateFunctionRepository(
-    const Configuration& configuration,
-    const FunctionSource& function_source) {
-  ASSIGN_OR_RETURN(auto bidding_function_source_codes,
-                   GetFunctionSourceCodes(
-                       function_source, configuration.bidding_function_specs));
-  ASSIGN_OR_RETURN(
-      auto ad_scoring_function_source_codes,
-      GetFunctionSourceCodes(function_source,
-                             configuration.ad_scoring_function_specs));
-  absl::flat_hash_map<std::string,
-                      std::unique_ptr<BiddingFunctionInterface<
-                          BiddingFunctionInput, BiddingFunctionOutput>>>
-      bidding_functions;
-  bidding_functions.reserve(bidding_function_source_codes.size());
-  for (const auto& [uri, source] : bidding_function_source_codes) {
-    auto bidding_function_or_status =
-        absl::GetFlag(FLAGS_use_sandbox2)
-            ? FledgeSapiBiddingFunction::Create(
-                  source, FunctionOptions{.flatten_function_arguments = true})
-            : FledgeBiddingFunction::Create(
-                  source, FunctionOptions{.flatten_function_arguments = true});
-    if (bidding_function_or_status.ok()) {
-      bidding_functions.insert(
-          {uri, std::move(bidding_function_or_status.value())});
-    } else {
-      // Insert a placeholder to distinguish between unknown bidding functions
-      // versus those that are not currently available.
-      // TODO: increment a counter or otherwise track an error
-      bidding_functions.insert({uri, nullptr});
-    }
-  }
-  absl::flat_hash_map<std::string,
-                      std::unique_ptr<BiddingFunctionInterface<
-                          AdScoringFunctionInput, AdScoringFunctionOutput>>>
-      ad_scoring_functions;
-  ad_scoring_functions.reserve(ad_scoring_function_source_codes.size());
-  for (const auto& [uri, source] : ad_scoring_function_source_codes) {
-    auto ad_scoring_function_or_status =
-        absl::GetFlag(FLAGS_use_sandbox2)
-            ? FledgeSapiAdScoringFunction::Create(
-                  source, FunctionOptions{.flatten_function_arguments = true})
-            : FledgeAdScoringFunction::Create(
-                  source, FunctionOptions{.flatten_function_arguments = true});
-    if (ad_scoring_function_or_status.ok()) {
-      ad_scoring_functions.insert(
-          {uri, std::move(ad_scoring_function_or_status.value())});
+// Returns what the function of `definition` is built from.
+FunctionBuild GetFunctionBuild(const FunctionDefinition& definition) {
+  return {.source_code = definition.source_code,
+          .warm_up_iterations = definition.options.warm_up_iterations,
+          .warm_up_inputs = definition.options.warm_up_inputs,
+          .sandbox_trust_domain = definition.options.sandbox_trust_domain,
+          .max_heap_size_bytes = definition.options.max_heap_size_bytes,
+          .memoize = definition.memoize};
+}
+
+// Fills `functions` with an entry for each of the `definitions`, and adds
+// tasks to `builds` that build the functions into these entries. Functions
+// whose definition did not change since they were built for
+// `previous_functions` are carried over rather than rebuilt.
+//
+// Neither `definitions` nor `functions` may change until the builds are done.
+template <typename Function, typename SapiFunction, typename Entry>
+void AddFunctionBuilds(
+    const std::map<std::string, FunctionDefinition>& definitions,
+    const absl::flat_hash_map<std::string, Entry>& previous_functions,
+    absl::flat_hash_map<std::string, Entry>* functions,
+    std::vector<std::function<void()>>* builds) {
+  functions->reserve(definitions.size());
+  for (const auto& [uri, definition] : definitions) {
+    FunctionBuild build = GetFunctionBuild(definition);
+    const auto previous_it = previous_functions.find(uri);
+    if (previous_it != previous_functions.end() &&
+        previous_it->second.function != nullptr &&
+        *previous_it->second.build == build) {
+      Entry& entry =
+          functions->insert({uri, previous_it->second}).first->second;
+      entry.limiter->SetLimits(definition.limits);
+      entry.scheduling_weight = definition.scheduling_weight;
     } else {
-      // Insert a placeholder to distinguish between unknown ad scoring
-      // functions versus those that are not currently available.
-      // TODO: increment a counter or otherwise track an error
-      ad_scoring_functions.insert({uri, nullptr});
+      // Insert a placeholder to distinguish between unknown functions versus
+      // those that are not currently available. Builds replace it with the
+      // function if it builds successfully.
+      functions->insert(
+          {uri, Entry{.build = std::make_shared<const FunctionBuild>(
+                          std::move(build)),
+                      .scheduling_weight = definition.scheduling_weight,
+                      .metrics = GetAuctionFunctionMetrics(
+                          uri, std::is_same_v<Entry, BiddingFunctionEntry>,
+                          definition.memoize)}});
     }
   }
+  // No more insertions past this point, so the entries stay in place.
+  for (const auto& [uri, definition] : definitions) {
+    Entry* entry = &functions->at(uri);
+    if (entry->function != nullptr) {
+      continue;
+    }
+    builds->push_back([uri = absl::string_view(uri), &definition, entry] {
+      const absl::Time start = absl::Now();
+      auto function_or_status =
+          absl::GetFlag(FLAGS_use_sandbox2)
+              ? SapiFunction::Create(definition.source_code, definition.options)
+              : Function::Create(definition.source_code, definition.options);
+      entry->build_duration = absl::Now() - start;
+      if (function_or_status.ok()) {
+        entry->function = std::move(function_or_status.value());
+        entry->limiter =
+            std::make_shared<InvocationLimiter>(definition.limits);
+        if (definition.memoize) {
+          entry->memo = std::make_shared<typename Entry::Memo>(
+              std::max(1, absl::GetFlag(FLAGS_memoized_function_outputs)));
+        }
+      } else {
+        GetFunctionBuildFailureCounter(uri).Increment();
+      }
+      GetFunctionBuildHistogram(uri).RecordDuration(entry->build_duration);
+    });
+  }
+}
+
+// Creates a repository with the configured functions, fetching their source
+// codes and building them in parallel. Unchanged functions of
+// `previous_repository`, if any, are shared with the new repository.
+absl::StatusOr<std::unique_ptr<FunctionRepository>> CreateFunctionRepository(
+    const Configuration& configuration, const FunctionSource& function_source,
+    const FunctionRepository* previous_repository = nullptr) {
+  std::vector<absl::StatusOr<std::string>> fetched_bidding_function_codes;
+  std::vector<absl::StatusOr<std::string>> fetched_ad_scoring_function_codes;
+  std::vector<std::function<void()>> fetches;
+  AddSourceCodeFetches(function_source, configuration.bidding_function_specs,
+                       &fetched_bidding_function_codes, &fetches);
+  AddSourceCodeFetches(function_source,
+                       configuration.ad_scoring_function_specs,
+                       &fetched_ad_scoring_function_codes, &fetches);
+  RunInParallel(std::move(fetches));
+  ASSIGN_OR_RETURN(
+      auto bidding_function_definitions,
+      GetFunctionDefinitions(configuration.bidding_function_specs,
+                             std::move(fetched_bidding_function_codes)));
+  ASSIGN_OR_RETURN(
+      auto ad_scoring_function_definitions,
+      GetFunctionDefinitions(configuration.ad_scoring_function_specs,
+                             std::move(fetched_ad_scoring_function_codes)));
+
+  const FunctionRepository empty_repository({}, {});
+  if (previous_repository == nullptr) {
+    previous_repository = &empty_repository;
+  }
+  absl::flat_hash_map<std::string, BiddingFunctionEntry> bidding_functions;
+  absl::flat_hash_map<std::string, AdScoringFunctionEntry> ad_scoring_functions;
+  std::vector<std::function<void()>> builds;
+  AddFunctionBuilds<FledgeBiddingFunction, FledgeSapiBiddingFunction>(
+      bidding_function_definitions, previous_repository->bidding_functions(),
+      &bidding_functions, &builds);
+  AddFunctionBuilds<FledgeAdScoringFunction, FledgeSapiAdScoringFunction>(
+      ad_scoring_function_definitions,
+      previous_repository->ad_scoring_functions(), &ad_scoring_functions,
+      &builds);
+  RunInParallel(std::move(builds));
   return std::make_unique<FunctionRepository>(std::move(bidding_functions),
                                               std::move(ad_scoring_functions));
 }
+
+// Returns the deadline of the RPC of `context`, or the infinite future if it
+// has none.
+absl::Time GetRpcDeadline(const grpc::ServerContext* context) {
+  if (context == nullptr ||
+      context->deadline() == std::chrono::system_clock::time_point::max()) {
+    return absl::InfiniteFuture();
+  }
+  return absl::FromChrono(context->deadline());
+}
+
+// Returns the deadline of an auction starting now: --auction_deadline from now,
+// or --auction_rpc_deadline_margin before the deadline of its RPC if sooner.
+absl::Time GetAuctionDeadline(const grpc::ServerContext* context) {
+  return std::min(absl::Now() + absl::GetFlag(FLAGS_auction_deadline),
+                  GetRpcDeadline(context) -
+                      absl::GetFlag(FLAGS_auction_rpc_deadline_margin));
+}
+
+// Returns a recorder for the trace of the auction of `context` if its client
+// asks for one, or if the auction is sampled, and null otherwise.
+std::shared_ptr<TraceRecorder> StartAuctionTrace(
+    const grpc::ServerContext* context) {
+  if (context == nullptr) {
+    // The trace could not be returned.
+    return nullptr;
+  }
+  bool is_traced = absl::GetFlag(FLAGS_allow_requested_auction_traces) &&
+                   context->client_metadata().find(kTraceMetadataKey) !=
+                       context->client_metadata().end();
+  const double sampling_rate = absl::GetFlag(FLAGS_auction_trace_sampling_rate);
+  if (!is_traced && sampling_rate > 0) {
+    thread_local absl::InsecureBitGen bitgen;
+    is_traced = absl::Bernoulli(bitgen, sampling_rate);
+  }
+  return is_traced ? std::make_shared<TraceRecorder>() : nullptr;
+}
+
+// An auction, shared with its buyers. Buyers can outlive the auction if it has
+// a deadline, and the request along with it.
+struct AuctionState {
+  bool AreBuyersDone() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex) {
+    return pending_buyers == 0;
+  }
+
+  // The whole auction runs against the same snapshot of the functions.
+  std::shared_ptr<const FunctionRepository> function_repository;
+  // Records the trace of the auction, if traced. Late buyers keep recording
+  // into it once the trace is returned.
+  std::shared_ptr<TraceRecorder> trace_recorder;
+  // Shared with the buyers, so that it lasts as long as they do.
+  std::shared_ptr<const RunAdAuctionRequest> request;
+  // Cached state of the versioned interest groups of the request, which their
+  // resolved versions on `arena` alias.
+  std::vector<std::shared_ptr<const InterestGroupAuctionState>>
+      lasting_interest_group_states;
+  // Intermediate messages of all the buyers are allocated on the same arena,
+  // and are freed at once along with the auction.
+  google::protobuf::Arena arena;
+  // Interest groups grouped by their bidding function, so that each bidding
+  // function gets invoked once per auction. Buyers are kept in the order of
+  // their first appearance in the request.
+  struct Buyer {
+    absl::string_view bidding_logic_url;
+    std::vector<const InterestGroupAuctionState*> interest_groups;
+    bool skipped = false;
+  };
+  std::vector<Buyer> buyers;
+  absl::Mutex mutex;
+  // Result of each buyer once it is done, in the order of `buyers`.
+  std::vector<
+      absl::optional<absl::StatusOr<std::vector<ScoredInterestGroupBid>>>>
+      buyer_results ABSL_GUARDED_BY(mutex);
+  int pending_buyers ABSL_GUARDED_BY(mutex) = 0;
+};
+
+// The batches of a BatchComputeBid RPC, one per bidding function.
+struct BatchComputeBidState {
+  bool HasDoneBatches() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex) {
+    return !done_batches.empty() || pending_batches == 0;
+  }
+
+  std::shared_ptr<const FunctionRepository> function_repository;
+  // Indexes of the requests of each batch.
+  std::vector<std::vector<int>> batches;
+  absl::Mutex mutex;
+  // Results of the batches done since they were last written.
+  std::vector<BatchComputeBidResponse> done_batches ABSL_GUARDED_BY(mutex);
+  size_t pending_batches ABSL_GUARDED_BY(mutex) = 0;
+};
+
+// Reports the buyer of `bidding_logic_url` as left out of the auction of
+// `response` for `reason`, and counts it if `is_configured`.
+DroppedBuyer* AddDroppedBuyer(absl::string_view bidding_logic_url,
+                              DroppedBuyer::Reason reason, bool is_configured,
+                              RunAdAuctionResponse* response) {
+  DroppedBuyer* dropped_buyer = response->add_dropped_buyers();
+  dropped_buyer->set_bidding_logic_url(std::string(bidding_logic_url));
+  dropped_buyer->set_reason(reason);
+  if (is_configured) {
+    GetDroppedBuyerCounter(bidding_logic_url, reason).Increment();
+  }
+  return dropped_buyer;
+}
+
+// Orders bids by decreasing desirability score.
+bool IsMoreDesirable(const ScoredInterestGroupBid& first_bid,
+                     const ScoredInterestGroupBid& second_bid) {
+  return first_bid.desirability_score() > second_bid.desirability_score();
+}
+
+// Keeps the `count` most desirable of `bids`, in no particular order.
+void KeepMostDesirableBids(size_t count,
+                           std::vector<ScoredInterestGroupBid>* bids) {
+  if (bids->size() <= count) {
+    return;
+  }
+  std::nth_element(bids->begin(), bids->begin() + count, bids->end(),
+                   IsMoreDesirable);
+  bids->erase(bids->begin() + count, bids->end());
+}
+
+// Returns whether the inputs of a failed batch may succeed in smaller
+// batches. Running out of time or memory only gets worse by retrying.
+bool IsWorthBisecting(const absl::Status& status) {
+  return status.code() != absl::StatusCode::kDeadlineExceeded &&
+         status.code() != absl::StatusCode::kResourceExhausted;
+}
+
+// Appends to `results` the outcome of invoking `function` on `inputs`, whose
+// batch failed with `status`, by bisecting it to isolate the failing inputs.
+// Inputs get the failure of their batch once it cannot be split any further,
+// is not worth bisecting, or `deadline` has passed.
+void BisectFailedBatch(
+    const BiddingFunctionInterface<BiddingFunctionInput, BiddingFunctionOutput>&
+        function,
+    const BiddingFunctionInput& common_input,
+    absl::Span<const BiddingFunctionInput* const> inputs,
+    const absl::Status& status, absl::Time deadline,
+    std::vector<absl::StatusOr<BiddingFunctionOutput>>* results) {
+  if (inputs.size() == 1 || !IsWorthBisecting(status) ||
+      absl::Now() >= deadline) {
+    results->insert(results->end(), inputs.size(), status);
+    return;
+  }
+  const size_t half = inputs.size() / 2;
+  for (absl::Span<const BiddingFunctionInput* const> half_inputs :
+       {inputs.first(half), inputs.subspan(half)}) {
+    auto outputs = CheckBatchOutputCount(
+        function.BatchInvokeWithCommonInput(common_input, half_inputs),
+        half_inputs.size());
+    if (outputs.ok()) {
+      for (auto& output : *outputs) {
+        results->push_back(std::move(output));
+      }
+    } else {
+      BisectFailedBatch(function, common_input, half_inputs, outputs.status(),
+                        deadline, results);
+    }
+  }
+}
 }  // namespace
 
-absl::StatusOr<std::unique_ptr<::aviary::AdAuctions::Service>>
-AdAuctionsImpl::Create(
+absl::StatusOr<std::unique_ptr<AdAuctionsImpl>> AdAuctionsImpl::Create(
     const FunctionSource& function_source,
     absl::string_view configuration_file_name,
-    const ::aviary::util::PeriodicFunctionFactory& periodic_function_factory) {
+    const ::aviary::util::PeriodicFunctionFactory& periodic_function_factory,
+    const TrustedSignalsFetcher& trusted_signals_fetcher) {
   try {
     YAML::Node config = YAML::LoadFile(std::string(configuration_file_name));
     Configuration configuration{
@@ -218,8 +1012,25 @@ AdAuctionsImpl::Create(
         .ad_scoring_function_specs =
             config["adScoringFunctions"]
                 .as<std::vector<FunctionSpecification>>()};
+    const std::filesystem::path configuration_directory =
+        std::filesystem::path(std::string(configuration_file_name))
+            .parent_path();
+    RETURN_IF_ERROR(ReadWarmUpInputFiles(
+        configuration_directory, &configuration.bidding_function_specs));
+    RETURN_IF_ERROR(ReadWarmUpInputFiles(
+        configuration_directory, &configuration.ad_scoring_function_specs));
+    for (const FunctionSpecification& specification :
+         configuration.bidding_function_specs) {
+      if (specification.memoize) {
+        return absl::InvalidArgumentError(absl::Substitute(
+            "Bidding function '$0' cannot be memoized, only ad scoring "
+            "functions can.",
+            specification.uri));
+      }
+    }
     return AdAuctionsImpl::Create(configuration, function_source,
-                                  periodic_function_factory);
+                                  periodic_function_factory,
+                                  trusted_signals_fetcher);
   } catch (YAML::BadFile&) {
     return absl::NotFoundError("Could not open the YAML configuration file");
   } catch (YAML::ParserException&) {
@@ -234,16 +1045,104 @@ grpc::Status AdAuctionsImpl::ComputeBid(
     ::grpc::ServerContext* context,
     const ::aviary::ComputeBidRequest* request,
     ::aviary::BiddingFunctionOutput* response) {
-  const absl::StatusOr<BiddingFunctionOutput> bidding_result =
-      RunGenerateBidFunction(request->bidding_function_name(),
-                             request->input());
-  if (bidding_result.ok()) {
-    response->CopyFrom(bidding_result.value());
-  } else {
-    // TODO(b/194695646): record and expose failure metrics
-    return grpc::Status(
-        static_cast<grpc::StatusCode>(bidding_result.status().code()),
-        std::string(bidding_result.status().message()));
+  absl::StatusOr<std::vector<absl::StatusOr<BiddingFunctionOutput>>>
+      bidding_results = RunGenerateBidFunction(
+          *GetFunctionRepository(), request->bidding_function_name(),
+          /*common_input=*/BiddingFunctionInput(), {&request->input()},
+          GetRpcDeadline(context));
+  // Failures and rejections are counted by `RunGenerateBidFunction()`.
+  const absl::Status status = bidding_results.ok()
+                                  ? bidding_results->front().status()
+                                  : bidding_results.status();
+  if (!status.ok()) {
+    return grpc::Status(static_cast<grpc::StatusCode>(status.code()),
+                        std::string(status.message()));
+  }
+  response->Swap(&bidding_results->front().value());
+  return grpc::Status::OK;
+}
+
+grpc::Status AdAuctionsImpl::BatchComputeBid(
+    ::grpc::ServerContext* context,
+    const ::aviary::BatchComputeBidRequest* request,
+    ::grpc::ServerWriter<::aviary::BatchComputeBidResponse>* writer) {
+  auto state = std::make_shared<BatchComputeBidState>();
+  state->function_repository = GetFunctionRepository();
+  absl::flat_hash_map<absl::string_view, size_t> batch_indexes;
+  for (int i = 0; i < request->requests_size(); i++) {
+    auto [it, inserted] = batch_indexes.try_emplace(
+        request->requests(i).bidding_function_name(), state->batches.size());
+    if (inserted) {
+      state->batches.emplace_back();
+    }
+    state->batches[it->second].push_back(i);
+  }
+  {
+    absl::MutexLock lock(&state->mutex);
+    state->pending_batches = state->batches.size();
+  }
+
+  // Batches run concurrently on the auction executor, while this thread writes
+  // their results in the order they are done. Waiting for all of them keeps
+  // `request` alive for as long as they use it.
+  const absl::Time deadline = GetRpcDeadline(context);
+  auto run_batch = [this, state, request, deadline](size_t batch_index) {
+    const std::vector<int>& batch = state->batches[batch_index];
+    std::vector<const BiddingFunctionInput*> inputs;
+    inputs.reserve(batch.size());
+    for (int index : batch) {
+      inputs.push_back(&request->requests(index).input());
+    }
+    absl::StatusOr<std::vector<absl::StatusOr<BiddingFunctionOutput>>>
+        bidding_results = RunGenerateBidFunction(
+            *state->function_repository,
+            request->requests(batch.front()).bidding_function_name(),
+            /*common_input=*/BiddingFunctionInput(), inputs, deadline);
+    BatchComputeBidResponse response;
+    response.mutable_results()->Reserve(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+      BatchComputeBidResponse::Result* result = response.add_results();
+      result->set_index(batch[i]);
+      if (bidding_results.ok() && (*bidding_results)[i].ok()) {
+        result->mutable_output()->Swap(&(*bidding_results)[i].value());
+      } else {
+        // Failures and rejections are counted by `RunGenerateBidFunction()`.
+        const absl::Status status = bidding_results.ok()
+                                        ? (*bidding_results)[i].status()
+                                        : bidding_results.status();
+        result->set_error_code(static_cast<int>(status.code()));
+        result->set_error_message(std::string(status.message()));
+      }
+    }
+    absl::MutexLock lock(&state->mutex);
+    state->done_batches.push_back(std::move(response));
+    state->pending_batches--;
+  };
+  for (size_t batch_index = 0; batch_index < state->batches.size();
+       batch_index++) {
+    ScheduleBiddingFunctionTask(
+        *state->function_repository,
+        request->requests(state->batches[batch_index].front())
+            .bidding_function_name(),
+        [run_batch, batch_index] { run_batch(batch_index); });
+  }
+  // Once the client is gone, the remaining results are dropped.
+  bool is_client_reading = true;
+  bool is_done = false;
+  while (!is_done) {
+    std::vector<BatchComputeBidResponse> done_batches;
+    state->mutex.LockWhen(
+        absl::Condition(state.get(), &BatchComputeBidState::HasDoneBatches));
+    done_batches.swap(state->done_batches);
+    is_done = state->pending_batches == 0;
+    state->mutex.Unlock();
+    for (const BatchComputeBidResponse& response : done_batches) {
+      is_client_reading = is_client_reading && writer->Write(response);
+    }
+  }
+  if (!is_client_reading) {
+    return grpc::Status(grpc::StatusCode::CANCELLED,
+                        "The client stopped reading the results");
   }
   return grpc::Status::OK;
 }
@@ -252,93 +1151,587 @@ grpc::Status AdAuctionsImpl::RunAdAuction(
     ::grpc::ServerContext* context,
     const ::aviary::RunAdAuctionRequest* request,
     ::aviary::RunAdAuctionResponse* response) {
+  if (GetAuctionDeadline(context) == absl::InfiniteFuture()) {
+    // Buyers are all done by the end of the RPC, which owns the request.
+    return RunAdAuction(
+        context,
+        std::shared_ptr<const RunAdAuctionRequest>(std::shared_ptr<void>(),
+                                                   request),
+        response);
+  }
+  // Late buyers keep running once the RPC is over, and the request with them.
+  return RunAdAuction(context, std::make_shared<RunAdAuctionRequest>(*request),
+                      response);
+}
+
+grpc::Status AdAuctionsImpl::RunAdAuction(
+    ::grpc::ServerContext* context,
+    std::shared_ptr<const ::aviary::RunAdAuctionRequest> request,
+    ::aviary::RunAdAuctionResponse* response) {
+  if (request->interest_group_cache_scope().empty() &&
+      absl::c_any_of(request->interest_groups(),
+                     [](const InterestGroupAuctionState& interest_group) {
+                       return interest_group.version() != 0;
+                     })) {
+    return grpc::Status(
+        grpc::StatusCode::INVALID_ARGUMENT,
+        "Versioned interest groups require an interest_group_cache_scope");
+  }
+  const absl::Time deadline = GetAuctionDeadline(context);
+  const bool has_deadline = deadline != absl::InfiniteFuture();
+  auto state = std::make_shared<AuctionState>();
+  state->function_repository = GetFunctionRepository();
+  state->trace_recorder = StartAuctionTrace(context);
+  // The trace is returned however the auction ends.
+  absl::Cleanup return_trace = [context, recorder = state->trace_recorder] {
+    if (recorder != nullptr) {
+      context->AddTrailingMetadata(
+          kTraceTrailerKey,
+          recorder->ToProto(kMaxTraceTrailerBytes).SerializeAsString());
+    }
+  };
+  ScopedTraceContext trace_context(state->trace_recorder.get());
+  state->request = std::move(request);
+  const AuctionConfiguration& auction_configuration =
+      state->request->auction_configuration();
   absl::flat_hash_set<std::string> interest_group_buyers(
-      request->auction_configuration().interest_group_buyers().cbegin(),
-      request->auction_configuration().interest_group_buyers().cend());
-  std::vector<ScoredInterestGroupBid> scored_bids;
-  for (const auto& interest_group : request->interest_groups()) {
-    if (!interest_group_buyers.contains(interest_group.owner())) {
+      auction_configuration.interest_group_buyers().cbegin(),
+      auction_configuration.interest_group_buyers().cend());
+  absl::flat_hash_map<absl::string_view, size_t> buyer_indexes;
+  for (const auto& request_interest_group :
+       state->request->interest_groups()) {
+    if (!interest_group_buyers.contains(request_interest_group.owner())) {
       // Skip disallowed interest group owners.
       // Browser clients can perform this pre-filtering before calling
       // RunAdAuctions, but it never hurts to double-check.
       continue;
     }
-    const absl::StatusOr<BiddingFunctionOutput> bidding_result =
-        RunGenerateBidFunction(
-            interest_group.bidding_logic_url(),
-            CreateBiddingFunctionInput(interest_group,
-                                       request->auction_configuration()));
-    if (!bidding_result.ok()) {
-      // TODO(b/194695646): record and expose failure metrics
+    const InterestGroupAuctionState* interest_group = &request_interest_group;
+    if (request_interest_group.version() != 0) {
+      std::shared_ptr<const InterestGroupAuctionState> lasting_state =
+          interest_group_cache_.Resolve(
+              state->request->interest_group_cache_scope(),
+              request_interest_group);
+      if (lasting_state == nullptr) {
+        InterestGroupAuctionState* uncached_interest_group =
+            response->add_uncached_interest_groups();
+        uncached_interest_group->set_owner(request_interest_group.owner());
+        uncached_interest_group->set_name(request_interest_group.name());
+        uncached_interest_group->set_version(request_interest_group.version());
+        continue;
+      }
+      interest_group = CreateVersionedInterestGroup(
+          request_interest_group, *lasting_state, &state->arena);
+      state->lasting_interest_group_states.push_back(std::move(lasting_state));
+    }
+    auto [it, inserted] = buyer_indexes.try_emplace(
+        interest_group->bidding_logic_url(), state->buyers.size());
+    if (inserted) {
+      state->buyers.push_back(
+          {.bidding_logic_url = it->first,
+           .skipped = IsBuyerSkipped(interest_group->bidding_logic_url())});
+    }
+    state->buyers[it->second].interest_groups.push_back(interest_group);
+  }
+
+  // Buyers are run concurrently, and the bids of each buyer get scored as soon
+  // as they are in. Without a deadline, the calling thread runs the last buyer
+  // itself rather than waiting idle. Each buyer has its own result slot, so
+  // that results are combined in a deterministic order.
+  std::vector<size_t> running_buyers;
+  for (size_t i = 0; i < state->buyers.size(); i++) {
+    if (!state->buyers[i].skipped) {
+      running_buyers.push_back(i);
+    }
+  }
+  {
+    absl::MutexLock lock(&state->mutex);
+    state->buyer_results.resize(state->buyers.size());
+    state->pending_buyers = static_cast<int>(running_buyers.size());
+  }
+  auto run_buyer = [this, state, deadline](size_t buyer_index,
+                                           absl::Time scheduled) {
+    const AuctionState::Buyer& buyer = state->buyers[buyer_index];
+    ScopedTraceContext trace_context(state->trace_recorder.get());
+    if (TraceRecorder* recorder = state->trace_recorder.get();
+        recorder != nullptr) {
+      const int queue_span = recorder->AddSpan(
+          "executor_queue", TraceRecorder::kNoSpan, scheduled, absl::Now());
+      recorder->SetAttribute(queue_span, "function", buyer.bidding_logic_url);
+    }
+    ScopedTraceSpan buyer_span("buyer");
+    buyer_span.SetAttribute("function", buyer.bidding_logic_url);
+    absl::StatusOr<std::vector<ScoredInterestGroupBid>> result =
+        RunBuyerAuction(*state->function_repository, buyer.bidding_logic_url,
+                        buyer.interest_groups, *state->request, &state->arena,
+                        deadline);
+    absl::MutexLock lock(&state->mutex);
+    state->buyer_results[buyer_index] = std::move(result);
+    state->pending_buyers--;
+  };
+  const size_t scheduled_buyers =
+      has_deadline || running_buyers.empty() ? running_buyers.size()
+                                             : running_buyers.size() - 1;
+  for (size_t i = 0; i < scheduled_buyers; i++) {
+    const size_t buyer_index = running_buyers[i];
+    ScheduleBiddingFunctionTask(
+        *state->function_repository,
+        state->buyers[buyer_index].bidding_logic_url,
+        [run_buyer, buyer_index, scheduled = absl::Now()] {
+          run_buyer(buyer_index, scheduled);
+        });
+  }
+  if (scheduled_buyers < running_buyers.size()) {
+    run_buyer(running_buyers.back(), absl::Now());
+  }
+  // Buyers still running past the deadline are left out of the auction.
+  std::vector<
+      absl::optional<absl::StatusOr<std::vector<ScoredInterestGroupBid>>>>
+      buyer_results(state->buyers.size());
+  state->mutex.LockWhenWithDeadline(
+      absl::Condition(state.get(), &AuctionState::AreBuyersDone), deadline);
+  for (size_t i = 0; i < state->buyers.size(); i++) {
+    // Late buyers still write their result to their slot, which stays in place.
+    if (state->buyer_results[i].has_value()) {
+      buyer_results[i] = std::move(state->buyer_results[i]);
+    }
+  }
+  state->mutex.Unlock();
+
+  // Auctions returning their top bids only keep as many as twice that number
+  // while merging the bids of the buyers, and only sort the returned ones.
+  const size_t max_returned_bids = state->request->max_returned_bids();
+  std::vector<ScoredInterestGroupBid> scored_bids;
+  absl::Status first_failure;
+  bool has_successful_buyer = false;
+  for (size_t i = 0; i < state->buyers.size(); i++) {
+    const absl::string_view bidding_logic_url =
+        state->buyers[i].bidding_logic_url;
+    // Only configured functions get their lateness tracked and counted, so
+    // that requests naming arbitrary URIs cannot inflate either.
+    const bool is_configured =
+        state->function_repository->bidding_functions().contains(
+            bidding_logic_url);
+    if (state->buyers[i].skipped) {
+      AddDroppedBuyer(bidding_logic_url, DroppedBuyer::SKIPPED, is_configured,
+                      response);
+      continue;
+    }
+    // Buyers starting or done bidding past the deadline give up on their own.
+    const bool is_late = !buyer_results[i].has_value() ||
+                         buyer_results[i]->status().code() ==
+                             absl::StatusCode::kDeadlineExceeded;
+    if (has_deadline && is_configured) {
+      RecordBuyerLateness(bidding_logic_url, is_late);
+    }
+    if (is_late) {
+      AddDroppedBuyer(bidding_logic_url, DroppedBuyer::LATE, is_configured,
+                      response);
       continue;
     }
-    const auto ad_scoring_result = RunScoreAdFunction(
-        request->auction_configuration().decision_logic_url(),
-        CreateAdScoringInputs(bidding_result.value(),
-                              request->auction_configuration(),
-                              request->trusted_scoring_signals()));
-    if (!ad_scoring_result.ok()) {
-      // TODO(b/194695646): record and expose failure metrics
-      return grpc::Status(
-          static_cast<grpc::StatusCode>(ad_scoring_result.status().code()),
-          std::string(ad_scoring_result.status().message()));
+    absl::StatusOr<std::vector<ScoredInterestGroupBid>>& buyer_result =
+        *buyer_results[i];
+    if (!buyer_result.ok()) {
+      // Failures are counted by `RunScoreAdFunction()`.
+      AddDroppedBuyer(bidding_logic_url, DroppedBuyer::FAILED, is_configured,
+                      response)
+          ->set_message(std::string(buyer_result.status().message()));
+      if (first_failure.ok()) {
+        first_failure = buyer_result.status();
+      }
+      continue;
     }
-    scored_bids.push_back(GetScoredInterestGroupBid(
-        interest_group, bidding_result.value(), ad_scoring_result.value()));
+    has_successful_buyer = true;
+    std::move(buyer_result->begin(), buyer_result->end(),
+              std::back_inserter(scored_bids));
+    if (max_returned_bids > 0 && scored_bids.size() >= 2 * max_returned_bids) {
+      KeepMostDesirableBids(max_returned_bids, &scored_bids);
+    }
+  }
+  if (!has_successful_buyer && !first_failure.ok()) {
+    // The bids of the other buyers, if any, are only lost when every buyer
+    // with bids failed.
+    response->Clear();
+    return grpc::Status(static_cast<grpc::StatusCode>(first_failure.code()),
+                        std::string(first_failure.message()));
   }
-  absl::c_sort(scored_bids, [](const auto& first_bid, const auto& second_bid) {
-    return first_bid.desirability_score() > second_bid.desirability_score();
-  });
-  auto loser_it = scored_bids.cbegin();
+  {
+    ScopedTraceSpan sort_span("sort");
+    if (max_returned_bids > 0) {
+      KeepMostDesirableBids(max_returned_bids, &scored_bids);
+    }
+    absl::c_sort(scored_bids, IsMoreDesirable);
+  }
+  auto loser_it = scored_bids.begin();
   if (!scored_bids.empty() && scored_bids.front().desirability_score() > 0) {
-    response->mutable_winning_bid()->CopyFrom(scored_bids.front());
+    response->mutable_winning_bid()->Swap(&scored_bids.front());
     loser_it++;
   }
   response->mutable_losing_bids()->Reserve(scored_bids.end() - loser_it);
   for (; loser_it != scored_bids.end(); ++loser_it) {
-    response->mutable_losing_bids()->Add()->CopyFrom(*loser_it);
+    response->mutable_losing_bids()->Add()->Swap(&*loser_it);
   }
   return grpc::Status::OK;
 }
 
-absl::StatusOr<BiddingFunctionOutput> AdAuctionsImpl::RunGenerateBidFunction(
+absl::StatusOr<std::vector<ScoredInterestGroupBid>>
+AdAuctionsImpl::RunBuyerAuction(
+    const FunctionRepository& function_repository,
+    absl::string_view bidding_logic_url,
+    const std::vector<const InterestGroupAuctionState*>& interest_groups,
+    const RunAdAuctionRequest& request, google::protobuf::Arena* arena,
+    absl::Time deadline) {
+  if (absl::Now() >= deadline) {
+    return absl::DeadlineExceededError("The auction is over");
+  }
+  const AuctionConfiguration& auction_configuration =
+      request.auction_configuration();
+  const absl::string_view decision_logic_url =
+      auction_configuration.decision_logic_url();
+  // Only configured functions get metrics, so that requests naming arbitrary
+  // URIs cannot inflate the number of metrics.
+  const auto bidding_it =
+      function_repository.bidding_functions().find(bidding_logic_url);
+  const AuctionFunctionMetrics* bidding_metrics =
+      bidding_it != function_repository.bidding_functions().end()
+          ? &bidding_it->second.metrics
+          : nullptr;
+  const auto ad_scoring_it =
+      function_repository.ad_scoring_functions().find(decision_logic_url);
+  const AuctionFunctionMetrics* ad_scoring_metrics =
+      ad_scoring_it != function_repository.ad_scoring_functions().end()
+          ? &ad_scoring_it->second.metrics
+          : nullptr;
+  absl::Time stage_start = absl::Now();
+  // Records the time since `stage_start` into the `stage` histogram of
+  // `metrics`, unless null, and starts the next stage.
+  auto end_stage = [&stage_start](const AuctionFunctionMetrics* metrics,
+                                  Histogram* AuctionFunctionMetrics::*stage) {
+    const absl::Time now = absl::Now();
+    if (metrics != nullptr) {
+      (metrics->*stage)->RecordDuration(now - stage_start);
+    }
+    stage_start = now;
+  };
+  // Fetching signals waits on the network, so that it is timed on its own.
+  absl::flat_hash_map<absl::string_view, TrustedSignals>
+      trusted_bidding_signals;
+  {
+    ScopedTraceSpan lookup_span("trusted_signals_lookup");
+    trusted_bidding_signals =
+        LookUpTrustedBiddingSignals(interest_groups, deadline);
+  }
+  end_stage(bidding_metrics,
+            &AuctionFunctionMetrics::trusted_signals_lookup_seconds);
+  const BiddingFunctionInput* common_bidding_input;
+  std::vector<const BiddingFunctionInput*> bidding_inputs;
+  bidding_inputs.reserve(interest_groups.size());
+  {
+    ScopedTraceSpan input_building_span("input_building");
+    common_bidding_input = CreateCommonBiddingFunctionInput(
+        interest_groups, auction_configuration, arena);
+    for (const InterestGroupAuctionState* interest_group : interest_groups) {
+      ScopedTraceSpan interest_group_span("interest_group_input");
+      interest_group_span.SetAttribute("interest_group",
+                                       interest_group->name());
+      const auto signals_it = trusted_bidding_signals.find(
+          interest_group->trusted_bidding_signals_url());
+      bidding_inputs.push_back(CreateBiddingFunctionInput(
+          *interest_group, auction_configuration, *common_bidding_input,
+          signals_it == trusted_bidding_signals.end() ? nullptr
+                                                      : &signals_it->second,
+          arena));
+    }
+  }
+  end_stage(bidding_metrics, &AuctionFunctionMetrics::input_building_seconds);
+  absl::StatusOr<std::vector<absl::StatusOr<BiddingFunctionOutput>>>
+      bidding_results =
+          RunGenerateBidFunction(function_repository, bidding_logic_url,
+                                 *common_bidding_input, bidding_inputs,
+                                 deadline);
+  end_stage(bidding_metrics, &AuctionFunctionMetrics::invocation_seconds);
+  // A rejected buyer fails, or is late if still queued at the deadline.
+  RETURN_IF_ERROR(bidding_results.status());
+  // Results are matched to interest groups by position.
+  if (bidding_results->size() != interest_groups.size()) {
+    return absl::InternalError(
+        "Bidding did not return a result per interest group");
+  }
+
+  std::vector<const InterestGroupAuctionState*> bidding_interest_groups;
+  std::vector<BiddingFunctionOutput> bids;
+  for (size_t i = 0; i < bidding_results->size(); i++) {
+    if (!(*bidding_results)[i].ok()) {
+      // Interest groups whose bidding function failed do not bid, see
+      // `RunGenerateBidFunction()` for how failures are counted.
+      continue;
+    }
+    bidding_interest_groups.push_back(interest_groups[i]);
+    bids.push_back(std::move((*bidding_results)[i]).value());
+  }
+  std::vector<ScoredInterestGroupBid> scored_bids;
+  if (bids.empty()) {
+    return scored_bids;
+  }
+  if (absl::Now() >= deadline) {
+    return absl::DeadlineExceededError("The auction is over");
+  }
+
+  auto* common_ad_scoring_input =
+      google::protobuf::Arena::CreateMessage<AdScoringFunctionInput>(arena);
+  common_ad_scoring_input->unsafe_arena_set_allocated_auction_config(
+      Alias(auction_configuration));
+  std::vector<const AdScoringFunctionInput*> ad_scoring_inputs;
+  ad_scoring_inputs.reserve(bids.size());
+  {
+    ScopedTraceSpan input_building_span("input_building");
+    for (const auto& bid : bids) {
+      ad_scoring_inputs.push_back(
+          CreateAdScoringInputs(bid, request.trusted_scoring_signals(), arena));
+    }
+  }
+  end_stage(ad_scoring_metrics,
+            &AuctionFunctionMetrics::input_building_seconds);
+  auto ad_scoring_results =
+      RunScoreAdFunction(function_repository, decision_logic_url,
+                         *common_ad_scoring_input, ad_scoring_inputs, deadline);
+  end_stage(ad_scoring_metrics, &AuctionFunctionMetrics::invocation_seconds);
+  RETURN_IF_ERROR(ad_scoring_results.status());
+  // Results are matched to bids by position.
+  if (ad_scoring_results->size() != bids.size()) {
+    return absl::InternalError("Scoring did not return a result per bid");
+  }
+  scored_bids.reserve(bids.size());
+  for (size_t i = 0; i < bids.size(); i++) {
+    scored_bids.push_back(GetScoredInterestGroupBid(
+        *bidding_interest_groups[i], bids[i], (*ad_scoring_results)[i]));
+  }
+  return scored_bids;
+}
+
+absl::StatusOr<std::vector<absl::StatusOr<BiddingFunctionOutput>>>
+AdAuctionsImpl::RunGenerateBidFunction(
+    const FunctionRepository& function_repository,
     absl::string_view bidding_logic_url,
-    const BiddingFunctionInput& input) {
-  absl::ReaderMutexLock lock(&function_repository_mutex_);
-  ASSIGN_OR_RETURN(auto function,
-                   function_repository_->GetBiddingFunction(bidding_logic_url));
-  ASSIGN_OR_RETURN(auto bids, function->BatchInvoke({input}));
-  return bids.back();
+    const BiddingFunctionInput& common_input,
+    absl::Span<const BiddingFunctionInput* const> inputs,
+    absl::Time deadline) {
+  ScopedTraceSpan bidding_span("bidding");
+  const auto function_or = [&] {
+    ScopedTraceSpan lookup_span("repository_lookup");
+    return function_repository.GetBiddingFunction(bidding_logic_url);
+  }();
+  if (!function_or.ok()) {
+    return std::vector<absl::StatusOr<BiddingFunctionOutput>>(
+        inputs.size(), function_or.status());
+  }
+  const BiddingFunctionEntry& entry =
+      function_repository.bidding_functions().at(bidding_logic_url);
+  // The batch is admitted once, retries included.
+  InvocationLimiter* limiter = entry.limiter.get();
+  RETURN_IF_ERROR(AdmitInvocation(entry.metrics, limiter, deadline,
+                                  &admission_wait_budget_));
+  absl::Cleanup release = [limiter] { ReleaseInvocation(limiter); };
+  auto bids_or = CheckBatchOutputCount(
+      function_or.value()->BatchInvokeWithCommonInput(common_input, inputs),
+      inputs.size());
+  std::vector<absl::StatusOr<BiddingFunctionOutput>> results;
+  results.reserve(inputs.size());
+  if (bids_or.ok()) {
+    for (auto& bid : bids_or.value()) {
+      results.push_back(std::move(bid));
+    }
+  } else {
+    BisectFailedBatch(*function_or.value(), common_input, inputs,
+                      bids_or.status(), deadline, &results);
+  }
+  const int64_t failure_count = absl::c_count_if(
+      results, [](const auto& result) { return !result.ok(); });
+  if (failure_count > 0) {
+    entry.metrics.failures->Increment(failure_count);
+  }
+  return results;
 }
 
-absl::StatusOr<AdScoringFunctionOutput> AdAuctionsImpl::RunScoreAdFunction(
+absl::StatusOr<std::vector<AdScoringFunctionOutput>>
+AdAuctionsImpl::RunScoreAdFunction(
+    const FunctionRepository& function_repository,
     absl::string_view ad_scoring_logic_url,
-    const AdScoringFunctionInput& input) {
-  absl::ReaderMutexLock lock(&function_repository_mutex_);
-  ASSIGN_OR_RETURN(auto function, function_repository_->GetAdScoringFunction(
-                                      ad_scoring_logic_url));
-  ASSIGN_OR_RETURN(auto output, function->BatchInvoke({input}));
-  return output.back();
+    const AdScoringFunctionInput& common_input,
+    absl::Span<const AdScoringFunctionInput* const> inputs,
+    absl::Time deadline) {
+  ScopedTraceSpan scoring_span("scoring");
+  const auto function_or = [&] {
+    ScopedTraceSpan lookup_span("repository_lookup");
+    return function_repository.GetAdScoringFunction(ad_scoring_logic_url);
+  }();
+  ASSIGN_OR_RETURN(auto function, function_or);
+  const AdScoringFunctionEntry& entry =
+      function_repository.ad_scoring_functions().at(ad_scoring_logic_url);
+  const auto& memo = entry.memo;
+  InvocationLimiter* limiter = entry.limiter.get();
+  if (memo == nullptr) {
+    RETURN_IF_ERROR(AdmitInvocation(entry.metrics, limiter, deadline,
+                                    &admission_wait_budget_));
+    absl::Cleanup release = [limiter] { ReleaseInvocation(limiter); };
+    auto outputs = CheckBatchOutputCount(
+        function->BatchInvokeWithCommonInput(common_input, inputs),
+        inputs.size());
+    if (!outputs.ok()) {
+      // A failure fails the invocations of all the inputs.
+      entry.metrics.failures->Increment(inputs.size());
+    }
+    return outputs;
+  }
+
+  // Only the inputs whose output is not memoized are scored, in a batch.
+  const uint64_t common_input_fingerprint = FingerprintMessage(common_input);
+  std::vector<AdScoringFunctionOutput> outputs(inputs.size());
+  std::vector<FunctionMemoKey> missed_keys;
+  std::vector<size_t> missed_indices;
+  std::vector<const AdScoringFunctionInput*> missed_inputs;
+  {
+    ScopedTraceSpan memo_lookup_span("memo_lookup");
+    for (size_t i = 0; i < inputs.size(); i++) {
+      const FunctionMemoKey key = {
+          .common_input_fingerprint = common_input_fingerprint,
+          .input_fingerprint = FingerprintMessage(*inputs[i])};
+      absl::optional<AdScoringFunctionOutput> output = memo->Lookup(key);
+      if (output.has_value()) {
+        outputs[i] = *std::move(output);
+      } else {
+        missed_keys.push_back(key);
+        missed_indices.push_back(i);
+        missed_inputs.push_back(inputs[i]);
+      }
+    }
+  }
+  entry.metrics.memo_hits->Increment(inputs.size() - missed_inputs.size());
+  if (missed_inputs.empty()) {
+    return outputs;
+  }
+  entry.metrics.memo_misses->Increment(missed_inputs.size());
+  RETURN_IF_ERROR(AdmitInvocation(entry.metrics, limiter, deadline,
+                                  &admission_wait_budget_));
+  absl::Cleanup release = [limiter] { ReleaseInvocation(limiter); };
+  // Outputs are checked before being memoized, since later lookups of their
+  // inputs return them.
+  auto missed_outputs = CheckBatchOutputCount(
+      function->BatchInvokeWithCommonInput(common_input, missed_inputs),
+      missed_inputs.size());
+  if (!missed_outputs.ok()) {
+    entry.metrics.failures->Increment(missed_inputs.size());
+    return missed_outputs.status();
+  }
+  for (size_t i = 0; i < missed_inputs.size(); i++) {
+    memo->Insert(missed_keys[i], (*missed_outputs)[i]);
+    outputs[missed_indices[i]] = std::move((*missed_outputs)[i]);
+  }
+  return outputs;
+}
+
+absl::flat_hash_map<absl::string_view, TrustedSignals>
+AdAuctionsImpl::LookUpTrustedBiddingSignals(
+    const std::vector<const InterestGroupAuctionState*>& interest_groups,
+    absl::Time deadline) {
+  absl::flat_hash_map<absl::string_view, std::vector<std::string>>
+      keys_by_url;
+  for (const InterestGroupAuctionState* interest_group : interest_groups) {
+    if (interest_group->trusted_bidding_signals_url().empty()) {
+      continue;
+    }
+    std::vector<std::string>& keys =
+        keys_by_url[interest_group->trusted_bidding_signals_url()];
+    for (const std::string& key :
+         interest_group->trusted_bidding_signals_keys()) {
+      if (interest_group->trusted_bidding_signals().count(key) == 0) {
+        keys.push_back(key);
+      }
+    }
+  }
+  absl::flat_hash_map<absl::string_view, TrustedSignals> signals_by_url;
+  for (auto& [url, keys] : keys_by_url) {
+    if (keys.empty()) {
+      continue;
+    }
+    // Interest groups of the same buyer often share keys.
+    absl::c_sort(keys);
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    absl::StatusOr<TrustedSignals> signals =
+        trusted_signals_cache_.Get(url, keys, deadline);
+    if (signals.ok()) {
+      // Failures are counted by the cache.
+      signals_by_url.emplace(url, *std::move(signals));
+    }
+  }
+  return signals_by_url;
+}
+
+bool AdAuctionsImpl::IsBuyerSkipped(
+    absl::string_view bidding_logic_url) const {
+  absl::MutexLock lock(&late_buyers_mutex_);
+  const auto it = late_buyers_.find(bidding_logic_url);
+  return it != late_buyers_.end() && absl::Now() < it->second.skipped_until;
+}
+
+void AdAuctionsImpl::RecordBuyerLateness(absl::string_view bidding_logic_url,
+                                         bool late) {
+  absl::MutexLock lock(&late_buyers_mutex_);
+  if (!late) {
+    late_buyers_.erase(bidding_logic_url);
+    return;
+  }
+  LateBuyer& late_buyer = late_buyers_[bidding_logic_url];
+  late_buyer.consecutive_late_auctions++;
+  const int skip_threshold = absl::GetFlag(FLAGS_late_buyer_skip_threshold);
+  if (skip_threshold > 0 &&
+      late_buyer.consecutive_late_auctions >= skip_threshold) {
+    late_buyer.skipped_until =
+        absl::Now() + absl::GetFlag(FLAGS_late_buyer_skip_duration);
+  }
 }
 
-absl::StatusOr<std::unique_ptr<::aviary::AdAuctions::Service>>
-AdAuctionsImpl::Create(
+absl::StatusOr<std::unique_ptr<AdAuctionsImpl>> AdAuctionsImpl::Create(
     const Configuration& configuration,
     const FunctionSource& function_source,
-    const util::PeriodicFunctionFactory& periodic_function_factory) {
+    const util::PeriodicFunctionFactory& periodic_function_factory,
+    const TrustedSignalsFetcher& trusted_signals_fetcher) {
+  if (absl::GetFlag(FLAGS_auction_executor_threads) < 1) {
+    // Auctions would wait forever for an executor without threads.
+    return absl::InvalidArgumentError(
+        "--auction_executor_threads must be at least 1");
+  }
+  ASSIGN_OR_RETURN(
+      std::vector<int> auction_executor_cpus,
+      util::ParseCpuSet(absl::GetFlag(FLAGS_auction_executor_cpus)));
+  RETURN_IF_ERROR(::aviary::v8::V8PlatformInitializer::CheckFlags());
   ASSIGN_OR_RETURN(auto initial_function_repository,
                    CreateFunctionRepository(configuration, function_source));
   return absl::WrapUnique(new AdAuctionsImpl(
       configuration, function_source, std::move(initial_function_repository),
-      periodic_function_factory));
+      periodic_function_factory, trusted_signals_fetcher,
+      std::move(auction_executor_cpus)));
 }
 
 AdAuctionsImpl::AdAuctionsImpl(
     const Configuration& configuration,
     const FunctionSource& function_source,
-    std::unique_ptr<FunctionRepository> initial_function_repository,
-    const ::aviary::util::PeriodicFunctionFactory& periodic_function_factory)
-    : function_repository_(std::move(initial_function_repository)),
+    std::shared_ptr<const FunctionRepository> initial_function_repository,
+    const ::aviary::util::PeriodicFunctionFactory& periodic_function_factory,
+    const TrustedSignalsFetcher& trusted_signals_fetcher,
+    std::vector<int> auction_executor_cpus)
+    : interest_group_cache_(
+          absl::GetFlag(FLAGS_interest_group_cache_ttl),
+          std::max(0, absl::GetFlag(FLAGS_interest_group_cache_capacity))),
+      trusted_signals_cache_(
+          trusted_signals_fetcher, absl::GetFlag(FLAGS_trusted_signals_ttl),
+          std::max(0, absl::GetFlag(FLAGS_trusted_signals_cache_capacity))),
+      auction_executor_(std::make_unique<::aviary::util::ThreadPool>(
+          absl::GetFlag(FLAGS_auction_executor_threads),
+          std::move(auction_executor_cpus))),
+      admission_wait_budget_(absl::GetFlag(FLAGS_auction_executor_threads) -
+                             1),
+      function_repository_(std::move(initial_function_repository)),
       repository_refresh_(periodic_function_factory(
           // Copy the configuration object for use during refreshes.
           absl::bind_front(&AdAuctionsImpl::RefreshFunctionRepository,
@@ -351,12 +1744,43 @@ AdAuctionsImpl::AdAuctionsImpl(
 void AdAuctionsImpl::RefreshFunctionRepository(
     const Configuration& configuration,
     const FunctionSource& function_source) {
+  const absl::Time start = absl::Now();
   absl::StatusOr<std::unique_ptr<FunctionRepository>> repository_or_status =
-      CreateFunctionRepository(configuration, function_source);
+      CreateFunctionRepository(configuration, function_source,
+                               GetFunctionRepository().get());
+  GetRefreshHistogram().RecordDuration(absl::Now() - start);
   if (repository_or_status.ok()) {
-    absl::WriterMutexLock lock(&function_repository_mutex_);
-    function_repository_ = std::move(repository_or_status.value());
+    // The previous repository is freed by whichever request lets go of it
+    // last.
+    std::atomic_store(&function_repository_,
+                      std::shared_ptr<const FunctionRepository>(
+                          std::move(repository_or_status.value())));
   }
 }
+
+void AdAuctionsImpl::ScheduleBiddingFunctionTask(
+    const FunctionRepository& function_repository,
+    absl::string_view bidding_logic_url, std::function<void()> task) {
+  const auto it =
+      function_repository.bidding_functions().find(bidding_logic_url);
+  if (it == function_repository.bidding_functions().end()) {
+    // Unknown functions, which fail right away, share the default queue, so
+    // that requests naming arbitrary URIs cannot create queues.
+    auction_executor_->Schedule(std::move(task));
+    return;
+  }
+  auction_executor_->Schedule(
+      it->first, it->second.scheduling_weight,
+      [executor_queue = it->second.metrics.executor_queue_seconds,
+       task = std::move(task), scheduled = absl::Now()] {
+        executor_queue->RecordDuration(absl::Now() - scheduled);
+        task();
+      });
+}
+
+std::shared_ptr<const FunctionRepository>
+AdAuctionsImpl::GetFunctionRepository() const {
+  return std::atomic_load(&function_repository_);
+}
 }  // namespace server
 }  // namespace aviary
@@ -17,20 +17,30 @@
 #ifndef SERVER_AD_AUCTIONS_H_
 #define SERVER_AD_AUCTIONS_H_
 
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "function/bidding_function_interface.h"
+#include "google/protobuf/arena.h"
 #include "grpc++/grpc++.h"
 #include "proto/aviary.grpc.pb.h"
 #include "proto/aviary.pb.h"
 #include "server/function_repository.h"
 #include "server/function_source.h"
+#include "server/interest_group_cache.h"
+#include "server/invocation_limiter.h"
+#include "server/trusted_signals.h"
 #include "util/periodic_function.h"
+#include "util/thread_pool.h"
 #include "util/status_macros.h"
 
 namespace aviary {
@@ -47,47 +57,146 @@ struct Configuration {
 // Implements AdAuctions gRPC service.
 class AdAuctionsImpl final : public ::aviary::AdAuctions::Service {
  public:
-  static absl::StatusOr<std::unique_ptr<::aviary::AdAuctions::Service>> Create(
+  // Trusted bidding signals that requests only name the keys of are fetched
+  // by `trusted_signals_fetcher`, which must outlive the service.
+  static absl::StatusOr<std::unique_ptr<AdAuctionsImpl>> Create(
       const Configuration& configuration, const FunctionSource& function_source,
       const ::aviary::util::PeriodicFunctionFactory& periodic_function_factory =
-          ::aviary::util::PeriodicFunction::DefaultFactory());
+          ::aviary::util::PeriodicFunction::DefaultFactory(),
+      const TrustedSignalsFetcher& trusted_signals_fetcher =
+          TrustedSignalsFetcher::Default());
 
-  static absl::StatusOr<std::unique_ptr<::aviary::AdAuctions::Service>> Create(
+  static absl::StatusOr<std::unique_ptr<AdAuctionsImpl>> Create(
       const FunctionSource& function_source,
       absl::string_view configuration_file_name,
       const ::aviary::util::PeriodicFunctionFactory& periodic_function_factory =
-          ::aviary::util::PeriodicFunction::DefaultFactory());
+          ::aviary::util::PeriodicFunction::DefaultFactory(),
+      const TrustedSignalsFetcher& trusted_signals_fetcher =
+          TrustedSignalsFetcher::Default());
 
   grpc::Status ComputeBid(::grpc::ServerContext* context,
                           const ::aviary::ComputeBidRequest* request,
                           ::aviary::BiddingFunctionOutput* response) override;
 
+  // Runs a batch of invocations per bidding function concurrently, and writes
+  // the results of each batch as soon as it is done.
+  grpc::Status BatchComputeBid(
+      ::grpc::ServerContext* context,
+      const ::aviary::BatchComputeBidRequest* request,
+      ::grpc::ServerWriter<::aviary::BatchComputeBidResponse>* writer) override;
+
   grpc::Status RunAdAuction(::grpc::ServerContext* context,
                             const ::aviary::RunAdAuctionRequest* request,
                             ::aviary::RunAdAuctionResponse* response) override;
 
+  // Same as `RunAdAuction()` above, for a request that the auction can keep
+  // once the RPC is over. Buyers still running past the deadline of the
+  // auction share the request, rather than a copy of it.
+  grpc::Status RunAdAuction(
+      ::grpc::ServerContext* context,
+      std::shared_ptr<const ::aviary::RunAdAuctionRequest> request,
+      ::aviary::RunAdAuctionResponse* response);
+
  private:
   AdAuctionsImpl(
       const Configuration& configuration, const FunctionSource& function_source,
-      std::unique_ptr<FunctionRepository> initial_function_repository,
-      const ::aviary::util::PeriodicFunctionFactory& periodic_function_factory);
+      std::shared_ptr<const FunctionRepository> initial_function_repository,
+      const ::aviary::util::PeriodicFunctionFactory& periodic_function_factory,
+      const TrustedSignalsFetcher& trusted_signals_fetcher,
+      std::vector<int> auction_executor_cpus);
 
   void RefreshFunctionRepository(const Configuration& configuration,
-                                  const FunctionSource& function_source)
-      ABSL_LOCKS_EXCLUDED(function_repository_mutex_);
+                                  const FunctionSource& function_source);
 
-  absl::StatusOr<BiddingFunctionOutput> RunGenerateBidFunction(
-      absl::string_view bidding_logic_url, const BiddingFunctionInput& input)
-      ABSL_LOCKS_EXCLUDED(function_repository_mutex_);
+  // Returns the current function repository. Requests hold on to the returned
+  // snapshot for as long as they use its functions, so that a refresh never
+  // waits for them, and the snapshot is freed once its last user is done.
+  std::shared_ptr<const FunctionRepository> GetFunctionRepository() const;
 
-  absl::StatusOr<AdScoringFunctionOutput> RunScoreAdFunction(
+  // Invokes the bidding function for a batch of inputs sharing the fields set
+  // in `common_input`, and returns a bid or an error status for each input in
+  // the order of the inputs. If the batched invocation fails, the inputs are
+  // retried one by one, so that one failing input does not prevent the others
+  // from bidding. Returns an error status if the limiter of the function
+  // rejects the batch, or is still queueing it at `deadline`.
+  absl::StatusOr<std::vector<absl::StatusOr<BiddingFunctionOutput>>>
+  RunGenerateBidFunction(const FunctionRepository& function_repository,
+                         absl::string_view bidding_logic_url,
+                         const BiddingFunctionInput& common_input,
+                         absl::Span<const BiddingFunctionInput* const> inputs,
+                         absl::Time deadline);
+
+  // Invokes the ad scoring function for a batch of inputs sharing the fields
+  // set in `common_input`. Returns scores in the order of the inputs, or the
+  // status of the first failing invocation, or of the rejection of the batch
+  // by the limiter of the function. Memoized functions are only invoked for
+  // the inputs whose score is not memoized.
+  absl::StatusOr<std::vector<AdScoringFunctionOutput>> RunScoreAdFunction(
+      const FunctionRepository& function_repository,
       absl::string_view ad_scoring_logic_url,
-      const AdScoringFunctionInput& input)
-      ABSL_LOCKS_EXCLUDED(function_repository_mutex_);
+      const AdScoringFunctionInput& common_input,
+      absl::Span<const AdScoringFunctionInput* const> inputs,
+      absl::Time deadline);
+
+  // Schedules `task` on the auction executor, in the queue of the bidding
+  // function of `bidding_logic_url`, and records the time it waits there.
+  // `function_repository` must outlive the task.
+  void ScheduleBiddingFunctionTask(
+      const FunctionRepository& function_repository,
+      absl::string_view bidding_logic_url, std::function<void()> task);
+
+  // Invokes the bidding function shared by `interest_groups` and scores the
+  // resulting bids. Interest groups failing to bid are skipped. Function inputs
+  // are allocated on `arena` and alias the fields of `request`. Bids are not
+  // scored once `deadline` has passed, since the auction is over by then.
+  absl::StatusOr<std::vector<ScoredInterestGroupBid>> RunBuyerAuction(
+      const FunctionRepository& function_repository,
+      absl::string_view bidding_logic_url,
+      const std::vector<const InterestGroupAuctionState*>& interest_groups,
+      const RunAdAuctionRequest& request, google::protobuf::Arena* arena,
+      absl::Time deadline);
+
+  // Returns whether the buyer of `bidding_logic_url` is skipped for having
+  // been late in --late_buyer_skip_threshold consecutive auctions, which lasts
+  // --late_buyer_skip_duration.
+  bool IsBuyerSkipped(absl::string_view bidding_logic_url) const
+      ABSL_LOCKS_EXCLUDED(late_buyers_mutex_);
+
+  // Records whether the buyer of `bidding_logic_url` was late in an auction.
+  void RecordBuyerLateness(absl::string_view bidding_logic_url, bool late)
+      ABSL_LOCKS_EXCLUDED(late_buyers_mutex_);
+
+  // Returns the trusted bidding signals of `interest_groups` that they only
+  // name the keys of, by signals server URL. The signals of each server are
+  // looked up at once for all the interest groups, by `deadline`. Interest
+  // groups bid without the signals that fail to be fetched.
+  absl::flat_hash_map<absl::string_view, TrustedSignals>
+  LookUpTrustedBiddingSignals(
+      const std::vector<const InterestGroupAuctionState*>& interest_groups,
+      absl::Time deadline);
 
-  absl::Mutex function_repository_mutex_;
-  std::unique_ptr<FunctionRepository> function_repository_
-      ABSL_GUARDED_BY(function_repository_mutex_);
+  InterestGroupCache interest_group_cache_;
+  // Outlives `auction_executor_`, which runs buyers that use it.
+  TrustedSignalsCache trusted_signals_cache_;
+  // Runs the buyers of an auction concurrently, as well as the batches of
+  // `BatchComputeBid()`, queued by bidding function so that the functions
+  // take turns according to their scheduling weight.
+  std::unique_ptr<::aviary::util::ThreadPool> auction_executor_;
+  // Invocations queued by their limiter block their thread, which is mostly a
+  // thread of `auction_executor_`. At least one thread is left to the other
+  // invocations.
+  InvocationLimiter::WaitBudget admission_wait_budget_;
+  // Buyers that were late in their latest auctions, with the number of these
+  // auctions and until when they are skipped, by bidding logic URL.
+  struct LateBuyer {
+    int consecutive_late_auctions = 0;
+    absl::Time skipped_until = absl::InfinitePast();
+  };
+  mutable absl::Mutex late_buyers_mutex_;
+  absl::flat_hash_map<std::string, LateBuyer> late_buyers_
+      ABSL_GUARDED_BY(late_buyers_mutex_);
+  // Only accessed through std::atomic_load() and std::atomic_store().
+  std::shared_ptr<const FunctionRepository> function_repository_;
   std::unique_ptr<::aviary::util::PeriodicFunction> repository_refresh_;
 };
 }  // namespace server
@@ -14,11 +14,23 @@
 
 #include "server/ad_auctions.h"
 
+#include <atomic>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
-
+#include <map>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
 #include "absl/random/random.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "gmock/gmock.h"
 #include "grpc++/grpc++.h"
 #include "gtest/gtest.h"
@@ -26,8 +38,17 @@
 #include "proto/aviary.pb.h"
 #include "util/parse_proto.h"
 #include "util/test_periodic_function.h"
+#include "util/trace.pb.h"
 #include "v8/v8_platform_initializer.h"
 
+ABSL_DECLARE_FLAG(int, function_context_reuse_limit);
+ABSL_DECLARE_FLAG(absl::Duration, auction_deadline);
+ABSL_DECLARE_FLAG(int, auction_executor_threads);
+ABSL_DECLARE_FLAG(std::string, auction_executor_cpus);
+ABSL_DECLARE_FLAG(std::string, v8_platform_cpus);
+ABSL_DECLARE_FLAG(int, late_buyer_skip_threshold);
+ABSL_DECLARE_FLAG(bool, allow_requested_auction_traces);
+
 namespace aviary {
 namespace server {
 namespace {
@@ -37,6 +58,7 @@ using ::aviary::util::ParseTextOrDie;
 using ::aviary::util::TestPeriodicFunctionContainer;
 using ::aviary::v8::V8PlatformInitializer;
 using ::testing::AllOf;
+using ::testing::Contains;
 using ::testing::ElementsAre;
 using ::testing::HasSubstr;
 using ::testing::IsEmpty;
@@ -210,6 +232,67 @@ TEST_F(AdAuctionsTest, ComputeBidHappyPath) {
   EXPECT_EQ(response.bid(), 63.0);
 }
 
+TEST_F(AdAuctionsTest, BatchComputeBidStreamsBatchPerFunction) {
+  std::unique_ptr<AdAuctions::Service> ad_auctions =
+      CreateAdAuctions(Configuration{
+          .bidding_function_specs = {
+              FunctionSpecification{
+                  .uri = "local://double",
+                  .source_code =
+                      "(interestGroup, auctionSignals, perBuyerSignals, "
+                      "trustedBiddingSignals, browserSignals) => ({ bid: "
+                      "perBuyerSignals.foo * 2})"},
+              FunctionSpecification{
+                  .uri = "local://triple",
+                  .source_code =
+                      "(interestGroup, auctionSignals, perBuyerSignals, "
+                      "trustedBiddingSignals, browserSignals) => ({ bid: "
+                      "perBuyerSignals.foo * 3})"}}});
+  grpc::ServerBuilder builder;
+  builder.RegisterService(ad_auctions.get());
+  const std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  const std::unique_ptr<AdAuctions::Stub> stub =
+      AdAuctions::NewStub(server->InProcessChannel(grpc::ChannelArguments()));
+
+  BatchComputeBidRequest request;
+  const std::vector<std::pair<std::string, double>> bids = {
+      {"local://double", 1}, {"local://triple", 2},
+      {"local://double", 3}, {"local://missing", 4}};
+  for (const auto& [bidding_function_name, foo] : bids) {
+    ComputeBidRequest* bid_request = request.add_requests();
+    bid_request->set_bidding_function_name(bidding_function_name);
+    (*bid_request->mutable_input()
+          ->mutable_per_buyer_signals()
+          ->mutable_fields())["foo"]
+        .set_number_value(foo);
+  }
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReader<BatchComputeBidResponse>> reader =
+      stub->BatchComputeBid(&context, request);
+  std::map<int, BatchComputeBidResponse::Result> results;
+  BatchComputeBidResponse response;
+  int batches = 0;
+  while (reader->Read(&response)) {
+    batches++;
+    ASSERT_GT(response.results_size(), 0);
+    for (const auto& result : response.results()) {
+      // All the results of a batch come from the same function.
+      EXPECT_EQ(bids[result.index()].first,
+                bids[response.results(0).index()].first);
+      results[result.index()] = result;
+    }
+  }
+  ASSERT_TRUE(reader->Finish().ok());
+  EXPECT_EQ(batches, 3);
+  ASSERT_EQ(results.size(), bids.size());
+  EXPECT_EQ(results[0].output().bid(), 2);
+  EXPECT_EQ(results[1].output().bid(), 6);
+  EXPECT_EQ(results[2].output().bid(), 6);
+  EXPECT_EQ(results[3].error_code(), grpc::StatusCode::NOT_FOUND);
+  EXPECT_FALSE(results[3].error_message().empty());
+  server->Shutdown();
+}
+
 TEST_F(AdAuctionsTest, ComputeBidFunctionReload) {
   function_source_.AddRemoteFunction(
       "https://dsp.example/bidding/double.js",
@@ -248,6 +331,44 @@ TEST_F(AdAuctionsTest, ComputeBidFunctionReload) {
   EXPECT_EQ(response.bid(), 63.0);
 }
 
+TEST_F(AdAuctionsTest, RefreshKeepsUnchangedFunctions) {
+  // Reuse contexts, so that calls to the same function instance observe each
+  // other's global state.
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_function_context_reuse_limit, 100);
+  function_source_.AddRemoteFunction("https://dsp.example/bidding/count.js",
+                                     R"(
+    var count = 0;
+    (interestGroup, auctionSignals, perBuyerSignals, trustedBiddingSignals,
+     browserSignals) => ({ bid: count++ }))");
+  std::unique_ptr<AdAuctions::Service> ad_auctions = CreateAdAuctions(
+      Configuration{.bidding_function_specs = {FunctionSpecification{
+                        .uri = "https://dsp.example/bidding/count.js"}}});
+  ComputeBidRequest request;
+  request.set_bidding_function_name("https://dsp.example/bidding/count.js");
+  ::aviary::BiddingFunctionOutput response;
+  ASSERT_TRUE(
+      ad_auctions->ComputeBid(/*context=*/nullptr, &request, &response).ok());
+  const double first_bid = response.bid();
+
+  // The function instance survives a refresh when its source is unchanged.
+  refresh_periodic_functions_.InvokeAllNow();
+  ASSERT_TRUE(
+      ad_auctions->ComputeBid(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_EQ(response.bid(), first_bid + 1);
+
+  // It gets rebuilt once the source changes.
+  function_source_.AddRemoteFunction("https://dsp.example/bidding/count.js",
+                                     R"(
+    var count = 100;
+    (interestGroup, auctionSignals, perBuyerSignals, trustedBiddingSignals,
+     browserSignals) => ({ bid: count++ }))");
+  refresh_periodic_functions_.InvokeAllNow();
+  ASSERT_TRUE(
+      ad_auctions->ComputeBid(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_EQ(response.bid(), first_bid + 100);
+}
+
 TEST_F(AdAuctionsTest, ComputeBidCreateFromConfigurationFile) {
   std::string configuration_filename = WriteYamlConfiguration(R"(
 biddingFunctions:
@@ -385,6 +506,86 @@ TEST_F(AdAuctionsTest, RunAdAuctionHappyPath) {
               Property(&Scored::desirability_score, 60.0))));
 }
 
+TEST_F(AdAuctionsTest, RunAdAuctionReturnsTraceOnRequest) {
+  absl::FlagSaver flag_saver;
+  std::unique_ptr<AdAuctions::Service> ad_auctions =
+      AdAuctionsImpl::Create(function_source_,
+                             WriteStandardAuctionConfiguration(),
+                             refresh_periodic_functions_.Factory())
+          .value();
+  grpc::ServerBuilder builder;
+  builder.RegisterService(ad_auctions.get());
+  const std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  const std::unique_ptr<AdAuctions::Stub> stub =
+      AdAuctions::NewStub(server->InProcessChannel(grpc::ChannelArguments()));
+  auto request = ParseTextOrDie<RunAdAuctionRequest>(
+      R"pb(
+        interest_groups {
+          owner: "adnetwork.example"
+          name: "funnytoons"
+          bidding_logic_url: "https://adnetwork.example/bidding/double.js"
+          ads { render_url: "https://adnetwork.example/funny" }
+        }
+        auction_configuration {
+          decision_logic_url: "https://ssp.example/auction/preferFunnyAds.js"
+          interest_group_buyers: [ "adnetwork.example" ]
+          per_buyer_signals {
+            key: "adnetwork.example"
+            value {
+              fields {
+                key: "foo"
+                value { number_value: 21 }
+              }
+            }
+          }
+        }
+      )pb");
+
+  // Auctions are only traced on request.
+  {
+    grpc::ClientContext context;
+    RunAdAuctionResponse response;
+    ASSERT_TRUE(stub->RunAdAuction(&context, request, &response).ok());
+    EXPECT_EQ(context.GetServerTrailingMetadata().count("aviary-trace-bin"),
+              0);
+  }
+  // Requests are ignored unless allowed.
+  {
+    grpc::ClientContext context;
+    context.AddMetadata("aviary-trace", "1");
+    RunAdAuctionResponse response;
+    ASSERT_TRUE(stub->RunAdAuction(&context, request, &response).ok());
+    EXPECT_EQ(context.GetServerTrailingMetadata().count("aviary-trace-bin"),
+              0);
+  }
+  absl::SetFlag(&FLAGS_allow_requested_auction_traces, true);
+  grpc::ClientContext context;
+  context.AddMetadata("aviary-trace", "1");
+  RunAdAuctionResponse response;
+  ASSERT_TRUE(stub->RunAdAuction(&context, request, &response).ok());
+  EXPECT_TRUE(response.has_winning_bid());
+  const auto trailer_it =
+      context.GetServerTrailingMetadata().find("aviary-trace-bin");
+  ASSERT_NE(trailer_it, context.GetServerTrailingMetadata().end());
+  ::aviary::util::Trace trace;
+  ASSERT_TRUE(trace.ParseFromArray(trailer_it->second.data(),
+                                   trailer_it->second.size()));
+  EXPECT_EQ(trace.dropped_spans(), 0);
+  std::vector<std::string> span_names;
+  for (int i = 0; i < trace.spans_size(); i++) {
+    span_names.push_back(trace.spans(i).name());
+    // Enclosing spans come first.
+    EXPECT_LT(trace.spans(i).parent(), i);
+  }
+  for (const std::string& span_name :
+       {"executor_queue", "buyer", "input_building", "trusted_signals_lookup",
+        "interest_group_input", "bidding", "repository_lookup",
+        "pool_checkout", "execution", "scoring", "sort"}) {
+    EXPECT_THAT(span_names, Contains(span_name));
+  }
+  server->Shutdown();
+}
+
 TEST_F(AdAuctionsTest, RunAdAuctionWithRefresh) {
   std::unique_ptr<AdAuctions::Service> ad_auctions =
       AdAuctionsImpl::Create(function_source_,
@@ -591,6 +792,268 @@ adScoringFunctions:
           Property(&Scored::desirability_score, 50.0))));
 }
 
+namespace {
+// Serves a `ctr` of 4 and records the number of fetches.
+class FakeTrustedSignalsFetcher : public TrustedSignalsFetcher {
+ public:
+  absl::StatusOr<TrustedSignals> Fetch(
+      absl::string_view url, absl::Span<const std::string> keys,
+      absl::Time deadline) const override {
+    fetches_++;
+    TrustedSignals signals;
+    signals["ctr"].set_number_value(4);
+    return signals;
+  }
+
+  int fetches() const { return fetches_; }
+
+ private:
+  mutable std::atomic<int> fetches_{0};
+};
+}  // namespace
+
+TEST_F(AdAuctionsTest, RunAdAuctionLooksUpTrustedBiddingSignals) {
+  FakeTrustedSignalsFetcher trusted_signals_fetcher;
+  std::unique_ptr<AdAuctions::Service> ad_auctions =
+      AdAuctionsImpl::Create(
+          Configuration{
+              .bidding_function_specs = {FunctionSpecification{
+                  .uri = "local://multiply",
+                  .source_code = R"(
+                    (interestGroup, auctionSignals, perBuyerSignals,
+                     trustedBiddingSignals, browserSignals) => ({
+                      bid: trustedBiddingSignals.ctr,
+                      renderUrl: interestGroup.ads[0].renderUrl }))"}},
+              .ad_scoring_function_specs = {FunctionSpecification{
+                  .uri = "local://scoring",
+                  .source_code = R"(
+                    (adMetadata, bid, auctionConfig, trustedScoringSignals,
+                     browserSignals) => ({ desirabilityScore: bid }))"}}},
+          function_source_, refresh_periodic_functions_.Factory(),
+          trusted_signals_fetcher)
+          .value();
+  auto request = ParseTextOrDie<RunAdAuctionRequest>(
+      R"pb(
+        interest_groups {
+          owner: "dsp.example"
+          name: "looked_up"
+          bidding_logic_url: "local://multiply"
+          ads { render_url: "https://dsp.example/looked_up" }
+          trusted_bidding_signals_url: "https://kv.example/signals"
+          trusted_bidding_signals_keys: [ "ctr" ]
+        }
+        interest_groups {
+          owner: "dsp.example"
+          name: "inlined"
+          bidding_logic_url: "local://multiply"
+          ads { render_url: "https://dsp.example/inlined" }
+          trusted_bidding_signals {
+            key: "ctr"
+            value { number_value: 3 }
+          }
+          trusted_bidding_signals_url: "https://kv.example/signals"
+          trusted_bidding_signals_keys: [ "ctr" ]
+        }
+        auction_configuration {
+          decision_logic_url: "local://scoring"
+          interest_group_buyers: [ "dsp.example" ]
+        }
+      )pb");
+  for (int i = 0; i < 2; i++) {
+    ::aviary::RunAdAuctionResponse response;
+    grpc::Status status =
+        ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(response.winning_bid().interest_group_name(), "looked_up");
+    EXPECT_EQ(response.winning_bid().bid_price(), 4);
+    // Inlined signals take precedence over the looked up ones.
+    ASSERT_EQ(response.losing_bids_size(), 1);
+    EXPECT_EQ(response.losing_bids(0).bid_price(), 3);
+  }
+  // The second auction uses the cached signals.
+  EXPECT_EQ(trusted_signals_fetcher.fetches(), 1);
+}
+
+TEST_F(AdAuctionsTest, RunAdAuctionVersionedInterestGroups) {
+  std::unique_ptr<AdAuctions::Service> ad_auctions =
+      CreateAdAuctions(Configuration{
+          .bidding_function_specs = {FunctionSpecification{
+              .uri = "local://bidding",
+              .source_code = R"(
+                (interestGroup, auctionSignals, perBuyerSignals,
+                 trustedBiddingSignals, browserSignals) => ({
+                  bid: interestGroup.userBiddingSignals.bid,
+                  renderUrl: interestGroup.ads[0].renderUrl }))"}},
+          .ad_scoring_function_specs = {FunctionSpecification{
+              .uri = "local://scoring",
+              .source_code = R"(
+                (adMetadata, bid, auctionConfig, trustedScoringSignals,
+                 browserSignals) => ({ desirabilityScore: bid }))"}}});
+  auto request = ParseTextOrDie<RunAdAuctionRequest>(
+      R"pb(
+        interest_groups {
+          owner: "dsp.example"
+          name: "boringreads"
+          version: 1
+          bidding_logic_url: "local://bidding"
+          ads { render_url: "https://dsp.example/boringreads" }
+          user_bidding_signals {
+            fields {
+              key: "bid"
+              value { number_value: 5 }
+            }
+          }
+        }
+        auction_configuration {
+          decision_logic_url: "local://scoring"
+          interest_group_buyers: [ "dsp.example" ]
+        }
+      )pb");
+  ::aviary::RunAdAuctionResponse response;
+  // Versioned interest groups are cached within the scope of a client.
+  EXPECT_EQ(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response)
+          .error_code(),
+      grpc::StatusCode::INVALID_ARGUMENT);
+  request.set_interest_group_cache_scope("client");
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_EQ(response.winning_bid().bid_price(), 5);
+
+  // Later auctions only need to reference the state of the interest group.
+  InterestGroupAuctionState* interest_group =
+      request.mutable_interest_groups(0);
+  interest_group->clear_bidding_logic_url();
+  interest_group->clear_ads();
+  interest_group->clear_user_bidding_signals();
+  response.Clear();
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_EQ(response.winning_bid().render_url(),
+            "https://dsp.example/boringreads");
+  EXPECT_EQ(response.winning_bid().bid_price(), 5);
+  EXPECT_THAT(response.uncached_interest_groups(), IsEmpty());
+
+  // Other clients do not see the cached state.
+  request.set_interest_group_cache_scope("other client");
+  response.Clear();
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_FALSE(response.has_winning_bid());
+  EXPECT_EQ(response.uncached_interest_groups_size(), 1);
+  request.set_interest_group_cache_scope("client");
+
+  // Versions that are not cached must be sent in full.
+  interest_group->set_version(2);
+  response.Clear();
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_FALSE(response.has_winning_bid());
+  ASSERT_EQ(response.uncached_interest_groups_size(), 1);
+  EXPECT_EQ(response.uncached_interest_groups(0).name(), "boringreads");
+  EXPECT_EQ(response.uncached_interest_groups(0).version(), 2);
+}
+
+TEST_F(AdAuctionsTest, RunAdAuctionMemoizesAdScores) {
+  // Scores the same bid differently each time unless it is memoized.
+  std::unique_ptr<AdAuctions::Service> ad_auctions =
+      AdAuctionsImpl::Create(function_source_, WriteYamlConfiguration(R"(
+biddingFunctions:
+  - uri: local://bidding
+    source: |
+      (interestGroup, auctionSignals, perBuyerSignals, trustedBiddingSignals, browserSignals) => ({ bid: interestGroup.userBiddingSignals.bid, renderUrl: interestGroup.ads[0].renderUrl })
+adScoringFunctions:
+  - uri: local://scoring
+    memoize: true
+    source: |
+      (adMetadata, bid, auctionConfig, trustedScoringSignals, browserSignals) => ({ desirabilityScore: bid + Math.random() })
+)"))
+          .value();
+  auto request = ParseTextOrDie<RunAdAuctionRequest>(
+      R"pb(
+        interest_groups {
+          owner: "dsp.example"
+          name: "boringreads"
+          bidding_logic_url: "local://bidding"
+          ads { render_url: "https://dsp.example/boringreads" }
+          user_bidding_signals {
+            fields {
+              key: "bid"
+              value { number_value: 5 }
+            }
+          }
+        }
+        auction_configuration {
+          decision_logic_url: "local://scoring"
+          interest_group_buyers: [ "dsp.example" ]
+        }
+      )pb");
+  ::aviary::RunAdAuctionResponse response;
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response).ok());
+  const double desirability_score = response.winning_bid().desirability_score();
+  EXPECT_GE(desirability_score, 5);
+
+  response.Clear();
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_EQ(response.winning_bid().desirability_score(), desirability_score);
+
+  // Another bid is scored anew.
+  (*request.mutable_interest_groups(0)
+        ->mutable_user_bidding_signals()
+        ->mutable_fields())["bid"]
+      .set_number_value(6);
+  response.Clear();
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_GE(response.winning_bid().desirability_score(), 6);
+}
+
+TEST_F(AdAuctionsTest, CreateFailsOnMemoizedBiddingFunction) {
+  EXPECT_EQ(AdAuctionsImpl::Create(function_source_, WriteYamlConfiguration(R"(
+biddingFunctions:
+  - uri: local://bidding
+    memoize: true
+    source: |
+      (interestGroup, auctionSignals, perBuyerSignals, trustedBiddingSignals, browserSignals) => ({ bid: 1 })
+adScoringFunctions: []
+)"))
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(AdAuctionsTest, CreateFailsOnInvalidAuctionExecutorCpus) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_auction_executor_cpus, "0-a");
+  EXPECT_EQ(AdAuctionsImpl::Create(function_source_,
+                                   WriteStandardAuctionConfiguration())
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(AdAuctionsTest, CreateFailsOnInvalidV8PlatformCpus) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_v8_platform_cpus, "0-a");
+  EXPECT_EQ(AdAuctionsImpl::Create(function_source_,
+                                   WriteStandardAuctionConfiguration())
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(AdAuctionsTest, CreateFailsWithoutAuctionExecutorThreads) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_auction_executor_threads, 0);
+  EXPECT_EQ(AdAuctionsImpl::Create(function_source_,
+                                   WriteStandardAuctionConfiguration())
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
 TEST_F(AdAuctionsTest, RunAdAuctionDisallowedBuyerSkipped) {
   std::unique_ptr<AdAuctions::Service> ad_auctions =
       AdAuctionsImpl::Create(function_source_,
@@ -1216,6 +1679,109 @@ adScoringFunctions: []
               HasSubstr("defined more than once"));
 }
 
+TEST_F(AdAuctionsTest, CreateFromConfigurationFileWarmUp) {
+  // Written next to the configuration file, and referenced relatively to it.
+  const std::string warm_up_input_filename = WriteYamlConfiguration(
+      R"({"perBuyerSignals": {"increment": 10}})");
+  std::string configuration_filename = WriteYamlConfiguration(absl::Substitute(
+      R"(
+biddingFunctions:
+  - uri: local://sum
+    source: |
+      var sum = 0;
+      (interestGroup, auctionSignals, perBuyerSignals) => {
+        sum += perBuyerSignals.increment;
+        return { bid: sum };
+      }
+    warmUp:
+      iterations: 2
+      inputs:
+        - '{"perBuyerSignals": {"increment": 1}}'
+        - file: $0
+adScoringFunctions: []
+)",
+      std::filesystem::path(warm_up_input_filename).filename().string()));
+  auto auctions_or_status =
+      AdAuctionsImpl::Create(function_source_, configuration_filename);
+  ASSERT_TRUE(auctions_or_status.ok()) << auctions_or_status.status();
+  auto request = ParseTextOrDie<ComputeBidRequest>(
+      R"pb(
+        bidding_function_name: "local://sum"
+        input {
+          per_buyer_signals {
+            fields {
+              key: "increment"
+              value { number_value: 100 }
+            }
+          }
+        }
+      )pb");
+  ::aviary::BiddingFunctionOutput response;
+  grpc::Status status = auctions_or_status.value()->ComputeBid(
+      /*context=*/nullptr, &request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  // Both warm-up iterations invoked the function on both inputs.
+  EXPECT_EQ(response.bid(), 122.0);
+}
+
+TEST_F(AdAuctionsTest, CreateFromConfigurationFileSandboxTrustDomain) {
+  std::string configuration_filename = WriteYamlConfiguration(R"(
+biddingFunctions:
+  - uri: local://double
+    source: |
+      (interestGroup, auctionSignals, perBuyerSignals) =>
+          ({ bid: perBuyerSignals.foo * 2 })
+    sandboxTrustDomain: buyer
+  - uri: local://triple
+    source: |
+      (interestGroup, auctionSignals, perBuyerSignals) =>
+          ({ bid: perBuyerSignals.foo * 3 })
+    sandboxTrustDomain: buyer
+adScoringFunctions: []
+)");
+  auto auctions_or_status =
+      AdAuctionsImpl::Create(function_source_, configuration_filename);
+  ASSERT_TRUE(auctions_or_status.ok()) << auctions_or_status.status();
+  for (const auto& [function_name, expected_bid] :
+       {std::make_pair("local://double", 10.0),
+        std::make_pair("local://triple", 15.0)}) {
+    auto request = ParseTextOrDie<ComputeBidRequest>(
+        R"pb(
+          input {
+            per_buyer_signals {
+              fields {
+                key: "foo"
+                value { number_value: 5 }
+              }
+            }
+          }
+        )pb");
+    request.set_bidding_function_name(function_name);
+    ::aviary::BiddingFunctionOutput response;
+    grpc::Status status = auctions_or_status.value()->ComputeBid(
+        /*context=*/nullptr, &request, &response);
+    ASSERT_TRUE(status.ok()) << status.error_message();
+    EXPECT_EQ(response.bid(), expected_bid);
+  }
+}
+
+TEST_F(AdAuctionsTest, CreateFromConfigurationFileMissingWarmUpInputFile) {
+  std::string configuration_filename = WriteYamlConfiguration(R"(
+biddingFunctions:
+  - uri: local://double
+    source: "input => input.perBuyerSignals.foo * 2"
+    warmUp:
+      inputs:
+        - file: does_not_exist.json
+adScoringFunctions: []
+)");
+  auto status =
+      AdAuctionsImpl::Create(function_source_, configuration_filename).status();
+  EXPECT_EQ(status.code(), absl::StatusCode::kNotFound);
+  EXPECT_THAT(std::string(status.message()),
+              HasSubstr("does_not_exist.json"));
+}
+
 TEST_F(AdAuctionsTest, MissingConfigurationFile) {
   auto status = AdAuctionsImpl::Create(
                     function_source_, testing::TempDir() + "/non-existing.yaml")
@@ -1360,6 +1926,49 @@ adScoringFunctions: []
   EXPECT_EQ(status.error_code(), grpc::StatusCode::UNAVAILABLE);
 }
 
+TEST_F(AdAuctionsTest, BuildsManyFunctionsWithOneNotCompiling) {
+  constexpr int kNumFunctions = 8;
+  constexpr int kNotCompilingFunction = 5;
+  Configuration configuration;
+  for (int i = 0; i < kNumFunctions; i++) {
+    configuration.bidding_function_specs.push_back(FunctionSpecification{
+        .uri = absl::StrCat("local://multiply", i),
+        .source_code =
+            i == kNotCompilingFunction
+                ? "(interestGroup, auctionSignals, perBuyerSignals) => ({ bid: "
+                : absl::StrCat(
+                      "(interestGroup, auctionSignals, perBuyerSignals, "
+                      "trustedBiddingSignals, browserSignals) => ({ bid: "
+                      "perBuyerSignals.foo * ",
+                      i, "})")});
+  }
+  auto ad_auctions = CreateAdAuctions(configuration);
+
+  for (int i = 0; i < kNumFunctions; i++) {
+    auto request = ParseTextOrDie<ComputeBidRequest>(
+        R"pb(
+          input {
+            per_buyer_signals {
+              fields {
+                key: "foo"
+                value { number_value: 10 }
+              }
+            }
+          }
+        )pb");
+    request.set_bidding_function_name(absl::StrCat("local://multiply", i));
+    ::aviary::BiddingFunctionOutput response;
+    grpc::Status status =
+        ad_auctions->ComputeBid(/*context=*/nullptr, &request, &response);
+    if (i == kNotCompilingFunction) {
+      EXPECT_EQ(status.error_code(), grpc::StatusCode::UNAVAILABLE);
+    } else {
+      ASSERT_TRUE(status.ok()) << status.error_message();
+      EXPECT_EQ(response.bid(), i * 10);
+    }
+  }
+}
+
 TEST_F(AdAuctionsTest, BiddingFunctionNotFound) {
   auto ad_auctions = CreateAdAuctions(Configuration{
       .bidding_function_specs = {FunctionSpecification{
@@ -1451,5 +2060,354 @@ adScoringFunctions:
   EXPECT_EQ(bid.bid_price(), 60.0);
   EXPECT_EQ(bid.desirability_score(), 60.0);
 }
+
+TEST_F(AdAuctionsTest, RunAdAuctionFailingInterestGroupDoesNotFailBatch) {
+  auto ad_auctions = CreateAdAuctions(Configuration{
+      .bidding_function_specs = {FunctionSpecification{
+          .uri = "local://bidding",
+          .source_code = R"(
+            (interestGroup, auctionSignals, perBuyerSignals,
+             trustedBiddingSignals, browserSignals) => {
+              if (interestGroup.name == "broken") {
+                throw new Error("broken interest group");
+              }
+              return { bid: interestGroup.userBiddingSignals.bid,
+                       renderUrl: interestGroup.ads[0].renderUrl };
+            })"}},
+      .ad_scoring_function_specs = {FunctionSpecification{
+          .uri = "local://scoring",
+          .source_code = R"(
+            (adMetadata, bid, auctionConfig, trustedScoringSignals,
+             browserSignals) => ({ desirabilityScore: bid }))"}}});
+  auto request = ParseTextOrDie<RunAdAuctionRequest>(
+      R"pb(
+        interest_groups {
+          owner: "dsp.example"
+          name: "first"
+          bidding_logic_url: "local://bidding"
+          ads { render_url: "https://dsp.example/first" }
+          user_bidding_signals {
+            fields {
+              key: "bid"
+              value { number_value: 1 }
+            }
+          }
+        }
+        interest_groups {
+          owner: "dsp.example"
+          name: "broken"
+          bidding_logic_url: "local://bidding"
+          ads { render_url: "https://dsp.example/broken" }
+        }
+        interest_groups {
+          owner: "dsp.example"
+          name: "third"
+          bidding_logic_url: "local://bidding"
+          ads { render_url: "https://dsp.example/third" }
+          user_bidding_signals {
+            fields {
+              key: "bid"
+              value { number_value: 3 }
+            }
+          }
+        }
+        auction_configuration {
+          decision_logic_url: "local://scoring"
+          interest_group_buyers: [ "dsp.example" ]
+        }
+      )pb");
+  ::aviary::RunAdAuctionResponse response;
+  grpc::Status status =
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response);
+  ASSERT_TRUE(status.ok());
+  EXPECT_THAT(response.winning_bid(),
+              AllOf(Property(&Scored::interest_group_name, "third"),
+                    Property(&Scored::render_url, "https://dsp.example/third"),
+                    Property(&Scored::desirability_score, 3.0)));
+  EXPECT_THAT(response.losing_bids(),
+              ElementsAre(AllOf(
+                  Property(&Scored::interest_group_name, "first"),
+                  Property(&Scored::render_url, "https://dsp.example/first"),
+                  Property(&Scored::desirability_score, 1.0))));
+}
+
+TEST_F(AdAuctionsTest, RunAdAuctionManyBuyers) {
+  constexpr int kBuyers = 8;
+  Configuration configuration{
+      .ad_scoring_function_specs = {FunctionSpecification{
+          .uri = "local://scoring",
+          .source_code = R"(
+            (adMetadata, bid, auctionConfig, trustedScoringSignals,
+             browserSignals) => ({ desirabilityScore: bid }))"}}};
+  RunAdAuctionRequest request;
+  request.mutable_auction_configuration()->set_decision_logic_url(
+      "local://scoring");
+  for (int i = 0; i < kBuyers; i++) {
+    const std::string owner = absl::StrCat("buyer", i, ".example");
+    const std::string bidding_logic_url = absl::StrCat("local://bidding", i);
+    configuration.bidding_function_specs.push_back(FunctionSpecification{
+        .uri = bidding_logic_url,
+        .source_code = absl::Substitute(
+            R"(
+            (interestGroup, auctionSignals, perBuyerSignals,
+             trustedBiddingSignals, browserSignals) => ({
+              bid: $0, renderUrl: interestGroup.ads[0].renderUrl }))",
+            i + 1)});
+    request.mutable_auction_configuration()->add_interest_group_buyers(owner);
+    InterestGroupAuctionState* interest_group = request.add_interest_groups();
+    interest_group->set_owner(owner);
+    interest_group->set_name(absl::StrCat("group", i));
+    interest_group->set_bidding_logic_url(bidding_logic_url);
+    interest_group->add_ads()->set_render_url(absl::StrCat("https://", owner));
+  }
+  auto ad_auctions = CreateAdAuctions(configuration);
+  ::aviary::RunAdAuctionResponse response;
+  grpc::Status status =
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response);
+  ASSERT_TRUE(status.ok());
+  EXPECT_THAT(response.winning_bid(),
+              AllOf(Property(&Scored::interest_group_owner,
+                             absl::StrCat("buyer", kBuyers - 1, ".example")),
+                    Property(&Scored::desirability_score, kBuyers)));
+  ASSERT_EQ(response.losing_bids_size(), kBuyers - 1);
+  for (int i = 0; i < kBuyers - 1; i++) {
+    EXPECT_EQ(response.losing_bids(i).interest_group_owner(),
+              absl::StrCat("buyer", kBuyers - 2 - i, ".example"));
+    EXPECT_EQ(response.losing_bids(i).desirability_score(), kBuyers - 1 - i);
+  }
+}
+
+namespace {
+// Adds an interest group of `owner` bidding with `bidding_logic_url`.
+void AddBuyer(absl::string_view owner, absl::string_view bidding_logic_url,
+              RunAdAuctionRequest* request) {
+  request->mutable_auction_configuration()->add_interest_group_buyers(
+      std::string(owner));
+  InterestGroupAuctionState* interest_group = request->add_interest_groups();
+  interest_group->set_owner(std::string(owner));
+  interest_group->set_name(absl::StrCat(owner, "/group"));
+  interest_group->set_bidding_logic_url(std::string(bidding_logic_url));
+  interest_group->add_ads()->set_render_url(absl::StrCat("https://", owner));
+}
+
+// Configuration of a fast buyer bidding 1, and of a slow buyer bidding 2 after
+// 500ms.
+Configuration FastAndSlowBuyersConfiguration() {
+  return Configuration{
+      .bidding_function_specs =
+          {FunctionSpecification{
+               .uri = "local://fast",
+               .source_code = R"(
+                 (interestGroup, auctionSignals, perBuyerSignals,
+                  trustedBiddingSignals, browserSignals) => ({
+                   bid: 1, renderUrl: interestGroup.ads[0].renderUrl }))"},
+           FunctionSpecification{
+               .uri = "local://slow",
+               .source_code = R"(
+                 (interestGroup, auctionSignals, perBuyerSignals,
+                  trustedBiddingSignals, browserSignals) => {
+                   const end = Date.now() + 500;
+                   while (Date.now() < end) {}
+                   return { bid: 2, renderUrl: interestGroup.ads[0].renderUrl };
+                 })"}},
+      .ad_scoring_function_specs = {FunctionSpecification{
+          .uri = "local://scoring",
+          .source_code = R"(
+            (adMetadata, bid, auctionConfig, trustedScoringSignals,
+             browserSignals) => ({ desirabilityScore: bid }))"}}};
+}
+
+RunAdAuctionRequest FastAndSlowBuyersRequest() {
+  RunAdAuctionRequest request;
+  request.mutable_auction_configuration()->set_decision_logic_url(
+      "local://scoring");
+  AddBuyer("slow.example", "local://slow", &request);
+  AddBuyer("fast.example", "local://fast", &request);
+  return request;
+}
+}  // namespace
+
+TEST_F(AdAuctionsTest, RunAdAuctionReturnsTopBids) {
+  constexpr int kBuyers = 8;
+  Configuration configuration{
+      .ad_scoring_function_specs = {FunctionSpecification{
+          .uri = "local://scoring",
+          .source_code = R"(
+            (adMetadata, bid, auctionConfig, trustedScoringSignals,
+             browserSignals) => ({ desirabilityScore: bid }))"}}};
+  RunAdAuctionRequest request;
+  request.mutable_auction_configuration()->set_decision_logic_url(
+      "local://scoring");
+  for (int i = 0; i < kBuyers; i++) {
+    // Buyers bid in a shuffled order of amounts.
+    const int bid = (i * 3) % kBuyers + 1;
+    const std::string bidding_logic_url = absl::StrCat("local://bidding", bid);
+    configuration.bidding_function_specs.push_back(FunctionSpecification{
+        .uri = bidding_logic_url,
+        .source_code = absl::Substitute(
+            R"(
+            (interestGroup, auctionSignals, perBuyerSignals,
+             trustedBiddingSignals, browserSignals) => ({
+              bid: $0, renderUrl: interestGroup.ads[0].renderUrl }))",
+            bid)});
+    AddBuyer(absl::StrCat("buyer", bid, ".example"), bidding_logic_url,
+             &request);
+  }
+  request.set_max_returned_bids(3);
+  auto ad_auctions = CreateAdAuctions(configuration);
+  ::aviary::RunAdAuctionResponse response;
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response)
+          .ok());
+  EXPECT_THAT(response.winning_bid(),
+              AllOf(Property(&Scored::interest_group_owner, "buyer8.example"),
+                    Property(&Scored::desirability_score, 8)));
+  EXPECT_THAT(
+      response.losing_bids(),
+      ElementsAre(
+          AllOf(Property(&Scored::interest_group_owner, "buyer7.example"),
+                Property(&Scored::desirability_score, 7)),
+          AllOf(Property(&Scored::interest_group_owner, "buyer6.example"),
+                Property(&Scored::desirability_score, 6))));
+
+  // Only the winning bid is returned.
+  request.set_max_returned_bids(1);
+  response.Clear();
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response)
+          .ok());
+  EXPECT_EQ(response.winning_bid().desirability_score(), 8);
+  EXPECT_THAT(response.losing_bids(), IsEmpty());
+}
+
+TEST_F(AdAuctionsTest, RunAdAuctionLateBuyerDropped) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_auction_deadline, absl::Milliseconds(100));
+  // Buyers late in previous auctions do not hold up the fast buyer.
+  absl::SetFlag(&FLAGS_auction_executor_threads, 4);
+  auto ad_auctions = CreateAdAuctions(FastAndSlowBuyersConfiguration());
+  const RunAdAuctionRequest request = FastAndSlowBuyersRequest();
+  ::aviary::RunAdAuctionResponse response;
+  const absl::Time start = absl::Now();
+  grpc::Status status =
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response);
+  ASSERT_TRUE(status.ok());
+  // The auction does not wait for the slow buyer.
+  EXPECT_LT(absl::Now() - start, absl::Milliseconds(400));
+  EXPECT_EQ(response.winning_bid().interest_group_owner(), "fast.example");
+  EXPECT_THAT(response.losing_bids(), IsEmpty());
+  ASSERT_EQ(response.dropped_buyers_size(), 1);
+  EXPECT_EQ(response.dropped_buyers(0).bidding_logic_url(), "local://slow");
+  EXPECT_EQ(response.dropped_buyers(0).reason(), DroppedBuyer::LATE);
+}
+
+TEST_F(AdAuctionsTest, RunAdAuctionWithoutDeadlineWaitsForSlowBuyer) {
+  auto ad_auctions = CreateAdAuctions(FastAndSlowBuyersConfiguration());
+  const RunAdAuctionRequest request = FastAndSlowBuyersRequest();
+  ::aviary::RunAdAuctionResponse response;
+  grpc::Status status =
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response);
+  ASSERT_TRUE(status.ok());
+  EXPECT_EQ(response.winning_bid().interest_group_owner(), "slow.example");
+  EXPECT_EQ(response.losing_bids_size(), 1);
+  EXPECT_THAT(response.dropped_buyers(), IsEmpty());
+}
+
+TEST_F(AdAuctionsTest, RunAdAuctionLateBuyerSkipped) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_auction_deadline, absl::Milliseconds(100));
+  // Buyers late in previous auctions do not hold up the fast buyer.
+  absl::SetFlag(&FLAGS_auction_executor_threads, 4);
+  absl::SetFlag(&FLAGS_late_buyer_skip_threshold, 2);
+  auto ad_auctions = CreateAdAuctions(FastAndSlowBuyersConfiguration());
+  const RunAdAuctionRequest request = FastAndSlowBuyersRequest();
+  for (int i = 0; i < 2; i++) {
+    ::aviary::RunAdAuctionResponse response;
+    ASSERT_TRUE(
+        ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response)
+            .ok());
+    ASSERT_EQ(response.dropped_buyers_size(), 1);
+    EXPECT_EQ(response.dropped_buyers(0).reason(), DroppedBuyer::LATE);
+  }
+  // The slow buyer has been late in 2 auctions in a row, and is not even
+  // invoked in the next ones.
+  ::aviary::RunAdAuctionResponse response;
+  ASSERT_TRUE(
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response).ok());
+  EXPECT_EQ(response.winning_bid().interest_group_owner(), "fast.example");
+  ASSERT_EQ(response.dropped_buyers_size(), 1);
+  EXPECT_EQ(response.dropped_buyers(0).bidding_logic_url(), "local://slow");
+  EXPECT_EQ(response.dropped_buyers(0).reason(), DroppedBuyer::SKIPPED);
+}
+
+TEST_F(AdAuctionsTest, RunAdAuctionShedsBuyerPastFullQueue) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_auction_executor_threads, 4);
+  Configuration configuration = FastAndSlowBuyersConfiguration();
+  configuration.bidding_function_specs[1].max_concurrent_batches = 1;
+  configuration.bidding_function_specs[1].max_queued_batches = 0;
+  auto ad_auctions = CreateAdAuctions(configuration);
+  const RunAdAuctionRequest request = FastAndSlowBuyersRequest();
+  std::thread first_auction([&ad_auctions, &request] {
+    ::aviary::RunAdAuctionResponse response;
+    EXPECT_TRUE(
+        ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response)
+            .ok());
+    EXPECT_THAT(response.dropped_buyers(), IsEmpty());
+  });
+  // Lets the slow buyer of the first auction start bidding.
+  absl::SleepFor(absl::Milliseconds(100));
+  ::aviary::RunAdAuctionResponse response;
+  const absl::Time start = absl::Now();
+  grpc::Status status =
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response);
+  // The slow buyer is rejected right away.
+  EXPECT_LT(absl::Now() - start, absl::Milliseconds(300));
+  first_auction.join();
+  ASSERT_TRUE(status.ok());
+  EXPECT_EQ(response.winning_bid().interest_group_owner(), "fast.example");
+  ASSERT_EQ(response.dropped_buyers_size(), 1);
+  EXPECT_EQ(response.dropped_buyers(0).bidding_logic_url(), "local://slow");
+  EXPECT_EQ(response.dropped_buyers(0).reason(), DroppedBuyer::FAILED);
+}
+
+TEST_F(AdAuctionsTest, RunAdAuctionKeepsOtherBuyersOnScoringFailure) {
+  auto ad_auctions = CreateAdAuctions(Configuration{
+      .bidding_function_specs =
+          {FunctionSpecification{
+               .uri = "local://bid1",
+               .source_code = R"(
+                 (interestGroup, auctionSignals, perBuyerSignals,
+                  trustedBiddingSignals, browserSignals) => ({
+                   bid: 1, renderUrl: interestGroup.ads[0].renderUrl }))"},
+           FunctionSpecification{
+               .uri = "local://bid2",
+               .source_code = R"(
+                 (interestGroup, auctionSignals, perBuyerSignals,
+                  trustedBiddingSignals, browserSignals) => ({
+                   bid: 2, renderUrl: interestGroup.ads[0].renderUrl }))"}},
+      .ad_scoring_function_specs = {FunctionSpecification{
+          .uri = "local://scoring",
+          .source_code = R"(
+            (adMetadata, bid, auctionConfig, trustedScoringSignals,
+             browserSignals) => {
+              if (bid == 2) throw new Error("Unscorable bid");
+              return { desirabilityScore: bid };
+            })"}}});
+  RunAdAuctionRequest request;
+  request.mutable_auction_configuration()->set_decision_logic_url(
+      "local://scoring");
+  AddBuyer("buyer1.example", "local://bid1", &request);
+  AddBuyer("buyer2.example", "local://bid2", &request);
+  ::aviary::RunAdAuctionResponse response;
+  grpc::Status status =
+      ad_auctions->RunAdAuction(/*context=*/nullptr, &request, &response);
+  ASSERT_TRUE(status.ok());
+  EXPECT_EQ(response.winning_bid().interest_group_owner(), "buyer1.example");
+  ASSERT_EQ(response.dropped_buyers_size(), 1);
+  EXPECT_EQ(response.dropped_buyers(0).bidding_logic_url(), "local://bid2");
+  EXPECT_EQ(response.dropped_buyers(0).reason(), DroppedBuyer::FAILED);
+  EXPECT_FALSE(response.dropped_buyers(0).message().empty());
+}
 }  // namespace server
 }  // namespace aviary
@@ -0,0 +1,282 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/async_ad_auctions.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <utility>
+
+#include "absl/cleanup/cleanup.h"
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(int,
+          server_completion_queues,
+          1,
+          "Number of completion queues accepting the RPCs of the asynchronous "
+          "service.");
+ABSL_FLAG(int,
+          server_completion_queue_threads,
+          2,
+          "Number of threads polling each completion queue of the "
+          "asynchronous service.");
+ABSL_FLAG(int,
+          server_rpc_threads,
+          std::max(1u, std::thread::hardware_concurrency()),
+          "Number of threads handling the RPCs of the asynchronous service.");
+ABSL_FLAG(int,
+          server_rpc_queue_size,
+          1000,
+          "Maximum number of RPCs of the asynchronous service waiting for one "
+          "of the --server_rpc_threads threads. RPCs beyond that fail with "
+          "RESOURCE_EXHAUSTED.");
+
+namespace aviary {
+namespace server {
+namespace {
+
+// An RPC in flight, used as the tag of its operations on a completion queue.
+class Call {
+ public:
+  virtual ~Call() = default;
+
+  // Proceeds with the RPC once its pending operation is over, successfully
+  // if `ok`.
+  virtual void Proceed(bool ok) = 0;
+};
+
+// A unary RPC of a method of `AdAuctions`, handled by the corresponding
+// method of a synchronous service on an executor. RPCs cancelled or past their
+// deadline by the time they would be handled are failed instead, and so are
+// those finding the executor queue full. Deletes itself once done.
+template <typename Request, typename Response>
+class UnaryCall final : public Call {
+ public:
+  using RequestMethod = void (AsyncAdAuctionsServer::AsyncService::*)(
+      grpc::ServerContext*, Request*,
+      grpc::ServerAsyncResponseWriter<Response>*, grpc::CompletionQueue*,
+      grpc::ServerCompletionQueue*, void*);
+  using Handler = AsyncAdAuctionsServer::Handler<Request, Response>;
+
+  // Accepts RPCs of a method on a completion queue, and handles them.
+  struct Method {
+    AsyncAdAuctionsServer::AsyncService* async_service;
+    RequestMethod request_method;
+    const Handler* handler;
+    ::aviary::util::ThreadPool* executor;
+    grpc::ServerCompletionQueue* completion_queue;
+    // RPCs of all methods waiting for or running on `executor`, and how many
+    // can at most.
+    std::atomic<int>* pending_rpcs;
+    int max_pending_rpcs;
+  };
+
+  // Waits for the next RPC of `method`.
+  static void Accept(const Method& method) { new UnaryCall(method); }
+
+  void Proceed(bool ok) override {
+    if (accepted_) {
+      // The response was sent.
+      Unref();
+      return;
+    }
+    if (!ok) {
+      // The completion queue is shutting down.
+      delete this;
+      return;
+    }
+    accepted_ = true;
+    // The next RPC is accepted while this one is handled.
+    Accept(method_);
+    if (method_.pending_rpcs->fetch_add(1) >= method_.max_pending_rpcs) {
+      method_.pending_rpcs->fetch_sub(1);
+      responder_.FinishWithError(
+          grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                       "Too many RPCs are waiting to be handled"),
+          this);
+      return;
+    }
+    method_.executor->Schedule([this] {
+      // The call can be gone as soon as its response is sent.
+      absl::Cleanup done = [pending_rpcs = method_.pending_rpcs] {
+        pending_rpcs->fetch_sub(1);
+      };
+      if (done_tag_.is_done()) {
+        // Only cancelled RPCs are done before their response is sent.
+        responder_.FinishWithError(
+            grpc::Status(grpc::StatusCode::CANCELLED,
+                         "The RPC was cancelled before being handled"),
+            this);
+        return;
+      }
+      if (context_.deadline() <= std::chrono::system_clock::now()) {
+        responder_.FinishWithError(
+            grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                         "The RPC expired before being handled"),
+            this);
+        return;
+      }
+      const grpc::Status status =
+          (*method_.handler)(&context_, request_, &response_);
+      responder_.Finish(response_, status, this);
+    });
+  }
+
+ private:
+  // Tag notified once the RPC is done, either once its response is sent or
+  // once it is cancelled.
+  class DoneTag final : public Call {
+   public:
+    explicit DoneTag(UnaryCall* call) : call_(call) {}
+
+    bool is_done() const { return done_.load(std::memory_order_acquire); }
+
+    void Proceed(bool ok) override {
+      done_.store(true, std::memory_order_release);
+      call_->Unref();
+    }
+
+   private:
+    UnaryCall* const call_;
+    std::atomic<bool> done_ = false;
+  };
+
+  explicit UnaryCall(const Method& method)
+      : method_(method), responder_(&context_), done_tag_(this) {
+    context_.AsyncNotifyWhenDone(&done_tag_);
+    (method_.async_service->*method_.request_method)(
+        &context_, request_.get(), &responder_, method_.completion_queue,
+        method_.completion_queue, this);
+  }
+
+  // Deletes the call once both its response is sent and its done tag is
+  // notified, which can happen concurrently on different polling threads.
+  void Unref() {
+    if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  const Method method_;
+  grpc::ServerContext context_;
+  // Shared with the handler, which can keep it once the call is deleted.
+  const std::shared_ptr<Request> request_ = std::make_shared<Request>();
+  Response response_;
+  grpc::ServerAsyncResponseWriter<Response> responder_;
+  // Only notified for accepted RPCs.
+  DoneTag done_tag_;
+  bool accepted_ = false;
+  std::atomic<int> references_ = 2;
+};
+
+using ComputeBidCall =
+    UnaryCall<::aviary::ComputeBidRequest, ::aviary::BiddingFunctionOutput>;
+using RunAdAuctionCall =
+    UnaryCall<::aviary::RunAdAuctionRequest, ::aviary::RunAdAuctionResponse>;
+
+void PollCompletionQueue(grpc::ServerCompletionQueue* completion_queue) {
+  void* tag;
+  bool ok;
+  while (completion_queue->Next(&tag, &ok)) {
+    static_cast<Call*>(tag)->Proceed(ok);
+  }
+}
+
+// Returns a handler calling `handler` of `service`, which only uses requests
+// for the duration of their RPC.
+template <typename Request, typename Response>
+AsyncAdAuctionsServer::Handler<Request, Response> GetServiceHandler(
+    ::aviary::AdAuctions::Service* service,
+    grpc::Status (::aviary::AdAuctions::Service::*handler)(
+        grpc::ServerContext*, const Request*, Response*)) {
+  return [service, handler](grpc::ServerContext* context,
+                            std::shared_ptr<const Request> request,
+                            Response* response) {
+    return (service->*handler)(context, request.get(), response);
+  };
+}
+}  // namespace
+
+AsyncAdAuctionsServer::AsyncAdAuctionsServer(
+    ::aviary::AdAuctions::Service* service,
+    RunAdAuctionHandler run_ad_auction)
+    : compute_bid_(GetServiceHandler(
+          service, &::aviary::AdAuctions::Service::ComputeBid)),
+      run_ad_auction_(run_ad_auction != nullptr
+                          ? std::move(run_ad_auction)
+                          : GetServiceHandler(
+                                service,
+                                &::aviary::AdAuctions::Service::RunAdAuction)),
+      async_service_(service) {}
+
+AsyncAdAuctionsServer::~AsyncAdAuctionsServer() {
+  // Handlers still running send their responses before the queues go away.
+  rpc_executor_.reset();
+  for (const auto& completion_queue : completion_queues_) {
+    completion_queue->Shutdown();
+  }
+  for (std::thread& polling_thread : polling_threads_) {
+    polling_thread.join();
+  }
+}
+
+void AsyncAdAuctionsServer::RegisterWith(grpc::ServerBuilder* builder) {
+  builder->RegisterService(&async_service_);
+  const int completion_queue_count =
+      std::max(1, absl::GetFlag(FLAGS_server_completion_queues));
+  for (int i = 0; i < completion_queue_count; i++) {
+    completion_queues_.push_back(builder->AddCompletionQueue());
+  }
+}
+
+void AsyncAdAuctionsServer::Start() {
+  const int rpc_threads = std::max(1, absl::GetFlag(FLAGS_server_rpc_threads));
+  rpc_executor_ = std::make_unique<::aviary::util::ThreadPool>(rpc_threads);
+  const int max_pending_rpcs =
+      rpc_threads + std::max(0, absl::GetFlag(FLAGS_server_rpc_queue_size));
+  const int threads_per_queue =
+      std::max(1, absl::GetFlag(FLAGS_server_completion_queue_threads));
+  for (const auto& completion_queue : completion_queues_) {
+    // As many RPCs of each method are awaited as there are threads polling
+    // the queue, so that every thread can accept one at once.
+    for (int i = 0; i < threads_per_queue; i++) {
+      ComputeBidCall::Accept(
+          {.async_service = &async_service_,
+           .request_method =
+               &AsyncAdAuctionsServer::AsyncService::RequestComputeBid,
+           .handler = &compute_bid_,
+           .executor = rpc_executor_.get(),
+           .completion_queue = completion_queue.get(),
+           .pending_rpcs = &pending_rpcs_,
+           .max_pending_rpcs = max_pending_rpcs});
+      RunAdAuctionCall::Accept(
+          {.async_service = &async_service_,
+           .request_method =
+               &AsyncAdAuctionsServer::AsyncService::RequestRunAdAuction,
+           .handler = &run_ad_auction_,
+           .executor = rpc_executor_.get(),
+           .completion_queue = completion_queue.get(),
+           .pending_rpcs = &pending_rpcs_,
+           .max_pending_rpcs = max_pending_rpcs});
+    }
+    for (int i = 0; i < threads_per_queue; i++) {
+      polling_threads_.emplace_back(PollCompletionQueue,
+                                    completion_queue.get());
+    }
+  }
+}
+}  // namespace server
+}  // namespace aviary
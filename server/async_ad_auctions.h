@@ -0,0 +1,111 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SERVER_ASYNC_AD_AUCTIONS_H_
+#define SERVER_ASYNC_AD_AUCTIONS_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "grpc++/grpc++.h"
+#include "proto/aviary.grpc.pb.h"
+#include "util/thread_pool.h"
+
+namespace aviary {
+namespace server {
+
+// Serves the AdAuctions RPCs through the asynchronous gRPC API, on threads of
+// its own rather than on the threads of gRPC.
+//
+// --server_completion_queues completion queues, each polled by
+// --server_completion_queue_threads threads, accept RPCs and send their
+// responses. The RPCs themselves are handled by a pool of --server_rpc_threads
+// threads, which run the handlers of a synchronous service and complete the
+// RPCs once their results are ready. The handlers block their thread, so that
+// at most --server_rpc_threads RPCs are handled at once, and at most
+// --server_rpc_queue_size more wait for a thread. RPCs cancelled or past their
+// deadline while waiting are failed without being handled. BatchComputeBid,
+// which streams its results, is left to the threads of gRPC.
+class AsyncAdAuctionsServer {
+ public:
+  // Handles a unary RPC. The handler can keep the request once the RPC is
+  // over.
+  template <typename Request, typename Response>
+  using Handler = std::function<grpc::Status(
+      grpc::ServerContext*, std::shared_ptr<const Request>, Response*)>;
+  using RunAdAuctionHandler =
+      Handler<::aviary::RunAdAuctionRequest, ::aviary::RunAdAuctionResponse>;
+
+  // Handles the RPCs with `service`, which must outlive this server.
+  // RunAdAuction is handled by `run_ad_auction` if set, which spares copying
+  // the requests that outlive their RPC.
+  explicit AsyncAdAuctionsServer(::aviary::AdAuctions::Service* service,
+                                 RunAdAuctionHandler run_ad_auction = nullptr);
+
+  // Waits for the RPCs being handled to complete, then shuts down the
+  // completion queues. The gRPC server must have been shut down before.
+  ~AsyncAdAuctionsServer();
+
+  // Registers the service and the completion queues with `builder`. Must be
+  // called once, before the server is built.
+  void RegisterWith(grpc::ServerBuilder* builder);
+
+  // Starts accepting RPCs. Must be called once, after the server is built.
+  void Start();
+
+  AsyncAdAuctionsServer(const AsyncAdAuctionsServer&) = delete;
+  AsyncAdAuctionsServer& operator=(const AsyncAdAuctionsServer&) = delete;
+
+  // Serves the unary RPCs asynchronously, and forwards BatchComputeBid to the
+  // synchronous service.
+  class AsyncService final
+      : public ::aviary::AdAuctions::WithAsyncMethod_ComputeBid<
+            ::aviary::AdAuctions::WithAsyncMethod_RunAdAuction<
+                ::aviary::AdAuctions::Service>> {
+   public:
+    explicit AsyncService(::aviary::AdAuctions::Service* service)
+        : service_(service) {}
+
+    grpc::Status BatchComputeBid(
+        grpc::ServerContext* context,
+        const ::aviary::BatchComputeBidRequest* request,
+        grpc::ServerWriter<::aviary::BatchComputeBidResponse>* writer)
+        override {
+      return service_->BatchComputeBid(context, request, writer);
+    }
+
+   private:
+    ::aviary::AdAuctions::Service* const service_;
+  };
+
+ private:
+  const Handler<::aviary::ComputeBidRequest, ::aviary::BiddingFunctionOutput>
+      compute_bid_;
+  const RunAdAuctionHandler run_ad_auction_;
+  AsyncService async_service_;
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> completion_queues_;
+  std::unique_ptr<::aviary::util::ThreadPool> rpc_executor_;
+  // RPCs waiting for or running on `rpc_executor_`.
+  std::atomic<int> pending_rpcs_ = 0;
+  std::vector<std::thread> polling_threads_;
+};
+}  // namespace server
+}  // namespace aviary
+
+#endif  // SERVER_ASYNC_AD_AUCTIONS_H_
@@ -0,0 +1,291 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/async_ad_auctions.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "proto/aviary.grpc.pb.h"
+
+ABSL_DECLARE_FLAG(int, server_completion_queue_threads);
+ABSL_DECLARE_FLAG(int, server_rpc_queue_size);
+ABSL_DECLARE_FLAG(int, server_rpc_threads);
+
+namespace aviary {
+namespace server {
+namespace {
+
+// Bids the `bid` per-buyer signal. Blocks RunAdAuction until `Unblock()`.
+class FakeAdAuctions : public ::aviary::AdAuctions::Service {
+ public:
+  explicit FakeAdAuctions(int expected_blocked_calls)
+      : blocked_calls_(expected_blocked_calls) {}
+
+  grpc::Status ComputeBid(::grpc::ServerContext* context,
+                          const ::aviary::ComputeBidRequest* request,
+                          ::aviary::BiddingFunctionOutput* response) override {
+    compute_bid_calls_++;
+    if (request->bidding_function_name() != "local://bid") {
+      return grpc::Status(grpc::StatusCode::NOT_FOUND, "Unknown function");
+    }
+    response->set_bid(request->input()
+                          .per_buyer_signals()
+                          .fields()
+                          .at("bid")
+                          .number_value());
+    return grpc::Status::OK;
+  }
+
+  // Writes a response per request.
+  grpc::Status BatchComputeBid(
+      ::grpc::ServerContext* context,
+      const ::aviary::BatchComputeBidRequest* request,
+      ::grpc::ServerWriter<::aviary::BatchComputeBidResponse>* writer)
+      override {
+    for (int i = 0; i < request->requests_size(); i++) {
+      ::aviary::BatchComputeBidResponse response;
+      ::aviary::BatchComputeBidResponse::Result* result =
+          response.add_results();
+      result->set_index(i);
+      const grpc::Status status =
+          ComputeBid(context, &request->requests(i), result->mutable_output());
+      result->set_error_code(status.error_code());
+      writer->Write(response);
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::Status RunAdAuction(::grpc::ServerContext* context,
+                            const ::aviary::RunAdAuctionRequest* request,
+                            ::aviary::RunAdAuctionResponse* response) override {
+    blocked_calls_.DecrementCount();
+    unblocked_.WaitForNotification();
+    response->mutable_winning_bid()->set_bid(1);
+    return grpc::Status::OK;
+  }
+
+  // Waits for the expected number of RunAdAuction calls to be blocked at once.
+  void WaitForBlockedCalls() { blocked_calls_.Wait(); }
+
+  void Unblock() { unblocked_.Notify(); }
+
+  int compute_bid_calls() const { return compute_bid_calls_; }
+
+ private:
+  std::atomic<int> compute_bid_calls_ = 0;
+  absl::BlockingCounter blocked_calls_;
+  absl::Notification unblocked_;
+};
+
+class AsyncAdAuctionsServerTest : public ::testing::Test {
+ protected:
+  void StartServer(FakeAdAuctions* service,
+                   AsyncAdAuctionsServer::RunAdAuctionHandler run_ad_auction =
+                       nullptr) {
+    async_server_ = std::make_unique<AsyncAdAuctionsServer>(
+        service, std::move(run_ad_auction));
+    grpc::ServerBuilder builder;
+    async_server_->RegisterWith(&builder);
+    server_ = builder.BuildAndStart();
+    async_server_->Start();
+    stub_ = ::aviary::AdAuctions::NewStub(
+        server_->InProcessChannel(grpc::ChannelArguments()));
+  }
+
+  void TearDown() override {
+    server_->Shutdown();
+    async_server_.reset();
+  }
+
+  absl::FlagSaver flag_saver_;
+  std::unique_ptr<AsyncAdAuctionsServer> async_server_;
+  std::unique_ptr<grpc::Server> server_;
+  std::unique_ptr<::aviary::AdAuctions::Stub> stub_;
+};
+
+TEST_F(AsyncAdAuctionsServerTest, ComputesBid) {
+  FakeAdAuctions service(/*expected_blocked_calls=*/0);
+  StartServer(&service);
+  ::aviary::ComputeBidRequest request;
+  request.set_bidding_function_name("local://bid");
+  (*request.mutable_input()->mutable_per_buyer_signals()->mutable_fields())
+      ["bid"]
+          .set_number_value(2.5);
+  grpc::ClientContext context;
+  ::aviary::BiddingFunctionOutput response;
+  ASSERT_TRUE(stub_->ComputeBid(&context, request, &response).ok());
+  EXPECT_EQ(response.bid(), 2.5);
+}
+
+TEST_F(AsyncAdAuctionsServerTest, ReturnsHandlerStatus) {
+  FakeAdAuctions service(/*expected_blocked_calls=*/0);
+  StartServer(&service);
+  ::aviary::ComputeBidRequest request;
+  request.set_bidding_function_name("local://unknown");
+  grpc::ClientContext context;
+  ::aviary::BiddingFunctionOutput response;
+  EXPECT_EQ(stub_->ComputeBid(&context, request, &response).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+}
+
+TEST_F(AsyncAdAuctionsServerTest, StreamsBatchComputeBid) {
+  FakeAdAuctions service(/*expected_blocked_calls=*/0);
+  StartServer(&service);
+  ::aviary::BatchComputeBidRequest request;
+  request.add_requests()->set_bidding_function_name("local://unknown");
+  ::aviary::ComputeBidRequest* bid_request = request.add_requests();
+  bid_request->set_bidding_function_name("local://bid");
+  (*bid_request->mutable_input()->mutable_per_buyer_signals()->mutable_fields())
+      ["bid"]
+          .set_number_value(2.5);
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReader<::aviary::BatchComputeBidResponse>>
+      reader = stub_->BatchComputeBid(&context, request);
+  std::vector<::aviary::BatchComputeBidResponse> responses;
+  ::aviary::BatchComputeBidResponse response;
+  while (reader->Read(&response)) {
+    responses.push_back(response);
+  }
+  ASSERT_TRUE(reader->Finish().ok());
+  ASSERT_EQ(responses.size(), 2);
+  EXPECT_EQ(responses[0].results(0).error_code(), grpc::StatusCode::NOT_FOUND);
+  EXPECT_EQ(responses[1].results(0).output().bid(), 2.5);
+}
+
+TEST_F(AsyncAdAuctionsServerTest, LetsHandlersKeepRequests) {
+  FakeAdAuctions service(/*expected_blocked_calls=*/0);
+  std::shared_ptr<const ::aviary::RunAdAuctionRequest> kept_request;
+  StartServer(&service,
+              [&kept_request](
+                  grpc::ServerContext* context,
+                  std::shared_ptr<const ::aviary::RunAdAuctionRequest> request,
+                  ::aviary::RunAdAuctionResponse* response) {
+                kept_request = std::move(request);
+                return grpc::Status::OK;
+              });
+  ::aviary::RunAdAuctionRequest request;
+  request.set_max_returned_bids(3);
+  grpc::ClientContext context;
+  ::aviary::RunAdAuctionResponse response;
+  ASSERT_TRUE(stub_->RunAdAuction(&context, request, &response).ok());
+  // The call is gone once the client got its response.
+  server_->Shutdown();
+  async_server_.reset();
+  ASSERT_NE(kept_request, nullptr);
+  EXPECT_EQ(kept_request->max_returned_bids(), 3);
+}
+
+TEST_F(AsyncAdAuctionsServerTest, HandlesMoreRpcsThanPollingThreads) {
+  absl::SetFlag(&FLAGS_server_completion_queue_threads, 1);
+  absl::SetFlag(&FLAGS_server_rpc_threads, 5);
+  constexpr int kAuctions = 4;
+  // All auctions are in flight at once, although a single thread polls the
+  // completion queue, and a handler thread is left for other RPCs.
+  FakeAdAuctions service(kAuctions);
+  StartServer(&service);
+  std::vector<std::thread> clients;
+  for (int i = 0; i < kAuctions; i++) {
+    clients.emplace_back([this] {
+      grpc::ClientContext context;
+      ::aviary::RunAdAuctionResponse response;
+      EXPECT_TRUE(
+          stub_->RunAdAuction(&context, ::aviary::RunAdAuctionRequest(),
+                              &response)
+              .ok());
+      EXPECT_EQ(response.winning_bid().bid(), 1);
+    });
+  }
+  service.WaitForBlockedCalls();
+  // Other RPCs are still served while the auctions are blocked.
+  ::aviary::ComputeBidRequest request;
+  grpc::ClientContext context;
+  ::aviary::BiddingFunctionOutput response;
+  EXPECT_EQ(stub_->ComputeBid(&context, request, &response).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+  service.Unblock();
+  for (std::thread& client : clients) {
+    client.join();
+  }
+}
+
+TEST_F(AsyncAdAuctionsServerTest, RejectsRpcsBeyondQueueSize) {
+  absl::SetFlag(&FLAGS_server_rpc_threads, 1);
+  absl::SetFlag(&FLAGS_server_rpc_queue_size, 0);
+  FakeAdAuctions service(/*expected_blocked_calls=*/1);
+  StartServer(&service);
+  std::thread client([this] {
+    grpc::ClientContext context;
+    ::aviary::RunAdAuctionResponse response;
+    EXPECT_TRUE(stub_
+                    ->RunAdAuction(&context, ::aviary::RunAdAuctionRequest(),
+                                   &response)
+                    .ok());
+  });
+  service.WaitForBlockedCalls();
+  ::aviary::ComputeBidRequest request;
+  grpc::ClientContext context;
+  ::aviary::BiddingFunctionOutput response;
+  EXPECT_EQ(stub_->ComputeBid(&context, request, &response).error_code(),
+            grpc::StatusCode::RESOURCE_EXHAUSTED);
+  service.Unblock();
+  client.join();
+  EXPECT_EQ(service.compute_bid_calls(), 0);
+}
+
+TEST_F(AsyncAdAuctionsServerTest, DropsRpcsExpiredWhileQueued) {
+  absl::SetFlag(&FLAGS_server_rpc_threads, 1);
+  FakeAdAuctions service(/*expected_blocked_calls=*/1);
+  StartServer(&service);
+  std::thread client([this] {
+    grpc::ClientContext context;
+    ::aviary::RunAdAuctionResponse response;
+    EXPECT_TRUE(stub_
+                    ->RunAdAuction(&context, ::aviary::RunAdAuctionRequest(),
+                                   &response)
+                    .ok());
+  });
+  service.WaitForBlockedCalls();
+  {
+    ::aviary::ComputeBidRequest request;
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() +
+                         std::chrono::milliseconds(50));
+    ::aviary::BiddingFunctionOutput response;
+    EXPECT_EQ(stub_->ComputeBid(&context, request, &response).error_code(),
+              grpc::StatusCode::DEADLINE_EXCEEDED);
+  }
+  service.Unblock();
+  client.join();
+  // The expired RPC is dequeued before this one, without being handled.
+  ::aviary::ComputeBidRequest request;
+  grpc::ClientContext context;
+  ::aviary::BiddingFunctionOutput response;
+  EXPECT_EQ(stub_->ComputeBid(&context, request, &response).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+  EXPECT_EQ(service.compute_bid_calls(), 1);
+}
+}  // namespace
+}  // namespace server
+}  // namespace aviary
@@ -0,0 +1,233 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/auction_load.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <thread>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/synchronization/mutex.h"
+#include "google/protobuf/util/json_util.h"
+#include "grpc++/grpc++.h"
+
+namespace aviary {
+namespace server {
+namespace {
+
+using ::google::protobuf::util::JsonStringToMessage;
+
+// Returns the CPU time used by this process and its waited-for children.
+absl::Duration GetCpuTime() {
+  absl::Duration cpu_time;
+  for (int who : {RUSAGE_SELF, RUSAGE_CHILDREN}) {
+    struct rusage usage;
+    if (getrusage(who, &usage) == 0) {
+      cpu_time += absl::DurationFromTimeval(usage.ru_utime) +
+                  absl::DurationFromTimeval(usage.ru_stime);
+    }
+  }
+  return cpu_time;
+}
+
+std::string FormatMilliseconds(absl::Duration duration) {
+  return absl::StrFormat("%.3fms", absl::ToDoubleMilliseconds(duration));
+}
+
+// Returns the nearest-rank percentile of the sorted `latencies`.
+absl::Duration GetPercentile(const std::vector<absl::Duration>& latencies,
+                             double fraction) {
+  if (latencies.empty()) {
+    return absl::ZeroDuration();
+  }
+  const size_t rank = static_cast<size_t>(
+      std::ceil(std::clamp(fraction, 0.0, 1.0) * latencies.size()));
+  return latencies[std::max<size_t>(rank, 1) - 1];
+}
+}  // namespace
+
+RunAdAuctionRequest CreateSyntheticRequest(const SyntheticAuction& auction) {
+  RunAdAuctionRequest request;
+  AuctionConfiguration* configuration = request.mutable_auction_configuration();
+  configuration->set_seller("https://seller.example");
+  configuration->set_decision_logic_url(auction.decision_logic_url);
+  std::vector<std::string> owners;
+  for (size_t i = 0; i < auction.bidding_logic_urls.size(); i++) {
+    const std::string& owner =
+        owners.emplace_back(absl::StrCat("https://buyer", i, ".example"));
+    configuration->add_interest_group_buyers(owner);
+    (*(*configuration->mutable_per_buyer_signals())[owner]
+          .mutable_fields())["contextualCpm"]
+        .set_number_value(1.0 + i);
+  }
+  if (owners.empty()) {
+    return request;
+  }
+  for (int i = 0; i < auction.interest_groups; i++) {
+    const size_t buyer = i % owners.size();
+    InterestGroupAuctionState* interest_group = request.add_interest_groups();
+    interest_group->set_owner(owners[buyer]);
+    interest_group->set_name(absl::StrCat("interest-group-", i));
+    interest_group->set_bidding_logic_url(auction.bidding_logic_urls[buyer]);
+    (*interest_group->mutable_user_bidding_signals()
+          ->mutable_fields())["engagement"]
+        .set_number_value(i % 10);
+    for (int j = 0; j < auction.ads_per_interest_group; j++) {
+      InterestGroupAd* ad = interest_group->add_ads();
+      ad->set_render_url(
+          absl::StrCat("https://cdn.buyer", buyer, ".example/ad", i, "-", j));
+      (*ad->mutable_ad_metadata()->mutable_fields())["categories"]
+          .mutable_list_value()
+          ->add_values()
+          ->set_string_value(j % 2 == 0 ? "sports" : "auto");
+    }
+  }
+  return request;
+}
+
+absl::StatusOr<std::vector<RunAdAuctionRequest>> ReadRequests(
+    absl::string_view file_name) {
+  std::ifstream file{std::string(file_name)};
+  if (!file) {
+    return absl::NotFoundError(
+        absl::StrCat("Could not read the requests file ", file_name));
+  }
+  std::vector<RunAdAuctionRequest> requests;
+  std::string line;
+  for (int line_number = 1; std::getline(file, line); line_number++) {
+    if (line.empty()) {
+      continue;
+    }
+    if (!JsonStringToMessage(line, &requests.emplace_back()).ok()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Unable to parse the request on line ", line_number, " of ",
+          file_name));
+    }
+  }
+  return requests;
+}
+
+absl::Duration LoadReport::Percentile(double fraction) const {
+  return GetPercentile(latencies, fraction);
+}
+
+absl::Duration LoadReport::FailurePercentile(double fraction) const {
+  return GetPercentile(failure_latencies, fraction);
+}
+
+std::string LoadReport::ToString() const {
+  const double seconds = absl::ToDoubleSeconds(elapsed);
+  std::string report = absl::StrFormat(
+      "auctions: %d succeeded, %d failed in %.3fs\n"
+      "throughput: %.1f auctions/s\n"
+      "latency: p50 %s, p99 %s, p999 %s, max %s\n",
+      successes, failures, seconds, seconds > 0 ? successes / seconds : 0.0,
+      FormatMilliseconds(Percentile(0.5)), FormatMilliseconds(Percentile(0.99)),
+      FormatMilliseconds(Percentile(0.999)), FormatMilliseconds(Percentile(1)));
+  if (failures > 0) {
+    absl::StrAppend(&report,
+                    absl::StrFormat("failed latency: p50 %s, p99 %s, max %s\n",
+                                    FormatMilliseconds(FailurePercentile(0.5)),
+                                    FormatMilliseconds(FailurePercentile(0.99)),
+                                    FormatMilliseconds(FailurePercentile(1))));
+  }
+  if (successes > 0) {
+    absl::StrAppend(&report, "cpu per auction: ",
+                    FormatMilliseconds(cpu_time / successes),
+                    " (this process)\n");
+  }
+  if (!first_failure.empty()) {
+    absl::StrAppend(&report, "first failure: ", first_failure, "\n");
+  }
+  return report;
+}
+
+LoadReport RunLoad(AdAuctions::StubInterface& stub,
+                   const std::vector<RunAdAuctionRequest>& requests,
+                   const LoadOptions& options) {
+  LoadReport report;
+  if (requests.empty()) {
+    return report;
+  }
+  absl::Mutex mutex;
+  std::atomic<int64_t> next_auction{0};
+  const absl::Duration start_cpu_time = GetCpuTime();
+  const absl::Time start = absl::Now();
+  const absl::Time end = start + options.duration;
+
+  auto run_worker = [&] {
+    LoadReport worker_report;
+    while (true) {
+      const int64_t auction = next_auction.fetch_add(1);
+      absl::Time scheduled_start = absl::Now();
+      if (options.qps > 0) {
+        scheduled_start = start + absl::Seconds(auction / options.qps);
+        absl::SleepFor(scheduled_start - absl::Now());
+      }
+      if (scheduled_start >= end) {
+        break;
+      }
+      grpc::ClientContext context;
+      context.set_deadline(absl::ToChronoTime(absl::Now() + options.deadline));
+      RunAdAuctionResponse response;
+      const grpc::Status status = stub.RunAdAuction(
+          &context, requests[auction % requests.size()], &response);
+      const absl::Duration latency = absl::Now() - scheduled_start;
+      if (status.ok()) {
+        worker_report.successes++;
+        worker_report.latencies.push_back(latency);
+      } else {
+        worker_report.failure_latencies.push_back(latency);
+        if (worker_report.failures++ == 0) {
+          worker_report.first_failure = absl::StrCat(
+              "code ", status.error_code(), ": ", status.error_message());
+        }
+      }
+    }
+    absl::MutexLock lock(&mutex);
+    report.successes += worker_report.successes;
+    report.failures += worker_report.failures;
+    if (report.first_failure.empty()) {
+      report.first_failure = std::move(worker_report.first_failure);
+    }
+    report.latencies.insert(report.latencies.end(),
+                            worker_report.latencies.begin(),
+                            worker_report.latencies.end());
+    report.failure_latencies.insert(report.failure_latencies.end(),
+                                    worker_report.failure_latencies.begin(),
+                                    worker_report.failure_latencies.end());
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < std::max(1, options.concurrency); i++) {
+    workers.emplace_back(run_worker);
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  report.elapsed = absl::Now() - start;
+  report.cpu_time = GetCpuTime() - start_cpu_time;
+  std::sort(report.latencies.begin(), report.latencies.end());
+  std::sort(report.failure_latencies.begin(), report.failure_latencies.end());
+  return report;
+}
+}  // namespace server
+}  // namespace aviary
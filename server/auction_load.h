@@ -0,0 +1,106 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SERVER_AUCTION_LOAD_H_
+#define SERVER_AUCTION_LOAD_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "proto/aviary.grpc.pb.h"
+#include "proto/aviary.pb.h"
+
+namespace aviary {
+namespace server {
+
+// Shape of synthetic auctions.
+struct SyntheticAuction {
+  // Bidding functions of the buyers, one buyer per function, so that an
+  // auction fans out to as many buyers as there are functions.
+  std::vector<std::string> bidding_logic_urls;
+  // Ad scoring function of the seller.
+  std::string decision_logic_url;
+  // Interest groups of an auction, spread evenly across the buyers.
+  int interest_groups = 16;
+  int ads_per_interest_group = 4;
+};
+
+// Returns an auction of the given shape. Buyer `i` is the owner
+// `https://buyer<i>.example`, using the `i`-th bidding function and getting
+// `contextualCpm` per-buyer signals.
+RunAdAuctionRequest CreateSyntheticRequest(const SyntheticAuction& auction);
+
+// Reads recorded auctions from `file_name`, one request per line in the JSON
+// format of `RunAdAuctionRequest`. Empty lines are skipped.
+absl::StatusOr<std::vector<RunAdAuctionRequest>> ReadRequests(
+    absl::string_view file_name);
+
+struct LoadOptions {
+  // Auctions started per second, on schedule. When 0, auctions are started as
+  // soon as there is room for them within `concurrency`.
+  double qps = 0;
+  // Auctions in flight at most, each run by a thread of its own.
+  int concurrency = 1;
+  // How long auctions are started for.
+  absl::Duration duration = absl::Seconds(10);
+  // Deadline of each auction.
+  absl::Duration deadline = absl::Seconds(5);
+};
+
+// Outcome of a load run.
+struct LoadReport {
+  // Latency of the given fraction of the successful auctions, e.g. 0.99 for
+  // the 99th percentile, or zero if there was none.
+  absl::Duration Percentile(double fraction) const;
+
+  // Same as `Percentile()` for the failed auctions.
+  absl::Duration FailurePercentile(double fraction) const;
+
+  // Returns a human-readable summary of the run.
+  std::string ToString() const;
+
+  int64_t successes = 0;
+  int64_t failures = 0;
+  // Status of the first failed auction, if any.
+  std::string first_failure;
+  absl::Duration elapsed;
+  // CPU time used by this process, and the child processes it waited for,
+  // during the run.
+  absl::Duration cpu_time;
+  // Latencies of the successful auctions, in increasing order. With a target
+  // QPS, they are measured from the time the auction was scheduled to start
+  // rather than from when it actually started, so that auctions delayed by the
+  // server falling behind are accounted for.
+  std::vector<absl::Duration> latencies;
+  // Latencies of the failed auctions, measured the same way, which are
+  // reported apart so that auctions failing fast do not flatter the
+  // latencies, nor do those timing out hide the tail under overload.
+  std::vector<absl::Duration> failure_latencies;
+};
+
+// Runs `requests` in turn against `stub` with the given options, blocking
+// until the run is over.
+LoadReport RunLoad(AdAuctions::StubInterface& stub,
+                   const std::vector<RunAdAuctionRequest>& requests,
+                   const LoadOptions& options);
+}  // namespace server
+}  // namespace aviary
+
+#endif  // SERVER_AUCTION_LOAD_H_
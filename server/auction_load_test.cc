@@ -0,0 +1,155 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/auction_load.h"
+
+#include <algorithm>
+#include <fstream>
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "gmock/gmock.h"
+#include "grpc++/grpc++.h"
+#include "gtest/gtest.h"
+#include "proto/aviary.grpc.pb.h"
+#include "server/ad_auctions.h"
+#include "server/function_source.h"
+#include "v8/v8_platform_initializer.h"
+
+namespace aviary {
+namespace server {
+namespace {
+
+using ::aviary::v8::V8PlatformInitializer;
+using ::testing::Each;
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+using ::testing::Property;
+using ::testing::SizeIs;
+
+TEST(AuctionLoadTest, CreatesSyntheticRequest) {
+  const RunAdAuctionRequest request = CreateSyntheticRequest(
+      {.bidding_logic_urls = {"local://a", "local://b"},
+       .decision_logic_url = "local://score",
+       .interest_groups = 3,
+       .ads_per_interest_group = 2});
+  EXPECT_EQ(request.auction_configuration().decision_logic_url(),
+            "local://score");
+  EXPECT_THAT(request.auction_configuration().interest_group_buyers(),
+              ElementsAre("https://buyer0.example", "https://buyer1.example"));
+  EXPECT_THAT(request.auction_configuration().per_buyer_signals(), SizeIs(2));
+  EXPECT_THAT(
+      request.interest_groups(),
+      ElementsAre(
+          Property(&InterestGroupAuctionState::bidding_logic_url, "local://a"),
+          Property(&InterestGroupAuctionState::bidding_logic_url, "local://b"),
+          Property(&InterestGroupAuctionState::bidding_logic_url,
+                   "local://a")));
+  EXPECT_THAT(request.interest_groups(),
+              Each(Property(&InterestGroupAuctionState::ads, SizeIs(2))));
+}
+
+TEST(AuctionLoadTest, ReadsRequests) {
+  const std::string file_name = absl::StrCat(testing::TempDir(), "/requests");
+  std::ofstream(file_name)
+      << R"({"auctionConfiguration": {"decisionLogicUrl": "local://a"}})"
+      << "\n\n"
+      << R"({"auctionConfiguration": {"decisionLogicUrl": "local://b"}})"
+      << "\n";
+  const absl::StatusOr<std::vector<RunAdAuctionRequest>> requests =
+      ReadRequests(file_name);
+  ASSERT_TRUE(requests.ok()) << requests.status();
+  ASSERT_THAT(*requests, SizeIs(2));
+  EXPECT_EQ((*requests)[1].auction_configuration().decision_logic_url(),
+            "local://b");
+}
+
+TEST(AuctionLoadTest, FailsToReadInvalidRequests) {
+  const std::string file_name =
+      absl::StrCat(testing::TempDir(), "/invalid_requests");
+  std::ofstream(file_name) << "{}\nnot json\n";
+  const absl::StatusOr<std::vector<RunAdAuctionRequest>> requests =
+      ReadRequests(file_name);
+  EXPECT_EQ(requests.status().code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_THAT(std::string(requests.status().message()), HasSubstr("line 2"));
+}
+
+TEST(AuctionLoadTest, ComputesPercentiles) {
+  LoadReport report;
+  EXPECT_EQ(report.Percentile(0.5), absl::ZeroDuration());
+  for (int i = 1; i <= 100; i++) {
+    report.latencies.push_back(absl::Milliseconds(i));
+  }
+  EXPECT_EQ(report.Percentile(0), absl::Milliseconds(1));
+  EXPECT_EQ(report.Percentile(0.5), absl::Milliseconds(50));
+  EXPECT_EQ(report.Percentile(0.99), absl::Milliseconds(99));
+  EXPECT_EQ(report.Percentile(0.999), absl::Milliseconds(100));
+  EXPECT_EQ(report.Percentile(1), absl::Milliseconds(100));
+}
+
+TEST(AuctionLoadTest, ReportsFailedAuctionLatencies) {
+  LoadReport report;
+  report.successes = 1;
+  report.latencies = {absl::Milliseconds(1)};
+  report.failures = 2;
+  report.failure_latencies = {absl::Milliseconds(3), absl::Milliseconds(900)};
+  EXPECT_EQ(report.Percentile(1), absl::Milliseconds(1));
+  EXPECT_EQ(report.FailurePercentile(0.5), absl::Milliseconds(3));
+  EXPECT_EQ(report.FailurePercentile(1), absl::Milliseconds(900));
+  EXPECT_THAT(report.ToString(), HasSubstr("failed latency: p50 3.000ms"));
+}
+
+TEST(AuctionLoadTest, RunsAuctions) {
+  V8PlatformInitializer v8_platform_initializer;
+  FunctionSource function_source;
+  const std::unique_ptr<AdAuctions::Service> service =
+      AdAuctionsImpl::Create(
+          Configuration{
+              .bidding_function_specs =
+                  {FunctionSpecification{
+                      .uri = "local://bid",
+                      .source_code =
+                          "(interestGroup, auctionSignals, perBuyerSignals) => "
+                          "({ bid: perBuyerSignals.contextualCpm, "
+                          "renderUrl: interestGroup.ads[0].renderUrl })"}},
+              .ad_scoring_function_specs =
+                  {FunctionSpecification{
+                      .uri = "local://score",
+                      .source_code = "(adMetadata, bid) => "
+                                     "({ desirabilityScore: bid })"}}},
+          function_source)
+          .value();
+  grpc::ServerBuilder builder;
+  builder.RegisterService(service.get());
+  const std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  const std::unique_ptr<AdAuctions::Stub> stub =
+      AdAuctions::NewStub(server->InProcessChannel(grpc::ChannelArguments()));
+
+  const LoadReport report = RunLoad(
+      *stub,
+      {CreateSyntheticRequest({.bidding_logic_urls = {"local://bid"},
+                               .decision_logic_url = "local://score"})},
+      {.qps = 50, .concurrency = 2, .duration = absl::Milliseconds(200)});
+  EXPECT_EQ(report.failures, 0) << report.first_failure;
+  // Auctions are started on schedule, i.e. 10 of them in 200ms at 50 QPS.
+  EXPECT_EQ(report.successes, 10);
+  ASSERT_THAT(report.latencies, SizeIs(report.successes));
+  EXPECT_TRUE(
+      std::is_sorted(report.latencies.begin(), report.latencies.end()));
+  EXPECT_THAT(report.ToString(), HasSubstr("10 succeeded, 0 failed"));
+  server->Shutdown();
+}
+}  // namespace
+}  // namespace server
+}  // namespace aviary
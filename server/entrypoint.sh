@@ -14,7 +14,7 @@
 # limitations under the License.
 
 echo "Starting a gRPC server at port 8081..."
-nohup /usr/local/bin/server --use_sandbox2 --bind_address=0.0.0.0:8081 --configuration_file=/etc/aviary/sample_configuration.yaml --function_refresh_interval=1m &
+nohup /usr/local/bin/server --use_sandbox2 --bind_address=0.0.0.0:8081 --metrics_bind_address=0.0.0.0:8082 --configuration_file=/etc/aviary/sample_configuration.yaml --function_refresh_interval=1m &
 mkdir -p /tmp/envoy
 sed -e "s/%%PORT%%/${PORT}/g" /etc/envoy/envoy.tpl.yaml > /tmp/envoy/envoy.yaml
 /usr/local/bin/envoy -c /tmp/envoy/envoy.yaml
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SERVER_FUNCTION_MEMO_H_
+#define SERVER_FUNCTION_MEMO_H_
+
+#include <cstdint>
+#include <utility>
+
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "google/protobuf/message.h"
+#include "util/sharded_cache.h"
+
+namespace aviary::server {
+
+// Returns a fingerprint of `message`, the same for equal messages regardless
+// of the order of their map entries. Fingerprints are only stable within a
+// process.
+uint64_t FingerprintMessage(const google::protobuf::Message& message);
+
+// Key of a memoized function output: the fingerprints of the input shared by
+// the invocations of a batch, and of the input of the invocation.
+struct FunctionMemoKey {
+  uint64_t common_input_fingerprint = 0;
+  uint64_t input_fingerprint = 0;
+
+  bool operator==(const FunctionMemoKey& other) const {
+    return common_input_fingerprint == other.common_input_fingerprint &&
+           input_fingerprint == other.input_fingerprint;
+  }
+
+  template <typename H>
+  friend H AbslHashValue(H h, const FunctionMemoKey& key) {
+    return H::combine(std::move(h), key.common_input_fingerprint,
+                      key.input_fingerprint);
+  }
+};
+
+// Memoizes the outputs of a deterministic function by the fingerprints of its
+// inputs, evicting the least recently used outputs beyond a capacity.
+//
+// Thread-safe.
+template <typename Output>
+class FunctionMemo {
+ public:
+  // Memoizes at most `capacity` outputs.
+  explicit FunctionMemo(size_t capacity)
+      : outputs_(capacity, absl::InfiniteDuration(),
+                 util::CacheExpiration::kSinceLastUse) {}
+
+  // Returns the output memoized for `key`, if any.
+  absl::optional<Output> Lookup(const FunctionMemoKey& key) {
+    return outputs_.Lookup(key);
+  }
+
+  // Memoizes `output` as the output for `key`.
+  void Insert(const FunctionMemoKey& key, const Output& output) {
+    outputs_.Insert(key, output);
+  }
+
+  FunctionMemo(const FunctionMemo&) = delete;
+  FunctionMemo& operator=(const FunctionMemo&) = delete;
+
+ private:
+  util::ShardedCache<FunctionMemoKey, Output> outputs_;
+};
+
+}  // namespace aviary::server
+
+#endif  // SERVER_FUNCTION_MEMO_H_
@@ -0,0 +1,96 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/function_memo.h"
+
+#include <thread>
+#include <vector>
+
+#include "google/protobuf/struct.pb.h"
+#include "gtest/gtest.h"
+
+namespace aviary::server {
+namespace {
+
+FunctionMemoKey Key(uint64_t input_fingerprint) {
+  return {.common_input_fingerprint = 1,
+          .input_fingerprint = input_fingerprint};
+}
+
+TEST(FingerprintMessageTest, IgnoresOrderOfMapEntries) {
+  google::protobuf::Struct signals;
+  (*signals.mutable_fields())["a"].set_number_value(1);
+  (*signals.mutable_fields())["b"].set_string_value("c");
+  google::protobuf::Struct reordered_signals;
+  (*reordered_signals.mutable_fields())["b"].set_string_value("c");
+  (*reordered_signals.mutable_fields())["a"].set_number_value(1);
+  EXPECT_EQ(FingerprintMessage(signals), FingerprintMessage(reordered_signals));
+}
+
+TEST(FingerprintMessageTest, DistinguishesMessages) {
+  google::protobuf::Struct signals;
+  (*signals.mutable_fields())["a"].set_number_value(1);
+  google::protobuf::Struct other_signals;
+  (*other_signals.mutable_fields())["a"].set_number_value(2);
+  EXPECT_NE(FingerprintMessage(signals), FingerprintMessage(other_signals));
+}
+
+TEST(FunctionMemoTest, ReturnsInsertedOutput) {
+  FunctionMemo<int> memo(/*capacity=*/100);
+  EXPECT_EQ(memo.Lookup(Key(1)), absl::nullopt);
+  memo.Insert(Key(1), 42);
+  EXPECT_EQ(memo.Lookup(Key(1)), 42);
+  // Keys with different common inputs are distinct.
+  EXPECT_EQ(memo.Lookup({.common_input_fingerprint = 2,
+                         .input_fingerprint = 1}),
+            absl::nullopt);
+  memo.Insert(Key(1), 43);
+  EXPECT_EQ(memo.Lookup(Key(1)), 43);
+}
+
+TEST(FunctionMemoTest, EvictsLeastRecentlyUsedOutputs) {
+  // An output per shard.
+  FunctionMemo<int> memo(/*capacity=*/16);
+  for (int i = 0; i < 100; i++) {
+    memo.Insert(Key(i), i);
+  }
+  int memoized_outputs = 0;
+  for (int i = 0; i < 100; i++) {
+    memoized_outputs += memo.Lookup(Key(i)).has_value();
+  }
+  EXPECT_GT(memoized_outputs, 0);
+  EXPECT_LE(memoized_outputs, 16);
+}
+
+TEST(FunctionMemoTest, ServesConcurrentLookups) {
+  FunctionMemo<int> memo(/*capacity=*/1000);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&memo] {
+      for (int j = 0; j < 100; j++) {
+        const absl::optional<int> output = memo.Lookup(Key(j));
+        if (output.has_value()) {
+          EXPECT_EQ(*output, j);
+        } else {
+          memo.Insert(Key(j), j);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+}  // namespace
+}  // namespace aviary::server
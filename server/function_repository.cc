@@ -27,11 +27,11 @@ FunctionRepository::GetBiddingFunction(
     return absl::NotFoundError(absl::Substitute("Bidding function $0 not found",
                                                 bidding_function_uri));
   }
-  if (function_it->second == nullptr) {
+  if (function_it->second.function == nullptr) {
     return absl::UnavailableError(absl::Substitute(
         "Bidding function $0 is not available", bidding_function_uri));
   }
-  return function_it->second.get();
+  return function_it->second.function.get();
 }
 
 absl::StatusOr<const ::aviary::function::BiddingFunctionInterface<
@@ -43,23 +43,16 @@ FunctionRepository::GetAdScoringFunction(
     return absl::NotFoundError(absl::Substitute(
         "Ad scoring function $0 not found", ad_scoring_function_uri));
   }
-  if (function_it->second == nullptr) {
+  if (function_it->second.function == nullptr) {
     return absl::UnavailableError(absl::Substitute(
         "Ad scoring function $0 is not available", ad_scoring_function_uri));
   }
-  return function_it->second.get();
+  return function_it->second.function.get();
 }
 
 FunctionRepository::FunctionRepository(
-    absl::flat_hash_map<
-        std::string,
-        std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-            BiddingFunctionInput, BiddingFunctionOutput>>>
-        bidding_functions,
-    absl::flat_hash_map<
-        std::string,
-        std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-            AdScoringFunctionInput, AdScoringFunctionOutput>>>
+    absl::flat_hash_map<std::string, BiddingFunctionEntry> bidding_functions,
+    absl::flat_hash_map<std::string, AdScoringFunctionEntry>
         ad_scoring_functions)
     : bidding_functions_(std::move(bidding_functions)),
       ad_scoring_functions_(std::move(ad_scoring_functions)) {}
@@ -17,26 +17,108 @@
 #ifndef SERVER_FUNCTION_REPOSITORY_H_
 #define SERVER_FUNCTION_REPOSITORY_H_
 
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "absl/container/flat_hash_map.h"
 #include "absl/status/statusor.h"
+#include "absl/time/time.h"
 #include "function/bidding_function_interface.h"
 #include "proto/bidding_function.pb.h"
+#include "server/function_memo.h"
+#include "server/invocation_limiter.h"
+#include "util/metrics.h"
 
 namespace aviary::server {
 
+// What a function is built from. Functions are rebuilt whenever any of it
+// changes.
+struct FunctionBuild {
+  bool operator==(const FunctionBuild& other) const {
+    return source_code == other.source_code &&
+           warm_up_iterations == other.warm_up_iterations &&
+           warm_up_inputs == other.warm_up_inputs &&
+           sandbox_trust_domain == other.sandbox_trust_domain &&
+           max_heap_size_bytes == other.max_heap_size_bytes &&
+           memoize == other.memoize;
+  }
+
+  std::string source_code;
+  int warm_up_iterations = 0;
+  std::vector<std::string> warm_up_inputs;
+  std::string sandbox_trust_domain;
+  size_t max_heap_size_bytes = 0;
+  // Part of the build, so that turning memoization on or off rebuilds the
+  // function along with its memo.
+  bool memoize = false;
+};
+
+// Metrics of the auctions around the invocations of a configured function,
+// looked up once per function rather than by URI on every auction. Those that
+// do not apply to the function are null, e.g. the memo lookups of a function
+// that is not memoized.
+struct AuctionFunctionMetrics {
+  // Time spent by auctions in each stage around the invocations: looking up
+  // trusted signals, building the inputs, and bidding or scoring.
+  util::Histogram* trusted_signals_lookup_seconds = nullptr;
+  util::Histogram* input_building_seconds = nullptr;
+  util::Histogram* invocation_seconds = nullptr;
+  // Time spent by the invocations waiting for the auction executor, and for
+  // admission by the limiter of the function.
+  util::Histogram* executor_queue_seconds = nullptr;
+  util::Histogram* admission_queue_seconds = nullptr;
+  util::Counter* failures = nullptr;
+  // Batched invocations rejected by the limiter of the function.
+  util::Counter* queue_full_rejections = nullptr;
+  util::Counter* deadline_rejections = nullptr;
+  util::Counter* memo_hits = nullptr;
+  util::Counter* memo_misses = nullptr;
+};
+
+// A bidding or ad scoring function in a `FunctionRepository`. Functions are
+// shared by successive repositories for as long as their source code does not
+// change.
+template <typename Input, typename Output>
+struct FunctionEntry {
+  using Memo = FunctionMemo<Output>;
+
+  // Null for functions that are configured but failed to build.
+  std::shared_ptr<
+      const ::aviary::function::BiddingFunctionInterface<Input, Output>>
+      function;
+  // What the function was built from, shared by the successive repositories
+  // of the function.
+  std::shared_ptr<const FunctionBuild> build;
+  // Time it took to build the function, or to fail to.
+  absl::Duration build_duration;
+  // Outputs of the function by its inputs, for functions configured to be
+  // memoized, null otherwise. Memoized outputs are dropped along with the
+  // function when it is rebuilt.
+  std::shared_ptr<Memo> memo;
+  // Bounds the concurrent invocations of a built function, null otherwise.
+  // Shared by the successive repositories of the function, with the limits
+  // of the latest one.
+  std::shared_ptr<InvocationLimiter> limiter;
+  // Number of buyers, or of batches, of the function that the auction
+  // executor runs per turn of the function, relative to the other functions.
+  int scheduling_weight = 1;
+  // Set for every configured function, including those that failed to build.
+  AuctionFunctionMetrics metrics;
+};
+
+using BiddingFunctionEntry =
+    FunctionEntry<BiddingFunctionInput, BiddingFunctionOutput>;
+using AdScoringFunctionEntry =
+    FunctionEntry<AdScoringFunctionInput, AdScoringFunctionOutput>;
+
 // A snapshot of active, compiled bidding and ad scoring functions.
 class FunctionRepository {
  public:
   FunctionRepository(
-      absl::flat_hash_map<
-          std::string,
-          std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-              BiddingFunctionInput, BiddingFunctionOutput>>>
-          bidding_functions,
-      absl::flat_hash_map<
-          std::string,
-          std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-              AdScoringFunctionInput, AdScoringFunctionOutput>>>
+      absl::flat_hash_map<std::string, BiddingFunctionEntry> bidding_functions,
+      absl::flat_hash_map<std::string, AdScoringFunctionEntry>
           ad_scoring_functions);
   virtual ~FunctionRepository() = default;
 
@@ -48,18 +130,23 @@ class FunctionRepository {
       AdScoringFunctionInput, AdScoringFunctionOutput>*>
   GetAdScoringFunction(absl::string_view ad_scoring_function_uri) const;
 
+  // All the configured functions keyed by their URIs, including the
+  // unavailable ones.
+  const absl::flat_hash_map<std::string, BiddingFunctionEntry>&
+  bidding_functions() const {
+    return bidding_functions_;
+  }
+  const absl::flat_hash_map<std::string, AdScoringFunctionEntry>&
+  ad_scoring_functions() const {
+    return ad_scoring_functions_;
+  }
+
   FunctionRepository(const FunctionRepository&) = delete;
   FunctionRepository& operator=(const FunctionRepository&) = delete;
 
  private:
-  absl::flat_hash_map<
-      std::string, std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-                       BiddingFunctionInput, BiddingFunctionOutput>>>
-      bidding_functions_;
-
-  absl::flat_hash_map<
-      std::string, std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-                       AdScoringFunctionInput, AdScoringFunctionOutput>>>
+  absl::flat_hash_map<std::string, BiddingFunctionEntry> bidding_functions_;
+  absl::flat_hash_map<std::string, AdScoringFunctionEntry>
       ad_scoring_functions_;
 };
 }  // namespace aviary::server
@@ -29,16 +29,13 @@ using ::testing::Property;
 
 TEST(FunctionRepositoryTest, GetBiddingFunctionSuccess) {
   V8PlatformInitializer v8_platform_initializer;
-  absl::flat_hash_map<
-      std::string, std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-                       BiddingFunctionInput, BiddingFunctionOutput>>>
-      bidding_functions;
+  absl::flat_hash_map<std::string, BiddingFunctionEntry> bidding_functions;
   bidding_functions.insert(
       {"local://bidding_function",
-       FledgeBiddingFunction::Create(R"(input => ({bid: 1.23}))").value()});
+       {FledgeBiddingFunction::Create(R"(input => ({bid: 1.23}))").value()}});
   bidding_functions.insert(
       {"local://other_bidding_function",
-       FledgeBiddingFunction::Create(R"(input => ({bid: 3.45}))").value()});
+       {FledgeBiddingFunction::Create(R"(input => ({bid: 3.45}))").value()}});
   FunctionRepository repository(std::move(bidding_functions), {});
   auto bidding_function_or =
       repository.GetBiddingFunction("local://bidding_function");
@@ -68,11 +65,8 @@ TEST(FunctionRepositoryTest, GetBiddingFunctionNotFound) {
 }
 
 TEST(FunctionRepositoryTest, GetBiddingFunctionUnavailable) {
-  absl::flat_hash_map<
-      std::string, std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-                       BiddingFunctionInput, BiddingFunctionOutput>>>
-      bidding_functions;
-  bidding_functions.insert({"local://bidding_function", nullptr});
+  absl::flat_hash_map<std::string, BiddingFunctionEntry> bidding_functions;
+  bidding_functions.insert({"local://bidding_function", {nullptr}});
   FunctionRepository repository(std::move(bidding_functions), {});
   auto bidding_function_or =
       repository.GetBiddingFunction("local://bidding_function");
@@ -83,18 +77,16 @@ TEST(FunctionRepositoryTest, GetBiddingFunctionUnavailable) {
 
 TEST(FunctionRepositoryTest, GetAdScoringFunctionSuccess) {
   V8PlatformInitializer v8_platform_initializer;
-  absl::flat_hash_map<
-      std::string, std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-                       AdScoringFunctionInput, AdScoringFunctionOutput>>>
+  absl::flat_hash_map<std::string, AdScoringFunctionEntry>
       ad_scoring_functions;
   ad_scoring_functions.insert({"local://scoring_function",
-                               FledgeAdScoringFunction::Create(
-                                   R"(input => ({desirabilityScore: 42.0}))")
-                                   .value()});
+                               {FledgeAdScoringFunction::Create(
+                                    R"(input => ({desirabilityScore: 42.0}))")
+                                    .value()}});
   ad_scoring_functions.insert({"local://other_scoring_function",
-                               FledgeAdScoringFunction::Create(
-                                   R"(input => ({desirabilityScore: 43.0}))")
-                                   .value()});
+                               {FledgeAdScoringFunction::Create(
+                                    R"(input => ({desirabilityScore: 43.0}))")
+                                    .value()}});
   FunctionRepository repository({}, std::move(ad_scoring_functions));
   auto ad_scoring_function_or =
       repository.GetAdScoringFunction("local://scoring_function");
@@ -126,11 +118,9 @@ TEST(FunctionRepositoryTest, GetAdScoringFunctionNotFound) {
 }
 
 TEST(FunctionRepositoryTest, GetAdScoringFunctionUnavailable) {
-  absl::flat_hash_map<
-      std::string, std::unique_ptr<::aviary::function::BiddingFunctionInterface<
-                       AdScoringFunctionInput, AdScoringFunctionOutput>>>
+  absl::flat_hash_map<std::string, AdScoringFunctionEntry>
       ad_scoring_functions;
-  ad_scoring_functions.insert({"local://scoring_function", nullptr});
+  ad_scoring_functions.insert({"local://scoring_function", {nullptr}});
   FunctionRepository repository({}, std::move(ad_scoring_functions));
   auto bidding_function_or =
       repository.GetAdScoringFunction("local://scoring_function");
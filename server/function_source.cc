@@ -15,9 +15,11 @@
 #include "server/function_source.h"
 
 #include <regex>
+#include <utility>
 
 #include "absl/strings/str_cat.h"
 #include "httplib.h"
+#include "util/status_macros.h"
 
 namespace aviary {
 namespace server {
@@ -41,14 +43,35 @@ absl::StatusOr<std::string> TranslateResponse(const httplib::Result& res) {
   }
 }
 
-absl::Status InvalidRemoteUriError(const FunctionSpecification& specification) {
+absl::Status InvalidRemoteUriError(absl::string_view uri) {
   return absl::InvalidArgumentError(
-      absl::StrCat("Not a valid remote URL: ", specification.uri));
+      absl::StrCat("Not a valid remote URL: ", uri));
 }
 }  // namespace
 
 absl::StatusOr<std::string> FunctionSource::GetFunctionCode(
     const aviary::server::FunctionSpecification& specification) const {
+  ASSIGN_OR_RETURN(const ParsedUri parsed_uri,
+                   GetParsedUri(specification.uri));
+  if (parsed_uri.scheme == "local") {
+    if (!specification.source_code) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Function source code not provided for local function."));
+    }
+    return *specification.source_code;
+  }
+  return FetchRemoteFunctionCode(specification.uri, parsed_uri);
+}
+
+absl::StatusOr<FunctionSource::ParsedUri> FunctionSource::GetParsedUri(
+    const std::string& uri) const {
+  {
+    absl::MutexLock lock(&mutex_);
+    auto it = parsed_uris_.find(uri);
+    if (it != parsed_uris_.end()) {
+      return it->second;
+    }
+  }
   // Regular expression that allows to split a URL (if well-formed) into its
   // constituent parts (scheme, authority comprised of a host and an optional
   // port and a path).
@@ -68,33 +91,90 @@ absl::StatusOr<std::string> FunctionSource::GetFunctionCode(
   constexpr static int kSchemeHostPortGroup = 1;
   constexpr static int kSchemeGroup = 2;
   constexpr static int kPathGroup = 5;
+  absl::StatusOr<ParsedUri> parsed_uri;
   std::smatch m;
-  if (!std::regex_match(specification.uri, m, url_re)) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Not a valid URL: ", specification.uri));
-  }
-  auto scheme = m[kSchemeGroup].str();
-  if (scheme.empty()) {
-    return InvalidRemoteUriError(specification);
+  if (!std::regex_match(uri, m, url_re)) {
+    parsed_uri =
+        absl::InvalidArgumentError(absl::StrCat("Not a valid URL: ", uri));
+  } else if (m[kSchemeGroup].str().empty() ||
+             (m[kSchemeGroup].str() != "local" && m.size() < kPathGroup)) {
+    parsed_uri = InvalidRemoteUriError(uri);
+  } else {
+    parsed_uri = ParsedUri{.scheme = m[kSchemeGroup].str(),
+                           .scheme_host_port = m[kSchemeHostPortGroup].str(),
+                           .path = m[kPathGroup].str()};
   }
-  if (scheme == "local") {
-    if (!specification.source_code) {
-      return absl::InvalidArgumentError(absl::StrCat(
-          "Function source code not provided for local function."));
+  absl::MutexLock lock(&mutex_);
+  parsed_uris_.insert({uri, parsed_uri});
+  return parsed_uri;
+}
+
+absl::StatusOr<std::string> FunctionSource::FetchRemoteFunctionCode(
+    const std::string& uri, const ParsedUri& parsed_uri) const {
+  absl::optional<CachedResponse> cached_response;
+  {
+    absl::MutexLock lock(&mutex_);
+    auto it = cached_responses_.find(uri);
+    if (it != cached_responses_.end()) {
+      cached_response = it->second;
     }
-    return *specification.source_code;
   }
-  if (m.size() < kPathGroup) {
-    return InvalidRemoteUriError(specification);
+  httplib::Headers headers;
+  if (cached_response.has_value()) {
+    if (!cached_response->etag.empty()) {
+      headers.emplace("If-None-Match", cached_response->etag);
+    }
+    if (!cached_response->last_modified.empty()) {
+      headers.emplace("If-Modified-Since", cached_response->last_modified);
+    }
   }
-  auto scheme_host_port = m[kSchemeHostPortGroup].str();
-  auto path = m[kPathGroup].str();
-  httplib::Client cli(scheme_host_port.c_str());
-  auto res = cli.Get(path.c_str());
+  std::unique_ptr<httplib::Client> client =
+      AcquireClient(parsed_uri.scheme_host_port);
+  auto res = client->Get(parsed_uri.path.c_str(), headers);
   if (!res) {
+    // The client is not reused, in case its connection got broken.
     return absl::InternalError("Unable to fetch a URL");
   }
+  ReleaseClient(parsed_uri.scheme_host_port, std::move(client));
+  if (res->status == 304 && cached_response.has_value()) {
+    return std::move(cached_response->body);
+  }
+  if (res->status == 200) {
+    CachedResponse response = {
+        .body = res->body,
+        .etag = res->get_header_value("ETag"),
+        .last_modified = res->get_header_value("Last-Modified")};
+    absl::MutexLock lock(&mutex_);
+    if (response.etag.empty() && response.last_modified.empty()) {
+      cached_responses_.erase(uri);
+    } else {
+      cached_responses_.insert_or_assign(uri, std::move(response));
+    }
+  }
   return TranslateResponse(res);
 }
+
+std::unique_ptr<httplib::Client> FunctionSource::AcquireClient(
+    const std::string& scheme_host_port) const {
+  {
+    absl::MutexLock lock(&mutex_);
+    auto it = idle_clients_.find(scheme_host_port);
+    if (it != idle_clients_.end() && !it->second.empty()) {
+      std::unique_ptr<httplib::Client> client = std::move(it->second.back());
+      it->second.pop_back();
+      return client;
+    }
+  }
+  auto client = std::make_unique<httplib::Client>(scheme_host_port.c_str());
+  client->set_keep_alive(true);
+  return client;
+}
+
+void FunctionSource::ReleaseClient(
+    const std::string& scheme_host_port,
+    std::unique_ptr<httplib::Client> client) const {
+  absl::MutexLock lock(&mutex_);
+  idle_clients_[scheme_host_port].push_back(std::move(client));
+}
 }  // namespace server
 }  // namespace aviary
@@ -17,7 +17,14 @@
 #ifndef SERVER_FUNCTION_SOURCE_H_
 #define SERVER_FUNCTION_SOURCE_H_
 
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/types/optional.h"
 #include "httplib.h"
 
@@ -35,9 +42,46 @@ struct FunctionSpecification {
   // Bidding function source code which must be specified if URI uses `local`
   // scheme.
   absl::optional<std::string> source_code;
+  // Number of times the function is invoked on each warm-up input before it
+  // serves requests. The default of `FunctionOptions` applies when unset.
+  absl::optional<int> warm_up_iterations;
+  // Sample inputs to warm up the function with, in the JSON format of the
+  // function input message. Creating the function fails if it fails on any of
+  // them.
+  std::vector<std::string> warm_up_inputs;
+  // Files containing additional warm-up inputs, which are read into
+  // `warm_up_inputs` when the configuration is loaded.
+  std::vector<std::string> warm_up_input_files;
+  // Trust domain whose sandboxed functions share the same sandboxee processes,
+  // see `FunctionOptions::sandbox_trust_domain`. Functions get sandboxee
+  // processes of their own when empty.
+  std::string sandbox_trust_domain;
+  // Maximum heap size of each isolate running the function, in megabytes, see
+  // `FunctionOptions::max_heap_size_bytes`. V8's default applies when 0.
+  int max_heap_size_mb = 0;
+  // Whether the outputs of the function are memoized by its inputs, see
+  // `FunctionEntry::memo`. Only ad scoring functions can be memoized, and must
+  // then be deterministic.
+  bool memoize = false;
+  // Bounds of the batched invocations of the function running at once, and
+  // of those queued beyond that, see `InvocationLimiter`. The defaults of
+  // --function_max_concurrent_batches and --function_max_queued_batches apply
+  // when unset.
+  absl::optional<int> max_concurrent_batches;
+  absl::optional<int> max_queued_batches;
+  // Share of the auction executor given to the function when busy, see
+  // `FunctionEntry::scheduling_weight`.
+  int scheduling_weight = 1;
 };
 
 // Retrieves function code from different sources.
+//
+// Remote function code is fetched over connections that are kept open between
+// fetches from the same host. Responses are cached along with their `ETag` and
+// `Last-Modified` validators, so that fetching unchanged code again does not
+// download it again.
+//
+// Thread-safe.
 class FunctionSource {
  public:
   FunctionSource() = default;
@@ -51,6 +95,48 @@ class FunctionSource {
 
   FunctionSource(const FunctionSource&) = delete;
   FunctionSource& operator=(const FunctionSource&) = delete;
+
+ private:
+  // Constituent parts of a URI.
+  struct ParsedUri {
+    std::string scheme;
+    // Scheme, host and port, e.g. `https://example.com:8080`.
+    std::string scheme_host_port;
+    std::string path;
+  };
+
+  // Last successful response for a remote URL, with the validators needed to
+  // revalidate it.
+  struct CachedResponse {
+    std::string body;
+    std::string etag;
+    std::string last_modified;
+  };
+
+  absl::StatusOr<ParsedUri> GetParsedUri(const std::string& uri) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+  absl::StatusOr<std::string> FetchRemoteFunctionCode(
+      const std::string& uri, const ParsedUri& parsed_uri) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+  // Returns an idle client connected to `scheme_host_port`, or a new one if
+  // there is none. Clients are returned to the pool by `ReleaseClient()`.
+  std::unique_ptr<httplib::Client> AcquireClient(
+      const std::string& scheme_host_port) const ABSL_LOCKS_EXCLUDED(mutex_);
+  void ReleaseClient(const std::string& scheme_host_port,
+                     std::unique_ptr<httplib::Client> client) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  mutable absl::Mutex mutex_;
+  mutable absl::flat_hash_map<std::string, absl::StatusOr<ParsedUri>>
+      parsed_uris_ ABSL_GUARDED_BY(mutex_);
+  // Keyed by scheme, host and port. Concurrent fetches from the same host use
+  // different clients, since a client serves a single request at a time.
+  mutable absl::flat_hash_map<std::string,
+                              std::vector<std::unique_ptr<httplib::Client>>>
+      idle_clients_ ABSL_GUARDED_BY(mutex_);
+  // Keyed by URL.
+  mutable absl::flat_hash_map<std::string, CachedResponse> cached_responses_
+      ABSL_GUARDED_BY(mutex_);
 };
 
 }  // namespace server
@@ -14,9 +14,13 @@
 
 #include "server/function_source.h"
 
+#include <atomic>
 #include <thread>
+#include <vector>
 
+#include "absl/strings/str_cat.h"
 #include "absl/strings/substitute.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
 #include "absl/time/clock.h"
 #include "gtest/gtest.h"
@@ -153,6 +157,97 @@ TEST_F(UrlFunctionSourceTest, PermissionDenied) {
   EXPECT_EQ(code_or.status().code(), absl::StatusCode::kPermissionDenied)
       << code_or.status().ToString();
 }
+
+TEST_F(UrlFunctionSourceTest, RevalidatesWithEtag) {
+  std::atomic<int> full_responses = 0;
+  server_.Get("/source1.js",
+              [&](const httplib::Request& req, httplib::Response& res) {
+                res.set_header("ETag", R"("v1")");
+                if (req.get_header_value("If-None-Match") == R"("v1")") {
+                  res.status = 304;
+                  return;
+                }
+                full_responses++;
+                res.set_content(std::string(kSourceCode1), "text/javascript");
+              });
+  FunctionSource source;
+  const std::string uri =
+      absl::Substitute("http://localhost:$0/source1.js", port_);
+  for (int i = 0; i < 3; i++) {
+    absl::StatusOr<std::string> code_or = source.GetFunctionCode({.uri = uri});
+    ASSERT_TRUE(code_or.ok()) << code_or.status();
+    EXPECT_EQ(code_or.value(), kSourceCode1);
+  }
+  EXPECT_EQ(full_responses, 1);
+}
+
+TEST_F(UrlFunctionSourceTest, RevalidatesWithLastModified) {
+  constexpr absl::string_view kLastModified = "Wed, 21 Oct 2015 07:28:00 GMT";
+  std::atomic<int> full_responses = 0;
+  server_.Get("/source1.js",
+              [&](const httplib::Request& req, httplib::Response& res) {
+                if (req.get_header_value("If-Modified-Since") ==
+                    kLastModified) {
+                  res.status = 304;
+                  return;
+                }
+                full_responses++;
+                res.set_header("Last-Modified", std::string(kLastModified));
+                res.set_content(std::string(kSourceCode1), "text/javascript");
+              });
+  FunctionSource source;
+  const std::string uri =
+      absl::Substitute("http://localhost:$0/source1.js", port_);
+  for (int i = 0; i < 2; i++) {
+    absl::StatusOr<std::string> code_or = source.GetFunctionCode({.uri = uri});
+    ASSERT_TRUE(code_or.ok()) << code_or.status();
+    EXPECT_EQ(code_or.value(), kSourceCode1);
+  }
+  EXPECT_EQ(full_responses, 1);
+}
+
+TEST_F(UrlFunctionSourceTest, DownloadsChangedCode) {
+  std::atomic<int> version = 1;
+  server_.Get("/source.js",
+              [&](const httplib::Request& req, httplib::Response& res) {
+                const std::string etag = absl::StrCat(version.load());
+                res.set_header("ETag", etag);
+                if (req.get_header_value("If-None-Match") == etag) {
+                  res.status = 304;
+                  return;
+                }
+                res.set_content(
+                    std::string(version == 1 ? kSourceCode1 : kSourceCode2),
+                    "text/javascript");
+              });
+  FunctionSource source;
+  const std::string uri =
+      absl::Substitute("http://localhost:$0/source.js", port_);
+  EXPECT_EQ(source.GetFunctionCode({.uri = uri}).value(), kSourceCode1);
+  version = 2;
+  EXPECT_EQ(source.GetFunctionCode({.uri = uri}).value(), kSourceCode2);
+  EXPECT_EQ(source.GetFunctionCode({.uri = uri}).value(), kSourceCode2);
+}
+
+TEST_F(UrlFunctionSourceTest, ReusesConnection) {
+  absl::Mutex mutex;
+  std::vector<int> remote_ports;
+  server_.Get("/source1.js",
+              [&](const httplib::Request& req, httplib::Response& res) {
+                absl::MutexLock lock(&mutex);
+                remote_ports.push_back(req.remote_port);
+                res.set_content(std::string(kSourceCode1), "text/javascript");
+              });
+  FunctionSource source;
+  const std::string uri =
+      absl::Substitute("http://localhost:$0/source1.js", port_);
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(source.GetFunctionCode({.uri = uri}).ok());
+  }
+  absl::MutexLock lock(&mutex);
+  ASSERT_EQ(remote_ports.size(), 2);
+  EXPECT_EQ(remote_ports[0], remote_ports[1]);
+}
 }  // namespace
 }  // namespace server
 }  // namespace aviary
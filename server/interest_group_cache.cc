@@ -0,0 +1,130 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/interest_group_cache.h"
+
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "absl/types/optional.h"
+#include "util/metrics.h"
+
+namespace aviary {
+namespace server {
+namespace {
+
+using ::aviary::util::Counter;
+using ::aviary::util::MetricFamily;
+
+// Returns the counter of the lookups of versioned interest groups, by result:
+// hit, update (a hit with changes), miss (the state must be sent again) or
+// store (a new or complete state).
+Counter& GetLookupCounter(absl::string_view result) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_interest_group_cache_lookups_total",
+      "Lookups of cached interest groups, by result: hit, update, miss or "
+      "store.",
+      {"result"});
+  return family->Get({result});
+}
+
+// Returns whether `interest_group` sets any of the state that lasts across
+// auctions.
+bool HasLastingState(const InterestGroupAuctionState& interest_group) {
+  return !interest_group.bidding_logic_url().empty() ||
+         interest_group.ads_size() > 0 ||
+         interest_group.has_user_bidding_signals() ||
+         !interest_group.trusted_bidding_signals_url().empty() ||
+         interest_group.trusted_bidding_signals_keys_size() > 0;
+}
+
+// Returns the state of `interest_group` that lasts across auctions, with the
+// fields that it leaves out taken from `base`, if any.
+std::shared_ptr<const InterestGroupAuctionState> GetLastingState(
+    const InterestGroupAuctionState& interest_group,
+    const InterestGroupAuctionState* base) {
+  auto state = std::make_shared<InterestGroupAuctionState>();
+  if (base != nullptr) {
+    *state = *base;
+  }
+  state->set_owner(interest_group.owner());
+  state->set_name(interest_group.name());
+  state->set_version(interest_group.version());
+  if (!interest_group.bidding_logic_url().empty()) {
+    state->set_bidding_logic_url(interest_group.bidding_logic_url());
+  }
+  if (interest_group.ads_size() > 0) {
+    *state->mutable_ads() = interest_group.ads();
+  }
+  if (interest_group.has_user_bidding_signals()) {
+    *state->mutable_user_bidding_signals() =
+        interest_group.user_bidding_signals();
+  }
+  if (!interest_group.trusted_bidding_signals_url().empty()) {
+    state->set_trusted_bidding_signals_url(
+        interest_group.trusted_bidding_signals_url());
+  }
+  if (interest_group.trusted_bidding_signals_keys_size() > 0) {
+    *state->mutable_trusted_bidding_signals_keys() =
+        interest_group.trusted_bidding_signals_keys();
+  }
+  return state;
+}
+}  // namespace
+
+InterestGroupCache::InterestGroupCache(absl::Duration ttl, size_t capacity)
+    : states_(capacity, ttl, util::CacheExpiration::kSinceLastUse) {}
+
+std::shared_ptr<const InterestGroupAuctionState> InterestGroupCache::Resolve(
+    absl::string_view scope, const InterestGroupAuctionState& interest_group) {
+  const std::string cache_key =
+      CacheKey(scope, interest_group.owner(), interest_group.name());
+  std::shared_ptr<const InterestGroupAuctionState> base;
+  if (absl::optional<CachedState> cached = states_.Lookup(cache_key);
+      cached.has_value() && cached->version == interest_group.version()) {
+    if (!HasLastingState(interest_group)) {
+      GetLookupCounter("hit").Increment();
+      return std::move(cached->state);
+    }
+    if (interest_group.ads_size() == 0) {
+      base = std::move(cached->state);
+    }
+  }
+  if (base == nullptr && interest_group.ads_size() == 0) {
+    GetLookupCounter("miss").Increment();
+    return nullptr;
+  }
+  GetLookupCounter(base == nullptr ? "store" : "update").Increment();
+  std::shared_ptr<const InterestGroupAuctionState> state =
+      GetLastingState(interest_group, base.get());
+  states_.Insert(cache_key,
+                 CachedState{.version = interest_group.version(),
+                             .state = state},
+                 [&interest_group](const CachedState& cached) {
+                   // Requests racing with newer ones never roll the cached
+                   // state back.
+                   return cached.version <= interest_group.version();
+                 });
+  return state;
+}
+
+std::string InterestGroupCache::CacheKey(absl::string_view scope,
+                                         absl::string_view owner,
+                                         absl::string_view name) {
+  // The scope is prefixed with its size, and owners are domains, which cannot
+  // contain spaces, so that the parts are unambiguous.
+  return absl::StrCat(scope.size(), ":", scope, owner, " ", name);
+}
+}  // namespace server
+}  // namespace aviary
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SERVER_INTEREST_GROUP_CACHE_H_
+#define SERVER_INTEREST_GROUP_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "proto/aviary.pb.h"
+#include "util/sharded_cache.h"
+
+namespace aviary {
+namespace server {
+
+// Caches the state of versioned interest groups across auctions, so that
+// requests only need to send the state that changed since.
+//
+// Only the state that lasts across auctions is cached: the bidding logic URL,
+// the ads, the user bidding signals and the trusted bidding signals URL and
+// keys. Interest groups belong to users, so they are cached within a scope
+// specific to the client sending them, and a single version is cached per
+// scope, owner and name, the highest one.
+//
+// Thread-safe.
+class InterestGroupCache {
+ public:
+  // Caches the state of interest groups for `ttl` since they were last used.
+  // At most `capacity` interest groups are cached, beyond which the least
+  // recently used ones are evicted.
+  InterestGroupCache(absl::Duration ttl, size_t capacity);
+
+  // Returns the lasting state of `interest_group`, with the fields that it
+  // leaves out taken from the state cached in `scope` for the same owner, name
+  // and version, and caches it unless a higher version is cached already.
+  // Interest groups with ads are complete, and are cached as is. Returns null
+  // for an interest group without ads whose state is not cached, i.e. that
+  // must be sent again in full. `interest_group` must have a version.
+  std::shared_ptr<const InterestGroupAuctionState> Resolve(
+      absl::string_view scope, const InterestGroupAuctionState& interest_group);
+
+  InterestGroupCache(const InterestGroupCache&) = delete;
+  InterestGroupCache& operator=(const InterestGroupCache&) = delete;
+
+ private:
+  struct CachedState {
+    int64_t version = 0;
+    std::shared_ptr<const InterestGroupAuctionState> state;
+  };
+
+  static std::string CacheKey(absl::string_view scope, absl::string_view owner,
+                              absl::string_view name);
+
+  // Keyed by scope, owner and name, see `CacheKey()`.
+  util::ShardedCache<std::string, CachedState> states_;
+};
+
+}  // namespace server
+}  // namespace aviary
+
+#endif  // SERVER_INTEREST_GROUP_CACHE_H_
@@ -0,0 +1,160 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/interest_group_cache.h"
+
+#include <memory>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "gtest/gtest.h"
+#include "proto/aviary.pb.h"
+#include "util/parse_proto.h"
+
+namespace aviary {
+namespace server {
+namespace {
+
+using ::aviary::util::ParseTextOrDie;
+
+constexpr absl::string_view kScope = "client";
+
+InterestGroupAuctionState CompleteInterestGroup() {
+  return ParseTextOrDie<InterestGroupAuctionState>(R"pb(
+    owner: "dsp.example"
+    name: "boringreads"
+    version: 1
+    bidding_logic_url: "https://dsp.example/bidding.js"
+    ads { render_url: "https://dsp.example/boringreads" }
+    user_bidding_signals {
+      fields {
+        key: "age"
+        value { number_value: 42 }
+      }
+    }
+    browser_signals {
+      fields {
+        key: "topWindowHostname"
+        value { string_value: "publisher.example" }
+      }
+    }
+  )pb");
+}
+
+InterestGroupAuctionState Reference(int64_t version) {
+  InterestGroupAuctionState interest_group;
+  interest_group.set_owner("dsp.example");
+  interest_group.set_name("boringreads");
+  interest_group.set_version(version);
+  return interest_group;
+}
+
+TEST(InterestGroupCacheTest, ResolvesReferenceToCachedState) {
+  InterestGroupCache cache(absl::Hours(1), /*capacity=*/100);
+  const std::shared_ptr<const InterestGroupAuctionState> stored =
+      cache.Resolve(kScope, CompleteInterestGroup());
+  ASSERT_NE(stored, nullptr);
+  EXPECT_EQ(stored->ads_size(), 1);
+  // The state specific to an auction is not cached.
+  EXPECT_FALSE(stored->has_browser_signals());
+
+  const std::shared_ptr<const InterestGroupAuctionState> resolved =
+      cache.Resolve(kScope, Reference(1));
+  // References share the cached state.
+  EXPECT_EQ(resolved, stored);
+}
+
+TEST(InterestGroupCacheTest, MissesUncachedVersion) {
+  InterestGroupCache cache(absl::Hours(1), /*capacity=*/100);
+  EXPECT_EQ(cache.Resolve(kScope, Reference(1)), nullptr);
+  ASSERT_NE(cache.Resolve(kScope, CompleteInterestGroup()), nullptr);
+  EXPECT_EQ(cache.Resolve(kScope, Reference(2)), nullptr);
+}
+
+TEST(InterestGroupCacheTest, AppliesDelta) {
+  InterestGroupCache cache(absl::Hours(1), /*capacity=*/100);
+  ASSERT_NE(cache.Resolve(kScope, CompleteInterestGroup()), nullptr);
+  InterestGroupAuctionState delta = Reference(1);
+  delta.set_bidding_logic_url("https://dsp.example/other_bidding.js");
+  const std::shared_ptr<const InterestGroupAuctionState> resolved =
+      cache.Resolve(kScope, delta);
+  ASSERT_NE(resolved, nullptr);
+  EXPECT_EQ(resolved->bidding_logic_url(),
+            "https://dsp.example/other_bidding.js");
+  EXPECT_EQ(resolved->ads_size(), 1);
+  EXPECT_EQ(
+      resolved->user_bidding_signals().fields().at("age").number_value(), 42);
+  // The delta is cached along with the rest of the state.
+  EXPECT_EQ(cache.Resolve(kScope, Reference(1)), resolved);
+}
+
+TEST(InterestGroupCacheTest, ReplacesCompleteState) {
+  InterestGroupCache cache(absl::Hours(1), /*capacity=*/100);
+  ASSERT_NE(cache.Resolve(kScope, CompleteInterestGroup()), nullptr);
+  InterestGroupAuctionState new_version = CompleteInterestGroup();
+  new_version.set_version(2);
+  new_version.clear_user_bidding_signals();
+  ASSERT_NE(cache.Resolve(kScope, new_version), nullptr);
+  const std::shared_ptr<const InterestGroupAuctionState> resolved =
+      cache.Resolve(kScope, Reference(2));
+  ASSERT_NE(resolved, nullptr);
+  EXPECT_FALSE(resolved->has_user_bidding_signals());
+  // Only the latest version is cached.
+  EXPECT_EQ(cache.Resolve(kScope, Reference(1)), nullptr);
+}
+
+TEST(InterestGroupCacheTest, KeepsHigherVersion) {
+  InterestGroupCache cache(absl::Hours(1), /*capacity=*/100);
+  InterestGroupAuctionState new_version = CompleteInterestGroup();
+  new_version.set_version(2);
+  ASSERT_NE(cache.Resolve(kScope, new_version), nullptr);
+  // An older version is still resolved for its auction, but not cached.
+  ASSERT_NE(cache.Resolve(kScope, CompleteInterestGroup()), nullptr);
+  EXPECT_NE(cache.Resolve(kScope, Reference(2)), nullptr);
+  EXPECT_EQ(cache.Resolve(kScope, Reference(1)), nullptr);
+}
+
+TEST(InterestGroupCacheTest, SeparatesScopes) {
+  InterestGroupCache cache(absl::Hours(1), /*capacity=*/100);
+  ASSERT_NE(cache.Resolve(kScope, CompleteInterestGroup()), nullptr);
+  EXPECT_EQ(cache.Resolve("other client", Reference(1)), nullptr);
+  EXPECT_NE(cache.Resolve(kScope, Reference(1)), nullptr);
+}
+
+TEST(InterestGroupCacheTest, ExpiresUnusedState) {
+  InterestGroupCache cache(absl::Milliseconds(10), /*capacity=*/100);
+  ASSERT_NE(cache.Resolve(kScope, CompleteInterestGroup()), nullptr);
+  absl::SleepFor(absl::Milliseconds(20));
+  EXPECT_EQ(cache.Resolve(kScope, Reference(1)), nullptr);
+}
+
+TEST(InterestGroupCacheTest, StaysWithinCapacity) {
+  // An interest group per shard.
+  InterestGroupCache cache(absl::Hours(1), /*capacity=*/16);
+  InterestGroupAuctionState interest_group = CompleteInterestGroup();
+  for (int i = 0; i < 100; i++) {
+    interest_group.set_name(std::to_string(i));
+    ASSERT_NE(cache.Resolve(kScope, interest_group), nullptr);
+  }
+  int cached_interest_groups = 0;
+  InterestGroupAuctionState reference = Reference(1);
+  for (int i = 0; i < 100; i++) {
+    reference.set_name(std::to_string(i));
+    cached_interest_groups += cache.Resolve(kScope, reference) != nullptr;
+  }
+  EXPECT_LE(cached_interest_groups, 16);
+}
+}  // namespace
+}  // namespace server
+}  // namespace aviary
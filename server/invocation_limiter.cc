@@ -0,0 +1,90 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/invocation_limiter.h"
+
+namespace aviary::server {
+
+InvocationLimiter::WaitBudget::WaitBudget(int max_waiting_invocations)
+    : available_(max_waiting_invocations) {}
+
+bool InvocationLimiter::WaitBudget::TryAcquire() {
+  int available = available_.load(std::memory_order_relaxed);
+  while (available > 0) {
+    if (available_.compare_exchange_weak(available, available - 1,
+                                         std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void InvocationLimiter::WaitBudget::Release() {
+  available_.fetch_add(1, std::memory_order_relaxed);
+}
+
+InvocationLimiter::InvocationLimiter(Limits limits)
+    : limits_(limits), is_bounded_(limits.max_concurrent_batches > 0) {}
+
+void InvocationLimiter::SetLimits(Limits limits) {
+  absl::MutexLock lock(&mutex_);
+  limits_ = limits;
+  is_bounded_ = limits.max_concurrent_batches > 0;
+}
+
+bool InvocationLimiter::CanRun() const {
+  return limits_.max_concurrent_batches <= 0 ||
+         running_batches_ < limits_.max_concurrent_batches;
+}
+
+absl::Status InvocationLimiter::Acquire(absl::Time deadline,
+                                        WaitBudget* wait_budget) {
+  if (!is_bounded_) {
+    running_batches_++;
+    return absl::OkStatus();
+  }
+  absl::MutexLock lock(&mutex_);
+  if (!CanRun()) {
+    if (queued_batches_ >= limits_.max_queued_batches) {
+      return absl::ResourceExhaustedError(
+          "Too many invocations of the function are queued");
+    }
+    if (wait_budget != nullptr && !wait_budget->TryAcquire()) {
+      return absl::ResourceExhaustedError(
+          "Too many invocations of all functions are queued");
+    }
+    queued_batches_++;
+    const bool admitted = mutex_.AwaitWithDeadline(
+        absl::Condition(this, &InvocationLimiter::CanRun), deadline);
+    queued_batches_--;
+    if (wait_budget != nullptr) {
+      wait_budget->Release();
+    }
+    if (!admitted) {
+      return absl::DeadlineExceededError(
+          "The deadline passed while the invocation was queued");
+    }
+  }
+  running_batches_++;
+  return absl::OkStatus();
+}
+
+void InvocationLimiter::Release() {
+  running_batches_--;
+  if (is_bounded_) {
+    // Queued invocations get admitted as the lock is released.
+    absl::MutexLock lock(&mutex_);
+  }
+}
+}  // namespace aviary::server
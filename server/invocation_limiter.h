@@ -0,0 +1,107 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SERVER_INVOCATION_LIMITER_H_
+#define SERVER_INVOCATION_LIMITER_H_
+
+#include <atomic>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace aviary::server {
+
+// Bounds the batched invocations of a function running at once. Invocations
+// past the bound wait in a bounded queue, and are rejected right away once it
+// is full, so that a spike of traffic for a function fails fast rather than
+// piling up and slowing down every auction involving the function.
+//
+// Queued invocations are admitted in no particular order. They block their
+// thread while queued, which a `WaitBudget` shared across limiters bounds.
+// Unbounded limiters admit invocations without taking a lock.
+//
+// Thread-safe.
+class InvocationLimiter {
+ public:
+  struct Limits {
+    // Unbounded when 0.
+    int max_concurrent_batches = 0;
+    int max_queued_batches = 0;
+
+    bool operator==(const Limits& other) const {
+      return max_concurrent_batches == other.max_concurrent_batches &&
+             max_queued_batches == other.max_queued_batches;
+    }
+  };
+
+  // Bounds the invocations queued at once across the limiters sharing it, e.g.
+  // to fewer than the threads of an executor, so that invocations queued for
+  // some functions leave threads to the invocations of the others.
+  //
+  // Thread-safe.
+  class WaitBudget {
+   public:
+    explicit WaitBudget(int max_waiting_invocations);
+
+    // Returns whether an invocation can wait, in which case it must be
+    // released with `Release()` once done waiting.
+    bool TryAcquire();
+
+    void Release();
+
+    WaitBudget(const WaitBudget&) = delete;
+    WaitBudget& operator=(const WaitBudget&) = delete;
+
+   private:
+    std::atomic<int> available_;
+  };
+
+  explicit InvocationLimiter(Limits limits);
+
+  // Replaces the limits. Invocations already admitted keep running.
+  void SetLimits(Limits limits) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Admits an invocation, waiting for a running one to be released if needed.
+  // Returns a resource exhausted error if the queue is full, or if
+  // `wait_budget`, unless null, is exhausted, and a deadline exceeded error if
+  // `deadline` passes first. Admitted invocations must be released with
+  // `Release()`.
+  absl::Status Acquire(absl::Time deadline, WaitBudget* wait_budget = nullptr)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  void Release() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  InvocationLimiter(const InvocationLimiter&) = delete;
+  InvocationLimiter& operator=(const InvocationLimiter&) = delete;
+
+ private:
+  bool CanRun() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  absl::Mutex mutex_;
+  Limits limits_ ABSL_GUARDED_BY(mutex_);
+  // Whether `limits_` bounds the running invocations, read without the lock.
+  std::atomic<bool> is_bounded_;
+  // Updated without the lock while unbounded, and with it otherwise so that
+  // queued invocations get notified.
+  std::atomic<int> running_batches_ = 0;
+  int queued_batches_ ABSL_GUARDED_BY(mutex_) = 0;
+};
+
+}  // namespace aviary::server
+
+#endif  // SERVER_INVOCATION_LIMITER_H_
@@ -0,0 +1,121 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/invocation_limiter.h"
+
+#include <thread>
+
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "gtest/gtest.h"
+
+namespace aviary::server {
+namespace {
+
+TEST(InvocationLimiterTest, AdmitsUnboundedInvocations) {
+  InvocationLimiter limiter({});
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(limiter.Acquire(absl::InfinitePast()).ok());
+  }
+}
+
+TEST(InvocationLimiterTest, RejectsInvocationsPastFullQueue) {
+  InvocationLimiter limiter(
+      {.max_concurrent_batches = 2, .max_queued_batches = 0});
+  EXPECT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  EXPECT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  EXPECT_EQ(limiter.Acquire(absl::InfiniteFuture()).code(),
+            absl::StatusCode::kResourceExhausted);
+  limiter.Release();
+  EXPECT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+}
+
+TEST(InvocationLimiterTest, QueuesInvocationsUntilRelease) {
+  InvocationLimiter limiter(
+      {.max_concurrent_batches = 1, .max_queued_batches = 1});
+  ASSERT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  absl::Notification admitted;
+  std::thread queued([&] {
+    EXPECT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+    admitted.Notify();
+  });
+  EXPECT_FALSE(admitted.WaitForNotificationWithTimeout(absl::Milliseconds(50)));
+  // The queue is full while the invocation waits.
+  EXPECT_EQ(limiter.Acquire(absl::InfiniteFuture()).code(),
+            absl::StatusCode::kResourceExhausted);
+  limiter.Release();
+  admitted.WaitForNotification();
+  queued.join();
+}
+
+TEST(InvocationLimiterTest, GivesUpOnQueuedInvocationsPastDeadline) {
+  InvocationLimiter limiter(
+      {.max_concurrent_batches = 1, .max_queued_batches = 1});
+  ASSERT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  EXPECT_EQ(
+      limiter.Acquire(absl::Now() + absl::Milliseconds(10)).code(),
+      absl::StatusCode::kDeadlineExceeded);
+  // The queue is empty again.
+  EXPECT_EQ(
+      limiter.Acquire(absl::Now() + absl::Milliseconds(10)).code(),
+      absl::StatusCode::kDeadlineExceeded);
+}
+
+TEST(InvocationLimiterTest, QueuesInvocationsWithinWaitBudget) {
+  InvocationLimiter first_limiter(
+      {.max_concurrent_batches = 1, .max_queued_batches = 1});
+  InvocationLimiter second_limiter(
+      {.max_concurrent_batches = 1, .max_queued_batches = 1});
+  InvocationLimiter::WaitBudget wait_budget(/*max_waiting_invocations=*/1);
+  ASSERT_TRUE(first_limiter.Acquire(absl::InfiniteFuture(), &wait_budget).ok());
+  ASSERT_TRUE(
+      second_limiter.Acquire(absl::InfiniteFuture(), &wait_budget).ok());
+  absl::Notification admitted;
+  std::thread queued([&] {
+    EXPECT_TRUE(
+        first_limiter.Acquire(absl::InfiniteFuture(), &wait_budget).ok());
+    admitted.Notify();
+  });
+  EXPECT_FALSE(admitted.WaitForNotificationWithTimeout(absl::Milliseconds(50)));
+  // The queue of the second limiter has room, but the budget is spent.
+  EXPECT_EQ(
+      second_limiter.Acquire(absl::InfiniteFuture(), &wait_budget).code(),
+      absl::StatusCode::kResourceExhausted);
+  first_limiter.Release();
+  admitted.WaitForNotification();
+  queued.join();
+  // The budget is returned once done waiting.
+  EXPECT_EQ(second_limiter.Acquire(absl::Now() + absl::Milliseconds(10),
+                                   &wait_budget)
+                .code(),
+            absl::StatusCode::kDeadlineExceeded);
+}
+
+TEST(InvocationLimiterTest, AppliesNewLimits) {
+  InvocationLimiter limiter(
+      {.max_concurrent_batches = 1, .max_queued_batches = 0});
+  ASSERT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  EXPECT_FALSE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  limiter.SetLimits({.max_concurrent_batches = 2, .max_queued_batches = 0});
+  EXPECT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  // Invocations admitted while unbounded count once bounded again.
+  limiter.SetLimits({});
+  EXPECT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  limiter.SetLimits({.max_concurrent_batches = 3, .max_queued_batches = 0});
+  EXPECT_FALSE(limiter.Acquire(absl::InfiniteFuture()).ok());
+  limiter.Release();
+  EXPECT_TRUE(limiter.Acquire(absl::InfiniteFuture()).ok());
+}
+}  // namespace
+}  // namespace aviary::server
@@ -0,0 +1,133 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Runs auctions against an Aviary server at a given rate and concurrency, and
+// reports their latency, throughput and CPU cost. The server runs in process
+// from --configuration_file unless --target is set.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/time/time.h"
+#include "grpc++/grpc++.h"
+#include "proto/aviary.grpc.pb.h"
+#include "server/ad_auctions.h"
+#include "server/auction_load.h"
+#include "server/function_source.h"
+#include "v8/v8_platform_initializer.h"
+
+ABSL_FLAG(std::string, target, "",
+          "gRPC address of the server or Envoy endpoint to run auctions "
+          "against. When empty, a server is run in process from "
+          "--configuration_file.");
+
+ABSL_FLAG(std::string, configuration_file, "",
+          "Path to the configuration file of the in-process server in YAML "
+          "format, e.g. server/sample_configuration.yaml.");
+
+ABSL_FLAG(std::string, requests_file, "",
+          "File of recorded RunAdAuctionRequests to replay, one per line in "
+          "the JSON format. Synthetic auctions are run when empty.");
+
+ABSL_FLAG(std::vector<std::string>, bidding_logic_urls,
+          std::vector<std::string>({"local://constant", "local://doubling"}),
+          "Bidding functions of the buyers of synthetic auctions, one buyer "
+          "per function.");
+
+ABSL_FLAG(std::string, decision_logic_url, "local://disallowAutoAds",
+          "Ad scoring function of synthetic auctions.");
+
+ABSL_FLAG(int, interest_groups, 16,
+          "Interest groups of a synthetic auction, spread across the buyers.");
+
+ABSL_FLAG(int, ads_per_interest_group, 4,
+          "Ads of each interest group of a synthetic auction.");
+
+ABSL_FLAG(double, qps, 0,
+          "Auctions started per second. When 0, auctions are started as soon "
+          "as there is room for them within --concurrency.");
+
+ABSL_FLAG(int, concurrency, 8, "Auctions in flight at most.");
+
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(10),
+          "How long to start auctions for.");
+
+ABSL_FLAG(absl::Duration, deadline, absl::Seconds(5),
+          "Deadline of each auction.");
+
+using aviary::server::LoadOptions;
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  aviary::v8::V8PlatformInitializer v8_platform_initializer;
+
+  std::vector<aviary::RunAdAuctionRequest> requests;
+  if (absl::GetFlag(FLAGS_requests_file).empty()) {
+    requests.push_back(aviary::server::CreateSyntheticRequest(
+        {.bidding_logic_urls = absl::GetFlag(FLAGS_bidding_logic_urls),
+         .decision_logic_url = absl::GetFlag(FLAGS_decision_logic_url),
+         .interest_groups = absl::GetFlag(FLAGS_interest_groups),
+         .ads_per_interest_group =
+             absl::GetFlag(FLAGS_ads_per_interest_group)}));
+  } else {
+    auto requests_or =
+        aviary::server::ReadRequests(absl::GetFlag(FLAGS_requests_file));
+    if (!requests_or.ok()) {
+      std::cerr << requests_or.status() << std::endl;
+      return 1;
+    }
+    requests = *std::move(requests_or);
+  }
+
+  // Kept alive for as long as auctions run against them.
+  aviary::server::FunctionSource source;
+  std::unique_ptr<aviary::AdAuctions::Service> service;
+  std::unique_ptr<grpc::Server> server;
+  std::shared_ptr<grpc::Channel> channel;
+  if (absl::GetFlag(FLAGS_target).empty()) {
+    auto service_or = aviary::server::AdAuctionsImpl::Create(
+        source, absl::GetFlag(FLAGS_configuration_file));
+    if (!service_or.ok()) {
+      std::cerr << "Unable to initialize the server: " << service_or.status()
+                << std::endl;
+      return 1;
+    }
+    service = *std::move(service_or);
+    grpc::ServerBuilder builder;
+    builder.RegisterService(service.get());
+    server = builder.BuildAndStart();
+    channel = server->InProcessChannel(grpc::ChannelArguments());
+  } else {
+    channel = grpc::CreateChannel(absl::GetFlag(FLAGS_target),
+                                  grpc::InsecureChannelCredentials());
+  }
+
+  const std::unique_ptr<aviary::AdAuctions::Stub> stub =
+      aviary::AdAuctions::NewStub(channel);
+  const aviary::server::LoadReport report = aviary::server::RunLoad(
+      *stub, requests,
+      LoadOptions{.qps = absl::GetFlag(FLAGS_qps),
+                  .concurrency = absl::GetFlag(FLAGS_concurrency),
+                  .duration = absl::GetFlag(FLAGS_duration),
+                  .deadline = absl::GetFlag(FLAGS_deadline)});
+  std::cout << report.ToString();
+  if (server != nullptr) {
+    server->Shutdown();
+  }
+  return report.successes > 0 ? 0 : 1;
+}
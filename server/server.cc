@@ -12,14 +12,21 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <memory>
 #include <string>
+#include <thread>
+#include <utility>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/status/status.h"
+#include "absl/strings/numbers.h"
 #include "grpc++/ext/proto_server_reflection_plugin.h"
 #include "grpc++/grpc++.h"
+#include "httplib.h"
 #include "server/ad_auctions.h"
+#include "server/async_ad_auctions.h"
+#include "util/metrics.h"
 #include "v8.h"
 #include "v8/v8_platform_initializer.h"
 
@@ -33,14 +40,59 @@ ABSL_FLAG(std::string,
           "",
           "Path to the configuration file in YAML format.");
 
+ABSL_FLAG(std::string,
+          metrics_bind_address,
+          "",
+          "Address to serve metrics at under /metrics, in the Prometheus text "
+          "format. Metrics are not served when empty.");
+
+ABSL_FLAG(bool,
+          async_service,
+          false,
+          "Whether to serve RPCs through the asynchronous gRPC API, handling "
+          "them on --server_rpc_threads threads rather than on the threads of "
+          "gRPC.");
+
+using aviary::server::AdAuctionsImpl;
+using aviary::server::AsyncAdAuctionsServer;
 using aviary::server::FunctionSource;
 using grpc::Server;
 using grpc::ServerBuilder;
 
+// Starts serving metrics at --metrics_bind_address in the background, unless
+// empty. Returns false if the address cannot be bound.
+bool StartMetricsServer() {
+  const std::string address = absl::GetFlag(FLAGS_metrics_bind_address);
+  if (address.empty()) {
+    return true;
+  }
+  const size_t port_separator = address.rfind(':');
+  int port = 0;
+  if (port_separator == std::string::npos ||
+      !absl::SimpleAtoi(address.substr(port_separator + 1), &port)) {
+    return false;
+  }
+  // Never freed, since metrics are served for as long as the process runs.
+  auto* metrics_server = new httplib::Server();
+  metrics_server->Get(
+      "/metrics", [](const httplib::Request&, httplib::Response& response) {
+        response.set_content(aviary::util::MetricRegistry::Global().Export(),
+                             "text/plain; version=0.0.4");
+      });
+  if (!metrics_server->bind_to_port(
+          address.substr(0, port_separator).c_str(), port)) {
+    return false;
+  }
+  std::thread([metrics_server] { metrics_server->listen_after_bind(); })
+      .detach();
+  std::cout << "Serving metrics on " << address << std::endl;
+  return true;
+}
+
 void RunServer() {
   std::string server_address = absl::GetFlag(FLAGS_bind_address);
   FunctionSource source;
-  auto service_or = aviary::server::AdAuctionsImpl::Create(
+  auto service_or = AdAuctionsImpl::Create(
       source, absl::GetFlag(FLAGS_configuration_file));
   if (!service_or.ok()) {
     std::cerr << "Unable to initialize the server: "
@@ -48,6 +100,13 @@ void RunServer() {
     return;
   }
 
+  if (!StartMetricsServer()) {
+    std::cout << "Unable to serve metrics at "
+              << absl::GetFlag(FLAGS_metrics_bind_address) << ". Exiting."
+              << std::endl;
+    exit(1);
+  }
+
   grpc::EnableDefaultHealthCheckService(true);
   grpc::reflection::InitProtoReflectionServerBuilderPlugin();
 
@@ -56,8 +115,25 @@ void RunServer() {
   int bound_port = 0;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials(),
                            &bound_port);
-  builder.RegisterService(service_or.value().get());
+  // Declared before the server, which must be shut down first.
+  std::unique_ptr<AsyncAdAuctionsServer> async_server;
+  if (absl::GetFlag(FLAGS_async_service)) {
+    AdAuctionsImpl* service = service_or.value().get();
+    async_server = std::make_unique<AsyncAdAuctionsServer>(
+        service,
+        [service](grpc::ServerContext* context,
+                  std::shared_ptr<const aviary::RunAdAuctionRequest> request,
+                  aviary::RunAdAuctionResponse* response) {
+          return service->RunAdAuction(context, std::move(request), response);
+        });
+    async_server->RegisterWith(&builder);
+  } else {
+    builder.RegisterService(service_or.value().get());
+  }
   std::unique_ptr<Server> server(builder.BuildAndStart());
+  if (async_server != nullptr && server != nullptr) {
+    async_server->Start();
+  }
   if (bound_port != 0) {
     std::cout << "Server listening on " << server_address << std::endl;
     server->Wait();
@@ -21,6 +21,7 @@
 #include "absl/strings/substitute.h"
 #include "absl/synchronization/notification.h"
 #include "absl/time/time.h"
+#include "gmock/gmock.h"
 #include "grpc++/grpc++.h"
 #include "gtest/gtest.h"
 #include "httplib.h"
@@ -33,6 +34,7 @@ namespace aviary {
 namespace server {
 
 using ::aviary::util::FindUnusedPort;
+using ::testing::HasSubstr;
 using ::aviary::util::ParseTextOrDie;
 
 // Starts up an Aviary server in a separate process on a random local unused
@@ -83,9 +85,11 @@ class AviaryServer : public ::testing::Environment {
     std::string server_binary =
         absl::StrCat(test_workspace_dir, "/server/server");
     address_ = absl::StrCat("0.0.0.0:", FindUnusedPort().value());
+    metrics_port_ = FindUnusedPort().value();
     server_process_ =
         subprocess::RunBuilder(
             {server_binary, absl::StrCat("--bind_address=", address_),
+             absl::StrCat("--metrics_bind_address=0.0.0.0:", metrics_port_),
              absl::StrCat("--configuration_file=", ConfigurationFileName())})
             .popen();
     ABSL_ASSERT(WaitUntilServerIsReady());
@@ -119,6 +123,8 @@ adScoringFunctions: []
 
   std::string Address() const { return address_; }
 
+  int MetricsPort() const { return metrics_port_; }
+
  private:
   // Waits until server under test is ready to accept connections.
   // Returns true if the server is accepting connections.
@@ -137,6 +143,7 @@ adScoringFunctions: []
   }
 
   std::string address_;
+  int metrics_port_ = 0;
   subprocess::Popen server_process_;
   httplib::Server static_resources_server_;
   int static_resources_port_ = 0;
@@ -250,5 +257,21 @@ TEST_F(ServerTest, UnknownFunction) {
   EXPECT_EQ(response.status().code(), absl::StatusCode::kNotFound);
 }
 
+TEST_F(ServerTest, ServesMetrics) {
+  auto request = ParseTextOrDie<ComputeBidRequest>(
+      R"pb(
+        bidding_function_name: "local://constant"
+      )pb");
+  ASSERT_TRUE(ComputeBid(request).ok());
+
+  httplib::Client client("localhost", GetEnv<AviaryServer>()->MetricsPort());
+  const auto response = client.Get("/metrics");
+  ASSERT_TRUE(response);
+  EXPECT_EQ(response->status, 200);
+  EXPECT_THAT(response->body,
+              HasSubstr("aviary_function_stage_seconds_count{function=\"local:"
+                        "//constant\",stage=\"execution\"}"));
+}
+
 }  // namespace server
 }  // namespace aviary
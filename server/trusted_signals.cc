@@ -0,0 +1,243 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/trusted_signals.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "absl/algorithm/container.h"
+#include "absl/flags/flag.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "absl/types/optional.h"
+#include "google/protobuf/util/json_util.h"
+#include "util/metrics.h"
+
+ABSL_FLAG(absl::Duration,
+          trusted_signals_fetch_timeout,
+          absl::Seconds(1),
+          "Timeout of connecting to a trusted bidding signals server, and of "
+          "reading its response, within the deadline of the auction.");
+ABSL_FLAG(std::vector<std::string>,
+          trusted_signals_hosts,
+          {},
+          "Comma-separated hosts, optionally with a port, that trusted bidding "
+          "signals may be fetched from. The URLs of other hosts are not "
+          "fetched, and none is when empty.");
+
+namespace aviary {
+namespace server {
+namespace {
+
+using ::aviary::util::Counter;
+using ::aviary::util::MetricFamily;
+
+// Returns the counter of the trusted signals lookups that hit or missed the
+// cache.
+Counter& GetLookupCounter(bool hit) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_trusted_signals_lookups_total",
+      "Lookups of trusted bidding signals, by whether the cache had them.",
+      {"result"});
+  return family->Get({hit ? "hit" : "miss"});
+}
+
+// Returns the counter of the trusted signals fetches that succeeded or failed.
+Counter& GetFetchCounter(bool ok) {
+  static auto* const family = new MetricFamily<Counter>(
+      "aviary_trusted_signals_fetches_total",
+      "Fetches of trusted bidding signals, by result: ok or failed.",
+      {"result"});
+  return family->Get({ok ? "ok" : "failed"});
+}
+
+// Returns `value` with the characters that are not unreserved in a URL
+// percent-encoded, commas included.
+std::string UrlEncode(absl::string_view value) {
+  std::string encoded;
+  for (const char c : value) {
+    if (absl::ascii_isalnum(c) || c == '-' || c == '.' || c == '_' ||
+        c == '~') {
+      encoded.push_back(c);
+    } else {
+      absl::StrAppendFormat(&encoded, "%%%02X", static_cast<unsigned char>(c));
+    }
+  }
+  return encoded;
+}
+
+// Returns whether --trusted_signals_hosts lists the host of
+// `scheme_host_port`, with or without its port.
+bool IsAllowedHost(absl::string_view scheme_host_port) {
+  const absl::string_view host_port =
+      scheme_host_port.substr(scheme_host_port.find("://") + 3);
+  // The port follows the last colon, unless it belongs to an IPv6 address.
+  const size_t port_start = host_port.rfind(':');
+  const absl::string_view host =
+      port_start == absl::string_view::npos ||
+              host_port.find(']', port_start) != absl::string_view::npos
+          ? host_port
+          : host_port.substr(0, port_start);
+  const std::vector<std::string> allowed_hosts =
+      absl::GetFlag(FLAGS_trusted_signals_hosts);
+  return absl::c_linear_search(allowed_hosts, host_port) ||
+         absl::c_linear_search(allowed_hosts, host);
+}
+
+void SetTimeouts(absl::Duration timeout, httplib::Client* client) {
+  const int64_t microseconds = absl::ToInt64Microseconds(timeout);
+  client->set_connection_timeout(microseconds / 1000000,
+                                 microseconds % 1000000);
+  client->set_read_timeout(microseconds / 1000000, microseconds % 1000000);
+}
+}  // namespace
+
+const TrustedSignalsFetcher& TrustedSignalsFetcher::Default() {
+  static const auto* const fetcher = new TrustedSignalsFetcher();
+  return *fetcher;
+}
+
+absl::StatusOr<TrustedSignals> TrustedSignalsFetcher::Fetch(
+    absl::string_view url, absl::Span<const std::string> keys,
+    absl::Time deadline) const {
+  const size_t scheme_end = url.find("://");
+  if (scheme_end == absl::string_view::npos ||
+      (url.substr(0, scheme_end) != "http" &&
+       url.substr(0, scheme_end) != "https")) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Not a valid trusted signals URL: ", url));
+  }
+  const size_t path_start = url.find('/', scheme_end + 3);
+  const std::string scheme_host_port(url.substr(0, path_start));
+  if (!IsAllowedHost(scheme_host_port)) {
+    return absl::PermissionDeniedError(absl::StrCat(
+        "Trusted signals URL not allowed by --trusted_signals_hosts: ", url));
+  }
+  const absl::Duration timeout =
+      std::min(absl::GetFlag(FLAGS_trusted_signals_fetch_timeout),
+               deadline - absl::Now());
+  if (timeout <= absl::ZeroDuration()) {
+    return absl::DeadlineExceededError(
+        absl::StrCat("No time left to fetch trusted signals from ", url));
+  }
+  std::string path = path_start == absl::string_view::npos
+                         ? "/"
+                         : std::string(url.substr(path_start));
+  absl::StrAppend(&path, path.find('?') == std::string::npos ? "?" : "&",
+                  "keys=");
+  for (size_t i = 0; i < keys.size(); i++) {
+    absl::StrAppend(&path, i == 0 ? "" : ",", UrlEncode(keys[i]));
+  }
+
+  std::unique_ptr<httplib::Client> client = AcquireClient(scheme_host_port);
+  SetTimeouts(timeout, client.get());
+  auto res = client->Get(path.c_str());
+  if (!res) {
+    // The client is not reused, in case its connection got broken.
+    return absl::UnavailableError(
+        absl::StrCat("Unable to fetch trusted signals from ", url));
+  }
+  ReleaseClient(scheme_host_port, std::move(client));
+  if (res->status != 200) {
+    return absl::UnavailableError(
+        absl::StrCat("Unable to fetch trusted signals from ", url,
+                     ", HTTP status code: ", res->status));
+  }
+  google::protobuf::Struct values;
+  const auto parse_status =
+      google::protobuf::util::JsonStringToMessage(res->body, &values);
+  if (!parse_status.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid trusted signals from ", url, ": ",
+                     parse_status.ToString()));
+  }
+  return TrustedSignals(values.fields().begin(), values.fields().end());
+}
+
+std::unique_ptr<httplib::Client> TrustedSignalsFetcher::AcquireClient(
+    const std::string& scheme_host_port) const {
+  {
+    absl::MutexLock lock(&mutex_);
+    auto it = idle_clients_.find(scheme_host_port);
+    if (it != idle_clients_.end() && !it->second.empty()) {
+      std::unique_ptr<httplib::Client> client = std::move(it->second.back());
+      it->second.pop_back();
+      return client;
+    }
+  }
+  auto client = std::make_unique<httplib::Client>(scheme_host_port.c_str());
+  client->set_keep_alive(true);
+  return client;
+}
+
+void TrustedSignalsFetcher::ReleaseClient(
+    const std::string& scheme_host_port,
+    std::unique_ptr<httplib::Client> client) const {
+  absl::MutexLock lock(&mutex_);
+  idle_clients_[scheme_host_port].push_back(std::move(client));
+}
+
+TrustedSignalsCache::TrustedSignalsCache(const TrustedSignalsFetcher& fetcher,
+                                         absl::Duration ttl, size_t capacity)
+    : fetcher_(fetcher),
+      values_(capacity, ttl, util::CacheExpiration::kSinceInsertion) {}
+
+absl::StatusOr<TrustedSignals> TrustedSignalsCache::Get(
+    absl::string_view url, absl::Span<const std::string> keys,
+    absl::Time deadline) {
+  TrustedSignals signals;
+  std::vector<std::string> missing_keys;
+  for (const std::string& key : keys) {
+    absl::optional<CachedValue> cached = values_.Lookup(CacheKey(url, key));
+    if (!cached.has_value()) {
+      missing_keys.push_back(key);
+    } else if (cached->has_value) {
+      signals.insert_or_assign(key, std::move(cached->value));
+    }
+  }
+  GetLookupCounter(/*hit=*/true).Increment(keys.size() - missing_keys.size());
+  if (missing_keys.empty()) {
+    return signals;
+  }
+  GetLookupCounter(/*hit=*/false).Increment(missing_keys.size());
+
+  absl::StatusOr<TrustedSignals> fetched_signals =
+      fetcher_.Fetch(url, missing_keys, deadline);
+  GetFetchCounter(fetched_signals.ok()).Increment();
+  if (!fetched_signals.ok()) {
+    return fetched_signals.status();
+  }
+  for (const std::string& key : missing_keys) {
+    CachedValue cached;
+    const auto value_it = fetched_signals->find(key);
+    if (value_it != fetched_signals->end()) {
+      cached.has_value = true;
+      cached.value = value_it->second;
+      signals.insert_or_assign(key, std::move(value_it->second));
+    }
+    values_.Insert(CacheKey(url, key), std::move(cached));
+  }
+  return signals;
+}
+
+std::string TrustedSignalsCache::CacheKey(absl::string_view url,
+                                          absl::string_view key) {
+  // URLs cannot contain spaces, so that the URL and the key are unambiguous.
+  return absl::StrCat(url, " ", key);
+}
+}  // namespace server
+}  // namespace aviary
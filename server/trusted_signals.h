@@ -0,0 +1,125 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SERVER_TRUSTED_SIGNALS_H_
+#define SERVER_TRUSTED_SIGNALS_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "google/protobuf/struct.pb.h"
+#include "httplib.h"
+#include "util/sharded_cache.h"
+
+namespace aviary {
+namespace server {
+
+// Values of trusted bidding signals, by key.
+using TrustedSignals =
+    absl::flat_hash_map<std::string, google::protobuf::Value>;
+
+// Fetches trusted bidding signals from the key-value servers of buyers.
+//
+// The values of many keys are fetched at once from `<url>?keys=<keys>`, where
+// `<keys>` is the comma-separated list of the URL-encoded keys, which responds
+// with a JSON object of the values by key. Fetches from the same host reuse the
+// connections of the previous ones. URLs come from clients, so that values are
+// only fetched from the hosts of --trusted_signals_hosts.
+//
+// Thread-safe.
+class TrustedSignalsFetcher {
+ public:
+  TrustedSignalsFetcher() = default;
+  virtual ~TrustedSignalsFetcher() = default;
+
+  // Returns a fetcher shared by the whole process.
+  static const TrustedSignalsFetcher& Default();
+
+  // Fetches the values of `keys` from the server at `url`, giving up at
+  // `deadline`. Keys that the server has no value for are left out. Fails with
+  // kPermissionDenied for the hosts missing from --trusted_signals_hosts.
+  virtual absl::StatusOr<TrustedSignals> Fetch(
+      absl::string_view url, absl::Span<const std::string> keys,
+      absl::Time deadline) const;
+
+  TrustedSignalsFetcher(const TrustedSignalsFetcher&) = delete;
+  TrustedSignalsFetcher& operator=(const TrustedSignalsFetcher&) = delete;
+
+ private:
+  // Returns an idle client connected to `scheme_host_port`, or a new one if
+  // there is none. Clients are returned to the pool by `ReleaseClient()`.
+  std::unique_ptr<httplib::Client> AcquireClient(
+      const std::string& scheme_host_port) const ABSL_LOCKS_EXCLUDED(mutex_);
+  void ReleaseClient(const std::string& scheme_host_port,
+                     std::unique_ptr<httplib::Client> client) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  mutable absl::Mutex mutex_;
+  // Keyed by scheme, host and port.
+  mutable absl::flat_hash_map<std::string,
+                              std::vector<std::unique_ptr<httplib::Client>>>
+      idle_clients_ ABSL_GUARDED_BY(mutex_);
+};
+
+// Caches the trusted bidding signals fetched by a `TrustedSignalsFetcher` for
+// a time to live, so that auctions only need to name their keys.
+//
+// Thread-safe.
+class TrustedSignalsCache {
+ public:
+  // Caches the values fetched by `fetcher`, which must outlive the cache, for
+  // `ttl`. At most `capacity` values are cached, beyond which the values
+  // fetched the longest ago are evicted.
+  TrustedSignalsCache(const TrustedSignalsFetcher& fetcher, absl::Duration ttl,
+                      size_t capacity);
+
+  // Returns the values of `keys` from the server at `url`. All the values that
+  // are not cached are fetched at once, by `deadline`. Keys that the server
+  // has no value for are left out, and are cached as such. Fails if fetching
+  // fails.
+  absl::StatusOr<TrustedSignals> Get(absl::string_view url,
+                                     absl::Span<const std::string> keys,
+                                     absl::Time deadline);
+
+  TrustedSignalsCache(const TrustedSignalsCache&) = delete;
+  TrustedSignalsCache& operator=(const TrustedSignalsCache&) = delete;
+
+ private:
+  // A cached value, or its absence.
+  struct CachedValue {
+    bool has_value = false;
+    google::protobuf::Value value;
+  };
+
+  static std::string CacheKey(absl::string_view url, absl::string_view key);
+
+  const TrustedSignalsFetcher& fetcher_;
+  // Keyed by URL and key, see `CacheKey()`.
+  util::ShardedCache<std::string, CachedValue> values_;
+};
+
+}  // namespace server
+}  // namespace aviary
+
+#endif  // SERVER_TRUSTED_SIGNALS_H_
@@ -0,0 +1,271 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/trusted_signals.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/substitute.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "httplib.h"
+#include "util/unused_port.h"
+
+ABSL_DECLARE_FLAG(std::vector<std::string>, trusted_signals_hosts);
+
+namespace aviary {
+namespace server {
+namespace {
+
+using ::aviary::util::FindUnusedPort;
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Key;
+using ::testing::UnorderedElementsAre;
+
+// Returns the number value of each key that is a number, and records the
+// fetched keys.
+class FakeTrustedSignalsFetcher : public TrustedSignalsFetcher {
+ public:
+  absl::StatusOr<TrustedSignals> Fetch(
+      absl::string_view url, absl::Span<const std::string> keys,
+      absl::Time deadline) const override {
+    absl::MutexLock lock(&mutex_);
+    fetches_.emplace_back(keys.begin(), keys.end());
+    if (url != "https://kv.example/signals") {
+      return absl::UnavailableError("Unknown server");
+    }
+    TrustedSignals signals;
+    for (const std::string& key : keys) {
+      double number;
+      if (absl::SimpleAtod(key, &number)) {
+        signals[key].set_number_value(number);
+      }
+    }
+    return signals;
+  }
+
+  std::vector<std::vector<std::string>> fetches() const {
+    absl::MutexLock lock(&mutex_);
+    return fetches_;
+  }
+
+ private:
+  mutable absl::Mutex mutex_;
+  mutable std::vector<std::vector<std::string>> fetches_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+constexpr absl::string_view kUrl = "https://kv.example/signals";
+constexpr absl::Time kNoDeadline = absl::InfiniteFuture();
+
+TEST(TrustedSignalsCacheTest, FetchesMissingKeysAtOnce) {
+  FakeTrustedSignalsFetcher fetcher;
+  TrustedSignalsCache cache(fetcher, absl::Hours(1), /*capacity=*/100);
+  absl::StatusOr<TrustedSignals> signals =
+      cache.Get(kUrl, {"1", "2"}, kNoDeadline);
+  ASSERT_TRUE(signals.ok()) << signals.status();
+  EXPECT_EQ((*signals)["1"].number_value(), 1);
+  EXPECT_EQ((*signals)["2"].number_value(), 2);
+
+  // Only the key that is not cached yet gets fetched.
+  signals = cache.Get(kUrl, {"2", "3"}, kNoDeadline);
+  ASSERT_TRUE(signals.ok()) << signals.status();
+  EXPECT_THAT(*signals, UnorderedElementsAre(Key("2"), Key("3")));
+  EXPECT_THAT(fetcher.fetches(),
+              ElementsAre(ElementsAre("1", "2"), ElementsAre("3")));
+}
+
+TEST(TrustedSignalsCacheTest, CachesMissingValues) {
+  FakeTrustedSignalsFetcher fetcher;
+  TrustedSignalsCache cache(fetcher, absl::Hours(1), /*capacity=*/100);
+  for (int i = 0; i < 2; i++) {
+    absl::StatusOr<TrustedSignals> signals =
+        cache.Get(kUrl, {"unknown"}, kNoDeadline);
+    ASSERT_TRUE(signals.ok()) << signals.status();
+    EXPECT_THAT(*signals, IsEmpty());
+  }
+  EXPECT_EQ(fetcher.fetches().size(), 1);
+}
+
+TEST(TrustedSignalsCacheTest, RefetchesExpiredValues) {
+  FakeTrustedSignalsFetcher fetcher;
+  TrustedSignalsCache cache(fetcher, absl::Milliseconds(10),
+                            /*capacity=*/100);
+  ASSERT_TRUE(cache.Get(kUrl, {"1"}, kNoDeadline).ok());
+  absl::SleepFor(absl::Milliseconds(20));
+  ASSERT_TRUE(cache.Get(kUrl, {"1"}, kNoDeadline).ok());
+  EXPECT_EQ(fetcher.fetches().size(), 2);
+}
+
+TEST(TrustedSignalsCacheTest, KeysOfDifferentUrlsAreDistinct) {
+  FakeTrustedSignalsFetcher fetcher;
+  TrustedSignalsCache cache(fetcher, absl::Hours(1), /*capacity=*/100);
+  ASSERT_TRUE(cache.Get(kUrl, {"1"}, kNoDeadline).ok());
+  // The value cached for `kUrl` is not used for another server.
+  EXPECT_EQ(cache.Get("https://other.example/signals", {"1"}, kNoDeadline)
+                .status()
+                .code(),
+            absl::StatusCode::kUnavailable);
+}
+
+TEST(TrustedSignalsCacheTest, StaysWithinCapacity) {
+  FakeTrustedSignalsFetcher fetcher;
+  // A value per shard.
+  TrustedSignalsCache cache(fetcher, absl::Hours(1), /*capacity=*/16);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(cache.Get(kUrl, {std::to_string(i)}, kNoDeadline).ok());
+  }
+  int cached_values = 0;
+  for (int i = 0; i < 100; i++) {
+    const size_t fetches = fetcher.fetches().size();
+    ASSERT_TRUE(cache.Get(kUrl, {std::to_string(i)}, kNoDeadline).ok());
+    cached_values += fetcher.fetches().size() == fetches;
+  }
+  EXPECT_LE(cached_values, 16);
+}
+
+TEST(TrustedSignalsCacheTest, ServesConcurrentLookups) {
+  FakeTrustedSignalsFetcher fetcher;
+  TrustedSignalsCache cache(fetcher, absl::Hours(1), /*capacity=*/1000);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&cache] {
+      for (int j = 0; j < 100; j++) {
+        absl::StatusOr<TrustedSignals> signals =
+            cache.Get(kUrl, {std::to_string(j)}, kNoDeadline);
+        ASSERT_TRUE(signals.ok()) << signals.status();
+        EXPECT_EQ((*signals)[std::to_string(j)].number_value(), j);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+class TrustedSignalsFetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    absl::SetFlag(&FLAGS_trusted_signals_hosts, {"localhost"});
+    port_ = FindUnusedPort().value();
+    absl::Notification server_ready;
+    server_thread_ = std::make_unique<std::thread>([this, &server_ready] {
+      ASSERT_TRUE(server_.bind_to_port("0.0.0.0", port_));
+      server_ready.Notify();
+      server_.listen_after_bind();
+    });
+    ASSERT_TRUE(server_ready.WaitForNotificationWithTimeout(absl::Seconds(5)));
+    while (!server_.is_running()) {
+      absl::SleepFor(absl::Milliseconds(10));
+    }
+  }
+
+  void TearDown() override {
+    server_.stop();
+    server_thread_->join();
+  }
+
+  absl::FlagSaver flag_saver_;
+  httplib::Server server_;
+  int port_ = 0;
+  std::unique_ptr<std::thread> server_thread_;
+};
+
+TEST_F(TrustedSignalsFetcherTest, FetchesKeys) {
+  std::string requested_keys;
+  server_.Get("/signals", [&](const httplib::Request& req,
+                              httplib::Response& res) {
+    requested_keys = req.get_param_value("keys");
+    res.set_content(R"({"a": 1, "b c": {"d": "e"}})", "application/json");
+  });
+  TrustedSignalsFetcher fetcher;
+  absl::StatusOr<TrustedSignals> signals =
+      fetcher.Fetch(absl::Substitute("http://localhost:$0/signals", port_),
+                    {"a", "b c"}, kNoDeadline);
+  ASSERT_TRUE(signals.ok()) << signals.status();
+  EXPECT_EQ(requested_keys, "a,b c");
+  EXPECT_EQ((*signals)["a"].number_value(), 1);
+  EXPECT_EQ(
+      (*signals)["b c"].struct_value().fields().at("d").string_value(), "e");
+}
+
+TEST_F(TrustedSignalsFetcherTest, FailsOnErrorStatus) {
+  TrustedSignalsFetcher fetcher;
+  EXPECT_EQ(fetcher
+                .Fetch(absl::Substitute("http://localhost:$0/missing", port_),
+                       {"a"}, kNoDeadline)
+                .status()
+                .code(),
+            absl::StatusCode::kUnavailable);
+}
+
+TEST_F(TrustedSignalsFetcherTest, FailsOnInvalidResponse) {
+  server_.Get("/signals", [&](const httplib::Request&, httplib::Response& res) {
+    res.set_content("[1, 2]", "application/json");
+  });
+  TrustedSignalsFetcher fetcher;
+  EXPECT_EQ(fetcher
+                .Fetch(absl::Substitute("http://localhost:$0/signals", port_),
+                       {"a"}, kNoDeadline)
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(TrustedSignalsFetcherTest, OnlyFetchesFromAllowedHosts) {
+  int requests = 0;
+  server_.Get("/signals", [&](const httplib::Request&, httplib::Response& res) {
+    requests++;
+    res.set_content("{}", "application/json");
+  });
+  TrustedSignalsFetcher fetcher;
+  const std::string url =
+      absl::Substitute("http://127.0.0.1:$0/signals", port_);
+  EXPECT_EQ(fetcher.Fetch(url, {"a"}, kNoDeadline).status().code(),
+            absl::StatusCode::kPermissionDenied);
+  absl::SetFlag(&FLAGS_trusted_signals_hosts,
+                {absl::Substitute("127.0.0.1:$0", port_)});
+  EXPECT_TRUE(fetcher.Fetch(url, {"a"}, kNoDeadline).ok());
+  EXPECT_EQ(requests, 1);
+}
+
+TEST_F(TrustedSignalsFetcherTest, FailsPastDeadline) {
+  TrustedSignalsFetcher fetcher;
+  EXPECT_EQ(fetcher
+                .Fetch(absl::Substitute("http://localhost:$0/signals", port_),
+                       {"a"}, absl::Now())
+                .status()
+                .code(),
+            absl::StatusCode::kDeadlineExceeded);
+}
+
+TEST(TrustedSignalsFetcherUrlTest, RejectsInvalidUrl) {
+  TrustedSignalsFetcher fetcher;
+  EXPECT_EQ(
+      fetcher.Fetch("local://signals", {"a"}, kNoDeadline).status().code(),
+      absl::StatusCode::kInvalidArgument);
+}
+}  // namespace
+}  // namespace server
+}  // namespace aviary
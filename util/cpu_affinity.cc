@@ -0,0 +1,151 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/cpu_affinity.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+
+namespace aviary::util {
+namespace {
+
+absl::StatusOr<int> ParseCpu(absl::string_view cpu) {
+  int parsed;
+  if (!absl::SimpleAtoi(cpu, &parsed) || parsed < 0 ||
+      parsed >= CPU_SETSIZE) {
+    return absl::InvalidArgumentError(absl::StrCat("Invalid CPU: ", cpu));
+  }
+  return parsed;
+}
+
+// Returns the CPU list of a NUMA node, e.g. "0-15,32-47".
+absl::StatusOr<std::string> ReadNumaNodeCpuList(
+    absl::string_view node, absl::string_view numa_node_directory) {
+  int parsed;
+  if (!absl::SimpleAtoi(node, &parsed) || parsed < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid NUMA node: ", node));
+  }
+  std::ifstream file(
+      absl::StrCat(numa_node_directory, "/node", parsed, "/cpulist"));
+  std::string cpu_list(std::istreambuf_iterator<char>(file), {});
+  if (!file) {
+    return absl::NotFoundError(
+        absl::StrCat("NUMA node ", parsed, " is not available"));
+  }
+  return std::string(absl::StripAsciiWhitespace(cpu_list));
+}
+
+absl::Status AddCpus(absl::string_view cpu_set,
+                     absl::string_view numa_node_directory, bool allow_nodes,
+                     std::vector<int>& cpus) {
+  for (absl::string_view item :
+       absl::StrSplit(cpu_set, ',', absl::SkipWhitespace())) {
+    item = absl::StripAsciiWhitespace(item);
+    if (allow_nodes && absl::ConsumePrefix(&item, "node")) {
+      const absl::StatusOr<std::string> node_cpus =
+          ReadNumaNodeCpuList(item, numa_node_directory);
+      if (!node_cpus.ok()) {
+        return node_cpus.status();
+      }
+      // Node lists are plain CPU lists.
+      const absl::Status status =
+          AddCpus(*node_cpus, numa_node_directory, false, cpus);
+      if (!status.ok()) {
+        return status;
+      }
+      continue;
+    }
+    const std::vector<absl::string_view> range =
+        absl::StrSplit(item, absl::MaxSplits('-', 1));
+    const absl::StatusOr<int> first = ParseCpu(range.front());
+    if (!first.ok()) {
+      return first.status();
+    }
+    const absl::StatusOr<int> last = ParseCpu(range.back());
+    if (!last.ok()) {
+      return last.status();
+    }
+    if (*last < *first) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid CPU range: ", item));
+    }
+    for (int cpu = *first; cpu <= *last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return absl::OkStatus();
+}
+}  // namespace
+
+absl::StatusOr<std::vector<int>> ParseCpuSet(
+    absl::string_view cpu_set, absl::string_view numa_node_directory) {
+  std::vector<int> cpus;
+  const absl::Status status =
+      AddCpus(cpu_set, numa_node_directory, true, cpus);
+  if (!status.ok()) {
+    return status;
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+absl::Status PinCurrentThread(const std::vector<int>& cpus) {
+  if (cpus.empty()) {
+    return absl::InvalidArgumentError("No CPUs to pin to");
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      return absl::InvalidArgumentError(absl::StrCat("Invalid CPU: ", cpu));
+    }
+    CPU_SET(cpu, &cpu_set);
+  }
+  // A pid of 0 selects the calling thread.
+  if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to pin thread to CPUs: ", std::strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::vector<int>> GetCurrentThreadCpus() {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+    return absl::InternalError(
+        absl::StrCat("Failed to get thread CPUs: ", std::strerror(errno)));
+  }
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &cpu_set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+}  // namespace aviary::util
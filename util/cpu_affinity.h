@@ -0,0 +1,47 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTIL_CPU_AFFINITY_H_
+#define UTIL_CPU_AFFINITY_H_
+
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+
+namespace aviary::util {
+
+// Parses a set of CPUs in the list format of `taskset --cpu-list` and of
+// sysfs, e.g. "0-3,8,10-11". Items of the form "node<N>" stand for the CPUs
+// of NUMA node N, as listed under `numa_node_directory`, so that e.g. "node1"
+// keeps threads close to the memory of the second socket.
+//
+// Returns the sorted CPUs, none for an empty set.
+absl::StatusOr<std::vector<int>> ParseCpuSet(
+    absl::string_view cpu_set,
+    absl::string_view numa_node_directory = "/sys/devices/system/node");
+
+// Restricts the calling thread to the CPUs of `cpus`. The threads that it
+// starts afterwards inherit the restriction.
+absl::Status PinCurrentThread(const std::vector<int>& cpus);
+
+// Returns the sorted CPUs that the calling thread may run on.
+absl::StatusOr<std::vector<int>> GetCurrentThreadCpus();
+
+}  // namespace aviary::util
+
+#endif  // UTIL_CPU_AFFINITY_H_
@@ -0,0 +1,91 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/cpu_affinity.h"
+
+#include <sys/stat.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace aviary::util {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+TEST(ParseCpuSetTest, ParsesCpuList) {
+  const absl::StatusOr<std::vector<int>> cpus = ParseCpuSet("8,0-3, 10-11,2");
+  ASSERT_TRUE(cpus.ok()) << cpus.status();
+  EXPECT_THAT(*cpus, ElementsAre(0, 1, 2, 3, 8, 10, 11));
+}
+
+TEST(ParseCpuSetTest, ParsesEmptySet) {
+  const absl::StatusOr<std::vector<int>> cpus = ParseCpuSet("");
+  ASSERT_TRUE(cpus.ok()) << cpus.status();
+  EXPECT_THAT(*cpus, IsEmpty());
+}
+
+TEST(ParseCpuSetTest, RejectsInvalidCpus) {
+  EXPECT_EQ(ParseCpuSet("a").status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseCpuSet("-1").status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseCpuSet("3-1").status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseCpuSet("0-100000").status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ParseCpuSetTest, ParsesNumaNodes) {
+  const std::string numa_node_directory =
+      std::string(std::getenv("TEST_TMPDIR") != nullptr
+                      ? std::getenv("TEST_TMPDIR")
+                      : "/tmp") +
+      "/cpu_affinity_test_nodes";
+  mkdir(numa_node_directory.c_str(), 0700);
+  mkdir((numa_node_directory + "/node1").c_str(), 0700);
+  std::ofstream(numa_node_directory + "/node1/cpulist") << "4-5,12\n";
+
+  const absl::StatusOr<std::vector<int>> cpus =
+      ParseCpuSet("node1,0", numa_node_directory);
+  ASSERT_TRUE(cpus.ok()) << cpus.status();
+  EXPECT_THAT(*cpus, ElementsAre(0, 4, 5, 12));
+  EXPECT_EQ(ParseCpuSet("node2", numa_node_directory).status().code(),
+            absl::StatusCode::kNotFound);
+}
+
+TEST(PinCurrentThreadTest, PinsThreadsStartedAfterwards) {
+  std::thread([] {
+    const absl::StatusOr<std::vector<int>> cpus = GetCurrentThreadCpus();
+    ASSERT_TRUE(cpus.ok()) << cpus.status();
+    ASSERT_FALSE(cpus->empty());
+    ASSERT_TRUE(PinCurrentThread({cpus->front()}).ok());
+    EXPECT_THAT(*GetCurrentThreadCpus(), ElementsAre(cpus->front()));
+    std::thread([&cpus] {
+      EXPECT_THAT(*GetCurrentThreadCpus(), ElementsAre(cpus->front()));
+    }).join();
+  }).join();
+}
+
+TEST(PinCurrentThreadTest, RejectsEmptySet) {
+  EXPECT_EQ(PinCurrentThread({}).code(), absl::StatusCode::kInvalidArgument);
+}
+}  // namespace
+}  // namespace aviary::util
@@ -0,0 +1,174 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "util/metrics.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+
+namespace aviary::util {
+namespace {
+
+constexpr double kLatencyBuckets[] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001,
+    0.0025,  0.005,    0.01,    0.025,  0.05,    0.1,    0.25,
+    0.5,     1,        2.5,     5,      10};
+
+// Escapes a label value as required by the text format.
+std::string EscapeLabelValue(absl::string_view value) {
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (char c : value) {
+    switch (c) {
+      case '\\':
+        escaped.append("\\\\");
+        break;
+      case '"':
+        escaped.append("\\\"");
+        break;
+      case '\n':
+        escaped.append("\\n");
+        break;
+      default:
+        escaped.push_back(c);
+    }
+  }
+  return escaped;
+}
+
+// Formats `value` the way Prometheus does, e.g. `+Inf` for infinity.
+std::string FormatValue(double value) {
+  if (value == std::numeric_limits<double>::infinity()) {
+    return "+Inf";
+  }
+  return absl::StrCat(value);
+}
+}  // namespace
+
+Histogram::Histogram(absl::Span<const double> bounds)
+    : bounds_(bounds.begin(), bounds.end()),
+      bucket_counts_(new std::atomic<int64_t>[bounds.size() + 1]) {
+  for (size_t i = 0; i <= bounds_.size(); i++) {
+    bucket_counts_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::Record(double value) {
+  // Buckets count the values up to and including their bound.
+  const size_t bucket =
+      std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+      bounds_.begin();
+  bucket_counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  double sum = sum_.load(std::memory_order_relaxed);
+  while (!sum_.compare_exchange_weak(sum, sum + value,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+std::vector<int64_t> Histogram::GetBucketCounts() const {
+  std::vector<int64_t> bucket_counts(bounds_.size() + 1);
+  for (size_t i = 0; i < bucket_counts.size(); i++) {
+    bucket_counts[i] = bucket_counts_[i].load(std::memory_order_relaxed);
+  }
+  return bucket_counts;
+}
+
+absl::Span<const double> LatencyBuckets() { return kLatencyBuckets; }
+
+MetricRegistry& MetricRegistry::Global() {
+  // Never freed, since families registered with it are never freed either.
+  static auto* const registry = new MetricRegistry();
+  return *registry;
+}
+
+void MetricRegistry::Register(const MetricFamilyInterface* family) {
+  absl::MutexLock lock(&mutex_);
+  families_.push_back(family);
+}
+
+std::string MetricRegistry::Export() const {
+  std::vector<const MetricFamilyInterface*> families;
+  {
+    absl::MutexLock lock(&mutex_);
+    families = families_;
+  }
+  std::sort(families.begin(), families.end(),
+            [](const MetricFamilyInterface* a, const MetricFamilyInterface* b) {
+              return a->name() < b->name();
+            });
+  std::string output;
+  for (const MetricFamilyInterface* family : families) {
+    family->Export(&output);
+  }
+  return output;
+}
+
+namespace internal {
+void ExportSamples(absl::string_view name, absl::string_view labels,
+                   const Counter& counter, std::string* output) {
+  absl::StrAppend(output, name, labels, " ", counter.value(), "\n");
+}
+
+void ExportSamples(absl::string_view name, absl::string_view labels,
+                   const Gauge& gauge, std::string* output) {
+  absl::StrAppend(output, name, labels, " ", gauge.value(), "\n");
+}
+
+void ExportSamples(absl::string_view name, absl::string_view labels,
+                   const Histogram& histogram, std::string* output) {
+  // Bucket labels come after the labels of the metric, if any.
+  const std::string bucket_labels_prefix =
+      labels.empty() ? "{"
+                     : absl::StrCat(labels.substr(0, labels.size() - 1), ",");
+  const std::vector<int64_t> bucket_counts = histogram.GetBucketCounts();
+  int64_t count = 0;
+  for (size_t i = 0; i < bucket_counts.size(); i++) {
+    count += bucket_counts[i];
+    const double bound = i < histogram.bounds().size()
+                             ? histogram.bounds()[i]
+                             : std::numeric_limits<double>::infinity();
+    absl::StrAppend(output, name, "_bucket", bucket_labels_prefix, "le=\"",
+                    FormatValue(bound), "\"} ", count, "\n");
+  }
+  absl::StrAppend(output, name, "_sum", labels, " ",
+                  FormatValue(histogram.sum()), "\n");
+  absl::StrAppend(output, name, "_count", labels, " ", count, "\n");
+}
+
+absl::string_view MetricType(const Counter*) { return "counter"; }
+absl::string_view MetricType(const Gauge*) { return "gauge"; }
+absl::string_view MetricType(const Histogram*) { return "histogram"; }
+
+std::string FormatLabels(absl::Span<const std::string> label_names,
+                         absl::Span<const absl::string_view> label_values) {
+  if (label_names.empty()) {
+    return "";
+  }
+  std::vector<std::string> labels;
+  labels.reserve(label_names.size());
+  for (size_t i = 0; i < label_names.size(); i++) {
+    // Missing values are exported as empty ones.
+    const absl::string_view value =
+        i < label_values.size() ? label_values[i] : absl::string_view();
+    labels.push_back(
+        absl::StrCat(label_names[i], "=\"", EscapeLabelValue(value), "\""));
+  }
+  return absl::StrCat("{", absl::StrJoin(labels, ","), "}");
+}
+}  // namespace internal
+}  // namespace aviary::util
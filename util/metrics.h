@@ -0,0 +1,243 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTIL_METRICS_H_
+#define UTIL_METRICS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+namespace aviary::util {
+
+// Metrics exported in the Prometheus text format
+// (https://prometheus.io/docs/instrumenting/exposition_formats/).
+//
+// Recording a value only takes relaxed atomic operations, so that metrics can
+// stay on in production. Looking a metric up by its labels takes a lock, so
+// callers recording the same metric repeatedly keep a reference to it.
+
+// A monotonically increasing count.
+class Counter {
+ public:
+  void Increment(int64_t amount = 1) {
+    value_.fetch_add(amount, std::memory_order_relaxed);
+  }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+// A value that goes up and down, e.g. the length of a queue.
+class Gauge {
+ public:
+  void Add(int64_t amount) {
+    value_.fetch_add(amount, std::memory_order_relaxed);
+  }
+  void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+// Counts values into buckets of fixed upper bounds.
+class Histogram {
+ public:
+  // `bounds` must be sorted in increasing order. Values greater than the last
+  // bound are counted in an implicit bucket of infinite bound.
+  explicit Histogram(absl::Span<const double> bounds);
+
+  void Record(double value);
+
+  // Records `duration` in seconds.
+  void RecordDuration(absl::Duration duration) {
+    Record(absl::ToDoubleSeconds(duration));
+  }
+
+  absl::Span<const double> bounds() const { return bounds_; }
+
+  // Returns the number of values counted in each bucket, with the bucket of
+  // infinite bound last.
+  std::vector<int64_t> GetBucketCounts() const;
+
+  double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+ private:
+  const std::vector<double> bounds_;
+  const std::unique_ptr<std::atomic<int64_t>[]> bucket_counts_;
+  std::atomic<double> sum_{0};
+};
+
+// Bucket bounds suited to latencies in seconds, from 10us to 10s.
+absl::Span<const double> LatencyBuckets();
+
+// Common interface of the metric families, exported by `MetricRegistry`.
+class MetricFamilyInterface {
+ public:
+  virtual ~MetricFamilyInterface() = default;
+
+  virtual absl::string_view name() const = 0;
+
+  // Appends the samples of the family, with their help and type comments.
+  virtual void Export(std::string* output) const = 0;
+};
+
+// The metric families of the process.
+//
+// Thread-safe.
+class MetricRegistry {
+ public:
+  // Returns the registry that metric families register with by default.
+  static MetricRegistry& Global();
+
+  MetricRegistry() = default;
+
+  // Adds `family` to the exported families. `family` must outlive the
+  // registry, and its name must be unique within the registry.
+  void Register(const MetricFamilyInterface* family)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the metrics of all the families in the Prometheus text format,
+  // ordered by family name.
+  std::string Export() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  MetricRegistry(const MetricRegistry&) = delete;
+  MetricRegistry& operator=(const MetricRegistry&) = delete;
+
+ private:
+  mutable absl::Mutex mutex_;
+  std::vector<const MetricFamilyInterface*> families_ ABSL_GUARDED_BY(mutex_);
+};
+
+namespace internal {
+// Appends the samples of a single metric of family `name`, whose labels are
+// already formatted as `{name="value",...}` or empty.
+void ExportSamples(absl::string_view name, absl::string_view labels,
+                   const Counter& counter, std::string* output);
+void ExportSamples(absl::string_view name, absl::string_view labels,
+                   const Gauge& gauge, std::string* output);
+void ExportSamples(absl::string_view name, absl::string_view labels,
+                   const Histogram& histogram, std::string* output);
+
+// Returns the Prometheus type of the metrics of the family.
+absl::string_view MetricType(const Counter*);
+absl::string_view MetricType(const Gauge*);
+absl::string_view MetricType(const Histogram*);
+
+// Formats the labels of a metric for export.
+std::string FormatLabels(absl::Span<const std::string> label_names,
+                         absl::Span<const absl::string_view> label_values);
+}  // namespace internal
+
+// Metrics of the same name, distinguished by the values of their labels, e.g.
+//
+//   static auto* const latencies = new MetricFamily<Histogram>(
+//       "aviary_latency_seconds", "Latency of...", {"function"},
+//       LatencyBuckets());
+//   latencies->Get({uri}).RecordDuration(latency);
+//
+// Families are typically leaked, since they must outlive their registry.
+//
+// Thread-safe.
+template <typename Metric>
+class MetricFamily : public MetricFamilyInterface {
+ public:
+  // `metric_args` are passed to the constructor of each metric of the family.
+  // Registers the family with `MetricRegistry::Global()`.
+  template <typename... MetricArgs>
+  MetricFamily(absl::string_view name, absl::string_view help,
+               std::vector<std::string> label_names, MetricArgs... metric_args)
+      : name_(name),
+        help_(help),
+        label_names_(std::move(label_names)),
+        new_metric_([metric_args...] {
+          return std::make_unique<Metric>(metric_args...);
+        }) {
+    MetricRegistry::Global().Register(this);
+  }
+
+  // Returns the metric of the given label values, in the order of the label
+  // names, creating it if there is none. The metric lives as long as the
+  // family.
+  Metric& Get(std::initializer_list<absl::string_view> label_values)
+      ABSL_LOCKS_EXCLUDED(mutex_) {
+    std::string labels = internal::FormatLabels(label_names_, label_values);
+    {
+      absl::ReaderMutexLock lock(&mutex_);
+      if (auto it = metrics_.find(labels); it != metrics_.end()) {
+        return *it->second;
+      }
+    }
+    absl::MutexLock lock(&mutex_);
+    std::unique_ptr<Metric>& metric = metrics_[std::move(labels)];
+    if (metric == nullptr) {
+      metric = new_metric_();
+    }
+    return *metric;
+  }
+
+  absl::string_view name() const override { return name_; }
+
+  void Export(std::string* output) const override ABSL_LOCKS_EXCLUDED(mutex_) {
+    absl::StrAppend(output, "# HELP ", name_, " ", help_, "\n# TYPE ", name_,
+                    " ",
+                    internal::MetricType(static_cast<const Metric*>(nullptr)),
+                    "\n");
+    absl::ReaderMutexLock lock(&mutex_);
+    // Sorted for the output to be stable.
+    std::vector<const std::string*> labels;
+    labels.reserve(metrics_.size());
+    for (const auto& [metric_labels, metric] : metrics_) {
+      labels.push_back(&metric_labels);
+    }
+    std::sort(labels.begin(), labels.end(),
+              [](const std::string* a, const std::string* b) {
+                return *a < *b;
+              });
+    for (const std::string* metric_labels : labels) {
+      internal::ExportSamples(name_, *metric_labels,
+                              *metrics_.find(*metric_labels)->second, output);
+    }
+  }
+
+ private:
+  const std::string name_;
+  const std::string help_;
+  const std::vector<std::string> label_names_;
+  const std::function<std::unique_ptr<Metric>()> new_metric_;
+  mutable absl::Mutex mutex_;
+  // Metrics by their formatted labels.
+  absl::flat_hash_map<std::string, std::unique_ptr<Metric>> metrics_
+      ABSL_GUARDED_BY(mutex_);
+};
+}  // namespace aviary::util
+
+#endif  // UTIL_METRICS_H_
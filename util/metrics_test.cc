@@ -0,0 +1,136 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "util/metrics.h"
+
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace aviary::util {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+
+// Families must outlive the global registry, so test families are leaked.
+template <typename Metric, typename... MetricArgs>
+MetricFamily<Metric>& NewFamily(absl::string_view name,
+                                std::vector<std::string> label_names,
+                                MetricArgs... metric_args) {
+  return *new MetricFamily<Metric>(name, "Test metric.",
+                                   std::move(label_names), metric_args...);
+}
+
+TEST(MetricsTest, CountsPerLabels) {
+  auto& family = NewFamily<Counter>("test_counter", {"function"});
+  family.Get({"a"}).Increment();
+  family.Get({"a"}).Increment(2);
+  family.Get({"b"}).Increment();
+  EXPECT_EQ(family.Get({"a"}).value(), 3);
+  EXPECT_EQ(family.Get({"b"}).value(), 1);
+  std::string output;
+  family.Export(&output);
+  EXPECT_EQ(output,
+            "# HELP test_counter Test metric.\n"
+            "# TYPE test_counter counter\n"
+            "test_counter{function=\"a\"} 3\n"
+            "test_counter{function=\"b\"} 1\n");
+}
+
+TEST(MetricsTest, ExportsGaugeWithoutLabels) {
+  auto& family = NewFamily<Gauge>("test_gauge", {});
+  family.Get({}).Add(5);
+  family.Get({}).Add(-2);
+  std::string output;
+  family.Export(&output);
+  EXPECT_EQ(output,
+            "# HELP test_gauge Test metric.\n"
+            "# TYPE test_gauge gauge\n"
+            "test_gauge 3\n");
+}
+
+TEST(MetricsTest, EscapesLabelValues) {
+  auto& family = NewFamily<Counter>("test_escaped_counter", {"function"});
+  family.Get({"a\"b\\c\nd"}).Increment();
+  std::string output;
+  family.Export(&output);
+  EXPECT_THAT(output,
+              HasSubstr(
+                  "test_escaped_counter{function=\"a\\\"b\\\\c\\nd\"} 1"));
+}
+
+TEST(MetricsTest, CountsValuesIntoBuckets) {
+  constexpr double kBounds[] = {1, 10};
+  Histogram histogram(kBounds);
+  histogram.Record(0.5);
+  histogram.Record(1);
+  histogram.Record(5);
+  histogram.Record(100);
+  EXPECT_THAT(histogram.GetBucketCounts(), ElementsAre(2, 1, 1));
+  EXPECT_DOUBLE_EQ(histogram.sum(), 106.5);
+}
+
+TEST(MetricsTest, ExportsCumulativeBuckets) {
+  constexpr double kBounds[] = {0.5, 1};
+  auto& family = NewFamily<Histogram>("test_histogram", {"stage"},
+                                      absl::Span<const double>(kBounds));
+  family.Get({"execution"}).Record(0.25);
+  family.Get({"execution"}).Record(2);
+  std::string output;
+  family.Export(&output);
+  EXPECT_EQ(output,
+            "# HELP test_histogram Test metric.\n"
+            "# TYPE test_histogram histogram\n"
+            "test_histogram_bucket{stage=\"execution\",le=\"0.5\"} 1\n"
+            "test_histogram_bucket{stage=\"execution\",le=\"1\"} 1\n"
+            "test_histogram_bucket{stage=\"execution\",le=\"+Inf\"} 2\n"
+            "test_histogram_sum{stage=\"execution\"} 2.25\n"
+            "test_histogram_count{stage=\"execution\"} 2\n");
+}
+
+TEST(MetricsTest, RecordsDurationsInSeconds) {
+  Histogram histogram(LatencyBuckets());
+  histogram.RecordDuration(absl::Milliseconds(1));
+  EXPECT_DOUBLE_EQ(histogram.sum(), 0.001);
+}
+
+TEST(MetricsTest, RecordsConcurrently) {
+  auto& family = NewFamily<Histogram>("test_concurrent_histogram", {},
+                                      LatencyBuckets());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&family] {
+      for (int j = 0; j < 1000; j++) {
+        family.Get({}).Record(1);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_DOUBLE_EQ(family.Get({}).sum(), 4000);
+}
+
+TEST(MetricsTest, RegistryExportsFamiliesByName) {
+  NewFamily<Counter>("test_registry_b", {}).Get({}).Increment();
+  NewFamily<Counter>("test_registry_a", {}).Get({}).Increment();
+  const std::string output = MetricRegistry::Global().Export();
+  EXPECT_LT(output.find("test_registry_a 1"), output.find("test_registry_b 1"));
+}
+}  // namespace
+}  // namespace aviary::util
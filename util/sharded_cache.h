@@ -0,0 +1,147 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTIL_SHARDED_CACHE_H_
+#define UTIL_SHARDED_CACHE_H_
+
+#include <algorithm>
+#include <array>
+#include <list>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/hash/hash.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+
+namespace aviary::util {
+
+// When the values of a `ShardedCache` expire.
+enum class CacheExpiration {
+  // A time to live after being inserted. Lookups leave the cache as is, so
+  // that they only take a reader lock.
+  kSinceInsertion,
+  // A time to live after being last inserted or looked up.
+  kSinceLastUse,
+};
+
+// Caches values by key for a time to live, evicting the values that expire
+// first beyond a capacity, i.e. the least recently inserted or used ones.
+//
+// Values are spread across shards by key, each with a lock of its own, so that
+// concurrent callers seldom contend for the same lock.
+//
+// Thread-safe.
+template <typename Key, typename Value>
+class ShardedCache {
+ public:
+  // Caches at most `capacity` values, each for `ttl`.
+  ShardedCache(size_t capacity, absl::Duration ttl, CacheExpiration expiration)
+      : shard_capacity_(std::max<size_t>(1, capacity / kShards)),
+        ttl_(ttl),
+        expiration_(expiration) {}
+
+  // Returns the value cached for `key`, if any.
+  absl::optional<Value> Lookup(const Key& key) {
+    Shard& shard = GetShard(key);
+    const absl::Time now = absl::Now();
+    if (expiration_ == CacheExpiration::kSinceInsertion) {
+      absl::ReaderMutexLock lock(&shard.mutex);
+      const auto it = shard.index.find(key);
+      if (it == shard.index.end() || it->second->expiration <= now) {
+        return absl::nullopt;
+      }
+      return it->second->value;
+    }
+    absl::MutexLock lock(&shard.mutex);
+    const auto it = shard.index.find(key);
+    if (it == shard.index.end() || it->second->expiration <= now) {
+      return absl::nullopt;
+    }
+    it->second->expiration = now + ttl_;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    return it->second->value;
+  }
+
+  // Caches `value` for `key`.
+  void Insert(const Key& key, Value value) {
+    Insert(key, std::move(value), [](const Value&) { return true; });
+  }
+
+  // Caches `value` for `key`, unless `replaces(cached_value)` returns false
+  // for the value still cached for `key`.
+  template <typename Replaces>
+  void Insert(const Key& key, Value value, Replaces replaces) {
+    Shard& shard = GetShard(key);
+    const absl::Time now = absl::Now();
+    absl::MutexLock lock(&shard.mutex);
+    const auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      if (it->second->expiration > now && !replaces(it->second->value)) {
+        return;
+      }
+      it->second->value = std::move(value);
+      it->second->expiration = now + ttl_;
+      shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+      return;
+    }
+    if (shard.entries.size() >= shard_capacity_) {
+      shard.index.erase(shard.entries.back().key);
+      shard.entries.pop_back();
+    }
+    shard.entries.push_front(
+        {.key = key, .value = std::move(value), .expiration = now + ttl_});
+    shard.index.insert({key, shard.entries.begin()});
+  }
+
+  ShardedCache(const ShardedCache&) = delete;
+  ShardedCache& operator=(const ShardedCache&) = delete;
+
+ private:
+  static constexpr int kShards = 16;
+
+  struct Entry {
+    Key key;
+    Value value;
+    absl::Time expiration;
+  };
+
+  using EntryList = std::list<Entry>;
+
+  struct Shard {
+    absl::Mutex mutex;
+    // By decreasing expiration.
+    EntryList entries ABSL_GUARDED_BY(mutex);
+    absl::flat_hash_map<Key, typename EntryList::iterator> index
+        ABSL_GUARDED_BY(mutex);
+  };
+
+  Shard& GetShard(const Key& key) {
+    return shards_[absl::Hash<Key>()(key) % kShards];
+  }
+
+  const size_t shard_capacity_;
+  const absl::Duration ttl_;
+  const CacheExpiration expiration_;
+  std::array<Shard, kShards> shards_;
+};
+
+}  // namespace aviary::util
+
+#endif  // UTIL_SHARDED_CACHE_H_
@@ -0,0 +1,124 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/sharded_cache.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gtest/gtest.h"
+
+namespace aviary::util {
+namespace {
+
+TEST(ShardedCacheTest, FindsInsertedValue) {
+  ShardedCache<std::string, int> cache(/*capacity=*/100, absl::Hours(1),
+                                       CacheExpiration::kSinceInsertion);
+  EXPECT_EQ(cache.Lookup("key"), absl::nullopt);
+  cache.Insert("key", 1);
+  EXPECT_EQ(cache.Lookup("key"), 1);
+  cache.Insert("key", 2);
+  EXPECT_EQ(cache.Lookup("key"), 2);
+}
+
+TEST(ShardedCacheTest, ReplacesOnlyWhenAsked) {
+  ShardedCache<std::string, int> cache(/*capacity=*/100, absl::Hours(1),
+                                       CacheExpiration::kSinceInsertion);
+  const auto is_higher = [](int cached) { return cached < 2; };
+  cache.Insert("key", 3);
+  cache.Insert("key", 2, is_higher);
+  EXPECT_EQ(cache.Lookup("key"), 3);
+  cache.Insert("key", 1);
+  cache.Insert("key", 2, is_higher);
+  EXPECT_EQ(cache.Lookup("key"), 2);
+}
+
+TEST(ShardedCacheTest, ExpiresSinceInsertion) {
+  ShardedCache<std::string, int> cache(/*capacity=*/100,
+                                       absl::Milliseconds(30),
+                                       CacheExpiration::kSinceInsertion);
+  cache.Insert("key", 1);
+  absl::SleepFor(absl::Milliseconds(20));
+  ASSERT_EQ(cache.Lookup("key"), 1);
+  absl::SleepFor(absl::Milliseconds(20));
+  EXPECT_EQ(cache.Lookup("key"), absl::nullopt);
+}
+
+TEST(ShardedCacheTest, ExpiresSinceLastUse) {
+  ShardedCache<std::string, int> cache(/*capacity=*/100,
+                                       absl::Milliseconds(30),
+                                       CacheExpiration::kSinceLastUse);
+  cache.Insert("key", 1);
+  absl::SleepFor(absl::Milliseconds(20));
+  ASSERT_EQ(cache.Lookup("key"), 1);
+  absl::SleepFor(absl::Milliseconds(20));
+  ASSERT_EQ(cache.Lookup("key"), 1);
+  absl::SleepFor(absl::Milliseconds(40));
+  EXPECT_EQ(cache.Lookup("key"), absl::nullopt);
+}
+
+TEST(ShardedCacheTest, EvictsLeastRecentlyUsed) {
+  // Two values per shard.
+  ShardedCache<int, int> cache(/*capacity=*/32, absl::InfiniteDuration(),
+                               CacheExpiration::kSinceLastUse);
+  cache.Insert(0, 0);
+  for (int i = 1; i < 100; i++) {
+    cache.Insert(i, i);
+    // Keeps the first value the most recently used of its shard.
+    ASSERT_EQ(cache.Lookup(0), 0);
+  }
+}
+
+TEST(ShardedCacheTest, StaysWithinCapacity) {
+  // A value per shard.
+  ShardedCache<int, int> cache(/*capacity=*/16, absl::InfiniteDuration(),
+                               CacheExpiration::kSinceLastUse);
+  for (int i = 0; i < 100; i++) {
+    cache.Insert(i, i);
+  }
+  int cached_values = 0;
+  for (int i = 0; i < 100; i++) {
+    cached_values += cache.Lookup(i).has_value();
+  }
+  EXPECT_LE(cached_values, 16);
+  // The last inserted value is the most recently used of its shard.
+  EXPECT_EQ(cache.Lookup(99), 99);
+}
+
+TEST(ShardedCacheTest, ServesConcurrentCallers) {
+  for (const CacheExpiration expiration :
+       {CacheExpiration::kSinceInsertion, CacheExpiration::kSinceLastUse}) {
+    ShardedCache<int, int> cache(/*capacity=*/1000, absl::Hours(1),
+                                 expiration);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+      threads.emplace_back([&cache] {
+        for (int j = 0; j < 100; j++) {
+          cache.Insert(j, j);
+          const absl::optional<int> value = cache.Lookup(j);
+          ASSERT_TRUE(value.has_value());
+          EXPECT_EQ(*value, j);
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+}
+}  // namespace
+}  // namespace aviary::util
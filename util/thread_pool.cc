@@ -0,0 +1,96 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "util/cpu_affinity.h"
+
+namespace aviary::util {
+ThreadPool::ThreadPool(int num_threads) : ThreadPool(num_threads, {}) {}
+
+ThreadPool::ThreadPool(int num_threads, std::vector<int> cpus)
+    : cpus_(std::move(cpus)) {
+  threads_.reserve(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    threads_.emplace_back(&ThreadPool::WorkLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    absl::MutexLock lock(&mutex_);
+    stopping_ = true;
+  }
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Schedule(std::function<void()> closure) {
+  Schedule("", 1, std::move(closure));
+}
+
+void ThreadPool::Schedule(absl::string_view queue, int weight,
+                          std::function<void()> closure) {
+  absl::MutexLock lock(&mutex_);
+  auto [it, inserted] = queues_.try_emplace(queue);
+  if (inserted) {
+    turns_.emplace_back(queue);
+  }
+  it->second.weight = std::max(1, weight);
+  if (inserted) {
+    it->second.turn_closures = it->second.weight;
+  }
+  it->second.closures.push_back(std::move(closure));
+}
+
+bool ThreadPool::HasWorkOrIsStopping() const {
+  return !turns_.empty() || stopping_;
+}
+
+void ThreadPool::WorkLoop() {
+  if (!cpus_.empty()) {
+    // Best effort: a worker left unpinned, e.g. because its CPUs are outside
+    // of the cgroup of the process, still does its work.
+    PinCurrentThread(cpus_).IgnoreError();
+  }
+  while (true) {
+    std::function<void()> closure;
+    {
+      absl::MutexLock lock(&mutex_);
+      mutex_.Await(absl::Condition(this, &ThreadPool::HasWorkOrIsStopping));
+      if (turns_.empty()) {
+        // Stopping, and all the scheduled closures have been executed.
+        return;
+      }
+      const auto it = queues_.find(turns_.front());
+      Queue& queue = it->second;
+      closure = std::move(queue.closures.front());
+      queue.closures.pop_front();
+      if (queue.closures.empty()) {
+        queues_.erase(it);
+        turns_.pop_front();
+      } else if (--queue.turn_closures == 0) {
+        queue.turn_closures = queue.weight;
+        turns_.push_back(std::move(turns_.front()));
+        turns_.pop_front();
+      }
+    }
+    closure();
+  }
+}
+}  // namespace aviary::util
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTIL_THREAD_POOL_H_
+#define UTIL_THREAD_POOL_H_
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+
+namespace aviary::util {
+
+// A fixed-size pool of worker threads that execute scheduled closures in the
+// order of scheduling within each queue. Queues take turns, so that a queue
+// flooded with closures only delays those of the other queues by its turns.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int num_threads);
+
+  // Starts worker threads pinned to the CPUs of `cpus`, or left to the
+  // scheduler when empty, as parsed by `ParseCpuSet`.
+  ThreadPool(int num_threads, std::vector<int> cpus);
+
+  // Waits for all the scheduled closures to complete and joins the worker
+  // threads.
+  ~ThreadPool();
+
+  // Schedules a closure for execution on one of the worker threads, in the
+  // default queue.
+  void Schedule(std::function<void()> closure) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Schedules a closure in `queue`, which executes up to `weight` closures per
+  // turn. The weight of the latest closure applies to the queue.
+  void Schedule(absl::string_view queue, int weight,
+                std::function<void()> closure) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+ private:
+  void WorkLoop() ABSL_LOCKS_EXCLUDED(mutex_);
+  bool HasWorkOrIsStopping() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  struct Queue {
+    std::deque<std::function<void()>> closures;
+    int weight = 1;
+    // Closures left to execute in the current turn of the queue.
+    int turn_closures = 1;
+  };
+
+  absl::Mutex mutex_;
+  // Non-empty queues, by name.
+  absl::flat_hash_map<std::string, Queue> queues_ ABSL_GUARDED_BY(mutex_);
+  // Names of the non-empty queues, in the order of their turns, the first one
+  // having the current turn.
+  std::deque<std::string> turns_ ABSL_GUARDED_BY(mutex_);
+  bool stopping_ ABSL_GUARDED_BY(mutex_) = false;
+  const std::vector<int> cpus_;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace aviary::util
+
+#endif  // UTIL_THREAD_POOL_H_
@@ -0,0 +1,126 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/thread_pool.h"
+
+#include <string>
+#include <vector>
+
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "util/cpu_affinity.h"
+
+namespace aviary::util {
+namespace {
+
+TEST(ThreadPool, ExecutesAllScheduledClosures) {
+  absl::Mutex mutex;
+  int invocations = 0;
+  {
+    ThreadPool pool(4);
+    for (int i = 0; i < 100; i++) {
+      pool.Schedule([&] {
+        absl::MutexLock lock(&mutex);
+        invocations++;
+      });
+    }
+  }
+  // Destruction waits for the scheduled closures.
+  EXPECT_EQ(invocations, 100);
+}
+
+TEST(ThreadPool, ExecutesClosuresConcurrently) {
+  constexpr int kThreads = 4;
+  ThreadPool pool(kThreads);
+  absl::Mutex mutex;
+  int running = 0;
+  absl::BlockingCounter finished(kThreads);
+  for (int i = 0; i < kThreads; i++) {
+    pool.Schedule([&] {
+      absl::MutexLock lock(&mutex);
+      running++;
+      // Blocks until all the closures are running at the same time.
+      mutex.Await(absl::Condition(
+          +[](int* running) { return *running == kThreads; }, &running));
+      finished.DecrementCount();
+    });
+  }
+  finished.Wait();
+}
+
+TEST(ThreadPool, ExecutesClosuresInSchedulingOrder) {
+  absl::Mutex mutex;
+  std::vector<int> order;
+  {
+    ThreadPool pool(1);
+    for (int i = 0; i < 10; i++) {
+      pool.Schedule([&, i] {
+        absl::MutexLock lock(&mutex);
+        order.push_back(i);
+      });
+    }
+  }
+  EXPECT_EQ(order, std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
+TEST(ThreadPool, TakesTurnsAcrossQueues) {
+  absl::Mutex mutex;
+  std::vector<std::string> order;
+  {
+    ThreadPool pool(1);
+    absl::Notification start;
+    // Holds the worker until all the closures are scheduled.
+    pool.Schedule([&start] { start.WaitForNotification(); });
+    for (int i = 0; i < 6; i++) {
+      pool.Schedule("flooded", 2, [&] {
+        absl::MutexLock lock(&mutex);
+        order.push_back("flooded");
+      });
+    }
+    for (int i = 0; i < 2; i++) {
+      pool.Schedule("other", 1, [&] {
+        absl::MutexLock lock(&mutex);
+        order.push_back("other");
+      });
+    }
+    start.Notify();
+  }
+  EXPECT_EQ(order, std::vector<std::string>(
+                       {"flooded", "flooded", "other", "flooded", "flooded",
+                        "other", "flooded", "flooded"}));
+}
+
+TEST(ThreadPool, PinsWorkerThreads) {
+  const absl::StatusOr<std::vector<int>> cpus = GetCurrentThreadCpus();
+  ASSERT_TRUE(cpus.ok()) << cpus.status();
+  ASSERT_FALSE(cpus->empty());
+  absl::Mutex mutex;
+  std::vector<std::vector<int>> worker_cpus;
+  {
+    ThreadPool pool(2, {cpus->back()});
+    for (int i = 0; i < 10; i++) {
+      pool.Schedule([&] {
+        absl::MutexLock lock(&mutex);
+        worker_cpus.push_back(GetCurrentThreadCpus().value());
+      });
+    }
+  }
+  for (const std::vector<int>& cpus_of_worker : worker_cpus) {
+    EXPECT_EQ(cpus_of_worker, std::vector<int>({cpus->back()}));
+  }
+}
+}  // namespace
+}  // namespace aviary::util
@@ -0,0 +1,133 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/trace_recorder.h"
+
+#include <algorithm>
+#include <string>
+
+#include "absl/time/clock.h"
+#include "google/protobuf/io/coded_stream.h"
+
+namespace aviary::util {
+namespace {
+
+// Innermost context of the calling thread, if any.
+thread_local ScopedTraceContext* current_context = nullptr;
+}  // namespace
+
+TraceRecorder::TraceRecorder() : start_(absl::Now()) {
+  trace_.set_start_unix_micros(absl::ToUnixMicros(start_));
+}
+
+int TraceRecorder::StartSpan(absl::string_view name, int parent,
+                             absl::Time start) {
+  absl::MutexLock lock(&mutex_);
+  Trace::Span* span = trace_.add_spans();
+  span->set_name(std::string(name));
+  span->set_start_micros(absl::ToInt64Microseconds(start - start_));
+  span->set_parent(parent);
+  return trace_.spans_size() - 1;
+}
+
+void TraceRecorder::EndSpan(int span, absl::Time end) {
+  absl::MutexLock lock(&mutex_);
+  Trace::Span* ended_span = trace_.mutable_spans(span);
+  ended_span->set_duration_micros(
+      std::max<int64_t>(absl::ToInt64Microseconds(end - start_) -
+                            ended_span->start_micros(),
+                        0));
+}
+
+int TraceRecorder::AddSpan(absl::string_view name, int parent,
+                           absl::Time start, absl::Time end) {
+  const int span = StartSpan(name, parent, start);
+  EndSpan(span, end);
+  return span;
+}
+
+void TraceRecorder::SetAttribute(int span, absl::string_view key,
+                                 absl::string_view value) {
+  absl::MutexLock lock(&mutex_);
+  (*trace_.mutable_spans(span)->mutable_attributes())[std::string(key)] =
+      std::string(value);
+}
+
+Trace TraceRecorder::ToProto() const {
+  absl::MutexLock lock(&mutex_);
+  return trace_;
+}
+
+Trace TraceRecorder::ToProto(size_t max_bytes) const {
+  using ::google::protobuf::io::CodedOutputStream;
+  Trace trace;
+  trace.set_start_unix_micros(absl::ToUnixMicros(start_));
+  // Leaves room for the count of dropped spans.
+  size_t bytes = trace.ByteSizeLong() + 1 + CodedOutputStream::VarintSize32(
+                                               trace_.spans_size());
+  absl::MutexLock lock(&mutex_);
+  for (const Trace::Span& span : trace_.spans()) {
+    const size_t span_bytes = span.ByteSizeLong();
+    // Each span is serialized after a one-byte tag and its length.
+    bytes += 1 + CodedOutputStream::VarintSize64(span_bytes) + span_bytes;
+    if (bytes > max_bytes) {
+      break;
+    }
+    *trace.add_spans() = span;
+  }
+  trace.set_dropped_spans(trace_.spans_size() - trace.spans_size());
+  return trace;
+}
+
+ScopedTraceContext::ScopedTraceContext(TraceRecorder* recorder, int parent)
+    : recorder_(recorder), parent_(parent), previous_(current_context) {
+  current_context = this;
+}
+
+ScopedTraceContext::~ScopedTraceContext() { current_context = previous_; }
+
+TraceRecorder* ScopedTraceContext::recorder() {
+  return current_context != nullptr ? current_context->recorder_ : nullptr;
+}
+
+int ScopedTraceContext::parent() {
+  return current_context != nullptr ? current_context->parent_
+                                    : TraceRecorder::kNoSpan;
+}
+
+ScopedTraceSpan::ScopedTraceSpan(absl::string_view name)
+    : context_(current_context) {
+  if (context_ == nullptr || context_->recorder_ == nullptr) {
+    return;
+  }
+  span_ = context_->recorder_->StartSpan(name, context_->parent_, absl::Now());
+  previous_parent_ = context_->parent_;
+  context_->parent_ = span_;
+}
+
+ScopedTraceSpan::~ScopedTraceSpan() {
+  if (span_ == TraceRecorder::kNoSpan) {
+    return;
+  }
+  context_->recorder_->EndSpan(span_, absl::Now());
+  context_->parent_ = previous_parent_;
+}
+
+void ScopedTraceSpan::SetAttribute(absl::string_view key,
+                                   absl::string_view value) {
+  if (span_ != TraceRecorder::kNoSpan) {
+    context_->recorder_->SetAttribute(span_, key, value);
+  }
+}
+}  // namespace aviary::util
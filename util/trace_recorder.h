@@ -0,0 +1,115 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTIL_TRACE_RECORDER_H_
+#define UTIL_TRACE_RECORDER_H_
+
+#include <cstddef>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "util/trace.pb.h"
+
+namespace aviary::util {
+
+// Records the spans of a single request into a `Trace`, from any thread.
+//
+// Thread-safe.
+class TraceRecorder {
+ public:
+  // Index that stands for no span, as the parent of the top spans.
+  static constexpr int kNoSpan = -1;
+
+  // Starts the trace now.
+  TraceRecorder();
+
+  // Starts a span under `parent`, which must have been started before, and
+  // returns its index.
+  int StartSpan(absl::string_view name, int parent, absl::Time start)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+  void EndSpan(int span, absl::Time end) ABSL_LOCKS_EXCLUDED(mutex_);
+  // Records a span that already ended, and returns its index.
+  int AddSpan(absl::string_view name, int parent, absl::Time start,
+              absl::Time end) ABSL_LOCKS_EXCLUDED(mutex_);
+  void SetAttribute(int span, absl::string_view key, absl::string_view value)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the spans recorded so far. Spans not ended yet have no duration.
+  Trace ToProto() const ABSL_LOCKS_EXCLUDED(mutex_);
+  // Returns the first spans recorded so far whose trace serializes into at
+  // most `max_bytes`, counting the others as dropped. Enclosing spans are
+  // recorded first, so that every span kept keeps its parent.
+  Trace ToProto(size_t max_bytes) const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  TraceRecorder(const TraceRecorder&) = delete;
+  TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+ private:
+  const absl::Time start_;
+  mutable absl::Mutex mutex_;
+  Trace trace_ ABSL_GUARDED_BY(mutex_);
+};
+
+// Makes the calling thread record its spans into `recorder` under `parent`
+// for the lifetime of the context, unless `recorder` is null. Spans are only
+// recorded by threads with a context, so that untraced requests spend next to
+// nothing on tracing.
+class ScopedTraceContext {
+ public:
+  explicit ScopedTraceContext(TraceRecorder* recorder,
+                              int parent = TraceRecorder::kNoSpan);
+  ~ScopedTraceContext();
+
+  // Returns the recorder of the innermost context of the calling thread, or
+  // null if it has none.
+  static TraceRecorder* recorder();
+  // Returns the span of the calling thread that new spans go under.
+  static int parent();
+
+  ScopedTraceContext(const ScopedTraceContext&) = delete;
+  ScopedTraceContext& operator=(const ScopedTraceContext&) = delete;
+
+ private:
+  friend class ScopedTraceSpan;
+
+  TraceRecorder* const recorder_;
+  int parent_;
+  ScopedTraceContext* const previous_;
+};
+
+// Span covering its own lifetime in the trace of the calling thread, if any.
+// The spans started on the thread meanwhile go under it.
+class ScopedTraceSpan {
+ public:
+  explicit ScopedTraceSpan(absl::string_view name);
+  ~ScopedTraceSpan();
+
+  void SetAttribute(absl::string_view key, absl::string_view value);
+
+  ScopedTraceSpan(const ScopedTraceSpan&) = delete;
+  ScopedTraceSpan& operator=(const ScopedTraceSpan&) = delete;
+
+ private:
+  ScopedTraceContext* const context_;
+  int span_ = TraceRecorder::kNoSpan;
+  int previous_parent_ = TraceRecorder::kNoSpan;
+};
+
+}  // namespace aviary::util
+
+#endif  // UTIL_TRACE_RECORDER_H_
@@ -0,0 +1,114 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/trace_recorder.h"
+
+#include <thread>
+
+#include "absl/time/clock.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace aviary::util {
+namespace {
+
+using ::testing::Pair;
+using ::testing::UnorderedElementsAre;
+
+TEST(TraceRecorderTest, RecordsSpansRelativeToTraceStart) {
+  TraceRecorder recorder;
+  const absl::Time start =
+      absl::FromUnixMicros(recorder.ToProto().start_unix_micros());
+  const int parent = recorder.AddSpan("parent", TraceRecorder::kNoSpan,
+                                      start + absl::Microseconds(10),
+                                      start + absl::Microseconds(40));
+  const int child =
+      recorder.AddSpan("child", parent, start + absl::Microseconds(20),
+                       start + absl::Microseconds(25));
+  recorder.SetAttribute(child, "key", "value");
+
+  const Trace trace = recorder.ToProto();
+  ASSERT_EQ(trace.spans_size(), 2);
+  EXPECT_EQ(trace.spans(parent).name(), "parent");
+  // The trace starts within the microsecond of `start`.
+  EXPECT_NEAR(trace.spans(parent).start_micros(), 10, 1);
+  EXPECT_EQ(trace.spans(parent).duration_micros(), 30);
+  EXPECT_EQ(trace.spans(parent).parent(), TraceRecorder::kNoSpan);
+  EXPECT_EQ(trace.spans(child).name(), "child");
+  EXPECT_EQ(
+      trace.spans(child).start_micros() - trace.spans(parent).start_micros(),
+      10);
+  EXPECT_EQ(trace.spans(child).duration_micros(), 5);
+  EXPECT_EQ(trace.spans(child).parent(), parent);
+  EXPECT_THAT(trace.spans(child).attributes(),
+              UnorderedElementsAre(Pair("key", "value")));
+}
+
+TEST(TraceRecorderTest, DropsSpansBeyondMaxBytes) {
+  TraceRecorder recorder;
+  const absl::Time start =
+      absl::FromUnixMicros(recorder.ToProto().start_unix_micros());
+  const int parent = recorder.AddSpan("parent", TraceRecorder::kNoSpan, start,
+                                      start + absl::Microseconds(100));
+  for (int i = 0; i < 100; i++) {
+    recorder.AddSpan("child", parent, start, start + absl::Microseconds(1));
+  }
+
+  const Trace trace = recorder.ToProto(/*max_bytes=*/256);
+  EXPECT_LE(trace.ByteSizeLong(), 256);
+  ASSERT_GT(trace.spans_size(), 1);
+  EXPECT_LT(trace.spans_size(), 101);
+  EXPECT_EQ(trace.spans_size() + trace.dropped_spans(), 101);
+  EXPECT_EQ(trace.spans(0).name(), "parent");
+  EXPECT_EQ(recorder.ToProto(/*max_bytes=*/1 << 20).dropped_spans(), 0);
+}
+
+TEST(ScopedTraceSpanTest, NestsSpansOfThread) {
+  TraceRecorder recorder;
+  {
+    ScopedTraceContext context(&recorder);
+    ScopedTraceSpan outer("outer");
+    outer.SetAttribute("key", "value");
+    { ScopedTraceSpan inner("inner"); }
+    EXPECT_EQ(ScopedTraceContext::parent(), 0);
+    std::thread([&recorder] {
+      // Other threads record into the trace through their own context.
+      ScopedTraceContext context(&recorder, /*parent=*/0);
+      ScopedTraceSpan other("other");
+    }).join();
+  }
+  ScopedTraceSpan untraced("untraced");
+
+  const Trace trace = recorder.ToProto();
+  ASSERT_EQ(trace.spans_size(), 3);
+  EXPECT_EQ(trace.spans(0).name(), "outer");
+  EXPECT_EQ(trace.spans(0).parent(), TraceRecorder::kNoSpan);
+  EXPECT_THAT(trace.spans(0).attributes(),
+              UnorderedElementsAre(Pair("key", "value")));
+  EXPECT_EQ(trace.spans(1).name(), "inner");
+  EXPECT_EQ(trace.spans(1).parent(), 0);
+  EXPECT_EQ(trace.spans(2).name(), "other");
+  EXPECT_EQ(trace.spans(2).parent(), 0);
+}
+
+TEST(ScopedTraceSpanTest, RecordsNothingWithoutRecorder) {
+  EXPECT_EQ(ScopedTraceContext::recorder(), nullptr);
+  ScopedTraceContext context(/*recorder=*/nullptr);
+  EXPECT_EQ(ScopedTraceContext::recorder(), nullptr);
+  ScopedTraceSpan span("span");
+  span.SetAttribute("key", "value");
+  EXPECT_EQ(ScopedTraceContext::parent(), TraceRecorder::kNoSpan);
+}
+}  // namespace
+}  // namespace aviary::util
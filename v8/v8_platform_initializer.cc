@@ -14,17 +14,79 @@
 
 #include "v8/v8_platform_initializer.h"
 
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "absl/base/call_once.h"
+#include "absl/flags/flag.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
 #include "libplatform/libplatform.h"
+#include "util/cpu_affinity.h"
 #include "v8.h"
 
+ABSL_FLAG(int,
+          v8_platform_threads,
+          0,
+          "Number of worker threads of the V8 platform, which run the "
+          "concurrent compilation and garbage collection tasks of all the "
+          "isolates of a process. V8 picks a number from the count of CPUs "
+          "when 0.");
+ABSL_FLAG(std::string,
+          v8_platform_cpus,
+          "",
+          "CPUs that the worker threads of the V8 platform are pinned to, in "
+          "the format of `taskset --cpu-list` (e.g. \"0-3,8\"), or \"node<N>\" "
+          "for the CPUs of NUMA node N. Unpinned when empty.");
+ABSL_FLAG(bool,
+          v8_concurrent_compilation,
+          true,
+          "Whether V8 optimizes hot functions on the platform worker threads "
+          "rather than on the thread running the JavaScript.");
+ABSL_FLAG(bool,
+          v8_concurrent_gc,
+          true,
+          "Whether V8 marks, sweeps and scavenges on the platform worker "
+          "threads rather than only on the thread running the JavaScript.");
+
 namespace aviary {
 namespace v8 {
 namespace {
+
+// Creates the platform, with its worker threads pinned to --v8_platform_cpus if
+// set and valid. The workers are started along with the platform and inherit
+// the CPUs of the calling thread, which get restored afterwards.
+std::unique_ptr<::v8::Platform> CreatePlatform() {
+  const int thread_pool_size =
+      std::max(0, absl::GetFlag(FLAGS_v8_platform_threads));
+  const absl::StatusOr<std::vector<int>> platform_cpus =
+      util::ParseCpuSet(absl::GetFlag(FLAGS_v8_platform_cpus));
+  const absl::StatusOr<std::vector<int>> caller_cpus =
+      util::GetCurrentThreadCpus();
+  const bool pinned = platform_cpus.ok() && !platform_cpus->empty() &&
+                      caller_cpus.ok() &&
+                      util::PinCurrentThread(*platform_cpus).ok();
+  std::unique_ptr<::v8::Platform> platform =
+      ::v8::platform::NewDefaultPlatform(thread_pool_size);
+  if (pinned) {
+    util::PinCurrentThread(*caller_cpus).IgnoreError();
+  }
+  return platform;
+}
+
 class V8PlatformInitializerImpl {
  public:
-  V8PlatformInitializerImpl()
-      : platform_(::v8::platform::NewDefaultPlatform()) {
+  V8PlatformInitializerImpl() : platform_(CreatePlatform()) {
+    // Flags must be set before V8 gets initialized.
+    if (!absl::GetFlag(FLAGS_v8_concurrent_compilation)) {
+      ::v8::V8::SetFlagsFromString("--no-concurrent-recompilation");
+    }
+    if (!absl::GetFlag(FLAGS_v8_concurrent_gc)) {
+      ::v8::V8::SetFlagsFromString("--single-threaded-gc");
+    }
     ::v8::V8::InitializePlatform(platform_.get());
     ::v8::V8::Initialize();
   }
@@ -38,6 +100,8 @@ class V8PlatformInitializerImpl {
     ::v8::V8::ShutdownPlatform();
   }
 
+  ::v8::Platform* platform() const { return platform_.get(); }
+
  private:
   std::unique_ptr<::v8::Platform> platform_;
 };
@@ -50,5 +114,19 @@ V8PlatformInitializerImpl* InitializerInstance() {
 }  // namespace
 
 V8PlatformInitializer::V8PlatformInitializer() { InitializerInstance(); }
+
+::v8::Platform* V8PlatformInitializer::GetPlatform() {
+  return InitializerInstance()->platform();
+}
+
+absl::Status V8PlatformInitializer::CheckFlags() {
+  const absl::StatusOr<std::vector<int>> platform_cpus =
+      util::ParseCpuSet(absl::GetFlag(FLAGS_v8_platform_cpus));
+  if (!platform_cpus.ok()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Invalid --v8_platform_cpus: ", platform_cpus.status().message()));
+  }
+  return absl::OkStatus();
+}
 }  // namespace v8
 }  // namespace aviary
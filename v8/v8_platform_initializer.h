@@ -17,6 +17,12 @@
 #ifndef V8_V8_PLATFORM_INITIALIZER_H_
 #define V8_V8_PLATFORM_INITIALIZER_H_
 
+#include "absl/status/status.h"
+
+namespace v8 {
+class Platform;
+}  // namespace v8
+
 namespace aviary {
 namespace v8 {
 // V8 can only be initialized once per process, even if it is disposed and shut
@@ -27,6 +33,15 @@ namespace v8 {
 class V8PlatformInitializer {
  public:
   V8PlatformInitializer();
+
+  // Returns the process-wide platform, initializing V8 if needed. Used to run
+  // the tasks that V8 posts to the platform on behalf of isolates.
+  static ::v8::Platform* GetPlatform();
+
+  // Returns an error if the flags configuring the platform are invalid, e.g.
+  // --v8_platform_cpus. The platform ignores invalid flags, so binaries check
+  // them at startup.
+  static absl::Status CheckFlags();
 };
 }  // namespace v8
 }  // namespace aviary